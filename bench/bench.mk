@@ -0,0 +1,35 @@
+BENCH = \
+	obj/bench_kernels.o
+
+BENCH_SCALING = \
+	obj/bench_scaling.o
+
+
+CFLAGS += \
+	-Ibench/include/
+
+LIB += \
+	-lm \
+	-lpthread
+
+OBJ += \
+	obj/linalg.o
+
+
+.PHONY: bench
+
+bench: obj run-bench run-bench-scaling
+	./run-bench bench_results.json
+	./run-bench-scaling
+
+run-bench: $(OBJ) $(BENCH)
+	$(CC) $(CFLAGS) $^ -o $@ $(LIB)
+
+run-bench-scaling: $(OBJ) $(BENCH_SCALING)
+	$(CC) $(CFLAGS) $^ -o $@ $(LIB)
+
+obj/%.o: src/%.c
+	$(CC) -MMD -c $(CFLAGS) $< -o $@
+
+obj/%.o: bench/src/%.c
+	$(CC) -MMD -c $(CFLAGS) $< -o $@
@@ -0,0 +1,171 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* *************************************
+ * Wall-clock time in seconds.
+ * ************************************/
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* *************************************
+ * Best time in seconds of `repeats`
+ * runs of `statement`, after one
+ * warm-up run.
+ * ************************************/
+#define bench_best_time(result, repeats, statement) { \
+    statement; \
+    (result) = 1e300; \
+    for (int __r = 0; __r < (repeats); __r++) { \
+        double __t0 = bench_now(); \
+        statement; \
+        double __t = bench_now() - __t0; \
+        if (__t < (result)) (result) = __t; \
+    } \
+}
+
+/* *************************************
+ * Timing statistics of one benchmark,
+ * per call of the measured statement.
+ * ************************************/
+#define BENCH_MAX_SAMPLES 15
+#define BENCH_MIN_SAMPLES 3
+#define BENCH_MIN_SAMPLE_TIME 2e-3 // s, calls are batched up to this
+#define BENCH_TARGET_TIME 0.5      // s, total per benchmark
+
+typedef struct {
+    double min, median, mean, stddev; // s per call
+    size_t samples;
+    size_t calls_per_sample;
+} bench_stats;
+
+static inline int bench_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static inline void bench_compute_stats(bench_stats *stats, double *samples,
+                                       size_t n, size_t calls)
+{
+    qsort(samples, n, sizeof(double), bench_compare_double);
+    double sum = 0, sum_sq = 0;
+    for (size_t i = 0; i < n; i++) sum += samples[i];
+    double mean = sum / n;
+    for (size_t i = 0; i < n; i++) {
+        sum_sq += (samples[i] - mean) * (samples[i] - mean);
+    }
+    stats->min = samples[0];
+    stats->median = n % 2 ? samples[n / 2]
+                          : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    stats->mean = mean;
+    stats->stddev = n > 1 ? sqrt(sum_sq / (n - 1)) : 0;
+    stats->samples = n;
+    stats->calls_per_sample = calls;
+}
+
+/* *************************************
+ * Measures `statement`: one warm-up
+ * call, then calls are batched until a
+ * sample takes BENCH_MIN_SAMPLE_TIME,
+ * and as many samples are taken as fit
+ * in BENCH_TARGET_TIME (within the
+ * MIN/MAX sample counts).
+ * ************************************/
+#define bench_measure(stats, statement) { \
+    statement; \
+    size_t __calls = 1; \
+    double __t; \
+    for (;;) { \
+        double __t0 = bench_now(); \
+        for (size_t __c = 0; __c < __calls; __c++) { statement; } \
+        __t = bench_now() - __t0; \
+        if (__t >= BENCH_MIN_SAMPLE_TIME) break; \
+        __calls *= __t > 0 ? (size_t)(1.5 * BENCH_MIN_SAMPLE_TIME / __t) + 1 : 2; \
+    } \
+    size_t __n = (size_t)(BENCH_TARGET_TIME / __t); \
+    if (__n > BENCH_MAX_SAMPLES) __n = BENCH_MAX_SAMPLES; \
+    if (__n < BENCH_MIN_SAMPLES) __n = BENCH_MIN_SAMPLES; \
+    double __samples[BENCH_MAX_SAMPLES]; \
+    for (size_t __s = 0; __s < __n; __s++) { \
+        double __t0 = bench_now(); \
+        for (size_t __c = 0; __c < __calls; __c++) { statement; } \
+        __samples[__s] = (bench_now() - __t0) / __calls; \
+    } \
+    bench_compute_stats(&(stats), __samples, __n, __calls); \
+}
+
+/* *************************************
+ * One result: elements, bytes moved
+ * and flops per call give ns/element,
+ * GB/s and GFLOP/s from the median.
+ * ************************************/
+typedef struct {
+    const char *name;
+    size_t elements;
+    double bytes;
+    double flops;
+    bench_stats stats;
+} bench_result;
+
+static inline void bench_print_header(void)
+{
+    printf("%-38s %10s %12s %10s %9s %9s %7s\n", "benchmark", "elements",
+           "median [us]", "ns/elem", "GB/s", "GFLOP/s", "+-%");
+}
+
+static inline void bench_print_result(const bench_result *r)
+{
+    double t = r->stats.median;
+    printf("%-38s %10zu %12.3f %10.3f %9.2f %9.2f %7.1f\n", r->name,
+           r->elements, 1e6 * t, 1e9 * t / r->elements,
+           1e-9 * r->bytes / t, 1e-9 * r->flops / t,
+           100 * r->stats.stddev / r->stats.mean);
+    fflush(stdout);
+}
+
+/* *************************************
+ * JSON output: bench_json_open writes
+ * the run description, then one object
+ * per bench_json_result.
+ * ************************************/
+static inline FILE *bench_json_open(const char *path, const char *isa,
+                                    size_t threads)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return NULL;
+    fprintf(file, "{\n  \"library\": \"linalg\",\n");
+    fprintf(file, "  \"compiler\": \"%s\",\n", __VERSION__);
+    fprintf(file, "  \"isa\": \"%s\",\n  \"threads\": %zu,\n", isa, threads);
+    fprintf(file, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(file, "  \"results\": [");
+    return file;
+}
+
+static inline void bench_json_result(FILE *file, const bench_result *r,
+                                     int first)
+{
+    const bench_stats *s = &r->stats;
+    fprintf(file, "%s\n    {\"name\": \"%s\", \"elements\": %zu, "
+            "\"bytes\": %.17g, \"flops\": %.17g, "
+            "\"samples\": %zu, \"calls_per_sample\": %zu, "
+            "\"min_s\": %.6e, \"median_s\": %.6e, \"mean_s\": %.6e, "
+            "\"stddev_s\": %.6e, \"ns_per_element\": %.6g, "
+            "\"gb_per_s\": %.6g, \"gflop_per_s\": %.6g}",
+            first ? "" : ",", r->name, r->elements, r->bytes, r->flops,
+            s->samples, s->calls_per_sample, s->min, s->median, s->mean,
+            s->stddev, 1e9 * s->median / r->elements,
+            1e-9 * r->bytes / s->median, 1e-9 * r->flops / s->median);
+}
+
+static inline void bench_json_close(FILE *file)
+{
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
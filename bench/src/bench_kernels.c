@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_main.h"
+#include "linalg.h"
+
+/* *************************************
+ * Kernel benchmark suite.
+ *
+ * Times the public functions over sizes
+ * from L1-resident to DRAM-bound and
+ * prints ns/element, GB/s and GFLOP/s
+ * (median of the samples, with the
+ * relative standard deviation).
+ *
+ * usage: run-bench [results.json] [filter]
+ *
+ * Results are also written as JSON
+ * (default bench_results.json). Only
+ * benchmarks whose name contains filter
+ * are run. Set LINALG_NUM_THREADS and
+ * LINALG_ISA to benchmark other
+ * configurations.
+ *
+ * Bytes count the nominal traffic of
+ * one call (each operand read or written
+ * once); flops count one per add/mul.
+ * ************************************/
+
+#define CSV_PATH "bench_tmp.csv"
+#define BINARY_PATH "bench_tmp.bin"
+
+// 8 KiB, 128 KiB, 2 MiB, 32 MiB per vector
+static const size_t vector_sizes[] = {1 << 10, 1 << 14, 1 << 18, 1 << 22};
+// 8 KiB, 128 KiB, 2 MiB, 32 MiB per matrix
+static const size_t matrix_sides[] = {32, 128, 512, 2048};
+static const size_t gemm_sides[] = {32, 128, 512, 1024};
+static const size_t file_sides[] = {32, 128, 512, 1024};
+static const size_t batch_sides[] = {3, 4, 8, 16};
+static const size_t sparse_sides[] = {1 << 14, 1 << 17, 1 << 20};
+#define SPARSE_ROW_NNZ 16
+#define SPMM_COLS 16
+#define BATCH_COUNT 4096
+// Truncated SVD of (svd_rows x SVD_COLS) dense matrices, and of the
+// sparse ones above up to 2^17
+static const size_t svd_rows[] = {4096, 16384};
+#define SVD_COLS 1024
+#define SVD_RANK 16
+#define SVD_POWER_ITERATIONS 1
+// KNN_QUERIES queries of dimension KNN_DIM against knn_references rows
+static const size_t knn_references[] = {4096, 65536};
+#define KNN_QUERIES 256
+#define KNN_DIM 64
+#define KNN_K 10
+
+#define APPEND_COLUMNS 64
+
+#define N_SIZES(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *filter = NULL;
+static FILE *json = NULL;
+static int first_result = 1;
+static char name[128];
+
+static int selected(const char *function, size_t size)
+{
+    snprintf(name, sizeof(name), "%s/%zu", function, size);
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void record(bench_result *r)
+{
+    bench_print_result(r);
+    if (json != NULL) {
+        bench_json_result(json, r, first_result);
+        first_result = 0;
+    }
+}
+
+/* *************************************
+ * Runs `statement` as benchmark
+ * function/size if selected.
+ * ************************************/
+#define BENCH(function, size, n_elements, n_bytes, n_flops, statement) \
+    if (selected(function, size)) { \
+        bench_result __r = {name, (n_elements), (n_bytes), (n_flops), {0}}; \
+        bench_measure(__r.stats, statement); \
+        record(&__r); \
+    }
+
+static void copy_square(double **dst, double **src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) memcpy(dst[i], src[i], n * sizeof(double));
+}
+
+static void bench_vectors(void)
+{
+    volatile double sink = 0;
+    for (size_t s = 0; s < N_SIZES(vector_sizes); s++) {
+        size_t n = vector_sizes[s];
+        double b = 8.0 * n;
+        double *x = create_random_uniform_vector(n, 1);
+        double *y = create_random_uniform_vector(n, 2);
+        double *z = create_vector(n);
+
+        BENCH("dot_product", n, n, 2 * b, 2.0 * n,
+              sink = dot_product(x, y, n));
+        BENCH("vector_norm", n, n, b, 2.0 * n,
+              sink = vector_norm(x, n));
+        BENCH("distance_between_vectors", n, n, 2 * b, 3.0 * n,
+              sink = distance_between_vectors(x, y, n));
+        BENCH("squared_distance_between_vectors", n, n, 2 * b, 3.0 * n,
+              sink = squared_distance_between_vectors(x, y, n));
+        copy_vector(z, x, n);
+        BENCH("normalize_vector", n, n, 3 * b, 3.0 * n,
+              sink = normalize_vector(z, n));
+        BENCH("elementwise_addition", n, n, 3 * b, n,
+              elementwise_addition(z, x, y, n));
+        BENCH("elementwise_multiplication", n, n, 3 * b, n,
+              elementwise_multiplication(z, x, y, n));
+        BENCH("vector_subtraction", n, n, 3 * b, n,
+              vector_subtraction(z, x, y, n));
+        BENCH("scale_vector_by_factor", n, n, 2 * b, n,
+              scale_vector_by_factor(z, 1.0, n));
+        BENCH("add_scalar_to_vector", n, n, 2 * b, n,
+              add_scalar_to_vector(z, 0.0, n));
+        BENCH("copy_vector", n, n, 2 * b, 0,
+              copy_vector(z, x, n));
+        BENCH("vector_average", n, n, b, n,
+              sink = vector_average(x, n));
+        BENCH("vector_variance", n, n, b, 3.0 * n,
+              sink = vector_variance(x, n));
+        BENCH("vector_max", n, n, b, 0,
+              sink = vector_max(x, n));
+        BENCH("compute_vector_statistics", n, n, b, 5.0 * n,
+              sink = compute_vector_statistics(x, n).std);
+        static const char *reductions[] = {"fast", "pairwise",
+                                           "compensated", "reproducible"};
+        for (int mode = LINALG_REDUCTION_PAIRWISE;
+             mode <= LINALG_REDUCTION_REPRODUCIBLE; mode++) {
+            char function[64];
+            linalg_set_reduction((linalg_reduction)mode);
+            snprintf(function, sizeof(function), "dot_product/%s",
+                     reductions[mode]);
+            BENCH(function, n, n, 2 * b, 2.0 * n,
+                  sink = dot_product(x, y, n));
+            snprintf(function, sizeof(function), "vector_average/%s",
+                     reductions[mode]);
+            BENCH(function, n, n, b, n,
+                  sink = vector_average(x, n));
+        }
+        linalg_set_reduction(LINALG_REDUCTION_FAST);
+        BENCH("fill_random_uniform_vector", n, n, b, 0,
+              fill_random_uniform_vector(z, n, 0.0, 1.0, 3));
+        BENCH("fill_random_normal_vector", n, n, b, 0,
+              fill_random_normal_vector(z, n, 0.0, 1.0, 3));
+        BENCH("evaluate_function_on_vector/exp", n, n, 2 * b, 0,
+              evaluate_function_on_vector(z, exp, x, n));
+        BENCH("elementwise_exp", n, n, 2 * b, 0,
+              elementwise_exp(z, x, n));
+        BENCH("elementwise_log", n, n, 2 * b, 0,
+              elementwise_log(z, x, n));
+        BENCH("elementwise_sin", n, n, 2 * b, 0,
+              elementwise_sin(z, x, n));
+        BENCH("elementwise_tanh", n, n, 2 * b, 0,
+              elementwise_tanh(z, x, n));
+        BENCH("elementwise_pow", n, n, 2 * b, 0,
+              elementwise_pow(z, x, 1.5, n));
+
+        destroy_vector(x);
+        destroy_vector(y);
+        destroy_vector(z);
+    }
+    (void)sink;
+}
+
+static void bench_matrices(void)
+{
+    for (size_t s = 0; s < N_SIZES(matrix_sides); s++) {
+        size_t n = matrix_sides[s], e = n * n;
+        double b = 8.0 * e;
+        double **x = create_random_uniform_matrix(n, n, 1);
+        double **y = create_random_uniform_matrix(n, n, 2);
+        double **z = create_matrix(n, n);
+
+        BENCH("elementwise_matrix_addition", n, e, 3 * b, e,
+              elementwise_matrix_addition(z, x, y, n, n));
+        BENCH("elementwise_matrix_multiplication", n, e, 3 * b, e,
+              elementwise_matrix_multiplication(z, x, y, n, n));
+        BENCH("add_scaled_matrix_to_matrix", n, e, 3 * b, 2.0 * e,
+              add_scaled_matrix_to_matrix(z, x, y, 0.5, n, n));
+        BENCH("scale_matrix_by_factor", n, e, 2 * b, e,
+              scale_matrix_by_factor(z, 1.0, n, n));
+        BENCH("transpose_matrix", n, e, 2 * b, 0,
+              transpose_matrix(z, x, n, n));
+        BENCH("transpose_square_matrix_in_place", n, e, 2 * b, 0,
+              transpose_square_matrix_in_place(z, n));
+        BENCH("create_transpose_of_matrix", n, e, 2 * b, 0, {
+            double **t = create_transpose_of_matrix(x, n, n);
+            destroy_matrix(t, n);
+        });
+        BENCH("fill_random_uniform_matrix", n, e, b, 0,
+              fill_random_uniform_matrix(z, n, n, 0.0, 1.0, 3));
+
+        // Temporary matrix from the system, an arena and a pool
+        BENCH("create_destroy_matrix", n, e, b, 0,
+              destroy_matrix(create_matrix(n, n), n));
+        linalg_arena *arena = linalg_arena_create(0);
+        linalg_allocator arena_allocator = linalg_arena_allocator(arena);
+        BENCH("create_destroy_matrix_arena", n, e, b, 0, {
+            create_matrix_with_allocator(n, n, &arena_allocator);
+            linalg_arena_reset(arena, NULL);
+        });
+        linalg_arena_destroy(arena);
+        linalg_pool *pool = linalg_pool_create();
+        linalg_allocator pool_allocator = linalg_pool_allocator(pool);
+        BENCH("create_destroy_matrix_pool", n, e, b, 0,
+              destroy_matrix(create_matrix_with_allocator(n, n, &pool_allocator),
+                             n));
+        linalg_pool_destroy(pool);
+
+        // A*x as GEMV and, as before, as a product with an n x 1 matrix
+        double *v = create_random_uniform_vector(n, 4);
+        double *w = create_vector(n);
+        double **column = create_random_uniform_matrix(n, 1, 4);
+        double **product = create_matrix(n, 1);
+        BENCH("matrix_multiplication_by_column", n, e, b, 2.0 * e,
+              matrix_multiplication(product, x, column, n, n, 1));
+        BENCH("matrix_vector_multiplication", n, e, b, 2.0 * e,
+              matrix_vector_multiplication(w, x, v, n, n));
+        BENCH("general_matrix_vector_multiplication_t", n, e, b, 2.0 * e,
+              general_matrix_vector_multiplication(w, x, v, n, n, 1.0, 1.0,
+                                                   LINALG_TRANSPOSE));
+        BENCH("rank_one_update", n, e, 2 * b, 2.0 * e,
+              rank_one_update(z, v, w, n, n, 1e-3));
+        destroy_matrix(product, n);
+        destroy_matrix(column, n);
+        destroy_vector(w);
+        destroy_vector(v);
+
+        // z = 2*(x.*y + 0.5*x) + 1, as separate passes and fused
+        BENCH("update_chain_unfused", n, e, 3 * b, 5.0 * e, {
+            elementwise_matrix_multiplication(z, x, y, n, n);
+            add_scaled_matrix_to_matrix(z, z, x, 0.5, n, n);
+            scale_matrix_by_factor(z, 2.0, n, n);
+            add_scalar_to_matrix(z, 1.0, n, n);
+        });
+        linalg_expr *ex = expr_create();
+        expr_node xn = expr_matrix(ex, x, n, n);
+        expr_node root = expr_add(ex, expr_mul(ex, xn, expr_matrix(ex, y, n, n)),
+                                  expr_scale(ex, xn, 0.5));
+        root = expr_add_scalar(ex, expr_scale(ex, root, 2.0), 1.0);
+        BENCH("expr_evaluate_matrix", n, e, 3 * b, 5.0 * e,
+              expr_evaluate_matrix(ex, root, z, n, n));
+        expr_destroy(ex);
+
+        // A column through a copy and through a strided view
+        volatile double sink = 0;
+        double *col = create_vector(n);
+        BENCH("copy_column_to_vector+dot_product", n, n, 8.0 * n, 2.0 * n, {
+            copy_column_to_vector(col, x, 1, n);
+            sink = dot_product(col, col, n);
+        });
+        BENCH("dot_product_view/column", n, n, 8.0 * n, 2.0 * n,
+              sink = dot_product_view(matrix_column_view(matrix_of(x), 1),
+                                      matrix_column_view(matrix_of(x), 1)));
+        (void)sink;
+
+        // Growing an n x 1 matrix by APPEND_COLUMNS columns
+        BENCH("create_matrix_with_inserted_column/append", n,
+              n * APPEND_COLUMNS, 0, 0, {
+            double **m = create_matrix(n, 1);
+            for (size_t c = 1; c <= APPEND_COLUMNS; c++) {
+                double **grown = create_matrix_with_inserted_column(m, col, n, c, c);
+                destroy_matrix(m, n);
+                m = grown;
+            }
+            destroy_matrix(m, n);
+        });
+        BENCH("matrix_append_column", n, n * APPEND_COLUMNS, 0, 0, {
+            matrix_t *m = matrix_alloc(n, 1);
+            for (size_t c = 1; c <= APPEND_COLUMNS; c++) matrix_append_column(m, col);
+            matrix_free(m);
+        });
+        destroy_vector(col);
+
+        destroy_matrix(x, n);
+        destroy_matrix(y, n);
+        destroy_matrix(z, n);
+    }
+
+    for (size_t s = 0; s < N_SIZES(gemm_sides); s++) {
+        size_t n = gemm_sides[s], e = n * n;
+        double **a = create_random_uniform_matrix(n, n, 1);
+        double **b = create_random_uniform_matrix(n, n, 2);
+        double **c = create_matrix(n, n);
+
+        BENCH("matrix_multiplication", n, e, 3 * 8.0 * e, 2.0 * e * n,
+              matrix_multiplication(c, a, b, n, n, n));
+        BENCH("general_matrix_multiplication_tn", n, e, 3 * 8.0 * e,
+              2.0 * e * n,
+              general_matrix_multiplication(c, a, b, n, n, n, 1.0, 1.0,
+                                            LINALG_TRANSPOSE,
+                                            LINALG_NO_TRANSPOSE));
+
+
+        // Factorizations of a copy (the copy is included in the time)
+        size_t *pivot = malloc(n * sizeof(size_t));
+        BENCH("lu_decomposition", n, e, 8.0 * e, 2.0 / 3.0 * e * n, {
+            copy_square(c, a, n);
+            lu_decomposition(c, n, pivot);
+        });
+        general_matrix_multiplication(b, a, a, n, n, n, 1.0, 0.0,
+                                      LINALG_NO_TRANSPOSE, LINALG_TRANSPOSE);
+        for (size_t i = 0; i < n; i++) b[i][i] += n;
+        BENCH("cholesky_decomposition", n, e, 8.0 * e, 1.0 / 3.0 * e * n, {
+            copy_square(c, b, n);
+            cholesky_decomposition(c, n);
+        });
+        double *tau = create_vector(n);
+        BENCH("qr_decomposition", n, e, 8.0 * e, 4.0 / 3.0 * e * n, {
+            copy_square(c, a, n);
+            qr_decomposition(c, n, n, tau);
+        });
+        destroy_vector(tau);
+        free(pivot);
+        double *lambda = create_vector(n);
+        BENCH("symmetric_eigen_decomposition", n, e, 8.0 * e, 0,
+              symmetric_eigen_decomposition(lambda, c, a, n));
+        destroy_vector(lambda);
+
+        destroy_matrix(a, n);
+        destroy_matrix(b, n);
+        destroy_matrix(c, n);
+    }
+}
+
+// Passes of a randomized SVD over its matrix: the sample, the power
+// iterations and the projection, each a product both ways but the first
+// Same sizes as the double benchmarks, for float and 16-bit storage
+static void bench_precision(void)
+{
+    volatile float sink = 0;
+    for (size_t s = 0; s < N_SIZES(vector_sizes); s++) {
+        size_t n = vector_sizes[s];
+        double b = 4.0 * n;
+        double *xd = create_random_uniform_vector(n, 1);
+        double *yd = create_random_uniform_vector(n, 2);
+        float *x = create_vector_f32(n), *y = create_vector_f32(n);
+        linalg_f16 *xh = malloc(n * sizeof(linalg_f16));
+        linalg_f16 *yh = malloc(n * sizeof(linalg_f16));
+        linalg_bf16 *xb = malloc(n * sizeof(linalg_bf16));
+        linalg_bf16 *yb = malloc(n * sizeof(linalg_bf16));
+        convert_vector_f64_to_f32(x, xd, n);
+        convert_vector_f64_to_f32(y, yd, n);
+        convert_vector_f32_to_f16(yh, y, n);
+        convert_vector_f32_to_bf16(xb, x, n);
+        convert_vector_f32_to_bf16(yb, y, n);
+
+        BENCH("dot_product_f32", n, n, 2 * b, 2.0 * n,
+              sink = dot_product_f32(x, y, n));
+        BENCH("distance_between_vectors_f32", n, n, 2 * b, 3.0 * n,
+              sink = distance_between_vectors_f32(x, y, n));
+        BENCH("convert_vector_f32_to_f16", n, n, 1.5 * b, 0,
+              convert_vector_f32_to_f16(xh, x, n));
+        BENCH("dot_product_f16", n, n, b, 2.0 * n,
+              sink = dot_product_f16(xh, yh, n));
+        BENCH("dot_product_bf16", n, n, b, 2.0 * n,
+              sink = dot_product_bf16(xb, yb, n));
+
+        free(yb);
+        free(xb);
+        free(yh);
+        free(xh);
+        destroy_vector_f32(y);
+        destroy_vector_f32(x);
+        destroy_vector(yd);
+        destroy_vector(xd);
+    }
+    (void)sink;
+
+    for (size_t s = 0; s < N_SIZES(gemm_sides); s++) {
+        size_t n = gemm_sides[s], e = n * n;
+        float **a = create_matrix_f32(n, n), **b = create_matrix_f32(n, n);
+        float **c = create_matrix_f32(n, n);
+        double *row = create_random_uniform_vector(n, 1);
+        for (size_t i = 0; i < n; i++) {
+            convert_vector_f64_to_f32(a[i], row, n);
+            convert_vector_f64_to_f32(b[n - 1 - i], row, n);
+            row[i] = 0.5;
+        }
+
+        BENCH("matrix_multiplication_f32", n, e, 3 * 4.0 * e, 2.0 * e * n,
+              matrix_multiplication_f32(c, a, b, n, n, n));
+
+        destroy_vector(row);
+        destroy_matrix_f32(c, n);
+        destroy_matrix_f32(b, n);
+        destroy_matrix_f32(a, n);
+    }
+}
+
+static double svd_passes(void)
+{
+    return 2.0 * SVD_POWER_ITERATIONS + 2.0;
+}
+
+static void bench_neighbours(void)
+{
+    volatile double sink = 0;
+    size_t *indices = malloc(KNN_QUERIES * KNN_K * sizeof(size_t));
+    double *distances = create_vector(KNN_QUERIES * KNN_K);
+    double **q = create_random_uniform_matrix(KNN_QUERIES, KNN_DIM, 1);
+    for (size_t s = 0; s < N_SIZES(knn_references); s++) {
+        size_t n = knn_references[s], e = KNN_QUERIES * n;
+        double **r = create_random_uniform_matrix(n, KNN_DIM, 2);
+        double b = 8.0 * KNN_DIM * n, flops = 2.0 * e * KNN_DIM;
+
+        // The distance matrix only at the smaller size (32 MiB)
+        if (n <= 4096) {
+            double **d = create_matrix(KNN_QUERIES, n);
+            BENCH("distance_between_vectors/all_pairs", n, e, b, flops, {
+                for (size_t i = 0; i < KNN_QUERIES; i++)
+                    for (size_t j = 0; j < n; j++)
+                        d[i][j] = distance_between_vectors(q[i], r[j], KNN_DIM);
+            });
+            BENCH("pairwise_distances", n, e, b + 8.0 * e, flops,
+                  pairwise_distances(d, q, KNN_QUERIES, r, n, KNN_DIM,
+                                     LINALG_DISTANCE_EUCLIDEAN));
+            destroy_matrix(d, KNN_QUERIES);
+        }
+        BENCH("k_nearest_neighbours", n, e, b, flops,
+              sink = k_nearest_neighbours(indices, distances, q, KNN_QUERIES,
+                                          r, n, KNN_DIM, KNN_K,
+                                          LINALG_DISTANCE_EUCLIDEAN));
+        destroy_matrix(r, n);
+    }
+    destroy_matrix(q, KNN_QUERIES);
+    destroy_vector(distances);
+    free(indices);
+    (void)sink;
+}
+
+static void bench_svd(void)
+{
+    double s[SVD_RANK];
+    size_t l = SVD_RANK + 10;
+    for (size_t r = 0; r < N_SIZES(svd_rows); r++) {
+        size_t m = svd_rows[r], e = m * SVD_COLS;
+        double **a = create_random_uniform_matrix(m, SVD_COLS, 1);
+        double **u = create_matrix(m, SVD_RANK);
+        double **v = create_matrix(SVD_COLS, SVD_RANK);
+        BENCH("truncated_svd", m, e, svd_passes() * 8.0 * e,
+              svd_passes() * 2.0 * e * l,
+              truncated_svd(s, u, v, a, m, SVD_COLS, SVD_RANK,
+                            SVD_POWER_ITERATIONS, 5));
+        destroy_matrix(a, m);
+        destroy_matrix(u, m);
+        destroy_matrix(v, SVD_COLS);
+    }
+}
+
+static void bench_batches(void)
+{
+    for (size_t s = 0; s < N_SIZES(batch_sides); s++) {
+        size_t n = batch_sides[s], e = n * n, total = BATCH_COUNT * e;
+        double b = 8.0 * total;
+        double *x = create_random_uniform_vector(total, 1);
+        double *y = create_random_uniform_vector(total, 2);
+        double *z = create_vector(total);
+        double *v = create_vector(BATCH_COUNT * n);
+        matrix_batch X = matrix_batch_contiguous(x, n, n);
+        matrix_batch Y = matrix_batch_contiguous(y, n, n);
+        matrix_batch Z = matrix_batch_contiguous(z, n, n);
+        vector_batch in = {y, n, e}, out = {v, n, n};
+
+        // The same products one call per matrix, for comparison
+        double **xs = malloc(total * sizeof(double *));
+        double **ys = malloc(total * sizeof(double *));
+        double **zs = malloc(total * sizeof(double *));
+        for (size_t i = 0; i < BATCH_COUNT * n; i++) {
+            xs[i] = x + i * n;
+            ys[i] = y + i * n;
+            zs[i] = z + i * n;
+        }
+        BENCH("general_matrix_multiplication_each", n, total, 3 * b,
+              2.0 * total * n, {
+            for (size_t k = 0; k < BATCH_COUNT; k++) {
+                general_matrix_multiplication(zs + k * n, xs + k * n,
+                                              ys + k * n, n, n, n, 1.0, 0.0,
+                                              LINALG_NO_TRANSPOSE,
+                                              LINALG_NO_TRANSPOSE);
+            }
+        });
+        BENCH("batched_general_matrix_multiplication", n, total, 3 * b,
+              2.0 * total * n,
+              batched_general_matrix_multiplication(Z, X, Y, BATCH_COUNT, 1.0,
+                                                    0.0, LINALG_NO_TRANSPOSE,
+                                                    LINALG_NO_TRANSPOSE));
+        BENCH("batched_matrix_vector_multiplication", n, total, b,
+              2.0 * total,
+              batched_matrix_vector_multiplication(out, X, in, BATCH_COUNT,
+                                                   1.0, 0.0,
+                                                   LINALG_NO_TRANSPOSE));
+        BENCH("batched_transpose", n, total, 2 * b, 0,
+              batched_transpose(Z, X, BATCH_COUNT));
+        BENCH("batched_add_scaled", n, total, 3 * b, 2.0 * total,
+              batched_add_scaled(Z, X, Y, 0.5, BATCH_COUNT));
+
+        free(xs);
+        free(ys);
+        free(zs);
+        destroy_vector(x);
+        destroy_vector(y);
+        destroy_vector(z);
+        destroy_vector(v);
+    }
+}
+
+// Square matrix with SPARSE_ROW_NNZ random columns per row
+static void bench_sparse(void)
+{
+    for (size_t s = 0; s < N_SIZES(sparse_sides); s++) {
+        size_t n = sparse_sides[s], nnz = n * SPARSE_ROW_NNZ;
+        size_t *ri = malloc(nnz * sizeof(size_t));
+        size_t *ci = malloc(nnz * sizeof(size_t));
+        double *vals = create_random_uniform_vector(nnz, 1);
+        for (size_t k = 0; k < nnz; k++) {
+            ri[k] = k / SPARSE_ROW_NNZ;
+            ci[k] = (size_t)(vals[k] * n);
+        }
+        double b = 20.0 * nnz; // value, index, gathered x
+        double *x = create_random_uniform_vector(n, 2);
+        double *y = create_vector(n);
+
+        BENCH("create_sparse_matrix_from_triplets", n, nnz, 32.0 * nnz, 0, {
+            destroy_sparse_matrix(create_sparse_matrix_from_triplets(
+                n, n, nnz, ri, ci, vals, LINALG_CSR));
+        });
+        sparse_matrix *csr = create_sparse_matrix_from_triplets(
+            n, n, nnz, ri, ci, vals, LINALG_CSR);
+        sparse_matrix *csc = create_converted_sparse_matrix(csr, LINALG_CSC);
+        BENCH("sparse_matrix_vector_multiplication_csr", n, nnz, b, 2.0 * nnz,
+              sparse_matrix_vector_multiplication(y, csr, x, 1.0, 0.0,
+                                                  LINALG_NO_TRANSPOSE));
+        BENCH("sparse_matrix_vector_multiplication_csc", n, nnz, b, 2.0 * nnz,
+              sparse_matrix_vector_multiplication(y, csc, x, 1.0, 0.0,
+                                                  LINALG_NO_TRANSPOSE));
+        if (n <= (1 << 17)) {
+            double **B = create_random_uniform_matrix(n, SPMM_COLS, 3);
+            double **C = create_matrix(n, SPMM_COLS);
+            BENCH("sparse_dense_matrix_multiplication", n, nnz,
+                  16.0 * nnz + 8.0 * nnz * SPMM_COLS,
+                  2.0 * nnz * SPMM_COLS,
+                  sparse_dense_matrix_multiplication(C, csr, B, SPMM_COLS,
+                                                     1.0, 0.0));
+            destroy_matrix(B, n);
+            destroy_matrix(C, n);
+
+            double s[SVD_RANK];
+            BENCH("sparse_truncated_svd", n, nnz, svd_passes() * 16.0 * nnz,
+                  svd_passes() * 2.0 * nnz * (SVD_RANK + 10),
+                  sparse_truncated_svd(s, NULL, NULL, csr, SVD_RANK,
+                                       SVD_POWER_ITERATIONS, 5));
+        }
+
+        destroy_sparse_matrix(csr);
+        destroy_sparse_matrix(csc);
+        destroy_vector(x);
+        destroy_vector(y);
+        destroy_vector(vals);
+        free(ri);
+        free(ci);
+    }
+}
+
+static double file_size(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return 0;
+    fseek(file, 0, SEEK_END);
+    double size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+static void bench_files(void)
+{
+    volatile double sink = 0;
+    for (size_t s = 0; s < N_SIZES(file_sides); s++) {
+        size_t n = file_sides[s], e = n * n, rows, cols;
+        double **x = create_random_uniform_matrix(n, n, 1);
+        double **y = create_matrix(n, n);
+        csv_write_options shortest = {-1, 0};
+
+        write_matrix_to_csv(CSV_PATH, NULL, x, n, n, NULL);
+        double csv_bytes = file_size(CSV_PATH);
+        BENCH("write_matrix_to_csv", n, e, csv_bytes, 0,
+              write_matrix_to_csv(CSV_PATH, NULL, x, n, n, NULL));
+        BENCH("read_csv_to_new_matrix", n, e, csv_bytes, 0, {
+            double **m = read_csv_to_new_matrix(CSV_PATH, &rows, &cols, NULL);
+            destroy_matrix(m, rows);
+        });
+        BENCH("read_csv_to_matrix", n, e, csv_bytes, 0,
+              read_csv_to_matrix(y, CSV_PATH, n, n));
+        write_matrix_to_csv(CSV_PATH, NULL, x, n, n, &shortest);
+        BENCH("write_matrix_to_csv_shortest", n, e, file_size(CSV_PATH), 0,
+              write_matrix_to_csv(CSV_PATH, NULL, x, n, n, &shortest));
+
+        save_matrix_to_binary_file(BINARY_PATH, x, n, n);
+        double binary_bytes = file_size(BINARY_PATH);
+        BENCH("save_matrix_to_binary_file", n, e, binary_bytes, 0,
+              save_matrix_to_binary_file(BINARY_PATH, x, n, n));
+        BENCH("load_matrix_from_binary_file", n, e, binary_bytes, 0, {
+            double **m = load_matrix_from_binary_file(BINARY_PATH, &rows, &cols);
+            destroy_matrix(m, rows);
+        });
+        // Sums the mapped matrix, so that every page is faulted in and
+        // read: mapping alone moves no data
+        BENCH("matrix_map_file", n, e, binary_bytes, e, {
+            matrix_t *m = matrix_map_file(BINARY_PATH);
+            double sum = 0;
+            for (size_t i = 0; i < m->rows; i++)
+                sum += vector_average(m->row[i], m->cols);
+            sink = sum;
+            matrix_free(m);
+        });
+
+        destroy_matrix(x, n);
+        destroy_matrix(y, n);
+    }
+    remove(CSV_PATH);
+    remove(BINARY_PATH);
+    (void)sink;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *json_path = argc > 1 ? argv[1] : "bench_results.json";
+    filter = argc > 2 ? argv[2] : NULL;
+
+    static const char *isa_names[] = {"generic", "sse2", "avx2", "avx512"};
+    const char *isa = isa_names[linalg_get_isa()];
+    size_t threads = linalg_get_num_threads();
+    json = bench_json_open(json_path, isa, threads);
+    if (json == NULL) {
+        fprintf(stderr, "could not open %s\n", json_path);
+        return 1;
+    }
+
+    printf("isa %s, %zu thread(s), results in %s\n", isa, threads, json_path);
+    bench_print_header();
+    bench_vectors();
+    bench_matrices();
+    bench_precision();
+    bench_neighbours();
+    bench_svd();
+    bench_batches();
+    bench_sparse();
+    bench_files();
+
+    bench_json_close(json);
+    return 0;
+}
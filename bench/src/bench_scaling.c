@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_main.h"
+#include "linalg.h"
+
+/* *************************************
+ * Thread scaling benchmark.
+ *
+ * Runs the threaded kernels with 1..N
+ * threads and prints time and speedup
+ * relative to one thread. N defaults to
+ * the number of CPUs available; pass a
+ * different N as first argument.
+ *
+ * Also checks that the elementwise
+ * results are bitwise identical for
+ * every thread count.
+ * ************************************/
+
+#define GEMM_SIZE 2000
+#define ELEMENTWISE_SIZE 4000
+#define REPEATS 5
+
+static int matrices_identical(double **a, double **b, size_t rows, size_t cols)
+{
+    for (size_t i = 0; i < rows; i++) {
+        if (memcmp(a[i], b[i], cols * sizeof(double)) != 0) return 0;
+    }
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t max_threads = 0;
+    if (argc > 1) {
+        max_threads = strtoul(argv[1], NULL, 10);
+    } else {
+        linalg_set_num_threads(0);
+        max_threads = linalg_get_num_threads();
+    }
+
+    const size_t n = GEMM_SIZE, e = ELEMENTWISE_SIZE;
+    double **a = create_random_uniform_matrix(n, n, 1);
+    double **b = create_random_uniform_matrix(n, n, 2);
+    double **c = create_matrix(n, n);
+    double **x = create_random_uniform_matrix(e, e, 3);
+    double **y = create_random_uniform_matrix(e, e, 4);
+    double **z = create_matrix(e, e);
+    double **reference = create_matrix(e, e);
+
+    double base_gemm = 0, base_add = 0, base_axpy = 0, base_transpose = 0;
+    int identical = 1;
+
+    printf("%8s %12s %8s %12s %8s %12s %8s %12s %8s\n", "threads",
+           "gemm [s]", "speedup", "add [s]", "speedup",
+           "add_scaled", "speedup", "transpose", "speedup");
+    for (size_t t = 1; t <= max_threads; t++) {
+        linalg_set_num_threads(t);
+        double t_gemm, t_add, t_axpy, t_transpose;
+        bench_best_time(t_gemm, REPEATS,
+                        matrix_multiplication(c, a, b, n, n, n));
+        bench_best_time(t_add, REPEATS,
+                        elementwise_matrix_addition(z, x, y, e, e));
+        bench_best_time(t_axpy, REPEATS,
+                        add_scaled_matrix_to_matrix(z, x, y, 0.5, e, e));
+        if (t == 1) {
+            for (size_t i = 0; i < e; i++) {
+                memcpy(reference[i], z[i], e * sizeof(double));
+            }
+        } else {
+            identical &= matrices_identical(z, reference, e, e);
+        }
+        bench_best_time(t_transpose, REPEATS, {
+            double **tr = create_transpose_of_matrix(x, e, e);
+            destroy_matrix(tr, e);
+        });
+        if (t == 1) {
+            base_gemm = t_gemm;
+            base_add = t_add;
+            base_axpy = t_axpy;
+            base_transpose = t_transpose;
+        }
+        printf("%8zu %12.4f %8.2f %12.4f %8.2f %12.4f %8.2f %12.4f %8.2f\n", t,
+               t_gemm, base_gemm / t_gemm, t_add, base_add / t_add,
+               t_axpy, base_axpy / t_axpy,
+               t_transpose, base_transpose / t_transpose);
+    }
+    printf("elementwise results identical across thread counts: %s\n",
+           identical ? "yes" : "NO");
+
+    destroy_matrix(a, n);
+    destroy_matrix(b, n);
+    destroy_matrix(c, n);
+    destroy_matrix(x, e);
+    destroy_matrix(y, e);
+    destroy_matrix(z, e);
+    destroy_matrix(reference, e);
+    return identical ? 0 : 1;
+}
@@ -1,6 +1,266 @@
 #pragma once
 
 #include <stddef.h> //for size_t
+#include <stdint.h> //for uint16_t
+
+/* **********************************************
+ *
+ * Alignment in bytes of matrix data and rows
+ * (one cache line).
+ *
+ * **********************************************/
+#define LINALG_ALIGNMENT 64
+
+/* **********************************************
+ *
+ * Pluggable allocator for vectors and matrices.
+ * alloc returns size bytes aligned to alignment
+ * (a power of two) or NULL; free releases a
+ * block from alloc given the same size. state
+ * is passed to both. A NULL allocator pointer,
+ * or alloc == NULL, means the system allocator.
+ *
+ * See linalg_arena_allocator and
+ * linalg_pool_allocator for the built-in ones.
+ *
+ * **********************************************/
+typedef struct {
+	void* (*alloc)(void* state, size_t size, size_t alignment);
+	void  (*free)(void* state, void* ptr, size_t size);
+	void* state;
+} linalg_allocator;
+
+/* **********************************************
+ *
+ * Matrix stored as one contiguous row-major
+ * block. Element (i, j) is data[i*stride + j].
+ * stride (leading dimension) is >= cols and
+ * may be padded so rows start on cache lines.
+ *
+ * row is a double** view into the block,
+ * row[i] == data + i*stride, which can be
+ * passed to every function taking double**.
+ *
+ * **********************************************/
+typedef struct matrix_t {
+	double*  data;
+	double** row;
+	size_t   rows;
+	size_t   cols;
+	size_t   stride;
+	unsigned flags;     // internal: ownership of data
+	void*    base;      // internal: allocation or mapping backing data
+	size_t   base_size; // internal: size of base
+	linalg_allocator allocator; // internal: owner of handle and data
+} matrix_t;
+
+/* **********************************************
+ *
+ * Set number of threads used by the library.
+ * Default is 1 (serial) unless the environment
+ * variable LINALG_NUM_THREADS is set. 0 means
+ * one thread per CPU available to the process.
+ *
+ * Threads are kept in a persistent pool, each
+ * pinned to its own CPU, and work is split in
+ * fixed contiguous row ranges, so elementwise
+ * results do not depend on the thread count.
+ * Currently threaded: matrix_multiplication,
+ * the factorizations and triangular solves,
+ * the matrix-vector products, the sparse
+ * products, the elementwise matrix functions,
+ * the transposes, random generation, the
+ * batched functions, the reductions (see
+ * linalg_set_reduction), the pairwise
+ * distances and nearest neighbours and the
+ * zeroing (NUMA first touch) in create_matrix.
+ *
+ * **********************************************/
+void linalg_set_num_threads(
+	size_t num_threads
+);
+
+/* **********************************************
+ *
+ * Returns number of threads used by the library.
+ *
+ * **********************************************/
+size_t linalg_get_num_threads(void);
+
+/* **********************************************
+ *
+ * Instruction sets the vector and matrix
+ * kernels are compiled for. At load time the
+ * library picks the best one the CPU supports;
+ * the environment variable LINALG_ISA
+ * (generic, sse2, avx2, avx512) caps it.
+ *
+ * **********************************************/
+typedef enum {
+	LINALG_ISA_GENERIC,
+	LINALG_ISA_SSE2,
+	LINALG_ISA_AVX2,   // AVX2 + FMA + F16C
+	LINALG_ISA_AVX512  // AVX-512F
+} linalg_isa;
+
+/* **********************************************
+ *
+ * Returns instruction set in use.
+ *
+ * **********************************************/
+linalg_isa linalg_get_isa(void);
+
+/* **********************************************
+ *
+ * Switch kernels to given instruction set.
+ * Returns 0, or -1 if the CPU does not support
+ * it. Not thread safe; call before using the
+ * library from several threads.
+ *
+ * **********************************************/
+int linalg_set_isa(
+	linalg_isa isa
+);
+
+/* **********************************************
+ *
+ * How dot_product, vector_norm, the distances,
+ * vector_average, vector_variance and
+ * vector_standard_deviation add up their terms.
+ *
+ * FAST: one SIMD accumulator per lane. Error
+ * grows with the length; the result depends on
+ * the instruction set and the thread count.
+ * PAIRWISE: pairwise (tree) summation, error
+ * grows with log of the length.
+ * COMPENSATED: TwoSum (Kahan-Babuska) in every
+ * lane, about as accurate as summing in twice
+ * the precision. The rounding of the products
+ * and squares themselves is not corrected.
+ * REPRODUCIBLE: fixed blocks, lanes and tree,
+ * so results are the same bits for every
+ * instruction set and thread count. Accuracy
+ * as PAIRWISE.
+ *
+ * Default is FAST unless the environment
+ * variable LINALG_REDUCTION is set (fast,
+ * pairwise, compensated, reproducible).
+ *
+ * **********************************************/
+typedef enum {
+	LINALG_REDUCTION_FAST,
+	LINALG_REDUCTION_PAIRWISE,
+	LINALG_REDUCTION_COMPENSATED,
+	LINALG_REDUCTION_REPRODUCIBLE
+} linalg_reduction;
+
+/* **********************************************
+ *
+ * Set reduction mode. Not thread safe, as
+ * linalg_set_isa.
+ *
+ * **********************************************/
+void linalg_set_reduction(
+	linalg_reduction mode
+);
+
+/* **********************************************
+ *
+ * Returns reduction mode in use.
+ *
+ * **********************************************/
+linalg_reduction linalg_get_reduction(void);
+
+/* **********************************************
+ *
+ * Arena allocator. Allocation bumps a pointer
+ * in large chunks; everything allocated after
+ * a marker is released at once, in O(1), by
+ * linalg_arena_reset. Chunks are kept for
+ * reuse (no new page faults) until
+ * linalg_arena_destroy. Freeing the most recent
+ * allocation pops it; other frees are no-ops.
+ *
+ * chunk_size is the chunk size in bytes, 0 for
+ * the default (1 MiB). Not thread safe: use one
+ * arena per thread. Returns NULL if allocation
+ * fails.
+ *
+ * Example, temporaries of one request:
+ *     linalg_arena_marker mark = linalg_arena_mark(arena);
+ *     linalg_allocator a = linalg_arena_allocator(arena);
+ *     double** tmp = create_matrix_with_allocator(n, n, &a);
+ *     ...
+ *     linalg_arena_reset(arena, &mark);
+ *
+ * **********************************************/
+typedef struct linalg_arena linalg_arena;
+
+typedef struct {
+	void*  chunk;
+	size_t used;
+} linalg_arena_marker;
+
+linalg_arena* linalg_arena_create(
+	size_t chunk_size
+);
+
+void linalg_arena_destroy(
+	linalg_arena* arena
+);
+
+linalg_allocator linalg_arena_allocator(
+	linalg_arena* arena
+);
+
+/* **********************************************
+ *
+ * Current position of the arena.
+ *
+ * **********************************************/
+linalg_arena_marker linalg_arena_mark(
+	linalg_arena* arena
+);
+
+/* **********************************************
+ *
+ * Releases everything allocated after mark
+ * (everything if mark is NULL). Vectors and
+ * matrices allocated there must not be used or
+ * destroyed afterwards.
+ *
+ * **********************************************/
+void linalg_arena_reset(
+	linalg_arena* arena,
+	const linalg_arena_marker* mark
+);
+
+/* **********************************************
+ *
+ * Pool allocator with power-of-two size classes
+ * from 64 B to 4 GiB. Freed blocks go to a free
+ * list of their class and are reused by the
+ * next allocation of that class, so large
+ * temporaries do not page fault again; larger
+ * blocks go to the system allocator. Alignments up to
+ * LINALG_ALIGNMENT are supported.
+ *
+ * All memory is returned to the system by
+ * linalg_pool_destroy. Not thread safe.
+ * Returns NULL if allocation fails.
+ *
+ * **********************************************/
+typedef struct linalg_pool linalg_pool;
+
+linalg_pool* linalg_pool_create(void);
+
+void linalg_pool_destroy(
+	linalg_pool* pool
+);
+
+linalg_allocator linalg_pool_allocator(
+	linalg_pool* pool
+);
 
 /* **********************************************
  *
@@ -23,6 +283,24 @@ double* create_vector_malloc(
 	size_t len
 );
 
+/* **********************************************
+ *
+ * create_vector and create_vector_malloc with
+ * memory from allocator (NULL: system).
+ * REMEMBER TO FREE with
+ * destroy_vector_with_allocator.
+ *
+ * **********************************************/
+double* create_vector_with_allocator(
+	size_t len,
+	const linalg_allocator* allocator
+);
+
+double* create_vector_malloc_with_allocator(
+	size_t len,
+	const linalg_allocator* allocator
+);
+
 /* **********************************************
  *
  * Create vector of equally spaced numbers
@@ -40,14 +318,72 @@ double* create_linspace(
 
 /* **********************************************
  *
- * Create vector with random uniform numbers
+ * Create vector with random numbers uniformly
+ * distributed on [0, 1). Random seed must be
+ * specified.
  * REMEMBER TO FREE with destroy_vector.
  *
+ * The generator is counter-based (Philox4x32-10):
+ * element i depends only on the seed and i, so a
+ * seed gives the same numbers for any number of
+ * threads. Large vectors are filled in parallel.
+ *
  * **********************************************/
 
 double* create_random_uniform_vector(size_t len, unsigned long int seed);
 
 
+/* **********************************************
+ *
+ * Create vector with normally distributed random
+ * numbers with given mean and standard deviation.
+ * REMEMBER TO FREE with destroy_vector.
+ *
+ * **********************************************/
+double* create_random_normal_vector(
+	size_t len, 
+	double mean, 
+	double std, 
+	unsigned long int seed
+);
+
+
+/* **********************************************
+ *
+ * Fill existing vector v with random numbers:
+ *   uniform      on [low, high)
+ *   normal       with mean and std
+ *   exponential  with rate (mean 1/rate)
+ *
+ * Uses the same streams as the create_random_*
+ * functions: filling with seed s gives the numbers
+ * create_random_*_vector would for s.
+ *
+ * **********************************************/
+void fill_random_uniform_vector(
+	double* v, 
+	size_t len, 
+	double low, 
+	double high, 
+	unsigned long int seed
+);
+
+void fill_random_normal_vector(
+	double* v, 
+	size_t len, 
+	double mean, 
+	double std, 
+	unsigned long int seed
+);
+
+void fill_random_exponential_vector(
+	double* v, 
+	size_t len, 
+	double rate, 
+	unsigned long int seed
+);
+
+
 /* **********************************************
  *
  * Free memory of vector created by create_vector
@@ -57,6 +393,18 @@ void destroy_vector(
 	double *vector
 );
 
+/* **********************************************
+ *
+ * Free vector created with allocator; len must
+ * be the length it was created with.
+ *
+ * **********************************************/
+void destroy_vector_with_allocator(
+	double* vector,
+	size_t len,
+	const linalg_allocator* allocator
+);
+
 /* **********************************************
  *
  * Copy elements of v_source to v_dest.
@@ -71,7 +419,8 @@ void copy_vector(
 /* **********************************************
  *
  * Copy elements form column col_index in matrix
- * to a vector.
+ * to a vector. matrix_column_view reads the
+ * column without copying.
  *
  * **********************************************/
 void copy_column_to_vector(
@@ -119,6 +468,88 @@ void evaluate_function_on_vector(
 	size_t len
 );
 
+/* **********************************************
+ *
+ * Function evaluated on a whole chunk of a vector:
+ * output[i] = f(input[i]) for i < len. ctx is
+ * passed through unchanged.
+ * 
+ * **********************************************/
+typedef void (*linalg_batch_function)(
+	double* output,
+	const double* input,
+	size_t len,
+	void* ctx
+);
+
+/* **********************************************
+ *
+ * Like evaluate_function_on_vector, but the
+ * function is called once per chunk of (at most
+ * 2048) elements rather than once per element.
+ * Large vectors are split across the thread
+ * pool, so the function may run concurrently on
+ * disjoint chunks and must be thread-safe.
+ * 
+ * **********************************************/
+void evaluate_batch_function_on_vector(
+	double* output,
+	linalg_batch_function function,
+	double* x,
+	size_t len,
+	void* ctx
+);
+
+/* **********************************************
+ *
+ * Vectorized elementwise math: res[i] = f(v[i]).
+ * res may be v. Large vectors are split across
+ * the thread pool.
+ *
+ * Maximum errors, in units in the last place
+ * (ULP) of the exact result, measured against
+ * long double references over the whole domain,
+ * for every instruction set:
+ *
+ *   elementwise_exp      1.0
+ *   elementwise_log      1.1 (0.6 with AVX2 and up)
+ *   elementwise_sqrt     0.5 (correctly rounded)
+ *   elementwise_sin      0.9
+ *   elementwise_cos      0.9
+ *   elementwise_tanh     2.6
+ *   elementwise_sigmoid  2.8
+ *
+ * Special values (NaN, infinities, zeros, log
+ * of negative numbers, overflow and underflow)
+ * follow the C library. sin and cos hand
+ * arguments with |x| >= 1e6 to the C library.
+ * 
+ * **********************************************/
+void elementwise_exp(double* res, double* v, size_t len);
+void elementwise_log(double* res, double* v, size_t len);
+void elementwise_sqrt(double* res, double* v, size_t len);
+void elementwise_sin(double* res, double* v, size_t len);
+void elementwise_cos(double* res, double* v, size_t len);
+void elementwise_tanh(double* res, double* v, size_t len);
+void elementwise_sigmoid(double* res, double* v, size_t len);
+
+/* **********************************************
+ *
+ * res[i] = v[i]^exponent with the special cases
+ * of pow() from the C library. With AVX2 or
+ * AVX-512, normal results are within 1.2 ULP
+ * (measured against powl), also when
+ * |exponent * log v[i]| is in the hundreds; the
+ * SSE2 and generic builds call pow() per element.
+ * 
+ * **********************************************/
+void elementwise_pow(
+	double* res,
+	double* v,
+	double exponent,
+	size_t len
+);
+
 /* **********************************************
  *
  * Add v1 and v2 elementwise
@@ -175,6 +606,10 @@ double dot_product(
 /* **********************************************
  *
  * Computes Euclidean norm (2-norm) of vector.
+ * Neither overflows nor underflows for finite
+ * elements: if the plain sum of squares does,
+ * it is redone with the elements scaled by a
+ * power of two (as LAPACK's dnrm2).
  * 
  * **********************************************/
 double vector_norm(
@@ -185,9 +620,11 @@ double vector_norm(
 /* **********************************************
  *
  * Normalizes a vector to have 2-norm equal to 1.
+ * Returns the norm it divided by, so that no
+ * separate vector_norm is needed.
  * 
  * **********************************************/
-void normalize_vector(
+double normalize_vector(
 	double *v1,
 	size_t len
 );
@@ -195,6 +632,7 @@ void normalize_vector(
 /* **********************************************
  *
  * Returns Euclidean distance between v1 and v2.
+ * Overflow safe as vector_norm.
  * 
  * **********************************************/
 double distance_between_vectors(
@@ -203,6 +641,19 @@ double distance_between_vectors(
 	size_t len
 );
 
+/* **********************************************
+ *
+ * Returns squared Euclidean distance between v1
+ * and v2, without the square root (e.g. for
+ * comparing distances).
+ * 
+ * **********************************************/
+double squared_distance_between_vectors(
+	double *v1,
+	double *v2,
+	size_t len
+);
+
 /* **********************************************
  *
  * Compute average of values in vector.
@@ -226,7 +677,48 @@ double vector_standard_deviation(
 	size_t len
 );
 
+/* **********************************************
+ *
+ * Computes variance of values in vector.
+ * 
+ * Note: this is NOT sample variance. 
+ * 
+ * **********************************************/
 double vector_variance(double *v1, size_t len);
+
+/* **********************************************
+ *
+ * Statistics of the values in a vector, see
+ * compute_vector_statistics.
+ * variance and std are NOT sample statistics.
+ * 
+ * **********************************************/
+typedef struct {
+	double mean;
+	double variance;
+	double std;
+	double min;
+	double max;
+	double sum_of_squares;
+	double norm;
+} vector_statistics;
+
+/* **********************************************
+ *
+ * Computes all fields of vector_statistics in
+ * a single pass over memory (blockwise Welford/
+ * Chan updates, SIMD within blocks). Use this
+ * instead of calling vector_average,
+ * vector_variance, vector_max, vector_norm etc.
+ * one after the other.
+ * For len == 0 all fields except the sums are
+ * NaN.
+ * 
+ * **********************************************/
+vector_statistics compute_vector_statistics(
+	double* v,
+	size_t len
+);
 /* **********************************************
  *
  * Returns value of largest element in vector.
@@ -239,8 +731,10 @@ double vector_max(
 
 /* **********************************************
  *
- * Create a matrix (fragmented 2D array) with
- * given number of rows and cols on the heap.
+ * Create a matrix of zeros with given number of
+ * rows and cols on the heap. Data is one
+ * contiguous aligned block (see matrix_t),
+ * the returned pointer is its double** view.
  * REMEMBER TO FREE with destroy_matrix.
  *
  * **********************************************/
@@ -251,83 +745,379 @@ double** create_matrix(
 
 /* **********************************************
  *
- * Creates a new matrix which is the transpose of
- * a given matrix.
- * REMEMBER TO FREE with destroy_matix.
- * 
+ * Allocate a contiguous matrix of zeros.
+ * REMEMBER TO FREE with matrix_free.
+ * Returns NULL if allocation fails.
+ *
  * **********************************************/
-double** create_transpose_of_matrix(
-	double **mat, 
-	size_t initial_rows, 
-	size_t initial_cols);
+matrix_t* matrix_alloc(
+	size_t rows,
+	size_t cols
+);
 
 /* **********************************************
  *
- * Creates a new matrix which is the same as
- * a given matrix but with an additional column
- * inserted at a given index. Inserted column
- * (vector) must have length equal to number
- * of rows in matrix.
- * REMEMBER TO FREE with destroy_matrix
- * 
- * col_insert_index == 0 	-> insert first
- * col_insert_index == cols -> insert last 
- * 
- * 
+ * create_matrix and matrix_alloc with the
+ * handle and data from allocator (NULL:
+ * system). The matrix remembers its allocator,
+ * so destroy_matrix and matrix_free release it
+ * there.
+ *
  * **********************************************/
-double** create_matrix_with_inserted_column(
-	double** matrix, 
-	double* vector,
-	size_t rows, 
-	size_t cols, 
-	size_t col_insert_index
+double** create_matrix_with_allocator(
+	size_t rows,
+	size_t cols,
+	const linalg_allocator* allocator
+);
+
+matrix_t* matrix_alloc_with_allocator(
+	size_t rows,
+	size_t cols,
+	const linalg_allocator* allocator
 );
 
 /* **********************************************
  *
- * Creates a new matrix populated with random
- * doubles uniformly distributed on [0, 1].
- * Random seed must be specified.
- * REMEMBER TO FREE with destroy_matrix.
- * 
+ * Free a matrix allocated with matrix_alloc.
+ *
  * **********************************************/
-double** create_random_uniform_matrix(
-	size_t rows, 
-	size_t cols, 
-	unsigned long int seed
+void matrix_free(
+	matrix_t* m
 );
 
-
 /* **********************************************
  *
- * Free memory of matrix created with
- * create_matrix
+ * Returns the matrix_t handle behind a double**
+ * returned by create_matrix (or matrix_t.row).
+ * Only valid for such pointers.
  *
  * **********************************************/
-void destroy_matrix(
-	double **mat,
-	size_t rows
+matrix_t* matrix_of(
+	double** mat
 );
 
 /* **********************************************
  *
- * Adds a scalar to alla elements of matrix.
- * 
+ * Non-owning view of the rows x cols window of
+ * m starting at element (row, col): no elements
+ * are copied, only row pointers set up (O(rows)).
+ * Its row can be passed to every function
+ * taking double**, and writes go to m.
+ * Row ranges are (row, 0, rows, m->cols),
+ * column ranges (0, col, m->rows, cols); for a
+ * double** from create_matrix use matrix_of.
+ * A row range of a double** needs no view at
+ * all: mat + row.
+ * Free with matrix_free (m is untouched); the
+ * view must not outlive m, nor be used after m
+ * grows (matrix_insert_column). Returns NULL if
+ * the window does not fit in m or memory runs
+ * out.
+ *
  * **********************************************/
-void scale_matrix_by_factor(
-	double **mat, 
-	double factor, 
+matrix_t* matrix_view(
+	const matrix_t* m,
+	size_t row,
+	size_t col,
 	size_t rows,
 	size_t cols
 );
 
 /* **********************************************
  *
- * Multiplies all elements of matrix by scalar.
- * 
+ * Vector of len elements stride apart (1 for
+ * contiguous), not owning them, e.g. a matrix
+ * column. Passed by value; nothing to free.
+ *
  * **********************************************/
-void add_scalar_to_matrix(
-	double **mat, 
+typedef struct {
+	double* data;
+	size_t  len;
+	size_t  stride;
+} vector_view;
+
+/* **********************************************
+ *
+ * Views of a contiguous vector, of row row and
+ * of column col of m (stride m->stride). A row
+ * or column out of range gives an empty view
+ * (len 0).
+ *
+ * **********************************************/
+vector_view vector_view_of(
+	double* v,
+	size_t len
+);
+
+vector_view matrix_row_view(
+	const matrix_t* m,
+	size_t row
+);
+
+vector_view matrix_column_view(
+	const matrix_t* m,
+	size_t col
+);
+
+/* **********************************************
+ *
+ * dot_product, vector_norm, scale_vector_by_
+ * factor and copy_vector on views (of equal
+ * len). Strided views are gathered block by
+ * block into a small buffer, so the reductions
+ * keep their SIMD kernels, reduction modes and
+ * threading; contiguous ones go straight to
+ * the kernels.
+ *
+ * **********************************************/
+double dot_product_view(
+	vector_view v1,
+	vector_view v2
+);
+
+double vector_norm_view(
+	vector_view v
+);
+
+void scale_vector_view(
+	vector_view v,
+	double scale_factor
+);
+
+void copy_vector_view(
+	vector_view dest,
+	vector_view src
+);
+
+/* **********************************************
+ *
+ * Column builder. A matrix has room for
+ * m->stride columns per row; matrix_reserve_
+ * columns grows that to at least capacity
+ * (moving the elements once).
+ * matrix_insert_column inserts column (length
+ * m->rows) before column index (m->cols to
+ * append) by shifting the rows in place; when
+ * the room is used up it doubles it, so
+ * appending costs amortized O(rows).
+ * Moving invalidates old row pointers
+ * (m->row[i]) and views, not m or m->row.
+ * Return 0, or -1 if memory runs out, index >
+ * m->cols or m does not own its data (views,
+ * matrix_map_file); m is then unchanged.
+ *
+ * **********************************************/
+int matrix_reserve_columns(
+	matrix_t* m,
+	size_t capacity
+);
+
+int matrix_insert_column(
+	matrix_t* m,
+	const double* column,
+	size_t index
+);
+
+int matrix_append_column(
+	matrix_t* m,
+	const double* column
+);
+
+/* **********************************************
+ *
+ * Creates a new matrix which is the transpose of
+ * a given matrix.
+ * REMEMBER TO FREE with destroy_matix.
+ * 
+ * **********************************************/
+double** create_transpose_of_matrix(
+	double **mat, 
+	size_t initial_rows, 
+	size_t initial_cols);
+
+/* **********************************************
+ *
+ * Writes the transpose of mat (rows x cols) into
+ * result (cols x rows), which must already be
+ * allocated and must not overlap mat.
+ *
+ * Works in cache-sized blocks with SIMD register
+ * tiles (up to 8x8), so both reads and writes
+ * stay within a few cache lines and pages.
+ * create_transpose_of_matrix uses this.
+ *
+ * **********************************************/
+void transpose_matrix(
+	double** result,
+	double** mat,
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Transposes the square n x n matrix mat in
+ * place, swapping blocks pairwise through a small
+ * buffer. No extra matrix memory is needed. Works
+ * for any row pointers.
+ *
+ * **********************************************/
+void transpose_square_matrix_in_place(
+	double** mat,
+	size_t n
+);
+
+/* **********************************************
+ *
+ * Transposes the matrix m in place, also when it
+ * is not square, and returns the handle of the
+ * result: a cols x rows matrix in the same data
+ * block. Square matrices use the blocked path
+ * above.
+ *
+ * For rectangular matrices the row padding is
+ * dropped (the new stride equals the new cols)
+ * and the elements are moved along the cycles of
+ * the transpose permutation, using one bit of
+ * scratch memory per element. This is serial and
+ * much slower than transpose_matrix; prefer an
+ * out-of-place transpose when memory allows.
+ *
+ * The handle holds the row pointer array, so it
+ * may be reallocated: use the returned handle
+ * and its row, not old row pointers. Returns
+ * NULL (m unchanged) if memory runs out or m
+ * does not own its data (e.g. matrix_map_file).
+ *
+ * **********************************************/
+matrix_t* matrix_transpose_in_place(
+	matrix_t* m
+);
+
+/* **********************************************
+ *
+ * Creates a new matrix which is the same as
+ * a given matrix but with an additional column
+ * inserted at a given index. Inserted column
+ * (vector) must have length equal to number
+ * of rows in matrix.
+ * REMEMBER TO FREE with destroy_matrix
+ * 
+ * col_insert_index == 0 	-> insert first
+ * col_insert_index == cols -> insert last 
+ * 
+ * For a bias column in a linear fit,
+ * least_squares takes it implicitly. To add
+ * columns one by one, matrix_insert_column
+ * works in place.
+ * 
+ * **********************************************/
+double** create_matrix_with_inserted_column(
+	double** matrix, 
+	double* vector,
+	size_t rows, 
+	size_t cols, 
+	size_t col_insert_index
+);
+
+/* **********************************************
+ *
+ * Creates a new matrix populated with random
+ * doubles uniformly distributed on [0, 1).
+ * Random seed must be specified.
+ * REMEMBER TO FREE with destroy_matrix.
+ * 
+ * Element (i, j) is element i*cols + j of the
+ * seed's stream, independent of thread count.
+ * 
+ * **********************************************/
+double** create_random_uniform_matrix(
+	size_t rows, 
+	size_t cols, 
+	unsigned long int seed
+);
+
+
+/* **********************************************
+ *
+ * Creates a new matrix populated with normally
+ * distributed random doubles.
+ * REMEMBER TO FREE with destroy_matrix.
+ * 
+ * **********************************************/
+double** create_random_normal_matrix(
+	size_t rows, 
+	size_t cols, 
+	double mean, 
+	double std, 
+	unsigned long int seed
+);
+
+
+/* **********************************************
+ *
+ * Fill existing matrix with random numbers, see
+ * fill_random_uniform_vector. Works on any row
+ * pointers (e.g. from matrix_alloc).
+ * 
+ * **********************************************/
+void fill_random_uniform_matrix(
+	double** mat, 
+	size_t rows, 
+	size_t cols, 
+	double low, 
+	double high, 
+	unsigned long int seed
+);
+
+void fill_random_normal_matrix(
+	double** mat, 
+	size_t rows, 
+	size_t cols, 
+	double mean, 
+	double std, 
+	unsigned long int seed
+);
+
+void fill_random_exponential_matrix(
+	double** mat, 
+	size_t rows, 
+	size_t cols, 
+	double rate, 
+	unsigned long int seed
+);
+
+
+/* **********************************************
+ *
+ * Free memory of matrix created with
+ * create_matrix
+ *
+ * **********************************************/
+void destroy_matrix(
+	double **mat,
+	size_t rows
+);
+
+/* **********************************************
+ *
+ * Adds a scalar to alla elements of matrix.
+ * 
+ * **********************************************/
+void scale_matrix_by_factor(
+	double **mat, 
+	double factor, 
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Multiplies all elements of matrix by scalar.
+ * 
+ * **********************************************/
+void add_scalar_to_matrix(
+	double **mat, 
 	double scalar, 
 	size_t rows, 
 	size_t cols
@@ -335,65 +1125,1100 @@ void add_scalar_to_matrix(
 
 /* **********************************************
  *
- * Elementwize addition
- * Adds mat1 and mat2 and stores in res.
- * mat1, mat2 and res should be of same size.
- * 
+ * Elementwize addition
+ * Adds mat1 and mat2 and stores in res.
+ * mat1, mat2 and res should be of same size.
+ * 
+ * **********************************************/
+void elementwise_matrix_addition(
+	double **res,
+	double **mat1,
+	double **mat2, 
+	size_t rows, 
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Elementwize product
+ * Multiplies mat1 and mat2 and stores in res.
+ * mat1, mat2 and res should be of same size.
+ * 
+ * **********************************************/
+void elementwise_matrix_multiplication(
+	double **res, 
+	double **mat1, 
+	double **mat2, 
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Elementwise addition of matrices where second
+ * matrix is scaled by a constant factor.
+ * Result is stored in res.
+ * Matrices should have the same size.
+ * 
+ * **********************************************/
+void add_scaled_matrix_to_matrix(
+	double **res, 
+	double **mat,
+	double **mat_to_scale, 
+	double factor, 
+	size_t rows, 
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Lazy elementwise expressions.
+ *
+ * Chains of elementwise operations are built as
+ * nodes in a context and evaluated in one fused
+ * pass, without temporaries: each tile of the
+ * result (part of a row) is computed through all
+ * operations while it is in L1, with the SIMD
+ * kernels, and in parallel when threads are
+ * enabled. E.g. res = 2*(a.*b + 0.5*c) + 1:
+ *
+ *   linalg_expr *e = expr_create();
+ *   expr_node a = expr_matrix(e, A, rows, cols);
+ *   expr_node b = expr_matrix(e, B, rows, cols);
+ *   expr_node c = expr_matrix(e, C, rows, cols);
+ *   expr_node x = expr_add(e, expr_mul(e, a, b),
+ *                             expr_scale(e, c, 0.5));
+ *   x = expr_add_scalar(e, expr_scale(e, x, 2), 1);
+ *   expr_evaluate_matrix(e, x, res, rows, cols);
+ *   expr_destroy(e);
+ *
+ * Every operation rounds like the corresponding
+ * unfused function, so results are identical to
+ * the chain of separate calls.
+ *
+ * Leaves are referenced, not copied: they must
+ * stay valid until evaluation. A vector leaf of
+ * length cols is broadcast over every row of a
+ * matrix result. The result may be one of the
+ * matrix leaves (elements are only combined with
+ * elements at the same position), but not a
+ * broadcast vector.
+ *
+ * Node constructors return -1 when out of memory
+ * or given an invalid node; -1 propagates, and
+ * evaluating it fails.
+ *
+ * **********************************************/
+typedef struct linalg_expr linalg_expr;
+typedef int expr_node;
+
+/* **********************************************
+ * Creates an empty expression context.
+ * REMEMBER TO FREE with expr_destroy.
+ * expr_reset removes all nodes so the context
+ * can be reused.
+ * **********************************************/
+linalg_expr* expr_create(void);
+void expr_reset(linalg_expr* e);
+void expr_destroy(linalg_expr* e);
+
+/* **********************************************
+ * Leaves: a rows x cols matrix, a vector and a
+ * scalar broadcast to every element.
+ * **********************************************/
+expr_node expr_matrix(linalg_expr* e, double** mat, size_t rows, size_t cols);
+expr_node expr_vector(linalg_expr* e, double* v, size_t len);
+expr_node expr_scalar(linalg_expr* e, double s);
+
+/* **********************************************
+ * Elementwise operations. min/max return b when
+ * either operand is NaN. expr_apply calls
+ * function on every element (not vectorized).
+ * **********************************************/
+expr_node expr_add(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_sub(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_mul(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_div(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_min(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_max(linalg_expr* e, expr_node a, expr_node b);
+expr_node expr_scale(linalg_expr* e, expr_node a, double factor);
+expr_node expr_add_scalar(linalg_expr* e, expr_node a, double scalar);
+expr_node expr_neg(linalg_expr* e, expr_node a);
+expr_node expr_abs(linalg_expr* e, expr_node a);
+expr_node expr_sqrt(linalg_expr* e, expr_node a);
+expr_node expr_apply(linalg_expr* e, expr_node a, double (*function)(double));
+
+/* **********************************************
+ * Evaluates node into result (rows x cols, or a
+ * vector of length len). Only the nodes root
+ * depends on are computed. Returns 0, or -1 if
+ * root is invalid, a leaf does not match the
+ * result shape, or memory runs out (result may
+ * then be partly written).
+ * **********************************************/
+int expr_evaluate_matrix(
+	const linalg_expr* e,
+	expr_node root,
+	double** result,
+	size_t rows,
+	size_t cols
+);
+
+int expr_evaluate_vector(
+	const linalg_expr* e,
+	expr_node root,
+	double* result,
+	size_t len
+);
+
+/* **********************************************
+ *
+ * Matrix product
+ * Multiplies mat 1 (m x n) by mat2
+ * (n x p) and stores result in res (m x p)
+ * Same as general_matrix_multiplication with
+ * alpha = 1, beta = 0 and no transposes.
+ *
+ * **********************************************/
+void matrix_multiplication(
+	double **res,
+	double **mat1,
+	double **mat2,
+	size_t m,
+	size_t n, 
+	size_t p
+);
+
+/* **********************************************
+ *
+ * Flags for operands that may be transposed.
+ *
+ * **********************************************/
+#define LINALG_NO_TRANSPOSE 0
+#define LINALG_TRANSPOSE    1
+
+/* **********************************************
+ *
+ * General matrix product (GEMM)
+ *     res = alpha * op(mat1) * op(mat2)
+ *           + beta * res
+ * where op(X) is X or its transpose depending on
+ * transpose_mat1/transpose_mat2.
+ * op(mat1) is (m x n), op(mat2) is (n x p) and
+ * res is (m x p). If beta is 0, res need not be
+ * initialized. res must not overlap the inputs.
+ *
+ * Uses a cache-blocked engine with packed panels
+ * and a SIMD micro-kernel chosen for the host CPU
+ * when the library is loaded.
+ *
+ * **********************************************/
+void general_matrix_multiplication(
+	double **res,
+	double **mat1,
+	double **mat2,
+	size_t m,
+	size_t n,
+	size_t p,
+	double alpha,
+	double beta,
+	int transpose_mat1,
+	int transpose_mat2
+);
+
+/* **********************************************
+ *
+ * Single precision (float) variants, named
+ * as the double functions with a _f32 suffix
+ * and with the same semantics. Float halves
+ * the memory traffic and doubles the SIMD
+ * width; sums are accumulated in float.
+ * create_matrix_f32 returns zeroed, padded
+ * rows like create_matrix, but has no matrix_t
+ * handle or allocator variants.
+ * REMEMBER TO FREE with destroy_vector_f32 and
+ * destroy_matrix_f32.
+ *
+ * **********************************************/
+float* create_vector_f32(
+	size_t len
+);
+
+void destroy_vector_f32(
+	float* vector
+);
+
+float** create_matrix_f32(
+	size_t rows,
+	size_t cols
+);
+
+void destroy_matrix_f32(
+	float** matrix,
+	size_t rows
+);
+
+void scale_vector_by_factor_f32(
+	float* v,
+	float scale_factor,
+	size_t len
+);
+
+void add_scalar_to_vector_f32(
+	float* v,
+	float scalar,
+	size_t len
+);
+
+void elementwise_addition_f32(
+	float* res,
+	float* v1,
+	float* v2,
+	size_t len
+);
+
+void elementwise_multiplication_f32(
+	float* res,
+	float* v1,
+	float* v2,
+	size_t len
+);
+
+void vector_subtraction_f32(
+	float* result,
+	float* v1,
+	float* v2,
+	size_t len
+);
+
+float dot_product_f32(
+	float* v1,
+	float* v2,
+	size_t len
+);
+
+float vector_norm_f32(
+	float* v1,
+	size_t len
+);
+
+float normalize_vector_f32(
+	float* v1,
+	size_t len
+);
+
+float distance_between_vectors_f32(
+	float* v1,
+	float* v2,
+	size_t len
+);
+
+void general_matrix_multiplication_f32(
+	float** res,
+	float** mat1,
+	float** mat2,
+	size_t m,
+	size_t n,
+	size_t p,
+	float alpha,
+	float beta,
+	int transpose_mat1,
+	int transpose_mat2
+);
+
+void matrix_multiplication_f32(
+	float** res,
+	float** mat1,
+	float** mat2,
+	size_t m,
+	size_t n,
+	size_t p
+);
+
+/* **********************************************
+ *
+ * 16-bit storage formats: IEEE binary16 (f16)
+ * and bfloat16 (bf16), as raw bits. Only the
+ * storage is 16-bit: the functions below widen
+ * elements to float as they load them and
+ * accumulate in float.
+ *
+ * **********************************************/
+typedef uint16_t linalg_f16;
+typedef uint16_t linalg_bf16;
+
+/* **********************************************
+ *
+ * Converts len elements between precisions.
+ * Narrowing rounds to nearest (ties to even);
+ * values beyond the target's range become
+ * infinities, and NaNs stay NaN.
+ *
+ * **********************************************/
+void convert_vector_f64_to_f32(
+	float* dst,
+	const double* src,
+	size_t len
+);
+
+void convert_vector_f32_to_f64(
+	double* dst,
+	const float* src,
+	size_t len
+);
+
+void convert_vector_f32_to_f16(
+	linalg_f16* dst,
+	const float* src,
+	size_t len
+);
+
+void convert_vector_f16_to_f32(
+	float* dst,
+	const linalg_f16* src,
+	size_t len
+);
+
+void convert_vector_f32_to_bf16(
+	linalg_bf16* dst,
+	const float* src,
+	size_t len
+);
+
+void convert_vector_bf16_to_f32(
+	float* dst,
+	const linalg_bf16* src,
+	size_t len
+);
+
+/* **********************************************
+ *
+ * dot_product, vector_norm and
+ * distance_between_vectors of vectors stored
+ * as f16 or bf16, accumulated in float.
+ *
+ * **********************************************/
+float dot_product_f16(
+	const linalg_f16* v1,
+	const linalg_f16* v2,
+	size_t len
+);
+
+float vector_norm_f16(
+	const linalg_f16* v1,
+	size_t len
+);
+
+float distance_between_vectors_f16(
+	const linalg_f16* v1,
+	const linalg_f16* v2,
+	size_t len
+);
+
+float dot_product_bf16(
+	const linalg_bf16* v1,
+	const linalg_bf16* v2,
+	size_t len
+);
+
+float vector_norm_bf16(
+	const linalg_bf16* v1,
+	size_t len
+);
+
+float distance_between_vectors_bf16(
+	const linalg_bf16* v1,
+	const linalg_bf16* v2,
+	size_t len
+);
+
+/* **********************************************
+ *
+ * Matrix-vector product (GEMV)
+ *     res = alpha * op(mat) * vec + beta * res
+ * where mat is (rows x cols) and op(mat) is mat
+ * or its transpose depending on transpose_mat.
+ * Without transpose vec has length cols and res
+ * length rows; with transpose the other way
+ * around. If beta is 0, res need not be
+ * initialized. res must not overlap vec.
+ *
+ * **********************************************/
+void general_matrix_vector_multiplication(
+	double* res,
+	double** mat,
+	double* vec,
+	size_t rows,
+	size_t cols,
+	double alpha,
+	double beta,
+	int transpose_mat
+);
+
+/* **********************************************
+ *
+ * res = mat * vec, mat is (rows x cols).
+ *
+ * **********************************************/
+void matrix_vector_multiplication(
+	double* res,
+	double** mat,
+	double* vec,
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Rank-1 update (GER)
+ *     mat += alpha * x * y^T
+ * mat is (rows x cols), x has length rows and
+ * y length cols.
+ *
+ * **********************************************/
+void rank_one_update(
+	double** mat,
+	double* x,
+	double* y,
+	size_t rows,
+	size_t cols,
+	double alpha
+);
+
+/* **********************************************
+ *
+ * Batches of small matrices
+ * A matrix_batch describes `count` matrices of
+ * the same shape (rows x cols) in one array:
+ * element (i, j) of matrix b is
+ *     data[b*stride + i*ld + j].
+ * ld is the row stride (>= cols) and stride the
+ * distance between matrices. An input with
+ * stride 0 is the same matrix for every item.
+ * A vector_batch is the same for vectors of
+ * length len.
+ *
+ * The batched functions below return 0, or -1
+ * (without writing) if the shapes do not match.
+ * Items are split between the library threads.
+ * Results must not overlap the inputs, except
+ * for the elementwise operations, which may run
+ * in place.
+ *
+ * **********************************************/
+typedef struct {
+	double* data;
+	size_t rows;
+	size_t cols;
+	size_t ld;
+	size_t stride;
+} matrix_batch;
+
+typedef struct {
+	double* data;
+	size_t len;
+	size_t stride;
+} vector_batch;
+
+/* **********************************************
+ *
+ * Batch of densely packed rows x cols matrices
+ * (ld = cols, stride = rows*cols).
+ *
+ * **********************************************/
+matrix_batch matrix_batch_contiguous(
+	double* data,
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Batched GEMM, for every item b
+ *     res[b] = alpha * op(mat1[b]) * op(mat2[b])
+ *              + beta * res[b]
+ * with op as in general_matrix_multiplication.
+ * The shapes of op(mat1) and op(mat2) must
+ * match res. If beta is 0, res need not be
+ * initialized.
+ *
+ * Square products of size 2, 3, 4, 8 and 16
+ * use kernels unrolled for that size.
+ *
+ * **********************************************/
+int batched_general_matrix_multiplication(
+	matrix_batch res,
+	matrix_batch mat1,
+	matrix_batch mat2,
+	size_t count,
+	double alpha,
+	double beta,
+	int transpose_mat1,
+	int transpose_mat2
+);
+
+/* **********************************************
+ *
+ * Batched matrix-vector product
+ *     y[b] = alpha * op(mat[b]) * x[b]
+ *            + beta * y[b]
+ * If beta is 0, y need not be initialized.
+ *
+ * **********************************************/
+int batched_matrix_vector_multiplication(
+	vector_batch y,
+	matrix_batch mat,
+	vector_batch x,
+	size_t count,
+	double alpha,
+	double beta,
+	int transpose_mat
+);
+
+/* **********************************************
+ *
+ * Transposes every matrix of the batch:
+ * res[b] = mat[b]^T.
+ *
+ * **********************************************/
+int batched_transpose(
+	matrix_batch res,
+	matrix_batch mat,
+	size_t count
+);
+
+/* **********************************************
+ *
+ * res[b] = mat1[b] + factor * mat2[b]
+ *
+ * **********************************************/
+int batched_add_scaled(
+	matrix_batch res,
+	matrix_batch mat1,
+	matrix_batch mat2,
+	double factor,
+	size_t count
+);
+
+/* **********************************************
+ *
+ * Elementwise product res[b] = mat1[b] .* mat2[b]
+ *
+ * **********************************************/
+int batched_elementwise_multiplication(
+	matrix_batch res,
+	matrix_batch mat1,
+	matrix_batch mat2,
+	size_t count
+);
+
+/* **********************************************
+ *
+ * res[b] = factor * mat[b]
+ *
+ * **********************************************/
+int batched_scale(
+	matrix_batch res,
+	matrix_batch mat,
+	double factor,
+	size_t count
+);
+
+/* **********************************************
+ *
+ * Sparse matrix in compressed form. CSR stores
+ * each row's nonzeros: row i has the entries
+ * ptr[i] .. ptr[i+1]-1 of index (their column)
+ * and values. CSC is the same per column, index
+ * holding rows. Indices are sorted and unique
+ * within a row (column). Memory is
+ * O(nnz + rows) for CSR, O(nnz + cols) for CSC.
+ *
+ * **********************************************/
+typedef enum {
+	LINALG_CSR = 1,
+	LINALG_CSC = 2
+} sparse_format;
+
+typedef struct {
+	sparse_format format;
+	size_t  rows;
+	size_t  cols;
+	size_t  nnz;
+	size_t* ptr;    // rows+1 (CSR) or cols+1 (CSC)
+	size_t* index;  // nnz column (CSR) or row (CSC) indices
+	double* values; // nnz
+} sparse_matrix;
+
+/* **********************************************
+ *
+ * Creates a sparse matrix from nnz triplets
+ * (row_index[k], col_index[k], values[k]), in
+ * any order (COO). Duplicates are summed.
+ * REMEMBER TO FREE with destroy_sparse_matrix.
+ * Returns NULL if an index is out of range or
+ * allocation fails.
+ *
+ * **********************************************/
+sparse_matrix* create_sparse_matrix_from_triplets(
+	size_t rows,
+	size_t cols,
+	size_t nnz,
+	const size_t* row_index,
+	const size_t* col_index,
+	const double* values,
+	sparse_format format
+);
+
+/* **********************************************
+ *
+ * Creates a sparse matrix of the elements of
+ * mat (rows x cols) with |x| > tolerance.
+ * REMEMBER TO FREE with destroy_sparse_matrix.
+ *
  * **********************************************/
-void elementwise_matrix_addition(
-	double **res,
-	double **mat1,
-	double **mat2, 
-	size_t rows, 
-	size_t cols
+sparse_matrix* create_sparse_matrix_from_dense(
+	double** mat,
+	size_t rows,
+	size_t cols,
+	double tolerance,
+	sparse_format format
 );
 
 /* **********************************************
  *
- * Elementwize product
- * Multiplies mat1 and mat2 and stores in res.
- * mat1, mat2 and res should be of same size.
- * 
+ * Copy of A in the given format (CSR <-> CSC).
+ * REMEMBER TO FREE with destroy_sparse_matrix.
+ *
  * **********************************************/
-void elementwise_matrix_multiplication(
-	double **res, 
-	double **mat1, 
-	double **mat2, 
+sparse_matrix* create_converted_sparse_matrix(
+	const sparse_matrix* A,
+	sparse_format format
+);
+
+/* **********************************************
+ *
+ * Dense copy of A (A->rows x A->cols).
+ * REMEMBER TO FREE with destroy_matrix.
+ *
+ * **********************************************/
+double** create_dense_matrix_from_sparse(
+	const sparse_matrix* A
+);
+
+/* **********************************************
+ *
+ * Free a sparse matrix.
+ *
+ * **********************************************/
+void destroy_sparse_matrix(
+	sparse_matrix* A
+);
+
+/* **********************************************
+ *
+ * Sparse matrix-vector product (SpMV)
+ *     res = alpha * op(A) * vec + beta * res
+ * with op(A) A or A^T depending on transpose
+ * (LINALG_NO_TRANSPOSE / LINALG_TRANSPOSE).
+ * If beta is 0, res need not be initialized.
+ * res must not overlap vec.
+ *
+ * A*x with CSR and A^T*x with CSC are threaded;
+ * the other two run serially (convert the
+ * matrix if they are hot).
+ *
+ * **********************************************/
+void sparse_matrix_vector_multiplication(
+	double* res,
+	const sparse_matrix* A,
+	const double* vec,
+	double alpha,
+	double beta,
+	int transpose
+);
+
+/* **********************************************
+ *
+ * Sparse times dense matrix (SpMM)
+ *     res = alpha * A * mat + beta * res
+ * mat is (A->cols x p) and res (A->rows x p).
+ * If beta is 0, res need not be initialized.
+ * Threaded over rows (CSR) or the p columns
+ * (CSC).
+ *
+ * **********************************************/
+void sparse_dense_matrix_multiplication(
+	double** res,
+	const sparse_matrix* A,
+	double** mat,
+	size_t p,
+	double alpha,
+	double beta
+);
+
+/* **********************************************
+ *
+ * Flags for triangular matrices.
+ *
+ * **********************************************/
+#define LINALG_UPPER 0
+#define LINALG_LOWER 1
+#define LINALG_NON_UNIT_DIAGONAL 0
+#define LINALG_UNIT_DIAGONAL     1
+
+/* **********************************************
+ *
+ * LU decomposition with partial pivoting,
+ *     P * mat = L * U
+ * in place: on return the strictly lower part
+ * of mat holds L (unit diagonal, not stored)
+ * and the upper part U. pivot (length n) gets
+ * the row interchanges: row i was swapped with
+ * row pivot[i] at step i, in order.
+ * Returns 0, or -1 if mat is singular (a zero
+ * pivot; the factorization is still completed).
+ *
+ * Blocked: the trailing updates run through
+ * general_matrix_multiplication's engine and
+ * are threaded.
+ *
+ * **********************************************/
+int lu_decomposition(
+	double** mat,
+	size_t n,
+	size_t* pivot
+);
+
+/* **********************************************
+ *
+ * Solves mat * X = b in place (b is n x nrhs,
+ * overwritten by X) from the output of
+ * lu_decomposition.
+ *
+ * **********************************************/
+void lu_solve(
+	double** lu,
+	size_t n,
+	const size_t* pivot,
+	double** b,
+	size_t nrhs
+);
+
+/* **********************************************
+ *
+ * Cholesky decomposition mat = L * L^T of a
+ * symmetric positive definite matrix, in place.
+ * Only the lower triangle of mat is read; on
+ * return mat is L (upper triangle zeroed).
+ * Returns 0, or -1 if mat is not positive
+ * definite (mat is then partly overwritten).
+ * Blocked like lu_decomposition.
+ *
+ * **********************************************/
+int cholesky_decomposition(
+	double** mat,
+	size_t n
+);
+
+/* **********************************************
+ *
+ * Solves L * L^T * X = b in place (b is
+ * n x nrhs) from the output of
+ * cholesky_decomposition.
+ *
+ * **********************************************/
+void cholesky_solve(
+	double** l,
+	size_t n,
+	double** b,
+	size_t nrhs
+);
+
+/* **********************************************
+ *
+ * Triangular solve with several right-hand
+ * sides (TRSM),
+ *     b = op(tri)^-1 * b
+ * tri is (n x n), LINALG_UPPER or LINALG_LOWER
+ * triangular per uplo; only that triangle is
+ * read. op is set by transpose as in
+ * general_matrix_multiplication. With
+ * LINALG_UNIT_DIAGONAL the diagonal is taken as
+ * ones and not read. b is (n x nrhs).
+ *
+ * **********************************************/
+void triangular_solve(
+	double** tri,
+	double** b,
+	size_t n,
+	size_t nrhs,
+	int uplo,
+	int transpose,
+	int diagonal
+);
+
+/* **********************************************
+ *
+ * Solves mat * x = b for a square mat (n x n)
+ * by LU decomposition of a copy; mat and b are
+ * not changed and x may be b.
+ * Returns 0, or -1 if mat is singular or
+ * memory runs out.
+ *
+ * **********************************************/
+int solve_linear_system(
+	double* x,
+	double** mat,
+	double* b,
+	size_t n
+);
+
+/* **********************************************
+ *
+ * Householder QR decomposition,
+ *     mat = Q * R
+ * in place, of a (rows x cols) matrix. On
+ * return the upper triangle of mat holds R and
+ * the part below the diagonal the Householder
+ * vectors (LAPACK layout); tau, of length
+ * min(rows, cols), gets their scale factors.
+ * Q is kept implicitly, see qr_multiply_q.
+ * Returns 0, or -1 if memory runs out.
+ *
+ * Blocked: the reflectors of each panel are
+ * applied together in compact WY form, so most
+ * of the work runs through
+ * general_matrix_multiplication's engine and
+ * is threaded.
+ *
+ * **********************************************/
+int qr_decomposition(
+	double** mat,
 	size_t rows,
-	size_t cols
+	size_t cols,
+	double* tau
 );
 
 /* **********************************************
  *
- * Elementwise addition of matrices where second
- * matrix is scaled by a constant factor.
- * Result is stored in res.
- * Matrices should have the same size.
- * 
+ * b = op(Q) * b in place, with Q (rows x rows)
+ * from the output of qr_decomposition and b
+ * (rows x nrhs). op is set by transpose as in
+ * general_matrix_multiplication.
+ * Returns 0, or -1 if memory runs out.
+ *
  * **********************************************/
-void add_scaled_matrix_to_matrix(
-	double **res, 
-	double **mat,
-	double **mat_to_scale, 
-	double factor, 
-	size_t rows, 
-	size_t cols
+int qr_multiply_q(
+	double** qr,
+	size_t rows,
+	size_t cols,
+	const double* tau,
+	double** b,
+	size_t nrhs,
+	int transpose
 );
 
 /* **********************************************
  *
- * Matrix product
- * Multiplies mat 1 (m x n) by mat2
- * (n x p) and stores result in res (m x p)
+ * Least-squares solve, minimizing
+ * || mat * X - b || column by column, from the
+ * output of qr_decomposition (rows >= cols).
+ * b (rows x nrhs) is overwritten: its first
+ * cols rows get X, the rest Q^T residuals.
+ * Returns 0, or -1 if R is singular (a zero on
+ * its diagonal), rows < cols or memory runs
+ * out.
  *
  * **********************************************/
-void matrix_multiplication(
-	double **res,
-	double **mat1,
-	double **mat2,
-	size_t m,
-	size_t n, 
-	size_t p
+int qr_solve(
+	double** qr,
+	size_t rows,
+	size_t cols,
+	const double* tau,
+	double** b,
+	size_t nrhs
+);
+
+/* **********************************************
+ *
+ * Fits y ~ mat * x in the least-squares sense
+ * by QR decomposition of a copy; mat and y are
+ * not changed.
+ * With intercept != 0 a bias column of ones is
+ * taken implicitly as the first column, as if
+ * inserted by create_matrix_with_inserted_column
+ * at index 0: x then has length cols + 1 with
+ * the bias in x[0]. The fit runs on centered
+ * columns, so the widened matrix is never built.
+ * Returns 0, or -1 if the (widened) matrix is
+ * rank deficient, has more columns than rows,
+ * or memory runs out.
+ *
+ * **********************************************/
+int least_squares(
+	double* x,
+	double** mat,
+	double* y,
+	size_t rows,
+	size_t cols,
+	int intercept
+);
+
+/* **********************************************
+ *
+ * Eigenvalues and eigenvectors of a symmetric
+ * matrix (n x n), mat * V = V * diag(lambda).
+ * Only the lower triangle of mat is read and
+ * mat is not changed. eigenvalues (length n)
+ * get lambda in ascending order and column j
+ * of eigenvectors (n x n) the orthonormal
+ * eigenvector of eigenvalues[j]; pass
+ * eigenvectors as NULL for the values only.
+ * Returns 0, or -1 if the iteration does not
+ * converge or memory runs out.
+ *
+ * Householder reduction to tridiagonal form,
+ * then divide and conquer; the eigenvector
+ * updates run through
+ * general_matrix_multiplication's engine and
+ * are threaded.
+ *
+ * **********************************************/
+int symmetric_eigen_decomposition(
+	double* eigenvalues,
+	double** eigenvectors,
+	double** mat,
+	size_t n
+);
+
+/* **********************************************
+ *
+ * Randomized truncated SVD,
+ *     mat ~ U * diag(s) * V^T,
+ * of a (rows x cols) matrix: the k largest
+ * singular values in s (descending), and the
+ * singular vectors as the columns of u
+ * (rows x k) and v (cols x k); u or v may be
+ * NULL. mat is not changed.
+ * The range of mat is sampled with k + 10
+ * Gaussian vectors drawn from seed (so results
+ * are reproducible) and refined by
+ * power_iterations passes over mat; 1-2 passes
+ * are usually enough unless the singular values
+ * decay slowly. Returns 0, or -1 if
+ * k > min(rows, cols) or memory runs out.
+ *
+ * Costs O(rows * cols * k) per pass, with mat
+ * only read in threaded GEMMs against thin
+ * matrices, so it suits matrices too large to
+ * decompose densely.
+ *
+ * **********************************************/
+int truncated_svd(
+	double* s,
+	double** u,
+	double** v,
+	double** mat,
+	size_t rows,
+	size_t cols,
+	size_t k,
+	size_t power_iterations,
+	unsigned long int seed
+);
+
+/* **********************************************
+ *
+ * truncated_svd of a sparse matrix (CSR or
+ * CSC), at O(nnz * k) per pass.
+ *
+ * **********************************************/
+int sparse_truncated_svd(
+	double* s,
+	double** u,
+	double** v,
+	const sparse_matrix* A,
+	size_t k,
+	size_t power_iterations,
+	unsigned long int seed
+);
+
+/* **********************************************
+ *
+ * Metrics of pairwise_distances and
+ * k_nearest_neighbours, between a query q and
+ * a reference r:
+ * EUCLIDEAN          |q - r|
+ * SQUARED_EUCLIDEAN  |q - r|^2
+ * COSINE             1 - q.r / (|q| |r|)
+ *                    (1 if either is zero)
+ * DOT                q.r, a similarity: the
+ *                    nearest have the largest
+ *
+ * **********************************************/
+typedef enum {
+	LINALG_DISTANCE_EUCLIDEAN,
+	LINALG_DISTANCE_SQUARED_EUCLIDEAN,
+	LINALG_DISTANCE_COSINE,
+	LINALG_DISTANCE_DOT
+} linalg_distance;
+
+/* **********************************************
+ *
+ * result[i][j] = distance between row i of
+ * queries (n_queries x dim) and row j of
+ * references (n_references x dim); result is
+ * n_queries x n_references.
+ * Computed as |q|^2 + |r|^2 - 2 q.r with the
+ * dot products from the threaded
+ * general_matrix_multiplication engine, so
+ * distances much smaller than the vectors lose
+ * relative accuracy (to about sqrt(eps) |q| for
+ * EUCLIDEAN); use distance_between_vectors
+ * where that matters.
+ * Returns 0, or -1 if memory runs out.
+ *
+ * **********************************************/
+int pairwise_distances(
+	double** result,
+	double** queries,
+	size_t n_queries,
+	double** references,
+	size_t n_references,
+	size_t dim,
+	linalg_distance metric
+);
+
+/* **********************************************
+ *
+ * For every row of queries, the k nearest rows
+ * of references (as pairwise_distances) without
+ * storing the n_queries x n_references matrix.
+ * Row i of indices and distances (both
+ * n_queries x k, row major; either may be NULL)
+ * gets the neighbours of query i, nearest first,
+ * ties to the lower index. Their distances are
+ * recomputed directly, without the
+ * cancellation above. If k >
+ * n_references the rest of the row is SIZE_MAX
+ * with distance INFINITY (-INFINITY for DOT).
+ * Returns 0, or -1 if memory runs out.
+ *
+ * Threaded over query blocks, or over
+ * references when there are few queries; the
+ * result does not depend on the thread count.
+ *
+ * **********************************************/
+int k_nearest_neighbours(
+	size_t* indices,
+	double* distances,
+	double** queries,
+	size_t n_queries,
+	double** references,
+	size_t n_references,
+	size_t dim,
+	size_t k,
+	linalg_distance metric
 );
 
 /* **********************************************
@@ -479,6 +2304,77 @@ void print_vectors_as_columns_to_file(
 	int* len_vectors
 );
 
+/* **********************************************
+ *
+ * Options for the write_*_to_csv functions.
+ * 
+ * precision: digits after the decimal point;
+ * 		   elements are written exactly like
+ * 		   printf("%.*e", precision, x).
+ * 		   Negative: shortest representation
+ * 		   that reads back to the same double.
+ * print_banner: print a line to stdout when
+ * 		   done, like print_matrix_to_file.
+ * 
+ * Passing NULL options means {8, 0}, which
+ * matches the layout of print_matrix_to_file.
+ * 
+ * **********************************************/
+typedef struct {
+	int precision;
+	int print_banner;
+} csv_write_options;
+
+/* **********************************************
+ *
+ * Writes a matrix to a CSV file, like
+ * print_matrix_to_file but formatting rows into
+ * large buffers (in parallel when threads are
+ * enabled) with a fast number formatter.
+ * header may be NULL for no header line.
+ * Returns 0, or -1 if the file could not be
+ * written.
+ * 
+ * **********************************************/
+int write_matrix_to_csv(
+	const char* filepath,
+	const char* header,
+	double** matrix,
+	size_t rows,
+	size_t cols,
+	const csv_write_options* options
+);
+
+/* **********************************************
+ *
+ * Writes a vector to a CSV file, one element
+ * per row. See write_matrix_to_csv.
+ * 
+ * **********************************************/
+int write_vector_to_csv(
+	const char* filepath,
+	const char* header,
+	double* vector,
+	size_t size,
+	const csv_write_options* options
+);
+
+/* **********************************************
+ *
+ * Writes vectors to columns of a CSV file, like
+ * print_vectors_as_columns_to_file. See
+ * write_matrix_to_csv.
+ * 
+ * **********************************************/
+int write_vectors_as_columns_to_csv(
+	const char* filepath,
+	const char* header,
+	double** vector_of_vectors,
+	int num_vectors,
+	int* len_vectors,
+	const csv_write_options* options
+);
+
 /* **********************************************
  *
  * Reads csv file to a matrix. Skips all rows
@@ -495,3 +2391,148 @@ void read_csv_to_matrix(
 	size_t rows, 
 	size_t cols
 );
+
+/* **********************************************
+ *
+ * Binary matrix files.
+ * 
+ * A 64 byte header followed by the elements,
+ * row-major, without padding. Header fields,
+ * in the byte order of the writer:
+ *   char     magic[8]     "LINALGMX"
+ *   uint32_t byte_order   0x01020304
+ *   uint16_t version      1
+ *   uint16_t dtype        1: double
+ *   uint64_t rows
+ *   uint64_t cols
+ *   uint64_t data_offset  64
+ *   uint32_t alignment    of data_offset, 64
+ *   (zero padding up to 64 bytes)
+ * 
+ * Writes matrix (rows x cols) to a binary file.
+ * Returns 0, or -1 if the file could not be
+ * written.
+ * 
+ * **********************************************/
+int save_matrix_to_binary_file(
+	const char* filepath,
+	double** matrix,
+	size_t rows,
+	size_t cols
+);
+
+/* **********************************************
+ *
+ * Reads a binary matrix file into a new matrix
+ * and sets rows and cols. Files written with
+ * the other byte order are converted.
+ * REMEMBER TO FREE with destroy_matrix.
+ * Returns NULL if the file cannot be read or
+ * is not a valid matrix file.
+ * 
+ * **********************************************/
+double** load_matrix_from_binary_file(
+	const char* filepath,
+	size_t* rows,
+	size_t* cols
+);
+
+/* **********************************************
+ *
+ * Maps a binary matrix file into memory and
+ * returns a READ-ONLY matrix over the mapping,
+ * without copying or reading the data up front;
+ * pages are loaded on first access. Writing to
+ * it crashes the program.
+ * REMEMBER TO FREE with matrix_free (unmaps).
+ * Returns NULL if the file cannot be mapped, is
+ * not a valid matrix file or has the other byte
+ * order (use load_matrix_from_binary_file).
+ * 
+ * **********************************************/
+matrix_t* matrix_map_file(
+	const char* filepath
+);
+
+/* **********************************************
+ *
+ * Binary sparse matrix files.
+ *
+ * A 64 byte header, then ptr, index (both as
+ * uint64_t) and values (double), without
+ * padding. Header fields, in the byte order of
+ * the writer:
+ *   char     magic[8]     "LINALGSP"
+ *   uint32_t byte_order   0x01020304
+ *   uint16_t version      1
+ *   uint16_t dtype        1: double
+ *   uint64_t rows
+ *   uint64_t cols
+ *   uint64_t nnz
+ *   uint16_t format       1: CSR, 2: CSC
+ *   uint16_t reserved     0
+ *   (zero padding up to 64 bytes)
+ *
+ * Writes A to a binary file. Returns 0, or -1
+ * if the file could not be written.
+ *
+ * **********************************************/
+int save_sparse_matrix_to_binary_file(
+	const char* filepath,
+	const sparse_matrix* A
+);
+
+/* **********************************************
+ *
+ * Reads a binary sparse matrix file. Files
+ * written with the other byte order are
+ * converted.
+ * REMEMBER TO FREE with destroy_sparse_matrix.
+ * Returns NULL if the file cannot be read or is
+ * not a valid sparse matrix file.
+ *
+ * **********************************************/
+sparse_matrix* load_sparse_matrix_from_binary_file(
+	const char* filepath
+);
+
+/* **********************************************
+ *
+ * Where and why read_csv_to_new_matrix failed.
+ * line and column are 1-based (column counts
+ * fields), 0 if not applicable.
+ * 
+ * **********************************************/
+typedef struct {
+	size_t line;
+	size_t column;
+	char message[96];
+} csv_error;
+
+/* **********************************************
+ *
+ * Reads csv file to a new matrix whose shape is
+ * inferred from the file. Skips all rows
+ * starting with #, and one extra assumed to be
+ * the header, like read_csv_to_matrix. Empty
+ * lines are ignored. The number of columns is
+ * taken from the first data row; every row
+ * must have that many numeric fields.
+ * 
+ * The file is memory mapped and parsed in
+ * parallel when threads are enabled.
+ * 
+ * On success, returns the matrix and sets rows
+ * and cols. REMEMBER TO FREE with
+ * destroy_matrix.
+ * On failure (unreadable file, malformed or
+ * ragged rows), returns NULL and, if error is
+ * not NULL, fills it in.
+ * 
+ * **********************************************/
+double** read_csv_to_new_matrix(
+	const char* filepath,
+	size_t* rows,
+	size_t* cols,
+	csv_error* error
+);
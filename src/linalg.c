@@ -8,414 +8,6816 @@
 //		algebra. Vectors, matrices and such.
 /*====================================================*/
 
+#define _GNU_SOURCE // CPU affinity, madvise, getline
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <float.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <gsl/gsl_rng.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "linalg.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define LINALG_X86 1
+#include <immintrin.h>
+#define LINALG_TARGET_SSE2   __attribute__((target("sse2")))
+#define LINALG_TARGET_AVX2   __attribute__((target("avx2,fma,f16c")))
+#define LINALG_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
 
-double* create_vector(size_t len){
-	double* vector = calloc(len, sizeof(double) * len);
-	return vector;
+// matrix_t.flags
+#define MATRIX_OWNS_DATA 0x1u
+#define MATRIX_MAPPED    0x2u
+
+
+/* ---------------------------------------------------
+ * Kernel selection. Kernels for every instruction set
+ * are compiled into the library with target attributes
+ * (no -march needed); the best set the host supports
+ * is picked once when the library is loaded.
+ * ------------------------------------------------- */
+
+// Computes the mr x nr tile ab = a*b from packed panels
+// (a: k x mr column slivers, b: k x nr row slivers).
+typedef void (*gemm_micro_kernel)(size_t k, const double* a,
+		const double* b, double* ab);
+typedef void (*gemm_micro_kernel_f32)(size_t k, const float* a,
+		const float* b, float* ab);
+
+#define GEMM_CONFIG(kernel_type) struct { \
+	kernel_type kernel; \
+	size_t mr, nr; /* register tile */ \
+	size_t mc;     /* rows of packed A block, kept in L2 */ \
+	size_t kc;     /* depth of a panel; a kc x nr sliver of B fits L1 */ \
+	size_t nc;     /* cols of packed B panel, kept in L3 */ \
 }
+typedef GEMM_CONFIG(gemm_micro_kernel) gemm_config;
+typedef GEMM_CONFIG(gemm_micro_kernel_f32) gemm_config_f32;
 
-double* create_vector_malloc(size_t len){
-	double* vector = malloc(len * sizeof(double));
-	return vector;
+// Vector (BLAS-1) kernels over elements of type T
+#define VECTOR_KERNEL_FIELDS(T) \
+	T (*dot)(const T* a, const T* b, size_t n); \
+	T (*sum)(const T* a, size_t n); \
+	T (*sum_of_squares)(const T* a, size_t n); \
+	T (*squared_distance)(const T* a, const T* b, size_t n); \
+	/* out[r] = dot(a[r], x), r < 4 */ \
+	void (*dot4)(const T* const* a, const T* x, size_t n, T* out); \
+	void (*add)(T* res, const T* a, const T* b, size_t n); \
+	void (*sub)(T* res, const T* a, const T* b, size_t n); \
+	void (*mul)(T* res, const T* a, const T* b, size_t n); \
+	void (*div)(T* res, const T* a, const T* b, size_t n); \
+	void (*min)(T* res, const T* a, const T* b, size_t n); \
+	void (*max)(T* res, const T* a, const T* b, size_t n); \
+	void (*sqrt)(T* res, const T* a, size_t n); \
+	void (*scale)(T* v, T s, size_t n); \
+	void (*add_scalar)(T* v, T s, size_t n); \
+	/* y += a*x */ \
+	void (*axpy)(T* y, T a, const T* x, size_t n); \
+	/* out = {sum, sum of squares, min, max}, n > 0 */ \
+	void (*moments)(const T* a, size_t n, T* out); \
+	T (*sum_squared_deviation)(const T* a, size_t n, T mean);
+
+typedef struct {
+	VECTOR_KERNEL_FIELDS(double)
+	// out[0] + out[1] = sum of a, with the rounding errors carried in out[1]
+	void (*sum_compensated)(const double* a, size_t n, double* out);
+	// Sum in one fixed order, the same bits on every instruction set
+	double (*sum_reproducible)(const double* a, size_t n);
+	// u[0 .. 2*n_blocks) = uniforms on [0, 1) from Philox blocks block, ...
+	void (*uniform)(double* u, uint64_t block, size_t n_blocks, uint64_t key);
+	// dst[j][dst_col + i] = src[i][src_col + j], i < m, j < n
+	void (*transpose)(double* const* dst, size_t dst_col,
+			const double* const* src, size_t src_col, size_t m, size_t n);
+} vector_kernels;
+
+typedef struct {
+	VECTOR_KERNEL_FIELDS(float)
+} vector_kernels_f32;
+
+// 16-bit storage formats (binary16, bfloat16): elements are widened to
+// float and accumulated in float
+typedef struct {
+	float (*dot)(const uint16_t* a, const uint16_t* b, size_t n);
+	float (*sum_of_squares)(const uint16_t* a, size_t n);
+	float (*squared_distance)(const uint16_t* a, const uint16_t* b, size_t n);
+	void (*to_f32)(float* dst, const uint16_t* src, size_t n);
+	void (*from_f32)(uint16_t* dst, const float* src, size_t n);
+} half_kernels;
+
+// Elementwise math functions, res[i] = f(x[i]); res may be x
+typedef struct {
+	void (*exp)(double* res, const double* x, size_t n);
+	void (*log)(double* res, const double* x, size_t n);
+	void (*sin)(double* res, const double* x, size_t n);
+	void (*cos)(double* res, const double* x, size_t n);
+	void (*tanh)(double* res, const double* x, size_t n);
+	void (*sigmoid)(double* res, const double* x, size_t n);
+	void (*pow)(double* res, const double* x, size_t n, double p);
+} math_kernels;
+
+static gemm_config gemm_cfg;
+static gemm_config_f32 gemm_cfg_f32;
+static vector_kernels vec_kernels;
+static vector_kernels_f32 vec_kernels_f32;
+static half_kernels f16_kernels;
+static half_kernels bf16_kernels;
+static math_kernels vec_math;
+static linalg_isa current_isa;
+static linalg_reduction reduction_mode = LINALG_REDUCTION_FAST;
+
+static void gemm_kernel_generic(size_t k, const double* a,
+		const double* b, double* ab);
+static void gemm_kernel_generic_f32(size_t k, const float* a,
+		const float* b, float* ab);
+#ifdef LINALG_X86
+static void gemm_kernel_avx2(size_t k, const double* a,
+		const double* b, double* ab);
+static void gemm_kernel_avx512(size_t k, const double* a,
+		const double* b, double* ab);
+static void gemm_kernel_avx2_f32(size_t k, const float* a,
+		const float* b, float* ab);
+static void gemm_kernel_avx512_f32(size_t k, const float* a,
+		const float* b, float* ab);
+#endif
+
+/*
+ * The reductions for one instruction set, from its vector type, width
+ * and intrinsics. T is the stored element type and R the type summed in;
+ * LOAD widens W elements to a vector of R and CVT one element to R. Four
+ * independent accumulators hide the add latency; every loop finishes
+ * with a scalar tail.
+ */
+#define DEFINE_REDUCTION_KERNELS(isa, TARGET, T, R, VEC, W, LOAD, CVT, \
+		ADD, SUB, FMADD, ZERO, HSUM) \
+TARGET static R dot_##isa(const T* a, const T* b, size_t n){ \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 4*(W) <= n; i += 4*(W)){ \
+		s0 = FMADD(LOAD(a + i), LOAD(b + i), s0); \
+		s1 = FMADD(LOAD(a + i + (W)), LOAD(b + i + (W)), s1); \
+		s2 = FMADD(LOAD(a + i + 2*(W)), LOAD(b + i + 2*(W)), s2); \
+		s3 = FMADD(LOAD(a + i + 3*(W)), LOAD(b + i + 3*(W)), s3); \
+	} \
+	for(; i + (W) <= n; i += (W)) s0 = FMADD(LOAD(a + i), LOAD(b + i), s0); \
+	R sum = HSUM(ADD(ADD(s0, s1), ADD(s2, s3))); \
+	for(; i < n; i++) sum += CVT(a[i]) * CVT(b[i]); \
+	return sum; \
+} \
+TARGET static R sum_of_squares_##isa(const T* a, size_t n){ \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 4*(W) <= n; i += 4*(W)){ \
+		VEC x0 = LOAD(a + i), x1 = LOAD(a + i + (W)); \
+		VEC x2 = LOAD(a + i + 2*(W)), x3 = LOAD(a + i + 3*(W)); \
+		s0 = FMADD(x0, x0, s0); \
+		s1 = FMADD(x1, x1, s1); \
+		s2 = FMADD(x2, x2, s2); \
+		s3 = FMADD(x3, x3, s3); \
+	} \
+	for(; i + (W) <= n; i += (W)){ \
+		VEC x = LOAD(a + i); \
+		s0 = FMADD(x, x, s0); \
+	} \
+	R sum = HSUM(ADD(ADD(s0, s1), ADD(s2, s3))); \
+	for(; i < n; i++) sum += CVT(a[i]) * CVT(a[i]); \
+	return sum; \
+} \
+TARGET static R squared_distance_##isa(const T* a, const T* b, size_t n){ \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 4*(W) <= n; i += 4*(W)){ \
+		VEC d0 = SUB(LOAD(a + i), LOAD(b + i)); \
+		VEC d1 = SUB(LOAD(a + i + (W)), LOAD(b + i + (W))); \
+		VEC d2 = SUB(LOAD(a + i + 2*(W)), LOAD(b + i + 2*(W))); \
+		VEC d3 = SUB(LOAD(a + i + 3*(W)), LOAD(b + i + 3*(W))); \
+		s0 = FMADD(d0, d0, s0); \
+		s1 = FMADD(d1, d1, s1); \
+		s2 = FMADD(d2, d2, s2); \
+		s3 = FMADD(d3, d3, s3); \
+	} \
+	for(; i + (W) <= n; i += (W)){ \
+		VEC d = SUB(LOAD(a + i), LOAD(b + i)); \
+		s0 = FMADD(d, d, s0); \
+	} \
+	R sum = HSUM(ADD(ADD(s0, s1), ADD(s2, s3))); \
+	for(; i < n; i++) sum += (CVT(a[i]) - CVT(b[i])) * (CVT(a[i]) - CVT(b[i])); \
+	return sum; \
 }
 
-double* create_linspace(double start, double end, size_t num_points){
-	double* linspace = create_vector(num_points);
-	for(int i = 0; i < num_points; i++){
-		linspace[i] = i * (end-start)/(num_points-1) + start;
-	}
-	return linspace;	
+/*
+ * All vector kernels of one instruction set and element type T (double
+ * or float): the reductions above plus the elementwise kernels.
+ */
+#define DEFINE_VECTOR_KERNELS(isa, TARGET, T, VEC, W, LOAD, STORE, SET1, \
+		ADD, SUB, MUL, DIV, SQRT, FMADD, ZERO, HSUM, MIN, MAX, HMIN, HMAX) \
+DEFINE_REDUCTION_KERNELS(isa, TARGET, T, T, VEC, W, LOAD, SCALAR_ID, \
+		ADD, SUB, FMADD, ZERO, HSUM) \
+TARGET static void dot4_##isa(const T* const* a, const T* x, \
+		size_t n, T* out){ \
+	const T *a0 = a[0], *a1 = a[1], *a2 = a[2], *a3 = a[3]; \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)){ \
+		VEC xv = LOAD(x + i); \
+		s0 = FMADD(LOAD(a0 + i), xv, s0); \
+		s1 = FMADD(LOAD(a1 + i), xv, s1); \
+		s2 = FMADD(LOAD(a2 + i), xv, s2); \
+		s3 = FMADD(LOAD(a3 + i), xv, s3); \
+	} \
+	out[0] = HSUM(s0); \
+	out[1] = HSUM(s1); \
+	out[2] = HSUM(s2); \
+	out[3] = HSUM(s3); \
+	for(; i < n; i++){ \
+		out[0] += a0[i] * x[i]; \
+		out[1] += a1[i] * x[i]; \
+		out[2] += a2[i] * x[i]; \
+		out[3] += a3[i] * x[i]; \
+	} \
+} \
+TARGET static T sum_##isa(const T* a, size_t n){ \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 4*(W) <= n; i += 4*(W)){ \
+		s0 = ADD(s0, LOAD(a + i)); \
+		s1 = ADD(s1, LOAD(a + i + (W))); \
+		s2 = ADD(s2, LOAD(a + i + 2*(W))); \
+		s3 = ADD(s3, LOAD(a + i + 3*(W))); \
+	} \
+	for(; i + (W) <= n; i += (W)) s0 = ADD(s0, LOAD(a + i)); \
+	T sum = HSUM(ADD(ADD(s0, s1), ADD(s2, s3))); \
+	for(; i < n; i++) sum += a[i]; \
+	return sum; \
+} \
+TARGET static void add_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, ADD(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] + b[i]; \
+} \
+TARGET static void sub_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, SUB(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] - b[i]; \
+} \
+TARGET static void mul_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, MUL(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] * b[i]; \
+} \
+TARGET static void div_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, DIV(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] / b[i]; \
+} \
+TARGET static void min_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, MIN(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] < b[i] ? a[i] : b[i]; \
+} \
+TARGET static void max_##isa(T* res, const T* a, const T* b, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, MAX(LOAD(a + i), LOAD(b + i))); \
+	for(; i < n; i++) res[i] = a[i] > b[i] ? a[i] : b[i]; \
+} \
+TARGET static void sqrt_##isa(T* res, const T* a, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(res + i, SQRT(LOAD(a + i))); \
+	for(; i < n; i++) res[i] = sqrt(a[i]); \
+} \
+TARGET static void scale_##isa(T* v, T s, size_t n){ \
+	VEC vs = SET1(s); \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(v + i, MUL(LOAD(v + i), vs)); \
+	for(; i < n; i++) v[i] *= s; \
+} \
+TARGET static void add_scalar_##isa(T* v, T s, size_t n){ \
+	VEC vs = SET1(s); \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(v + i, ADD(LOAD(v + i), vs)); \
+	for(; i < n; i++) v[i] += s; \
+} \
+TARGET static void axpy_##isa(T* y, T a, const T* x, size_t n){ \
+	VEC va = SET1(a); \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE(y + i, FMADD(va, LOAD(x + i), LOAD(y + i))); \
+	for(; i < n; i++) y[i] += a * x[i]; \
+} \
+TARGET static void moments_##isa(const T* a, size_t n, T* out){ \
+	VEC s0 = ZERO(), s1 = ZERO(), q0 = ZERO(), q1 = ZERO(); \
+	VEC lo = SET1(a[0]), hi = lo; \
+	size_t i = 0; \
+	for(; i + 2*(W) <= n; i += 2*(W)){ \
+		VEC x0 = LOAD(a + i), x1 = LOAD(a + i + (W)); \
+		s0 = ADD(s0, x0); \
+		s1 = ADD(s1, x1); \
+		q0 = FMADD(x0, x0, q0); \
+		q1 = FMADD(x1, x1, q1); \
+		lo = MIN(lo, MIN(x0, x1)); \
+		hi = MAX(hi, MAX(x0, x1)); \
+	} \
+	T sum = HSUM(ADD(s0, s1)), sum_sq = HSUM(ADD(q0, q1)); \
+	T min = HMIN(lo), max = HMAX(hi); \
+	for(; i < n; i++){ \
+		sum += a[i]; \
+		sum_sq += a[i] * a[i]; \
+		min = a[i] < min ? a[i] : min; \
+		max = a[i] > max ? a[i] : max; \
+	} \
+	out[0] = sum; \
+	out[1] = sum_sq; \
+	out[2] = min; \
+	out[3] = max; \
+} \
+TARGET static T sum_squared_deviation_##isa(const T* a, size_t n, T mean){ \
+	VEC vm = SET1(mean), s0 = ZERO(), s1 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 2*(W) <= n; i += 2*(W)){ \
+		VEC d0 = SUB(LOAD(a + i), vm), d1 = SUB(LOAD(a + i + (W)), vm); \
+		s0 = FMADD(d0, d0, s0); \
+		s1 = FMADD(d1, d1, s1); \
+	} \
+	T sum = HSUM(ADD(s0, s1)); \
+	for(; i < n; i++) sum += (a[i] - mean) * (a[i] - mean); \
+	return sum; \
 }
 
-double* create_random_uniform_vector(size_t len, unsigned long int seed){
-	double* vector = create_vector(len);	
-	gsl_rng * r;
-	r = gsl_rng_alloc(gsl_rng_default);
-	gsl_rng_set(r, seed);
-	for(int i = 0; i < len; i++){
-		vector[i] = gsl_rng_uniform(r);
-	}
-	gsl_rng_free(r);
-	return vector;
+/*
+ * Summation kernels of the reduction modes (double only). The
+ * compensated sum runs Knuth's TwoSum in every lane, i.e. Neumaier's
+ * correction without its branch. The reproducible sum gives element i
+ * to lane i mod 8 whatever the vector width (one 8-lane vector, two of
+ * four, four of two or eight scalars), adds the tail into the same
+ * lanes and the lanes in a fixed tree, so its bits do not depend on
+ * the instruction set.
+ */
+// s + x = t + (error added to c), then s = t
+static inline double two_sum_add(double s, double x, double* c){
+	double t = s + x, b = t - s;
+	*c += (s - (t - b)) + (x - b);
+	return t;
 }
 
-void destroy_vector(double *vector){
-	free(vector);
+#define TWO_SUM(VEC, ADD, SUB, s, x, c) do { \
+	VEC t_ = ADD(s, x), b_ = SUB(t_, s); \
+	c = ADD(c, ADD(SUB(s, SUB(t_, b_)), SUB(x, b_))); \
+	s = t_; \
+} while(0)
+
+#define DEFINE_SUMMATION_KERNELS(isa, TARGET, VEC, W, LOAD, STORE, ADD, \
+		SUB, ZERO) \
+TARGET static void sum_compensated_##isa(const double* a, size_t n, \
+		double* out){ \
+	VEC s0 = ZERO(), s1 = ZERO(), c0 = ZERO(), c1 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 2*(W) <= n; i += 2*(W)){ \
+		VEC x0 = LOAD(a + i), x1 = LOAD(a + i + (W)); \
+		TWO_SUM(VEC, ADD, SUB, s0, x0, c0); \
+		TWO_SUM(VEC, ADD, SUB, s1, x1, c1); \
+	} \
+	double s[2*(W)], c[2*(W)]; \
+	STORE(s, s0); \
+	STORE(s + (W), s1); \
+	STORE(c, c0); \
+	STORE(c + (W), c1); \
+	double sum = 0.0, err = 0.0; \
+	for(size_t l = 0; l < 2*(W); l++){ \
+		sum = two_sum_add(sum, s[l], &err); \
+		err += c[l]; \
+	} \
+	for(; i < n; i++) sum = two_sum_add(sum, a[i], &err); \
+	out[0] = sum; \
+	out[1] = err; \
+} \
+TARGET static double sum_reproducible_##isa(const double* a, size_t n){ \
+	VEC s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO(); \
+	VEC s4 = ZERO(), s5 = ZERO(), s6 = ZERO(), s7 = ZERO(); \
+	size_t i = 0; \
+	for(; i + 8 <= n; i += 8){ \
+		s0 = ADD(s0, LOAD(a + i)); \
+		if((W) <= 4) s1 = ADD(s1, LOAD(a + i + 1*(W))); \
+		if((W) <= 2){ \
+			s2 = ADD(s2, LOAD(a + i + 2*(W))); \
+			s3 = ADD(s3, LOAD(a + i + 3*(W))); \
+		} \
+		if((W) == 1){ \
+			s4 = ADD(s4, LOAD(a + i + 4*(W))); \
+			s5 = ADD(s5, LOAD(a + i + 5*(W))); \
+			s6 = ADD(s6, LOAD(a + i + 6*(W))); \
+			s7 = ADD(s7, LOAD(a + i + 7*(W))); \
+		} \
+	} \
+	double lane[8]; \
+	STORE(lane, s0); \
+	if((W) <= 4) STORE(lane + 1*(W), s1); \
+	if((W) <= 2){ \
+		STORE(lane + 2*(W), s2); \
+		STORE(lane + 3*(W), s3); \
+	} \
+	if((W) == 1){ \
+		STORE(lane + 4*(W), s4); \
+		STORE(lane + 5*(W), s5); \
+		STORE(lane + 6*(W), s6); \
+		STORE(lane + 7*(W), s7); \
+	} \
+	for(size_t l = 0; i < n; i++, l++) lane[l] += a[i]; \
+	return ((lane[0] + lane[1]) + (lane[2] + lane[3])) \
+		+ ((lane[4] + lane[5]) + (lane[6] + lane[7])); \
 }
 
-void copy_vector(double *v_dest, double *v_source, size_t len) {
-	for (int i = 0; i < len; i++) {
-		v_dest[i] = v_source[i];
+// Scalar stand-ins for the intrinsics: the portable kernels are the same
+// macros with one lane (and still four accumulators).
+#define SCALAR_LOAD(p) (*(p))
+#define SCALAR_STORE(p, x) (*(p) = (x))
+#define SCALAR_ID(x) (x)
+#define SCALAR_ADD(a, b) ((a) + (b))
+#define SCALAR_SUB(a, b) ((a) - (b))
+#define SCALAR_MUL(a, b) ((a) * (b))
+#define SCALAR_DIV(a, b) ((a) / (b))
+#define SCALAR_FMADD(a, b, c) ((a) * (b) + (c))
+#define SCALAR_ZERO() 0
+// Same NaN handling as the minpd/maxpd instructions
+#define SCALAR_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define SCALAR_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+DEFINE_VECTOR_KERNELS(generic, , double, double, 1, SCALAR_LOAD,
+		SCALAR_STORE, SCALAR_ID, SCALAR_ADD, SCALAR_SUB, SCALAR_MUL,
+		SCALAR_DIV, sqrt, SCALAR_FMADD, SCALAR_ZERO, SCALAR_ID, SCALAR_MIN,
+		SCALAR_MAX, SCALAR_ID, SCALAR_ID)
+
+DEFINE_VECTOR_KERNELS(generic_f32, , float, float, 1, SCALAR_LOAD,
+		SCALAR_STORE, SCALAR_ID, SCALAR_ADD, SCALAR_SUB, SCALAR_MUL,
+		SCALAR_DIV, sqrtf, SCALAR_FMADD, SCALAR_ZERO, SCALAR_ID, SCALAR_MIN,
+		SCALAR_MAX, SCALAR_ID, SCALAR_ID)
+
+DEFINE_SUMMATION_KERNELS(generic, , double, 1, SCALAR_LOAD, SCALAR_STORE,
+		SCALAR_ADD, SCALAR_SUB, SCALAR_ZERO)
+
+/*
+ * binary16 and bfloat16 <-> float. Narrowing rounds to nearest even and
+ * keeps infinities, NaNs (made quiet) and binary16 subnormals.
+ */
+static inline float half_to_float(uint16_t h){
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1F, mantissa = h & 0x3FF;
+	if(exponent == 0){
+		float f = mantissa * 0x1p-24f; // zero or subnormal, exact
+		return sign ? -f : f;
 	}
+	uint32_t bits = sign | mantissa << 13 | (exponent == 0x1F
+			? 0x7F800000u : (exponent + 112) << 23);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
 }
 
-void copy_column_to_vector(double* vector, double** matrix, 
-		int col_index, size_t len) {
-	for (int i = 0; i < len; i++) {
-		vector[i] = matrix[i][col_index];
+static inline uint16_t float_to_half(float f){
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint16_t sign = (x >> 16) & 0x8000;
+	uint32_t ax = x & 0x7FFFFFFF;
+	if(ax > 0x7F800000) return sign | 0x7E00 | ((ax >> 13) & 0x3FF);
+	if(ax >= 0x477FF000) return sign | 0x7C00; // rounds past 65504
+	if(ax < 0x38800000){
+		// Below 2^-14: subnormal, in units of 2^-24 (may round up to
+		// the smallest normal)
+		float a = fabsf(f) * 0x1p24f;
+		return sign | (uint16_t)lrintf(a);
 	}
+	uint32_t r = ax + 0xFFF + ((ax >> 13) & 1);
+	return sign | (uint16_t)((r >> 13) - (112 << 10));
 }
 
-void scale_vector_by_factor(double *v, double scale_factor, size_t len){
-	for(int i = 0; i < len; i++){
-		v[i] = v[i] * scale_factor;
-	}
+static inline float bfloat_to_float(uint16_t h){
+	uint32_t bits = (uint32_t)h << 16;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
 }
 
-void add_scalar_to_vector(double *v, double scalar, size_t len){
-	for(int i = 0; i < len; i++){
-		v[i] = v[i] + scalar;
-	}
+static inline uint16_t float_to_bfloat(float f){
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	if((x & 0x7FFFFFFF) > 0x7F800000) return (uint16_t)(x >> 16) | 0x40;
+	return (uint16_t)((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
 }
 
-void evaluate_function_on_vector(double* v_output, double (*function)(double), 
-		double* v_input, size_t len) {
-	for(int i = 0; i < len; i++){
-		v_output[i] = (*function)(v_input[i]); //dereference function
-		//since (*function) is the address of the function		
-	}
+#define HALF_LOAD(p) half_to_float(*(p))
+#define BFLOAT_LOAD(p) bfloat_to_float(*(p))
+
+DEFINE_REDUCTION_KERNELS(f16_generic, , uint16_t, float, float, 1,
+		HALF_LOAD, half_to_float, SCALAR_ADD, SCALAR_SUB, SCALAR_FMADD,
+		SCALAR_ZERO, SCALAR_ID)
+
+DEFINE_REDUCTION_KERNELS(bf16_generic, , uint16_t, float, float, 1,
+		BFLOAT_LOAD, bfloat_to_float, SCALAR_ADD, SCALAR_SUB, SCALAR_FMADD,
+		SCALAR_ZERO, SCALAR_ID)
+
+static void f16_to_f32_generic(float* dst, const uint16_t* src, size_t n){
+	for(size_t i = 0; i < n; i++) dst[i] = half_to_float(src[i]);
 }
 
-void elementwise_addition(double *res, double *v1, double *v2, size_t len){
-	for(int i = 0; i < len; i++){
-		res[i] = v1[i] + v2[i]; 
-	}
+static void f32_to_f16_generic(uint16_t* dst, const float* src, size_t n){
+	for(size_t i = 0; i < n; i++) dst[i] = float_to_half(src[i]);
 }
 
-void elementwise_multiplication(double *res, double *v1,
-								double *v2, size_t len){
-	for(int i = 0; i < len; i++){
-		res[i] = v1[i] * v2[i]; 
-	}
+static void bf16_to_f32_generic(float* dst, const uint16_t* src, size_t n){
+	for(size_t i = 0; i < n; i++) dst[i] = bfloat_to_float(src[i]);
 }
- 
-double dot_product(double *v1, double *v2, size_t len){
-	double sum = 0;
-	for (int i = 0; i < len; i++) {
-		sum += v1[i] * v2[i]; 
+
+static void f32_to_bf16_generic(uint16_t* dst, const float* src, size_t n){
+	for(size_t i = 0; i < n; i++) dst[i] = float_to_bfloat(src[i]);
+}
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3"): block b of a stream is a pure function of (key, b), so any
+ * range of a stream can be generated independently. Each block gives
+ * 128 bits, i.e. two doubles with 52 random mantissa bits each. All
+ * instruction sets produce bit-identical output.
+ */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+#define UNIFORM_ONE_BITS 0x3FF0000000000000ull
+
+// 64 random bits -> [0, 1) via the mantissa of a double in [1, 2)
+static inline double uniform_from_bits(uint64_t x){
+	uint64_t bits = (x >> 12) | UNIFORM_ONE_BITS;
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d - 1.0;
+}
+
+static void uniform_generic(double* u, uint64_t block, size_t n_blocks,
+		uint64_t key){
+	for(size_t b = 0; b < n_blocks; b++){
+		uint32_t c0 = (uint32_t)(block + b), c1 = (uint32_t)((block + b) >> 32);
+		uint32_t c2 = 0, c3 = 0;
+		uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+		for(int r = 0; r < PHILOX_ROUNDS; r++){
+			uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+			uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+			c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			c1 = (uint32_t)p1;
+			c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			c3 = (uint32_t)p0;
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+		u[2*b]     = uniform_from_bits((uint64_t)c0 << 32 | c1);
+		u[2*b + 1] = uniform_from_bits((uint64_t)c2 << 32 | c3);
 	}
-    return sum;
 }
 
-double vector_norm(double *v1, size_t len){
-	double sum = 0;
-	for(int i = 0; i < len; i++){
-		sum += v1[i] * v1[i];
+static void transpose_generic(double* const* dst, size_t dst_col,
+		const double* const* src, size_t src_col, size_t m, size_t n){
+	for(size_t j = 0; j < n; j++){
+		double* d = dst[j] + dst_col;
+		for(size_t i = 0; i < m; i++) d[i] = src[i][src_col + j];
 	}
-    return sqrt(sum);
 }
 
+#ifdef LINALG_X86
 
-void normalize_vector(double *v1, size_t len){
-	double norm = vector_norm(v1, len);
-	scale_vector_by_factor(v1, 1.0/norm, len);
+/*
+ * Philox with one block per 64-bit lane: the 32-bit words live in the low
+ * halves of the lanes so mul_epu32 gives the full 32x32 -> 64 product.
+ * Two groups of W blocks are interleaved to hide the multiply latency of
+ * the round chain. STORE2 interleaves the two doubles of each block; the
+ * partial last groups go through a buffer.
+ */
+#define PHILOX_ROUND_SIMD(VI, c, m0, m1, lo32, k0, k1, MUL_EPU32, AND, XOR, SRLI) { \
+	VI p0 = MUL_EPU32(c[0], m0), p1 = MUL_EPU32(c[2], m1); \
+	c[0] = XOR(XOR(SRLI(p1, 32), c[1]), k0); \
+	c[1] = AND(p1, lo32); \
+	c[2] = XOR(XOR(SRLI(p0, 32), c[3]), k1); \
+	c[3] = AND(p0, lo32); \
+}
+#define DEFINE_UNIFORM_KERNEL(isa, TARGET, VI, VD, W, SET1_64, LANES, ZERO, \
+		MUL_EPU32, ADD, AND, OR, XOR, SRLI, SLLI, CAST_PD, SET1_PD, SUB_PD, \
+		STORE2) \
+TARGET static void uniform_##isa(double* u, uint64_t block, size_t n_blocks, \
+		uint64_t key){ \
+	const VI m0 = SET1_64(PHILOX_M0), m1 = SET1_64(PHILOX_M1); \
+	const VI w0 = SET1_64(PHILOX_W0), w1 = SET1_64(PHILOX_W1); \
+	const VI lo32 = SET1_64(0xFFFFFFFF), one_bits = SET1_64(UNIFORM_ONE_BITS); \
+	const VD one = SET1_PD(1.0); \
+	for(size_t b = 0; b < n_blocks; b += 2*(W)){ \
+		VI ctr_a = ADD(SET1_64(block + b), LANES); \
+		VI ctr_b = ADD(SET1_64(block + b + (W)), LANES); \
+		VI a[4] = {AND(ctr_a, lo32), SRLI(ctr_a, 32), ZERO(), ZERO()}; \
+		VI c[4] = {AND(ctr_b, lo32), SRLI(ctr_b, 32), ZERO(), ZERO()}; \
+		VI k0 = SET1_64(key & 0xFFFFFFFF), k1 = SET1_64(key >> 32); \
+		for(int r = 0; r < PHILOX_ROUNDS; r++){ \
+			PHILOX_ROUND_SIMD(VI, a, m0, m1, lo32, k0, k1, MUL_EPU32, AND, XOR, SRLI) \
+			PHILOX_ROUND_SIMD(VI, c, m0, m1, lo32, k0, k1, MUL_EPU32, AND, XOR, SRLI) \
+			k0 = AND(ADD(k0, w0), lo32); \
+			k1 = AND(ADD(k1, w1), lo32); \
+		} \
+		VD xa = SUB_PD(CAST_PD(OR(SRLI(OR(SLLI(a[0], 32), a[1]), 12), one_bits)), one); \
+		VD ya = SUB_PD(CAST_PD(OR(SRLI(OR(SLLI(a[2], 32), a[3]), 12), one_bits)), one); \
+		VD xc = SUB_PD(CAST_PD(OR(SRLI(OR(SLLI(c[0], 32), c[1]), 12), one_bits)), one); \
+		VD yc = SUB_PD(CAST_PD(OR(SRLI(OR(SLLI(c[2], 32), c[3]), 12), one_bits)), one); \
+		if(b + 2*(W) <= n_blocks){ \
+			STORE2(u + 2*b, xa, ya); \
+			STORE2(u + 2*b + 2*(W), xc, yc); \
+		} else { \
+			double tail[4*(W)]; \
+			STORE2(tail, xa, ya); \
+			STORE2(tail + 2*(W), xc, yc); \
+			memcpy(u + 2*b, tail, 2 * (n_blocks - b) * sizeof(double)); \
+		} \
+	} \
 }
 
+#define SSE2_FMADD(a, b, c) _mm_add_pd(_mm_mul_pd((a), (b)), (c))
 
-void vector_subtraction(double* result, double* v1, double* v2, size_t len){
-	for(int i = 0; i < len; i++){
-		result[i] = v1[i] - v2[i];
-	}
+LINALG_TARGET_SSE2
+static inline double sse2_hsum(__m128d v){
+	return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
 }
 
-double distance_between_vectors(double *v1, double *v2, size_t len) {
-	double sum_squared = 0, res = 0;
-	for(int i = 0; i < len; i++){
-		sum_squared += pow(v1[i] - v2[i], 2);
-	}
-	res = sqrt(sum_squared);
-	return res;
+LINALG_TARGET_SSE2
+static inline double sse2_hmin(__m128d v){
+	return _mm_cvtsd_f64(_mm_min_sd(v, _mm_unpackhi_pd(v, v)));
 }
 
+LINALG_TARGET_SSE2
+static inline double sse2_hmax(__m128d v){
+	return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+}
 
-double vector_average(double *v1, size_t len){
-	double sum = 0;
-	for(int i = 0; i < len; i++){
-		sum += v1[i];
-	}
+LINALG_TARGET_AVX2
+static inline double avx2_hsum(__m256d v){
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
 
-   	return sum/len;
+LINALG_TARGET_AVX2
+static inline double avx2_hmin(__m256d v){
+	return sse2_hmin(_mm_min_pd(_mm256_castpd256_pd128(v),
+			_mm256_extractf128_pd(v, 1)));
 }
 
-double vector_standard_deviation(double *v1, size_t len){
-	double sum = 0;
-	double mu = vector_average(v1, len);
-	for(int i = 0; i < len; i++){
-		sum += (v1[i] - mu) * (v1[i] - mu);
-	}
-    return sqrt(sum/len);
+LINALG_TARGET_AVX2
+static inline double avx2_hmax(__m256d v){
+	return sse2_hmax(_mm_max_pd(_mm256_castpd256_pd128(v),
+			_mm256_extractf128_pd(v, 1)));
 }
 
+DEFINE_VECTOR_KERNELS(sse2, LINALG_TARGET_SSE2, double, __m128d, 2, _mm_loadu_pd,
+		_mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd,
+		_mm_sqrt_pd, SSE2_FMADD, _mm_setzero_pd, sse2_hsum, _mm_min_pd,
+		_mm_max_pd, sse2_hmin, sse2_hmax)
 
-double vector_variance(double *v1, size_t len){
-	double sum = 0;
-	double mu = vector_average(v1, len);
-	for(int i = 0; i < len; i++){
-		sum += (v1[i] - mu) * (v1[i] - mu);
-	}
-    return sum/len;
+DEFINE_VECTOR_KERNELS(avx2, LINALG_TARGET_AVX2, double, __m256d, 4, _mm256_loadu_pd,
+		_mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd,
+		_mm256_mul_pd, _mm256_div_pd, _mm256_sqrt_pd, _mm256_fmadd_pd,
+		_mm256_setzero_pd, avx2_hsum, _mm256_min_pd, _mm256_max_pd, avx2_hmin,
+		avx2_hmax)
+
+DEFINE_VECTOR_KERNELS(avx512, LINALG_TARGET_AVX512, double, __m512d, 8,
+		_mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, _mm512_add_pd,
+		_mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd, _mm512_sqrt_pd,
+		_mm512_fmadd_pd, _mm512_setzero_pd,
+		_mm512_reduce_add_pd, _mm512_min_pd, _mm512_max_pd,
+		_mm512_reduce_min_pd, _mm512_reduce_max_pd)
+
+DEFINE_SUMMATION_KERNELS(sse2, LINALG_TARGET_SSE2, __m128d, 2, _mm_loadu_pd,
+		_mm_storeu_pd, _mm_add_pd, _mm_sub_pd, _mm_setzero_pd)
+DEFINE_SUMMATION_KERNELS(avx2, LINALG_TARGET_AVX2, __m256d, 4, _mm256_loadu_pd,
+		_mm256_storeu_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_setzero_pd)
+DEFINE_SUMMATION_KERNELS(avx512, LINALG_TARGET_AVX512, __m512d, 8,
+		_mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, _mm512_sub_pd,
+		_mm512_setzero_pd)
+
+#define SSE2_FMADD_PS(a, b, c) _mm_add_ps(_mm_mul_ps((a), (b)), (c))
+
+LINALG_TARGET_SSE2
+static inline float sse2_hsum_ps(__m128 v){
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	return _mm_cvtss_f32(_mm_add_ss(v, _mm_shuffle_ps(v, v, 1)));
 }
 
+LINALG_TARGET_SSE2
+static inline float sse2_hmin_ps(__m128 v){
+	v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+	return _mm_cvtss_f32(_mm_min_ss(v, _mm_shuffle_ps(v, v, 1)));
+}
 
-double vector_max(double* vector, size_t len){
-	double max = vector[0];
-	for(int i = 1; i < len; i++){
-		if(vector[i] > max){
-			max = vector[i];
-		}
-	}
-	return max;
+LINALG_TARGET_SSE2
+static inline float sse2_hmax_ps(__m128 v){
+	v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+	return _mm_cvtss_f32(_mm_max_ss(v, _mm_shuffle_ps(v, v, 1)));
 }
 
-double** create_matrix(size_t rows, size_t cols){
-	double** mat = malloc(sizeof(double*) * rows); // array of poiners to rows
-	for(int i = 0; i < rows; i++){
-		mat[i] = calloc(cols, sizeof(double) * cols); // rows with doubles
-	}
-	return mat;
+LINALG_TARGET_AVX2
+static inline float avx2_hsum_ps(__m256 v){
+	return sse2_hsum_ps(_mm_add_ps(_mm256_castps256_ps128(v),
+			_mm256_extractf128_ps(v, 1)));
 }
 
-double** create_transpose_of_matrix(double** matrix,
-		size_t initial_rows, size_t initial_cols){
-	double** transpose = create_matrix(initial_cols, initial_rows);
-	for(int i = 0; i < initial_rows; i++){
-		for(int j = 0; j < initial_cols; j++){
-			transpose[j][i] = matrix[i][j];
-		}
-	}
-	return transpose;
+LINALG_TARGET_AVX2
+static inline float avx2_hmin_ps(__m256 v){
+	return sse2_hmin_ps(_mm_min_ps(_mm256_castps256_ps128(v),
+			_mm256_extractf128_ps(v, 1)));
 }
 
-double** create_random_uniform_matrix(size_t rows, size_t cols, 
-		unsigned long int seed){
-	double** matrix = create_matrix(rows, cols);	
-	gsl_rng * r;
-	r = gsl_rng_alloc(gsl_rng_default);
-	gsl_rng_set(r, seed);
-	for(int i = 0; i < rows; i++){
-		for(int j = 0; j < cols; j++){
-			matrix[i][j] = gsl_rng_uniform(r);
+LINALG_TARGET_AVX2
+static inline float avx2_hmax_ps(__m256 v){
+	return sse2_hmax_ps(_mm_max_ps(_mm256_castps256_ps128(v),
+			_mm256_extractf128_ps(v, 1)));
+}
+
+DEFINE_VECTOR_KERNELS(sse2_f32, LINALG_TARGET_SSE2, float, __m128, 4,
+		_mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps,
+		_mm_mul_ps, _mm_div_ps, _mm_sqrt_ps, SSE2_FMADD_PS, _mm_setzero_ps,
+		sse2_hsum_ps, _mm_min_ps, _mm_max_ps, sse2_hmin_ps, sse2_hmax_ps)
+
+DEFINE_VECTOR_KERNELS(avx2_f32, LINALG_TARGET_AVX2, float, __m256, 8,
+		_mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps,
+		_mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps, _mm256_sqrt_ps,
+		_mm256_fmadd_ps, _mm256_setzero_ps, avx2_hsum_ps, _mm256_min_ps,
+		_mm256_max_ps, avx2_hmin_ps, avx2_hmax_ps)
+
+DEFINE_VECTOR_KERNELS(avx512_f32, LINALG_TARGET_AVX512, float, __m512, 16,
+		_mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps,
+		_mm512_sub_ps, _mm512_mul_ps, _mm512_div_ps, _mm512_sqrt_ps,
+		_mm512_fmadd_ps, _mm512_setzero_ps, _mm512_reduce_add_ps,
+		_mm512_min_ps, _mm512_max_ps, _mm512_reduce_min_ps,
+		_mm512_reduce_max_ps)
+
+// 16-bit formats widened to float lanes: binary16 by F16C's vcvtph2ps,
+// bfloat16 by a 16-bit shift into the high half of each lane
+#define AVX2_LOAD_F16(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(p)))
+#define AVX2_LOAD_BF16(p) _mm256_castsi256_ps(_mm256_slli_epi32( \
+	_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p))), 16))
+#define AVX512_LOAD_F16(p) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(p)))
+#define AVX512_LOAD_BF16(p) _mm512_castsi512_ps(_mm512_slli_epi32( \
+	_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p))), 16))
+
+DEFINE_REDUCTION_KERNELS(f16_avx2, LINALG_TARGET_AVX2, uint16_t, float,
+		__m256, 8, AVX2_LOAD_F16, half_to_float, _mm256_add_ps,
+		_mm256_sub_ps, _mm256_fmadd_ps, _mm256_setzero_ps, avx2_hsum_ps)
+
+DEFINE_REDUCTION_KERNELS(bf16_avx2, LINALG_TARGET_AVX2, uint16_t, float,
+		__m256, 8, AVX2_LOAD_BF16, bfloat_to_float, _mm256_add_ps,
+		_mm256_sub_ps, _mm256_fmadd_ps, _mm256_setzero_ps, avx2_hsum_ps)
+
+DEFINE_REDUCTION_KERNELS(f16_avx512, LINALG_TARGET_AVX512, uint16_t, float,
+		__m512, 16, AVX512_LOAD_F16, half_to_float, _mm512_add_ps,
+		_mm512_sub_ps, _mm512_fmadd_ps, _mm512_setzero_ps,
+		_mm512_reduce_add_ps)
+
+DEFINE_REDUCTION_KERNELS(bf16_avx512, LINALG_TARGET_AVX512, uint16_t, float,
+		__m512, 16, AVX512_LOAD_BF16, bfloat_to_float, _mm512_add_ps,
+		_mm512_sub_ps, _mm512_fmadd_ps, _mm512_setzero_ps,
+		_mm512_reduce_add_ps)
+
+#define DEFINE_HALF_CONVERSIONS(isa, TARGET, HALF_VEC, W, LOAD_PS, \
+		STORE_PS, LOAD_F16, CVTPS_PH, STORE_HALF) \
+TARGET static void f16_to_f32_##isa(float* dst, const uint16_t* src, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)) STORE_PS(dst + i, LOAD_F16(src + i)); \
+	for(; i < n; i++) dst[i] = half_to_float(src[i]); \
+} \
+TARGET static void f32_to_f16_##isa(uint16_t* dst, const float* src, size_t n){ \
+	size_t i = 0; \
+	for(; i + (W) <= n; i += (W)){ \
+		HALF_VEC h = CVTPS_PH(LOAD_PS(src + i), _MM_FROUND_TO_NEAREST_INT); \
+		STORE_HALF((HALF_VEC*)(dst + i), h); \
+	} \
+	for(; i < n; i++) dst[i] = float_to_half(src[i]); \
+}
+
+DEFINE_HALF_CONVERSIONS(avx2, LINALG_TARGET_AVX2, __m128i, 8,
+		_mm256_loadu_ps, _mm256_storeu_ps, AVX2_LOAD_F16, _mm256_cvtps_ph,
+		_mm_storeu_si128)
+
+DEFINE_HALF_CONVERSIONS(avx512, LINALG_TARGET_AVX512, __m256i, 16,
+		_mm512_loadu_ps, _mm512_storeu_ps, AVX512_LOAD_F16, _mm512_cvtps_ph,
+		_mm256_storeu_si256)
+
+LINALG_TARGET_SSE2
+static inline void sse2_store2(double* p, __m128d x, __m128d y){
+	_mm_storeu_pd(p, _mm_unpacklo_pd(x, y));
+	_mm_storeu_pd(p + 2, _mm_unpackhi_pd(x, y));
+}
+
+LINALG_TARGET_AVX2
+static inline void avx2_store2(double* p, __m256d x, __m256d y){
+	__m256d lo = _mm256_unpacklo_pd(x, y), hi = _mm256_unpackhi_pd(x, y);
+	_mm256_storeu_pd(p, _mm256_permute2f128_pd(lo, hi, 0x20));
+	_mm256_storeu_pd(p + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+}
+
+LINALG_TARGET_AVX512
+static inline void avx512_store2(double* p, __m512d x, __m512d y){
+	const __m512i lo = _mm512_set_epi64(11, 3, 10, 2, 9, 1, 8, 0);
+	const __m512i hi = _mm512_set_epi64(15, 7, 14, 6, 13, 5, 12, 4);
+	_mm512_storeu_pd(p, _mm512_permutex2var_pd(x, lo, y));
+	_mm512_storeu_pd(p + 8, _mm512_permutex2var_pd(x, hi, y));
+}
+
+/*
+ * Transposes split the m x n block into register tiles (2x2, 4x4, 8x8)
+ * transposed with unpack/permute; leftover rows and columns are scalar.
+ */
+#define TRANSPOSE_EDGES(T) \
+	for(size_t j = 0; j < n; j++){ \
+		double* d = dst[j] + dst_col; \
+		size_t i = j < n - n % (T) ? m - m % (T) : 0; \
+		for(; i < m; i++) d[i] = src[i][src_col + j]; \
+	}
+
+LINALG_TARGET_SSE2
+static void transpose_sse2(double* const* dst, size_t dst_col,
+		const double* const* src, size_t src_col, size_t m, size_t n){
+	for(size_t i = 0; i + 2 <= m; i += 2){
+		for(size_t j = 0; j + 2 <= n; j += 2){
+			__m128d r0 = _mm_loadu_pd(src[i] + src_col + j);
+			__m128d r1 = _mm_loadu_pd(src[i + 1] + src_col + j);
+			_mm_storeu_pd(dst[j] + dst_col + i, _mm_unpacklo_pd(r0, r1));
+			_mm_storeu_pd(dst[j + 1] + dst_col + i, _mm_unpackhi_pd(r0, r1));
 		}
 	}
-	gsl_rng_free(r);
-	return matrix;
+	TRANSPOSE_EDGES(2)
 }
 
-double** create_matrix_with_inserted_column(double** matrix, double* vector, 
-		size_t rows, size_t cols, size_t col_insert_index){
-	double** result = create_matrix(rows, cols+1);
-	// Before insert
-	for(int j = 0; j < col_insert_index; j++){
-		for(int i = 0; i < rows; i++){
-			result[i][j] = matrix[i][j];
+LINALG_TARGET_AVX2
+static void transpose_avx2(double* const* dst, size_t dst_col,
+		const double* const* src, size_t src_col, size_t m, size_t n){
+	for(size_t i = 0; i + 4 <= m; i += 4){
+		for(size_t j = 0; j + 4 <= n; j += 4){
+			__m256d r0 = _mm256_loadu_pd(src[i] + src_col + j);
+			__m256d r1 = _mm256_loadu_pd(src[i + 1] + src_col + j);
+			__m256d r2 = _mm256_loadu_pd(src[i + 2] + src_col + j);
+			__m256d r3 = _mm256_loadu_pd(src[i + 3] + src_col + j);
+			__m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+			__m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+			_mm256_storeu_pd(dst[j] + dst_col + i, _mm256_permute2f128_pd(t0, t2, 0x20));
+			_mm256_storeu_pd(dst[j + 1] + dst_col + i, _mm256_permute2f128_pd(t1, t3, 0x20));
+			_mm256_storeu_pd(dst[j + 2] + dst_col + i, _mm256_permute2f128_pd(t0, t2, 0x31));
+			_mm256_storeu_pd(dst[j + 3] + dst_col + i, _mm256_permute2f128_pd(t1, t3, 0x31));
 		}
 	}
-	// Insert, j == col_insert_index
-	for(int i = 0; i < rows; i++){
-		result[i][col_insert_index] = vector[i];
-	}	
-	// After insert
-	for(int j = col_insert_index; j < cols; j++){
-		for(int i = 0; i < rows; i++){
-			result[i][j+1] = matrix[i][j];
+	TRANSPOSE_EDGES(4)
+}
+
+LINALG_TARGET_AVX512
+static void transpose_avx512(double* const* dst, size_t dst_col,
+		const double* const* src, size_t src_col, size_t m, size_t n){
+	for(size_t i = 0; i + 8 <= m; i += 8){
+		for(size_t j = 0; j + 8 <= n; j += 8){
+			__m512d r[8], t[8], u[8];
+			for(int k = 0; k < 8; k++) r[k] = _mm512_loadu_pd(src[i + k] + src_col + j);
+			for(int k = 0; k < 8; k += 2){
+				t[k]     = _mm512_unpacklo_pd(r[k], r[k + 1]);
+				t[k + 1] = _mm512_unpackhi_pd(r[k], r[k + 1]);
+			}
+			// u[0..3]: rows 0-3, u[4..7]: rows 4-7; 128-bit lanes regrouped
+			for(int k = 0; k < 8; k += 4){
+				u[k]     = _mm512_shuffle_f64x2(t[k], t[k + 2], 0x88);
+				u[k + 1] = _mm512_shuffle_f64x2(t[k], t[k + 2], 0xDD);
+				u[k + 2] = _mm512_shuffle_f64x2(t[k + 1], t[k + 3], 0x88);
+				u[k + 3] = _mm512_shuffle_f64x2(t[k + 1], t[k + 3], 0xDD);
+			}
+			static const int col[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+			for(int k = 0; k < 4; k++){
+				_mm512_storeu_pd(dst[j + col[2*k]] + dst_col + i,
+						_mm512_shuffle_f64x2(u[k], u[k + 4], 0x88));
+				_mm512_storeu_pd(dst[j + col[2*k + 1]] + dst_col + i,
+						_mm512_shuffle_f64x2(u[k], u[k + 4], 0xDD));
+			}
 		}
 	}
-	return result;
+	TRANSPOSE_EDGES(8)
 }
 
-void destroy_matrix(double **matrix, size_t rows){
-	for(int i = 0; i < rows; i++){
-		free(matrix[i]); // Free rows
-	}
-	free(matrix); // Free array of pointers to rows
+DEFINE_UNIFORM_KERNEL(sse2, LINALG_TARGET_SSE2, __m128i, __m128d, 2,
+		_mm_set1_epi64x, _mm_set_epi64x(1, 0), _mm_setzero_si128,
+		_mm_mul_epu32, _mm_add_epi64, _mm_and_si128, _mm_or_si128,
+		_mm_xor_si128, _mm_srli_epi64, _mm_slli_epi64, _mm_castsi128_pd,
+		_mm_set1_pd, _mm_sub_pd, sse2_store2)
+
+DEFINE_UNIFORM_KERNEL(avx2, LINALG_TARGET_AVX2, __m256i, __m256d, 4,
+		_mm256_set1_epi64x, _mm256_set_epi64x(3, 2, 1, 0),
+		_mm256_setzero_si256, _mm256_mul_epu32, _mm256_add_epi64,
+		_mm256_and_si256, _mm256_or_si256, _mm256_xor_si256,
+		_mm256_srli_epi64, _mm256_slli_epi64, _mm256_castsi256_pd,
+		_mm256_set1_pd, _mm256_sub_pd, avx2_store2)
+
+DEFINE_UNIFORM_KERNEL(avx512, LINALG_TARGET_AVX512, __m512i, __m512d, 8,
+		_mm512_set1_epi64, _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+		_mm512_setzero_si512, _mm512_mul_epu32, _mm512_add_epi64,
+		_mm512_and_si512, _mm512_or_si512, _mm512_xor_si512,
+		_mm512_srli_epi64, _mm512_slli_epi64, _mm512_castsi512_pd,
+		_mm512_set1_pd, _mm512_sub_pd, avx512_store2)
+
+#endif // LINALG_X86
+
+/*
+ * Elementwise exp, log, sin, cos, tanh, sigmoid and pow, one
+ * implementation for every instruction set. The kernels are written
+ * against a small family of vector operations named by OPS (OPS##_ADD,
+ * OPS##_LT, OPS##_SELECT, ...); the portable kernels use the one-lane
+ * MATH_SCALAR family. Only arithmetic, bit operations and selects are
+ * used, so there are no per-lane branches.
+ *
+ *   exp      x = k ln2 + r, |r| <= ln2/2 (Cody-Waite), e^r from its
+ *            Taylor series to r^13; 2^k is applied in two halves so
+ *            that overflow and subnormal results come out right
+ *   log      x = 2^e m, m in [sqrt(1/2), sqrt(2)), log m = 2 atanh(s)
+ *            with s = (m - 1)/(m + 1) and the fdlibm polynomial; the
+ *            result is formed as hi + lo, which pow uses
+ *   sin/cos  x = k pi/2 + r with pi/2 in 33-bit parts, so each product
+ *            is exact for |k| < 2^20, and fdlibm's polynomials on
+ *            [-pi/4, pi/4]; lanes with |x| >= MATH_TRIG_MAX go to libm
+ *   tanh     expm1(2|x|) / (expm1(2|x|) + 2), with the sign of x
+ *   sigmoid  1/(1 + e^-|x|), times e^-|x| for x < 0
+ *   pow      exp(p log|x|) with the log and the product carried in two
+ *            doubles; needs FMA, so SSE2 and generic use libm
+ */
+#define MATH_ROUND 0x1.8p52 // (x + MATH_ROUND) - MATH_ROUND rounds |x| < 2^51
+#define MATH_ROUND_LOW ((int64_t)1 << 51) // low 52 bits of MATH_ROUND
+#define MATH_ONE_BITS 0x3FF0000000000000ll
+#define MATH_TWO52_BITS 0x4330000000000000ll
+#define MATH_MANTISSA_BITS 0x000FFFFFFFFFFFFFll
+#define MATH_EXP_MAX 710.0   // e^x overflows above
+#define MATH_EXP_MIN -746.0  // and underflows to 0 below
+#define MATH_LOG2E 1.4426950408889634
+#define MATH_LN2_HI 6.93147180369123816490e-01 // 32 bits: k*MATH_LN2_HI is exact
+#define MATH_LN2_LO 1.90821492927058770002e-10
+#define MATH_TWO_OVER_PI 0.6366197723675814
+#define MATH_PIO2_1  1.57079632673412561417e+00 // pi/2 = PIO2_1 + PIO2_2 + ...
+#define MATH_PIO2_2  6.07710050630396597660e-11
+#define MATH_PIO2_3  2.02226624871116645580e-21
+#define MATH_PIO2_3T 8.47842766036889956997e-32
+#define MATH_TRIG_MAX 1e6
+#define MATH_TANH_MAX 20.0 // tanh rounds to +-1 above
+
+static inline uint64_t math_bits(double x){
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
 }
 
-void scale_matrix_by_factor(double** mat, double factor, 
-		size_t rows, size_t cols){
-	for(int i = 0; i < rows; i++){
-		for(int j = 0; j < cols; j++){
-			mat[i][j] *= factor;
-		}
+static inline double math_double(uint64_t bits){
+	double x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+// Lanes of a block whose argument is too large for the vector reduction
+static void math_trig_fallback(double* res, const double* x, size_t n,
+		double (*f)(double)){
+	for(size_t i = 0; i < n; i++){
+		if(!(fabs(x[i]) < MATH_TRIG_MAX)) res[i] = f(x[i]);
 	}
 }
 
-void add_scalar_to_matrix(double** mat, double scalar, 
-		size_t rows, size_t cols){
-	for(int i = 0; i < rows; i++){
-		for(int j = 0; j < cols; j++){
-			mat[i][j] += scalar;
-		}
+static void math_pow_libm(double* res, const double* x, size_t n, double p){
+	for(size_t i = 0; i < n; i++) res[i] = pow(x[i], p);
+}
+
+// res[0 .. n) = f(x[0 .. n)) one vector at a time; the tail goes
+// through a zero-padded vector so that it is computed the same way.
+#define DEFINE_MATH_MAP(name, isa, TARGET, OPS) \
+TARGET static void math_##name##_##isa(double* res, const double* x, \
+		size_t n){ \
+	size_t i = 0; \
+	for(; i + OPS##_W <= n; i += OPS##_W) math_##name##_block_##isa(res + i, x + i); \
+	if(i < n){ \
+		double tail[OPS##_W] = {0}; \
+		memcpy(tail, x + i, (n - i) * sizeof(double)); \
+		math_##name##_block_##isa(tail, tail); \
+		memcpy(res + i, tail, (n - i) * sizeof(double)); \
+	} \
+}
+
+#define DEFINE_MATH_KERNELS(isa, TARGET, OPS) \
+TARGET static inline OPS##_VEC math_abs_##isa(OPS##_VEC x){ \
+	return OPS##_CAST_D(OPS##_AND_I(OPS##_CAST_I(x), OPS##_SET1_I(INT64_MAX))); \
+} \
+/* 2^k for integral k in [-1022, 1023] */ \
+TARGET static inline OPS##_VEC math_pow2_##isa(OPS##_VEC k){ \
+	OPS##_VI bits = OPS##_CAST_I(OPS##_ADD(k, OPS##_SET1(MATH_ROUND))); \
+	bits = OPS##_ADD_I(bits, OPS##_SET1_I(1023 - MATH_ROUND_LOW)); \
+	return OPS##_CAST_D(OPS##_SLLI(bits, 52)); \
+} \
+/* a + b = sum + *err exactly */ \
+TARGET static inline OPS##_VEC math_two_sum_##isa(OPS##_VEC a, OPS##_VEC b, \
+		OPS##_VEC* err){ \
+	OPS##_VEC sum = OPS##_ADD(a, b), bb = OPS##_SUB(sum, a); \
+	*err = OPS##_ADD(OPS##_SUB(a, OPS##_SUB(sum, bb)), OPS##_SUB(b, bb)); \
+	return sum; \
+} \
+/* x + lo = k ln2 + r; returns e^r - 1 and the integral k */ \
+TARGET static inline OPS##_VEC math_expm1_reduced_##isa(OPS##_VEC x, \
+		OPS##_VEC lo, OPS##_VEC* k){ \
+	*k = OPS##_SUB(OPS##_FMADD(x, OPS##_SET1(MATH_LOG2E), \
+			OPS##_SET1(MATH_ROUND)), OPS##_SET1(MATH_ROUND)); \
+	OPS##_VEC r = OPS##_FMADD(*k, OPS##_SET1(-MATH_LN2_HI), x); \
+	r = OPS##_ADD(OPS##_FMADD(*k, OPS##_SET1(-MATH_LN2_LO), r), lo); \
+	OPS##_VEC p = OPS##_SET1(1.6059043836821613e-10); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(2.08767569878681e-09)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(2.505210838544172e-08)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(2.755731922398589e-07)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(2.7557319223985893e-06)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(2.48015873015873e-05)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.0001984126984126984)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.001388888888888889)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.008333333333333333)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.041666666666666664)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.16666666666666666)); \
+	p = OPS##_FMADD(p, r, OPS##_SET1(0.5)); \
+	return OPS##_FMADD(OPS##_MUL(r, r), p, r); \
+} \
+/* e^(x + lo), |lo| tiny next to x */ \
+TARGET static inline OPS##_VEC math_exp_vec_##isa(OPS##_VEC x, OPS##_VEC lo){ \
+	x = OPS##_MAX(OPS##_SET1(MATH_EXP_MIN), OPS##_MIN(OPS##_SET1(MATH_EXP_MAX), x)); \
+	OPS##_VEC k, q = math_expm1_reduced_##isa(x, lo, &k); \
+	OPS##_VEC k1 = OPS##_SUB(OPS##_FMADD(k, OPS##_SET1(0.5), \
+			OPS##_SET1(MATH_ROUND)), OPS##_SET1(MATH_ROUND)); \
+	return OPS##_MUL(OPS##_MUL(OPS##_ADD(q, OPS##_SET1(1.0)), \
+			math_pow2_##isa(k1)), math_pow2_##isa(OPS##_SUB(k, k1))); \
+} \
+/* x = 2^e m, m in [sqrt(1/2), sqrt(2)), for finite x > 0 (subnormals \
+   included); returns m */ \
+TARGET static inline OPS##_VEC math_log_split_##isa(OPS##_VEC x, \
+		OPS##_VEC* exponent){ \
+	OPS##_MASK tiny = OPS##_LT(x, OPS##_SET1(DBL_MIN)); \
+	x = OPS##_SELECT(tiny, OPS##_MUL(x, OPS##_SET1(0x1p52)), x); \
+	OPS##_VI bits = OPS##_CAST_I(x); \
+	OPS##_VEC m = OPS##_CAST_D(OPS##_OR_I(OPS##_AND_I(bits, \
+			OPS##_SET1_I(MATH_MANTISSA_BITS)), OPS##_SET1_I(MATH_ONE_BITS))); \
+	OPS##_VEC e = OPS##_SUB(OPS##_CAST_D(OPS##_OR_I(OPS##_SRLI(bits, 52), \
+			OPS##_SET1_I(MATH_TWO52_BITS))), OPS##_SET1(0x1p52 + 1023)); \
+	OPS##_MASK big = OPS##_LT(OPS##_SET1(M_SQRT2), m); \
+	m = OPS##_SELECT(big, OPS##_MUL(m, OPS##_SET1(0.5)), m); \
+	e = OPS##_ADD(e, OPS##_SELECT(big, OPS##_SET1(1.0), OPS##_SET1(0.0))); \
+	*exponent = OPS##_SUB(e, OPS##_SELECT(tiny, OPS##_SET1(52.0), \
+			OPS##_SET1(0.0))); \
+	return m; \
+} \
+/* s = f/u and its rounding error *s_lo, f = m - 1 and u = 2 + f, so \
+   that log m = 2 atanh(s + s_lo) */ \
+TARGET static inline OPS##_VEC math_log_ratio_##isa(OPS##_VEC m, \
+		OPS##_VEC* s_lo){ \
+	OPS##_VEC f = OPS##_SUB(m, OPS##_SET1(1.0)); \
+	OPS##_VEC u_lo, u = math_two_sum_##isa(OPS##_SET1(2.0), f, &u_lo); \
+	OPS##_VEC s = OPS##_DIV(f, u); \
+	OPS##_VEC lo = OPS##_FMADD(OPS##_SUB(OPS##_SET1(0.0), s), u, f); \
+	*s_lo = OPS##_DIV(OPS##_SUB(lo, OPS##_MUL(s, u_lo)), u); \
+	return s; \
+} \
+/* log x = hi + *lo for finite x > 0 (subnormals included) */ \
+TARGET static inline OPS##_VEC math_log_reduced_##isa(OPS##_VEC x, \
+		OPS##_VEC* lo){ \
+	OPS##_VEC e, m = math_log_split_##isa(x, &e); \
+	OPS##_VEC s_lo, s = math_log_ratio_##isa(m, &s_lo); \
+	OPS##_VEC z = OPS##_MUL(s, s); \
+	OPS##_VEC r = OPS##_SET1(1.479819860511658591e-01); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(1.531383769920937332e-01)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(1.818357216161805012e-01)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.222219843214978396e-01)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.857142874366239149e-01)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(3.999999999940941908e-01)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(6.666666666666735130e-01)); \
+	/* log x = e ln2 + 2s + (2 s_lo + s z r) */ \
+	OPS##_VEC t = OPS##_FMADD(OPS##_MUL(s, z), r, OPS##_ADD(s_lo, s_lo)); \
+	OPS##_VEC err, hi = math_two_sum_##isa(OPS##_MUL(e, \
+			OPS##_SET1(MATH_LN2_HI)), OPS##_ADD(s, s), &err); \
+	t = OPS##_FMADD(e, OPS##_SET1(MATH_LN2_LO), OPS##_ADD(t, err)); \
+	OPS##_VEC sum = OPS##_ADD(hi, t); \
+	*lo = OPS##_SUB(t, OPS##_SUB(sum, hi)); \
+	return sum; \
+} \
+/* log x given y = math_log_reduced(x): -inf at 0, NaN below, x at inf and NaN */ \
+TARGET static inline OPS##_VEC math_log_special_##isa(OPS##_VEC x, OPS##_VEC y){ \
+	OPS##_VEC zero = OPS##_SET1(0.0); \
+	y = OPS##_SELECT(OPS##_LT(zero, x), y, OPS##_SELECT(OPS##_LT(x, zero), \
+			OPS##_SET1(NAN), OPS##_SET1(-INFINITY))); \
+	return OPS##_SELECT(OPS##_LT(x, OPS##_SET1(INFINITY)), y, x); \
+} \
+/* sin x, or cos x with quadrant 1 (cos x = sin(x + pi/2)) */ \
+TARGET static inline OPS##_VEC math_sin_vec_##isa(OPS##_VEC x, int64_t quadrant){ \
+	OPS##_VEC k = OPS##_SUB(OPS##_FMADD(x, OPS##_SET1(MATH_TWO_OVER_PI), \
+			OPS##_SET1(MATH_ROUND)), OPS##_SET1(MATH_ROUND)); \
+	/* r + r_lo = x - k pi/2; every k*PIO2_i but the last is exact */ \
+	OPS##_VEC e1, e2; \
+	OPS##_VEC r = OPS##_FMADD(k, OPS##_SET1(-MATH_PIO2_1), x); \
+	r = math_two_sum_##isa(r, OPS##_MUL(k, OPS##_SET1(-MATH_PIO2_2)), &e1); \
+	r = math_two_sum_##isa(r, OPS##_MUL(k, OPS##_SET1(-MATH_PIO2_3)), &e2); \
+	OPS##_VEC lo = OPS##_FMADD(k, OPS##_SET1(-MATH_PIO2_3T), OPS##_ADD(e1, e2)); \
+	OPS##_VEC hi = OPS##_ADD(r, lo); \
+	OPS##_VEC r_lo = OPS##_SUB(lo, OPS##_SUB(hi, r)); \
+	r = hi; \
+	OPS##_VEC z = OPS##_MUL(r, r); \
+	OPS##_VEC ps = OPS##_SET1(1.58969099521155010221e-10); \
+	ps = OPS##_FMADD(ps, z, OPS##_SET1(-2.50507602534068634195e-08)); \
+	ps = OPS##_FMADD(ps, z, OPS##_SET1(2.75573137070700676789e-06)); \
+	ps = OPS##_FMADD(ps, z, OPS##_SET1(-1.98412698298579493134e-04)); \
+	ps = OPS##_FMADD(ps, z, OPS##_SET1(8.33333333332248946124e-03)); \
+	ps = OPS##_FMADD(ps, z, OPS##_SET1(-1.66666666666666324348e-01)); \
+	OPS##_VEC sin_r = OPS##_ADD(r, OPS##_FMADD(OPS##_MUL(r, z), ps, r_lo)); \
+	OPS##_VEC pc = OPS##_SET1(-1.13596475577881948265e-11); \
+	pc = OPS##_FMADD(pc, z, OPS##_SET1(2.08757232129817482790e-09)); \
+	pc = OPS##_FMADD(pc, z, OPS##_SET1(-2.75573143513906633035e-07)); \
+	pc = OPS##_FMADD(pc, z, OPS##_SET1(2.48015872894767294178e-05)); \
+	pc = OPS##_FMADD(pc, z, OPS##_SET1(-1.38888888888741095749e-03)); \
+	pc = OPS##_FMADD(pc, z, OPS##_SET1(4.16666666666666019037e-02)); \
+	OPS##_VEC hz = OPS##_MUL(z, OPS##_SET1(0.5)); \
+	OPS##_VEC w = OPS##_SUB(OPS##_SET1(1.0), hz); \
+	OPS##_VEC cos_r = OPS##_ADD(w, OPS##_ADD(OPS##_SUB(OPS##_SUB( \
+			OPS##_SET1(1.0), w), hz), OPS##_SUB(OPS##_MUL(OPS##_MUL(z, z), pc), \
+			OPS##_MUL(r, r_lo)))); \
+	/* quadrant q = k mod 4 picks sin r, cos r, -sin r, -cos r */ \
+	OPS##_VI q = OPS##_ADD_I(OPS##_CAST_I(OPS##_ADD(k, OPS##_SET1(MATH_ROUND))), \
+			OPS##_SET1_I(quadrant)); \
+	OPS##_MASK odd = OPS##_LT(OPS##_CAST_D(OPS##_OR_I(OPS##_SLLI(q, 63), \
+			OPS##_SET1_I(MATH_ONE_BITS))), OPS##_SET1(0.0)); \
+	OPS##_VEC y = OPS##_SELECT(odd, cos_r, sin_r); \
+	return OPS##_CAST_D(OPS##_XOR_I(OPS##_CAST_I(y), OPS##_SLLI(OPS##_AND_I(q, \
+			OPS##_SET1_I(2)), 62))); \
+} \
+TARGET static inline OPS##_VEC math_tanh_vec_##isa(OPS##_VEC x){ \
+	OPS##_VI sign = OPS##_AND_I(OPS##_CAST_I(x), OPS##_SET1_I(INT64_MIN)); \
+	OPS##_VEC a = OPS##_MIN(OPS##_SET1(MATH_TANH_MAX), math_abs_##isa(x)); \
+	OPS##_VEC k, q = math_expm1_reduced_##isa(OPS##_ADD(a, a), \
+			OPS##_SET1(0.0), &k); \
+	OPS##_VEC scale = math_pow2_##isa(k); \
+	OPS##_VEC em = OPS##_FMADD(scale, q, OPS##_SUB(scale, OPS##_SET1(1.0))); \
+	OPS##_VEC t = OPS##_DIV(em, OPS##_ADD(em, OPS##_SET1(2.0))); \
+	return OPS##_CAST_D(OPS##_OR_I(OPS##_CAST_I(t), sign)); \
+} \
+TARGET static inline OPS##_VEC math_sigmoid_vec_##isa(OPS##_VEC x){ \
+	OPS##_VEC e = math_exp_vec_##isa(OPS##_SUB(OPS##_SET1(0.0), \
+			math_abs_##isa(x)), OPS##_SET1(0.0)); \
+	OPS##_VEC s = OPS##_DIV(OPS##_SET1(1.0), OPS##_ADD(OPS##_SET1(1.0), e)); \
+	return OPS##_SELECT(OPS##_LT(x, OPS##_SET1(0.0)), OPS##_MUL(e, s), s); \
+} \
+TARGET static inline void math_exp_block_##isa(double* res, const double* x){ \
+	OPS##_STORE(res, math_exp_vec_##isa(OPS##_LOAD(x), OPS##_SET1(0.0))); \
+} \
+TARGET static inline void math_log_block_##isa(double* res, const double* x){ \
+	OPS##_VEC v = OPS##_LOAD(x), lo; \
+	OPS##_STORE(res, math_log_special_##isa(v, math_log_reduced_##isa(v, &lo))); \
+} \
+TARGET static inline void math_sin_block_##isa(double* res, const double* x){ \
+	OPS##_VEC v = OPS##_LOAD(x); \
+	OPS##_STORE(res, math_sin_vec_##isa(v, 0)); \
+	if(!(OPS##_HMAX(math_abs_##isa(v)) < MATH_TRIG_MAX)){ \
+		double lanes[OPS##_W]; \
+		OPS##_STORE(lanes, v); \
+		math_trig_fallback(res, lanes, OPS##_W, sin); \
+	} \
+} \
+TARGET static inline void math_cos_block_##isa(double* res, const double* x){ \
+	OPS##_VEC v = OPS##_LOAD(x); \
+	OPS##_STORE(res, math_sin_vec_##isa(v, 1)); \
+	if(!(OPS##_HMAX(math_abs_##isa(v)) < MATH_TRIG_MAX)){ \
+		double lanes[OPS##_W]; \
+		OPS##_STORE(lanes, v); \
+		math_trig_fallback(res, lanes, OPS##_W, cos); \
+	} \
+} \
+TARGET static inline void math_tanh_block_##isa(double* res, const double* x){ \
+	OPS##_STORE(res, math_tanh_vec_##isa(OPS##_LOAD(x))); \
+} \
+TARGET static inline void math_sigmoid_block_##isa(double* res, const double* x){ \
+	OPS##_STORE(res, math_sigmoid_vec_##isa(OPS##_LOAD(x))); \
+} \
+DEFINE_MATH_MAP(exp, isa, TARGET, OPS) \
+DEFINE_MATH_MAP(log, isa, TARGET, OPS) \
+DEFINE_MATH_MAP(sin, isa, TARGET, OPS) \
+DEFINE_MATH_MAP(cos, isa, TARGET, OPS) \
+DEFINE_MATH_MAP(tanh, isa, TARGET, OPS) \
+DEFINE_MATH_MAP(sigmoid, isa, TARGET, OPS)
+
+/*
+ * x^p for a scalar p: exp(y_hi + y_lo) with y_hi + y_lo = p (hi + lo)
+ * and log|x| = hi + lo. Any relative error in the log is multiplied by
+ * |y| (up to 745) in the result, so pow has its own log, good to about
+ * 2^-66 rather than the 2^-60 of math_log_reduced: the Taylor series of
+ * 2 atanh(s) to s^25, with the s and s^3 terms carried in two doubles.
+ * Integral p takes |x| and, if odd, gives the result the sign of x;
+ * otherwise x < 0 gives NaN through the log. The exact products need
+ * FMA.
+ */
+#define MATH_TWO_THIRDS_HI 6.66666666666666629659e-01 // 2/3 = HI + LO
+#define MATH_TWO_THIRDS_LO 3.70074341541718826408e-17
+#define DEFINE_MATH_POW(isa, TARGET, OPS) \
+/* log x = hi + *lo for finite x > 0 */ \
+TARGET static inline OPS##_VEC math_log_accurate_##isa(OPS##_VEC x, \
+		OPS##_VEC* lo){ \
+	OPS##_VEC e, m = math_log_split_##isa(x, &e); \
+	OPS##_VEC s_lo, s = math_log_ratio_##isa(m, &s_lo); \
+	/* s^3 = s3 + s3_lo and 2 s^3 / 3 = c s3 + t3_lo, c = TWO_THIRDS_HI */ \
+	OPS##_VEC z = OPS##_MUL(s, s); \
+	OPS##_VEC z_lo = OPS##_FMADD(s, s, OPS##_SUB(OPS##_SET1(0.0), z)); \
+	OPS##_VEC s3 = OPS##_MUL(z, s); \
+	OPS##_VEC s3_lo = OPS##_FMADD(z_lo, s, OPS##_FMADD(z, s, \
+			OPS##_SUB(OPS##_SET1(0.0), s3))); \
+	OPS##_VEC c = OPS##_SET1(MATH_TWO_THIRDS_HI); \
+	OPS##_VEC t3_lo = OPS##_FMADD(c, s3_lo, \
+			OPS##_MUL(OPS##_SET1(MATH_TWO_THIRDS_LO), s3)); \
+	/* 2 s^5 (1/5 + z/7 + ... + z^10/25); |z| < 0.0295 */ \
+	OPS##_VEC r = OPS##_SET1(2.0 / 25); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 23)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 21)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 19)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 17)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 15)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 13)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 11)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 9)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 7)); \
+	r = OPS##_FMADD(r, z, OPS##_SET1(2.0 / 5)); \
+	/* small terms: the series tail, s_lo times 2/(1 - s^2), e ln2_lo */ \
+	OPS##_VEC s_lo2 = OPS##_ADD(s_lo, s_lo); \
+	OPS##_VEC t = OPS##_FMADD(OPS##_MUL(s3, z), r, OPS##_FMADD(z, \
+			OPS##_FMADD(z, s_lo2, s_lo2), s_lo2)); \
+	t = OPS##_FMADD(e, OPS##_SET1(MATH_LN2_LO), OPS##_ADD(t, t3_lo)); \
+	/* e ln2_hi + 2s exactly, then + c s3 through FMAs: c s3 is at most \
+	   1% of the sum, so hi1 - hi is exact. No rounded product is added, \
+	   so the result does not depend on FP contraction. */ \
+	OPS##_VEC err1; \
+	OPS##_VEC hi1 = math_two_sum_##isa(OPS##_MUL(e, OPS##_SET1(MATH_LN2_HI)), \
+			OPS##_ADD(s, s), &err1); \
+	OPS##_VEC hi = OPS##_FMADD(c, s3, hi1); \
+	OPS##_VEC err2 = OPS##_FMADD(c, s3, OPS##_SUB(hi1, hi)); \
+	t = OPS##_ADD(t, OPS##_ADD(err1, err2)); \
+	OPS##_VEC sum = OPS##_ADD(hi, t); \
+	*lo = OPS##_SUB(t, OPS##_SUB(sum, hi)); \
+	return sum; \
+} \
+TARGET static inline OPS##_VEC math_pow_vec_##isa(OPS##_VEC x, OPS##_VEC p, \
+		OPS##_VI abs_mask, OPS##_VI sign_mask){ \
+	OPS##_VI bits = OPS##_CAST_I(x); \
+	OPS##_VEC a = OPS##_CAST_D(OPS##_AND_I(bits, abs_mask)); \
+	a = OPS##_SELECT(OPS##_LT(a, OPS##_SET1(-DBL_MAX)), \
+			OPS##_SET1(INFINITY), a); /* (-inf)^p = inf^p */ \
+	OPS##_VEC lo, hi = math_log_special_##isa(a, math_log_accurate_##isa(a, &lo)); \
+	OPS##_VEC y_hi = OPS##_MUL(p, hi); \
+	OPS##_VEC y_lo = OPS##_FMADD(p, lo, OPS##_FMADD(p, hi, \
+			OPS##_SUB(OPS##_SET1(0.0), y_hi))); \
+	/* beyond 2^10 the result is 0 or inf and y_lo meaningless */ \
+	y_lo = OPS##_SELECT(OPS##_LT(math_abs_##isa(y_hi), OPS##_SET1(0x1p10)), \
+			y_lo, OPS##_SET1(0.0)); \
+	OPS##_VEC y = math_exp_vec_##isa(y_hi, y_lo); \
+	return OPS##_CAST_D(OPS##_OR_I(OPS##_CAST_I(y), OPS##_AND_I(bits, sign_mask))); \
+} \
+TARGET static void math_pow_##isa(double* res, const double* x, size_t n, \
+		double p){ \
+	int integral = p == nearbyint(p); \
+	int odd = integral && fabs(p) < 0x1p53 && fmod(p, 2.0) != 0.0; \
+	OPS##_VEC vp = OPS##_SET1(p); \
+	OPS##_VI abs_mask = OPS##_SET1_I(integral ? INT64_MAX : -1); \
+	OPS##_VI sign_mask = OPS##_SET1_I(odd ? INT64_MIN : 0); \
+	size_t i = 0; \
+	for(; i + OPS##_W <= n; i += OPS##_W){ \
+		OPS##_STORE(res + i, math_pow_vec_##isa(OPS##_LOAD(x + i), vp, \
+				abs_mask, sign_mask)); \
+	} \
+	if(i < n){ \
+		double tail[OPS##_W] = {0}; \
+		memcpy(tail, x + i, (n - i) * sizeof(double)); \
+		OPS##_STORE(tail, math_pow_vec_##isa(OPS##_LOAD(tail), vp, \
+				abs_mask, sign_mask)); \
+		memcpy(res + i, tail, (n - i) * sizeof(double)); \
+	} \
+}
+
+#define MATH_SCALAR_VEC double
+#define MATH_SCALAR_VI uint64_t
+#define MATH_SCALAR_MASK int
+#define MATH_SCALAR_W 1
+#define MATH_SCALAR_LOAD SCALAR_LOAD
+#define MATH_SCALAR_STORE SCALAR_STORE
+#define MATH_SCALAR_SET1 SCALAR_ID
+#define MATH_SCALAR_SET1_I(x) ((uint64_t)(x))
+#define MATH_SCALAR_ADD SCALAR_ADD
+#define MATH_SCALAR_SUB SCALAR_SUB
+#define MATH_SCALAR_MUL SCALAR_MUL
+#define MATH_SCALAR_DIV SCALAR_DIV
+#define MATH_SCALAR_FMADD SCALAR_FMADD
+#define MATH_SCALAR_MIN SCALAR_MIN
+#define MATH_SCALAR_MAX SCALAR_MAX
+#define MATH_SCALAR_HMAX SCALAR_ID
+#define MATH_SCALAR_CAST_I math_bits
+#define MATH_SCALAR_CAST_D math_double
+#define MATH_SCALAR_AND_I(a, b) ((a) & (b))
+#define MATH_SCALAR_OR_I(a, b) ((a) | (b))
+#define MATH_SCALAR_XOR_I(a, b) ((a) ^ (b))
+#define MATH_SCALAR_ADD_I(a, b) ((a) + (b))
+#define MATH_SCALAR_SLLI(a, n) ((a) << (n))
+#define MATH_SCALAR_SRLI(a, n) ((a) >> (n))
+#define MATH_SCALAR_LT(a, b) ((a) < (b))
+#define MATH_SCALAR_SELECT(m, a, b) ((m) ? (a) : (b))
+
+DEFINE_MATH_KERNELS(generic, , MATH_SCALAR)
+
+#ifdef LINALG_X86
+#define MATH_SSE2_VEC __m128d
+#define MATH_SSE2_VI __m128i
+#define MATH_SSE2_MASK __m128d
+#define MATH_SSE2_W 2
+#define MATH_SSE2_LOAD _mm_loadu_pd
+#define MATH_SSE2_STORE _mm_storeu_pd
+#define MATH_SSE2_SET1 _mm_set1_pd
+#define MATH_SSE2_SET1_I _mm_set1_epi64x
+#define MATH_SSE2_ADD _mm_add_pd
+#define MATH_SSE2_SUB _mm_sub_pd
+#define MATH_SSE2_MUL _mm_mul_pd
+#define MATH_SSE2_DIV _mm_div_pd
+#define MATH_SSE2_FMADD SSE2_FMADD
+#define MATH_SSE2_MIN _mm_min_pd
+#define MATH_SSE2_MAX _mm_max_pd
+#define MATH_SSE2_HMAX sse2_hmax
+#define MATH_SSE2_CAST_I _mm_castpd_si128
+#define MATH_SSE2_CAST_D _mm_castsi128_pd
+#define MATH_SSE2_AND_I _mm_and_si128
+#define MATH_SSE2_OR_I _mm_or_si128
+#define MATH_SSE2_XOR_I _mm_xor_si128
+#define MATH_SSE2_ADD_I _mm_add_epi64
+#define MATH_SSE2_SLLI _mm_slli_epi64
+#define MATH_SSE2_SRLI _mm_srli_epi64
+#define MATH_SSE2_LT _mm_cmplt_pd
+#define MATH_SSE2_SELECT(m, a, b) _mm_or_pd(_mm_and_pd((m), (a)), \
+		_mm_andnot_pd((m), (b)))
+
+#define MATH_AVX2_VEC __m256d
+#define MATH_AVX2_VI __m256i
+#define MATH_AVX2_MASK __m256d
+#define MATH_AVX2_W 4
+#define MATH_AVX2_LOAD _mm256_loadu_pd
+#define MATH_AVX2_STORE _mm256_storeu_pd
+#define MATH_AVX2_SET1 _mm256_set1_pd
+#define MATH_AVX2_SET1_I _mm256_set1_epi64x
+#define MATH_AVX2_ADD _mm256_add_pd
+#define MATH_AVX2_SUB _mm256_sub_pd
+#define MATH_AVX2_MUL _mm256_mul_pd
+#define MATH_AVX2_DIV _mm256_div_pd
+#define MATH_AVX2_FMADD _mm256_fmadd_pd
+#define MATH_AVX2_MIN _mm256_min_pd
+#define MATH_AVX2_MAX _mm256_max_pd
+#define MATH_AVX2_HMAX avx2_hmax
+#define MATH_AVX2_CAST_I _mm256_castpd_si256
+#define MATH_AVX2_CAST_D _mm256_castsi256_pd
+#define MATH_AVX2_AND_I _mm256_and_si256
+#define MATH_AVX2_OR_I _mm256_or_si256
+#define MATH_AVX2_XOR_I _mm256_xor_si256
+#define MATH_AVX2_ADD_I _mm256_add_epi64
+#define MATH_AVX2_SLLI _mm256_slli_epi64
+#define MATH_AVX2_SRLI _mm256_srli_epi64
+#define MATH_AVX2_LT(a, b) _mm256_cmp_pd((a), (b), _CMP_LT_OQ)
+#define MATH_AVX2_SELECT(m, a, b) _mm256_blendv_pd((b), (a), (m))
+
+#define MATH_AVX512_VEC __m512d
+#define MATH_AVX512_VI __m512i
+#define MATH_AVX512_MASK __mmask8
+#define MATH_AVX512_W 8
+#define MATH_AVX512_LOAD _mm512_loadu_pd
+#define MATH_AVX512_STORE _mm512_storeu_pd
+#define MATH_AVX512_SET1 _mm512_set1_pd
+#define MATH_AVX512_SET1_I _mm512_set1_epi64
+#define MATH_AVX512_ADD _mm512_add_pd
+#define MATH_AVX512_SUB _mm512_sub_pd
+#define MATH_AVX512_MUL _mm512_mul_pd
+#define MATH_AVX512_DIV _mm512_div_pd
+#define MATH_AVX512_FMADD _mm512_fmadd_pd
+#define MATH_AVX512_MIN _mm512_min_pd
+#define MATH_AVX512_MAX _mm512_max_pd
+#define MATH_AVX512_HMAX _mm512_reduce_max_pd
+#define MATH_AVX512_CAST_I _mm512_castpd_si512
+#define MATH_AVX512_CAST_D _mm512_castsi512_pd
+#define MATH_AVX512_AND_I _mm512_and_si512
+#define MATH_AVX512_OR_I _mm512_or_si512
+#define MATH_AVX512_XOR_I _mm512_xor_si512
+#define MATH_AVX512_ADD_I _mm512_add_epi64
+#define MATH_AVX512_SLLI _mm512_slli_epi64
+#define MATH_AVX512_SRLI _mm512_srli_epi64
+#define MATH_AVX512_LT(a, b) _mm512_cmp_pd_mask((a), (b), _CMP_LT_OQ)
+#define MATH_AVX512_SELECT(m, a, b) _mm512_mask_blend_pd((m), (b), (a))
+
+DEFINE_MATH_KERNELS(sse2, LINALG_TARGET_SSE2, MATH_SSE2)
+DEFINE_MATH_KERNELS(avx2, LINALG_TARGET_AVX2, MATH_AVX2)
+DEFINE_MATH_KERNELS(avx512, LINALG_TARGET_AVX512, MATH_AVX512)
+DEFINE_MATH_POW(avx2, LINALG_TARGET_AVX2, MATH_AVX2)
+DEFINE_MATH_POW(avx512, LINALG_TARGET_AVX512, MATH_AVX512)
+#endif // LINALG_X86
+
+#define VECTOR_KERNEL_TABLE(isa) .dot = dot_##isa, .sum = sum_##isa, \
+	.sum_of_squares = sum_of_squares_##isa, \
+	.squared_distance = squared_distance_##isa, .dot4 = dot4_##isa, \
+	.add = add_##isa, .sub = sub_##isa, .mul = mul_##isa, .div = div_##isa, \
+	.min = min_##isa, .max = max_##isa, .sqrt = sqrt_##isa, \
+	.scale = scale_##isa, .add_scalar = add_scalar_##isa, .axpy = axpy_##isa, \
+	.moments = moments_##isa, .sum_squared_deviation = sum_squared_deviation_##isa
+#define VECTOR_KERNELS(isa) (vector_kernels){VECTOR_KERNEL_TABLE(isa), \
+	.sum_compensated = sum_compensated_##isa, \
+	.sum_reproducible = sum_reproducible_##isa, \
+	.uniform = uniform_##isa, .transpose = transpose_##isa}
+#define VECTOR_KERNELS_F32(isa) (vector_kernels_f32){VECTOR_KERNEL_TABLE(isa##_f32)}
+#define HALF_KERNELS(format, isa, conversions) (half_kernels){ \
+	dot_##format##_##isa, sum_of_squares_##format##_##isa, \
+	squared_distance_##format##_##isa, format##_to_f32_##conversions, \
+	f32_to_##format##_##conversions}
+#define MATH_KERNELS(isa, pow_isa) (math_kernels){math_exp_##isa, \
+	math_log_##isa, math_sin_##isa, math_cos_##isa, math_tanh_##isa, \
+	math_sigmoid_##isa, pow_isa}
+
+// Best instruction set supported by the host
+static linalg_isa host_isa(void){
+#ifdef LINALG_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return LINALG_ISA_AVX512;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+			&& __builtin_cpu_supports("f16c")){
+		return LINALG_ISA_AVX2;
 	}
+	if(__builtin_cpu_supports("sse2")) return LINALG_ISA_SSE2;
+#endif
+	return LINALG_ISA_GENERIC;
 }
 
-void elementwise_matrix_addition(double **result, double **mat1,
-		double **mat2, size_t rows, size_t cols){
-	for(int i = 0; i < rows; i++){
-		for(int j = 0; j < cols; j++){
-			result[i][j] = mat1[i][j] + mat2[i][j];
-		}
+int linalg_set_isa(linalg_isa isa){
+	if(isa < LINALG_ISA_GENERIC || isa > host_isa()) return -1;
+	gemm_cfg = (gemm_config){gemm_kernel_generic, 4, 4, 128, 256, 2048};
+	gemm_cfg_f32 = (gemm_config_f32){gemm_kernel_generic_f32, 4, 4, 128, 256, 2048};
+	vec_kernels = VECTOR_KERNELS(generic);
+	vec_kernels_f32 = VECTOR_KERNELS_F32(generic);
+	f16_kernels = HALF_KERNELS(f16, generic, generic);
+	bf16_kernels = HALF_KERNELS(bf16, generic, generic);
+	vec_math = MATH_KERNELS(generic, math_pow_libm);
+#ifdef LINALG_X86
+	switch(isa){
+	case LINALG_ISA_AVX512:
+		gemm_cfg = (gemm_config){gemm_kernel_avx512, 8, 16, 128, 320, 3072};
+		gemm_cfg_f32 = (gemm_config_f32){gemm_kernel_avx512_f32, 8, 32, 256, 320, 3072};
+		vec_kernels = VECTOR_KERNELS(avx512);
+		vec_kernels_f32 = VECTOR_KERNELS_F32(avx512);
+		f16_kernels = HALF_KERNELS(f16, avx512, avx512);
+		bf16_kernels = HALF_KERNELS(bf16, avx512, generic);
+		vec_math = MATH_KERNELS(avx512, math_pow_avx512);
+		break;
+	case LINALG_ISA_AVX2:
+		gemm_cfg = (gemm_config){gemm_kernel_avx2, 6, 8, 120, 256, 2048};
+		gemm_cfg_f32 = (gemm_config_f32){gemm_kernel_avx2_f32, 6, 16, 240, 256, 2048};
+		vec_kernels = VECTOR_KERNELS(avx2);
+		vec_kernels_f32 = VECTOR_KERNELS_F32(avx2);
+		f16_kernels = HALF_KERNELS(f16, avx2, avx2);
+		bf16_kernels = HALF_KERNELS(bf16, avx2, generic);
+		vec_math = MATH_KERNELS(avx2, math_pow_avx2);
+		break;
+	case LINALG_ISA_SSE2:
+		vec_kernels = VECTOR_KERNELS(sse2);
+		vec_kernels_f32 = VECTOR_KERNELS_F32(sse2);
+		vec_math = MATH_KERNELS(sse2, math_pow_libm);
+		break;
+	case LINALG_ISA_GENERIC:
+		break;
 	}
+#endif
+	current_isa = isa;
+	return 0;
 }
 
-void elementwise_matrix_multiplication(double **result, double **mat1,
-		double **mat2, size_t rows, size_t cols){
-	for(int i = 0; i < rows; i++){
-		for(int j = 0; j < cols; j++){
-			result[i][j] = mat1[i][j] * mat2[i][j];
+linalg_isa linalg_get_isa(void){
+	return current_isa;
+}
+
+void linalg_set_reduction(linalg_reduction mode){
+	reduction_mode = mode;
+}
+
+linalg_reduction linalg_get_reduction(void){
+	return reduction_mode;
+}
+
+__attribute__((constructor))
+static void linalg_init(void){
+	const char* env_threads = getenv("LINALG_NUM_THREADS");
+	if(env_threads != NULL){
+		linalg_set_num_threads(strtoul(env_threads, NULL, 10));
+	}
+
+	// LINALG_ISA caps the instruction set, e.g. to compare kernels
+	linalg_isa isa = host_isa();
+	const char* env_isa = getenv("LINALG_ISA");
+	if(env_isa != NULL){
+		static const char* names[] = {"generic", "sse2", "avx2", "avx512"};
+		for(int i = LINALG_ISA_GENERIC; i <= LINALG_ISA_AVX512; i++){
+			if(strcmp(env_isa, names[i]) == 0 && i < (int)isa) isa = i;
 		}
 	}
-}
+	linalg_set_isa(isa);
 
-void add_scaled_matrix_to_matrix(double **result, double **mat,
-		double **mat_to_scale, double factor, size_t m, size_t n){
-	for(int i = 0; i < m; i++){
-		for(int j = 0; j < n; j++){
-			result[i][j] = mat[i][j] + factor*mat_to_scale[i][j];
+	const char* env_reduction = getenv("LINALG_REDUCTION");
+	if(env_reduction != NULL){
+		static const char* names[] = {"fast", "pairwise", "compensated",
+			"reproducible"};
+		for(int i = LINALG_REDUCTION_FAST; i <= LINALG_REDUCTION_REPRODUCIBLE; i++){
+			if(strcmp(env_reduction, names[i]) == 0) reduction_mode = i;
 		}
 	}
 }
 
-void matrix_multiplication(double **result, double **mat1, double **mat2,
-		      size_t m, size_t n, size_t p){
 
-	for(int i = 0; i < m; i++){
-		for(int j = 0; j < p; j++){
+/* ---------------------------------------------------
+ * Thread pool. Off by default (one thread); enabled
+ * with linalg_set_num_threads or LINALG_NUM_THREADS.
+ *
+ * Workers are persistent and pinned to one CPU each.
+ * Work is split statically: thread t always gets the
+ * same contiguous range of rows for a given size, so
+ * results are deterministic and, together with the
+ * parallel first touch in matrix_alloc, the rows a
+ * thread works on stay on its own NUMA node.
+ * ------------------------------------------------- */
 
-			result[i][j] = 0;
+// Minimum elements per thread before an elementwise kernel is split
+#define PARALLEL_MIN_ELEMENTS (1 << 15)
 
-			for(int k = 0; k < n; k++){
-				result[i][j] += mat1[i][k] * mat2[k][j];
-			}
+typedef void (*parallel_task)(void* ctx, size_t thread, size_t n_threads);
+
+static struct {
+	pthread_mutex_t region;  // held by the caller for a whole region
+	pthread_mutex_t mutex;
+	pthread_cond_t  start;
+	pthread_cond_t  done;
+	pthread_t*      workers;
+	size_t          n_workers;
+	size_t          n_threads; // requested, including the caller
+	unsigned long   generation;
+	size_t          pending;
+	parallel_task   task;
+	void*           ctx;
+	int             shutdown;
+} pool = {
+	.region = PTHREAD_MUTEX_INITIALIZER,
+	.mutex  = PTHREAD_MUTEX_INITIALIZER,
+	.start  = PTHREAD_COND_INITIALIZER,
+	.done   = PTHREAD_COND_INITIALIZER,
+	.n_threads = 1,
+};
+
+static _Thread_local int in_parallel_region;
+
+typedef struct {
+	size_t index;
+	int cpu; // -1: not pinned
+	unsigned long generation; // last region before the worker started
+} pool_worker_arg;
+
+static void* pool_worker_main(void* arg){
+	pool_worker_arg self = *(pool_worker_arg*)arg;
+	free(arg);
+	if(self.cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(self.cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	in_parallel_region = 1;
+
+	unsigned long seen = self.generation;
+	pthread_mutex_lock(&pool.mutex);
+	for(;;){
+		while(pool.generation == seen && !pool.shutdown){
+			pthread_cond_wait(&pool.start, &pool.mutex);
 		}
+		if(pool.shutdown) break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.mutex);
+
+		pool.task(pool.ctx, self.index, pool.n_workers + 1);
+
+		pthread_mutex_lock(&pool.mutex);
+		if(--pool.pending == 0) pthread_cond_signal(&pool.done);
 	}
+	pthread_mutex_unlock(&pool.mutex);
+	return NULL;
 }
 
-void print_vector(double* a, size_t len){
-	printf("[");
-	for(int ix = 0; ix < len; ix++){
-		if(ix != len - 1){
-        		printf("%f, ", a[ix]);
-		} else {
-        		printf("%f", a[ix]);
-		}
+// Called with pool.region held
+static void pool_stop(void){
+	if(pool.n_workers == 0) return;
+	pthread_mutex_lock(&pool.mutex);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+	for(size_t i = 0; i < pool.n_workers; i++){
+		pthread_join(pool.workers[i], NULL);
 	}
-	printf("]\n");
+	free(pool.workers);
+	pool.workers = NULL;
+	pool.n_workers = 0;
+	pool.shutdown = 0;
 }
 
+// Called with pool.region held
+static void pool_start(void){
+	size_t n = pool.n_threads - 1;
+	pool.workers = malloc(n * sizeof(pthread_t));
+	if(pool.workers == NULL) return;
 
-void print_matrix(double** a, size_t rows, size_t cols){
-	printf("[\n");
-	for(int row_i = 0; row_i < rows; row_i++){
-		print_vector(a[row_i], cols);
+	// Worker t runs on the t-th CPU we are allowed on (the caller is thread 0)
+	cpu_set_t allowed;
+	int pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+		&& (size_t)CPU_COUNT(&allowed) >= pool.n_threads;
+	int cpu = -1;
+	if(pin){
+		do { cpu++; } while(!CPU_ISSET(cpu, &allowed));
 	}
-	printf("]\n");
-}
 
-void print_matrix_to_file(char* filepath, char* header, double** matrix,
-					  	  size_t rows, size_t cols){
-	FILE* file = fopen(filepath, "w");
-	fprintf(file, "%s\n", header);
-	
-	for(int row_i = 0; row_i < rows; row_i++){
-		for(int col_j = 0; col_j < cols; col_j++){
-			if(col_j != cols - 1){
-				fprintf(file, "%.8e, ", matrix[row_i][col_j]);
-			}else{
-				fprintf(file, "%.8e\n", matrix[row_i][col_j]);
-			}
+	for(size_t i = 0; i < n; i++){
+		pool_worker_arg* arg = malloc(sizeof(pool_worker_arg));
+		if(arg == NULL) break;
+		arg->index = i + 1;
+		arg->cpu = -1;
+		arg->generation = pool.generation;
+		if(pin){
+			do { cpu++; } while(!CPU_ISSET(cpu, &allowed));
+			arg->cpu = cpu;
 		}
+		if(pthread_create(&pool.workers[i], NULL, pool_worker_main, arg) != 0){
+			free(arg);
+			break;
+		}
+		pool.n_workers++;
 	}
-	
-	fclose(file);
-	printf("\nSucessfully printed matrix to file: %s\n", filepath);
 }
 
-
-void print_vector_to_file(char* filepath, char* header, double* vector,
-		size_t size){
-	FILE* file = fopen(filepath, "w");
-	fprintf(file, "%s\n", header);
-	for(int index = 0; index < size; index++){
-		fprintf(file, "%.8e\n", vector[index]);
+void linalg_set_num_threads(size_t num_threads){
+	if(num_threads == 0){
+		cpu_set_t allowed;
+		num_threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+			? (size_t)CPU_COUNT(&allowed) : 1;
 	}
+	pthread_mutex_lock(&pool.region);
+	pool_stop();
+	pool.n_threads = num_threads;
+	pthread_mutex_unlock(&pool.region);
+}
 
-	fclose(file);
-	printf("\nSucessfully printed vector to file: %s\n", filepath);
+size_t linalg_get_num_threads(void){
+	return pool.n_threads;
 }
 
-// Helper for print_vectors_as_columns_to_file
-int get_max_value_of_int_vector(int* vector, int len){
-	int max = vector[0];
-	for(int i = 1; i < len; i++){
-		if(vector[i] > max){
-			max = vector[i];
-		}
+// Runs task(ctx, t, n) on n threads, t = 0 being the caller. Falls back to
+// a single thread inside another region or while the pool is busy.
+static void linalg_parallel(parallel_task task, void* ctx){
+	if(pool.n_threads <= 1 || in_parallel_region
+			|| pthread_mutex_trylock(&pool.region) != 0){
+		task(ctx, 0, 1);
+		return;
 	}
-	return max;
+	if(pool.n_workers == 0) pool_start();
+	if(pool.n_workers == 0){
+		pthread_mutex_unlock(&pool.region);
+		task(ctx, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.task = task;
+	pool.ctx = ctx;
+	pool.pending = pool.n_workers;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+
+	in_parallel_region = 1;
+	task(ctx, 0, pool.n_workers + 1);
+	in_parallel_region = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	while(pool.pending > 0){
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+	pthread_mutex_unlock(&pool.region);
 }
 
+// Whether work on n elements is worth splitting across the pool
+static int parallel_worthwhile(size_t n){
+	return pool.n_threads > 1 && n >= 2 * PARALLEL_MIN_ELEMENTS;
+}
 
-void print_vectors_as_columns_to_file(char* filepath, char* header,
-		double** vector_of_vectors, int n_vectors, int* len_vectors){
-	FILE* file = fopen(filepath, "w");
-	fprintf(file, "%s\n", header);
-	
-	int  n_cols   = n_vectors;
-	int* len_cols = len_vectors;
-	int max_rows = get_max_value_of_int_vector(len_cols, n_cols);
-	
-	for(int row_i = 0; row_i < max_rows; row_i++){ //rows
-		for(int col_i = 0; col_i < n_cols; col_i++){  //cols
-			if(col_i != n_cols - 1){
-				if(row_i < len_cols[col_i]){ //within vector_i's length; print
-					fprintf(file, "%.8e, ", vector_of_vectors[col_i][row_i]);
-				} else {// = past vector_i's length and not last column
-					fprintf(file, ", ");
-				}
-			} else { // = element of last column, break line
-				if(row_i < len_cols[col_i]){ //within vector_i's length
-					fprintf(file, "%.8e\n", vector_of_vectors[col_i][row_i]);
-				} else {// = past vector_i's length and last column, break line
-					fprintf(file, "\n");
-				}
-			}
-		}
+// Static split of [0, n) into n_parts ranges whose boundaries are
+// multiples of align; part t gets [*begin, *end).
+static void partition_range(size_t n, size_t t, size_t n_parts, size_t align,
+		size_t* begin, size_t* end){
+	size_t blocks = (n + align - 1) / align;
+	size_t b0 = blocks * t / n_parts;
+	size_t b1 = blocks * (t + 1) / n_parts;
+	*begin = b0 * align < n ? b0 * align : n;
+	*end   = b1 * align < n ? b1 * align : n;
+}
+
+// Barrier for the threads of one region; n_threads is the count the
+// region's task was called with.
+typedef struct {
+	atomic_size_t count;
+	atomic_size_t phase;
+} spin_barrier;
+
+static void spin_barrier_wait(spin_barrier* b, size_t n_threads){
+	if(n_threads <= 1) return;
+	size_t phase = atomic_load(&b->phase);
+	if(atomic_fetch_add(&b->count, 1) + 1 == n_threads){
+		atomic_store(&b->count, 0);
+		atomic_fetch_add(&b->phase, 1);
+	} else {
+		while(atomic_load(&b->phase) == phase) sched_yield();
 	}
+}
 
-	fclose(file);
-	printf("\nSucessfully printed vector of vectors to file: %s\n", filepath);
+__attribute__((destructor))
+static void linalg_fini(void){
+	pthread_mutex_lock(&pool.region);
+	pool_stop();
+	pthread_mutex_unlock(&pool.region);
 }
 
-void read_csv_to_matrix(
-	double** matrix, char* filepath, size_t rows, size_t cols
-) {
-	int  max_row_length = 1000;
-    char row_buffer[max_row_length];
 
-    FILE *file = fopen(filepath, "r");
+/* ---------------------------------------------------
+ * Random numbers. Element i of a stream (i*cols + j for
+ * matrices) is drawn from Philox block i/2 keyed by the
+ * seed, so the output is the same for any thread count
+ * and instruction set.
+ * ------------------------------------------------- */
 
-    // Skip comments (rows starting with #) and one extra row
-    // which is assumed to be header
-    while (!feof(file)) {
-        fgets(row_buffer, max_row_length, file);
-        if (strncmp(row_buffer, "#", sizeof(char)) != 0) break;
-    }
+#define RANDOM_CHUNK 512 // elements generated per kernel call, even
 
-    // Read all rows
-    int i_row = 0;
-    if (!feof(file)) fgets(row_buffer, max_row_length, file);
-    while (!feof(file) && i_row < rows) {
+typedef enum {
+	RANDOM_UNIFORM,     // a + (b - a)*u
+	RANDOM_NORMAL,      // mean a, std b (Box-Muller on block pairs)
+	RANDOM_EXPONENTIAL  // rate a
+} random_distribution;
+
+typedef struct {
+	random_distribution distribution;
+	double a, b;
+	uint64_t key;
+	double* v;      // vector destination, or
+	double** rows;  // matrix destination
+	size_t n;       // vector length or number of rows
+	size_t cols;
+} random_args;
+
+// out[0 .. n) = elements index, ..., index + n - 1 of the stream
+static void random_fill(const random_args* args, double* out, uint64_t index,
+		size_t n){
+	double u[RANDOM_CHUNK];
+	while(n > 0){
+		size_t skip = index % 2;
+		size_t count = n < RANDOM_CHUNK - skip ? n : RANDOM_CHUNK - skip;
+		size_t n_blocks = (skip + count + 1) / 2;
+		// Whole blocks of uniforms go straight into out
+		int direct = args->distribution == RANDOM_UNIFORM && skip == 0
+			&& count % 2 == 0;
+		vec_kernels.uniform(direct ? out : u, index / 2, n_blocks, args->key);
+		switch(args->distribution){
+		case RANDOM_UNIFORM:
+			if(!direct) memcpy(out, u + skip, count * sizeof(double));
+			// Separate roundings, as in every kernel set
+			if(args->b - args->a != 1.0) vec_kernels.scale(out, args->b - args->a, count);
+			if(args->a != 0.0) vec_kernels.add_scalar(out, args->a, count);
+			break;
+		case RANDOM_NORMAL:
+			for(size_t k = 0; k < 2 * n_blocks; k += 2){
+				double r = args->b * sqrt(-2.0 * log1p(-u[k]));
+				double theta = 2.0 * M_PI * u[k + 1];
+				u[k]     = args->a + r * cos(theta);
+				u[k + 1] = args->a + r * sin(theta);
+			}
+			memcpy(out, u + skip, count * sizeof(double));
+			break;
+		case RANDOM_EXPONENTIAL:
+			for(size_t k = 0; k < count; k++){
+				out[k] = -log1p(-u[skip + k]) / args->a;
+			}
+			break;
+		}
+		index += count;
+		out += count;
+		n -= count;
+	}
+}
+
+static void random_task(void* ctx, size_t t, size_t n_threads){
+	const random_args* args = ctx;
+	size_t begin, end;
+	if(args->rows == NULL){
+		partition_range(args->n, t, n_threads, RANDOM_CHUNK, &begin, &end);
+		random_fill(args, args->v + begin, begin, end - begin);
+		return;
+	}
+	partition_range(args->n, t, n_threads, 1, &begin, &end);
+	for(size_t i = begin; i < end; i++){
+		random_fill(args, args->rows[i], (uint64_t)i * args->cols, args->cols);
+	}
+}
+
+static void random_run(random_args args){
+	size_t n = args.rows == NULL ? args.n : args.n * args.cols;
+	if(parallel_worthwhile(n)) linalg_parallel(random_task, &args);
+	else random_task(&args, 0, 1);
+}
+
+void fill_random_uniform_vector(double* v, size_t len, double low,
+		double high, unsigned long int seed){
+	random_run((random_args){RANDOM_UNIFORM, low, high, seed, v, NULL, len, 0});
+}
+
+void fill_random_normal_vector(double* v, size_t len, double mean,
+		double std, unsigned long int seed){
+	random_run((random_args){RANDOM_NORMAL, mean, std, seed, v, NULL, len, 0});
+}
+
+void fill_random_exponential_vector(double* v, size_t len, double rate,
+		unsigned long int seed){
+	random_run((random_args){RANDOM_EXPONENTIAL, rate, 0, seed, v, NULL, len, 0});
+}
+
+void fill_random_uniform_matrix(double** mat, size_t rows, size_t cols,
+		double low, double high, unsigned long int seed){
+	random_run((random_args){RANDOM_UNIFORM, low, high, seed, NULL, mat,
+			rows, cols});
+}
+
+void fill_random_normal_matrix(double** mat, size_t rows, size_t cols,
+		double mean, double std, unsigned long int seed){
+	random_run((random_args){RANDOM_NORMAL, mean, std, seed, NULL, mat,
+			rows, cols});
+}
+
+void fill_random_exponential_matrix(double** mat, size_t rows, size_t cols,
+		double rate, unsigned long int seed){
+	random_run((random_args){RANDOM_EXPONENTIAL, rate, 0, seed, NULL, mat,
+			rows, cols});
+}
+
+
+/* ---------------------------------------------------
+ * Allocators. NULL (or alloc == NULL) is the system
+ * allocator. The arena bumps a pointer through a list
+ * of chunks; a marker is (chunk, used) so a reset is
+ * O(1) and the chunks after it stay for reuse. The
+ * pool keeps one free list per power-of-two class,
+ * carved from slabs that live until the pool does.
+ * ------------------------------------------------- */
+
+static int allocator_is_system(const linalg_allocator* a){
+	return a == NULL || a->alloc == NULL;
+}
+
+static size_t round_up(size_t n, size_t multiple){
+	return (n + multiple - 1) / multiple * multiple;
+}
+
+static void* allocator_alloc(const linalg_allocator* a, size_t size){
+	if(allocator_is_system(a)){
+		return aligned_alloc(LINALG_ALIGNMENT, round_up(size, LINALG_ALIGNMENT));
+	}
+	return a->alloc(a->state, size, LINALG_ALIGNMENT);
+}
+
+static void allocator_free(const linalg_allocator* a, void* ptr, size_t size){
+	if(allocator_is_system(a)){
+		free(ptr);
+	} else if(a->free != NULL){
+		a->free(a->state, ptr, size);
+	}
+}
+
+#define ARENA_DEFAULT_CHUNK (1u << 20)
+
+typedef struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;  // usable bytes after the header
+	size_t used;
+} arena_chunk;
+
+// Header padded so chunk data is aligned like the chunk
+#define ARENA_HEADER round_up(sizeof(arena_chunk), LINALG_ALIGNMENT)
+
+struct linalg_arena {
+	arena_chunk* first;
+	arena_chunk* current;
+	size_t chunk_size;
+};
+
+static char* arena_data(arena_chunk* c){
+	return (char*)c + ARENA_HEADER;
+}
+
+static arena_chunk* arena_new_chunk(size_t size){
+	size = round_up(size, LINALG_ALIGNMENT);
+	arena_chunk* c = aligned_alloc(LINALG_ALIGNMENT, ARENA_HEADER + size);
+	if(c == NULL) return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+linalg_arena* linalg_arena_create(size_t chunk_size){
+	linalg_arena* arena = malloc(sizeof(linalg_arena));
+	if(arena == NULL) return NULL;
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+	arena->first = arena_new_chunk(arena->chunk_size);
+	if(arena->first == NULL){
+		free(arena);
+		return NULL;
+	}
+	arena->current = arena->first;
+	return arena;
+}
+
+void linalg_arena_destroy(linalg_arena* arena){
+	if(arena == NULL) return;
+	arena_chunk* c = arena->first;
+	while(c != NULL){
+		arena_chunk* next = c->next;
+		free(c);
+		c = next;
+	}
+	free(arena);
+}
+
+static void* arena_alloc(void* state, size_t size, size_t alignment){
+	linalg_arena* arena = state;
+	arena_chunk* c = arena->current;
+	for(;;){
+		uintptr_t data = (uintptr_t)arena_data(c);
+		uintptr_t start = (data + c->used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+		if(start + size <= data + c->size){
+			c->used = start + size - data;
+			arena->current = c;
+			return (void*)start;
+		}
+		if(c->next == NULL) break;
+		// Chunks past the current one are free after a reset
+		c = c->next;
+		c->used = 0;
+	}
+	size_t need = size + alignment;
+	arena_chunk* fresh = arena_new_chunk(need > arena->chunk_size ? need : arena->chunk_size);
+	if(fresh == NULL) return NULL;
+	c->next = fresh;
+	arena->current = fresh;
+	return arena_alloc(state, size, alignment);
+}
+
+static void arena_free(void* state, void* ptr, size_t size){
+	linalg_arena* arena = state;
+	arena_chunk* c = arena->current;
+	char* data = arena_data(c);
+	// Only the most recent allocation can be given back
+	if((char*)ptr >= data && (char*)ptr + size == data + c->used){
+		c->used = (char*)ptr - data;
+	}
+}
+
+linalg_allocator linalg_arena_allocator(linalg_arena* arena){
+	return (linalg_allocator){arena_alloc, arena_free, arena};
+}
+
+linalg_arena_marker linalg_arena_mark(linalg_arena* arena){
+	return (linalg_arena_marker){arena->current, arena->current->used};
+}
+
+void linalg_arena_reset(linalg_arena* arena, const linalg_arena_marker* mark){
+	if(mark == NULL){
+		arena->current = arena->first;
+		arena->current->used = 0;
+		return;
+	}
+	arena->current = mark->chunk;
+	arena->current->used = mark->used;
+}
+
+#define POOL_MIN_SHIFT 6   // 64 B
+#define POOL_MAX_SHIFT 32  // 4 GiB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLAB_SIZE (256u << 10)
+
+typedef struct pool_block {
+	struct pool_block* next;
+} pool_block;
+
+struct linalg_pool {
+	pool_block* free_list[POOL_CLASSES];
+	void* slabs;  // list linked through the first word of each slab
+};
+
+linalg_pool* linalg_pool_create(void){
+	return calloc(1, sizeof(linalg_pool));
+}
+
+void linalg_pool_destroy(linalg_pool* pool){
+	if(pool == NULL) return;
+	void* slab = pool->slabs;
+	while(slab != NULL){
+		void* next = *(void**)slab;
+		free(slab);
+		slab = next;
+	}
+	free(pool);
+}
+
+// Size class of size, or -1 if it goes to the system allocator
+static int pool_class(size_t size){
+	if(size > ((size_t)1 << POOL_MAX_SHIFT)) return -1;
+	int shift = size <= 1 ? 0 : 64 - __builtin_clzll((unsigned long long)size - 1);
+	return shift < POOL_MIN_SHIFT ? 0 : shift - POOL_MIN_SHIFT;
+}
+
+static void* pool_alloc(void* state, size_t size, size_t alignment){
+	linalg_pool* pool = state;
+	if(alignment > LINALG_ALIGNMENT) return NULL;
+	int k = pool_class(size);
+	if(k < 0){
+		return aligned_alloc(LINALG_ALIGNMENT, round_up(size, LINALG_ALIGNMENT));
+	}
+	if(pool->free_list[k] == NULL){
+		// Carve a slab into blocks; its first cache line links the slabs
+		size_t block = (size_t)1 << (k + POOL_MIN_SHIFT);
+		size_t bytes = block > POOL_SLAB_SIZE ? block : POOL_SLAB_SIZE;
+		char* slab = aligned_alloc(LINALG_ALIGNMENT, LINALG_ALIGNMENT + bytes);
+		if(slab == NULL) return NULL;
+		*(void**)slab = pool->slabs;
+		pool->slabs = slab;
+		for(size_t off = bytes; off >= block; off -= block){
+			pool_block* b = (pool_block*)(slab + LINALG_ALIGNMENT + off - block);
+			b->next = pool->free_list[k];
+			pool->free_list[k] = b;
+		}
+	}
+	pool_block* b = pool->free_list[k];
+	pool->free_list[k] = b->next;
+	return b;
+}
+
+static void pool_free(void* state, void* ptr, size_t size){
+	linalg_pool* pool = state;
+	int k = pool_class(size);
+	if(k < 0){
+		free(ptr);
+		return;
+	}
+	pool_block* b = ptr;
+	b->next = pool->free_list[k];
+	pool->free_list[k] = b;
+}
+
+linalg_allocator linalg_pool_allocator(linalg_pool* pool){
+	return (linalg_allocator){pool_alloc, pool_free, pool};
+}
+
+double* create_vector_with_allocator(size_t len,
+		const linalg_allocator* allocator){
+	if(allocator_is_system(allocator)){
+		return calloc(len, sizeof(double));
+	}
+	double* vector = allocator_alloc(allocator, len * sizeof(double));
+	if(vector != NULL) memset(vector, 0, len * sizeof(double));
+	return vector;
+}
+
+double* create_vector_malloc_with_allocator(size_t len,
+		const linalg_allocator* allocator){
+	if(allocator_is_system(allocator)){
+		return malloc(len * sizeof(double));
+	}
+	return allocator_alloc(allocator, len * sizeof(double));
+}
+
+void destroy_vector_with_allocator(double* vector, size_t len,
+		const linalg_allocator* allocator){
+	if(vector == NULL) return;
+	allocator_free(allocator, vector, len * sizeof(double));
+}
+
+double* create_vector(size_t len){
+	return create_vector_with_allocator(len, NULL);
+}
+
+double* create_vector_malloc(size_t len){
+	return create_vector_malloc_with_allocator(len, NULL);
+}
+
+double* create_linspace(double start, double end, size_t num_points){
+	double* linspace = create_vector(num_points);
+	for(size_t i = 0; i < num_points; i++){
+		linspace[i] = i * (end-start)/(num_points-1) + start;
+	}
+	return linspace;	
+}
+
+double* create_random_uniform_vector(size_t len, unsigned long int seed){
+	double* vector = create_vector_malloc(len);
+	fill_random_uniform_vector(vector, len, 0.0, 1.0, seed);
+	return vector;
+}
+
+double* create_random_normal_vector(size_t len, double mean, double std,
+		unsigned long int seed){
+	double* vector = create_vector_malloc(len);
+	fill_random_normal_vector(vector, len, mean, std, seed);
+	return vector;
+}
+
+void destroy_vector(double *vector){
+	free(vector);
+}
+
+void copy_vector(double *v_dest, double *v_source, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		v_dest[i] = v_source[i];
+	}
+}
+
+void copy_column_to_vector(double* vector, double** matrix, 
+		int col_index, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		vector[i] = matrix[i][col_index];
+	}
+}
+
+void scale_vector_by_factor(double *v, double scale_factor, size_t len){
+	vec_kernels.scale(v, scale_factor, len);
+}
+
+void add_scalar_to_vector(double *v, double scalar, size_t len){
+	vec_kernels.add_scalar(v, scalar, len);
+}
+
+void evaluate_function_on_vector(double* v_output, double (*function)(double), 
+		double* v_input, size_t len) {
+	for(size_t i = 0; i < len; i++){
+		v_output[i] = (*function)(v_input[i]); //dereference function
+		//since (*function) is the address of the function		
+	}
+}
+
+/*
+ * Elementwise math and batch callbacks. A vector is handed out in
+ * chunks of MATH_CHUNK elements, split across the pool when large; the
+ * math kernels cost several times a memory-bound elementwise op per
+ * element, hence the lower threshold.
+ */
+#define MATH_CHUNK 2048
+#define MATH_WORK_PER_ELEMENT 8
+
+typedef struct {
+	void (*kernel)(double* res, const double* x, size_t n);
+	void (*pow)(double* res, const double* x, size_t n, double p);
+	linalg_batch_function function;
+	void* ctx;
+	double p;
+	double* res;
+	const double* x;
+	size_t n;
+} math_args;
+
+static void math_task(void* ctx, size_t t, size_t n_threads){
+	const math_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->n, t, n_threads, MATH_CHUNK, &begin, &end);
+	for(size_t i = begin; i < end; i += MATH_CHUNK){
+		size_t n = end - i < MATH_CHUNK ? end - i : MATH_CHUNK;
+		if(g->function != NULL) g->function(g->res + i, g->x + i, n, g->ctx);
+		else if(g->pow != NULL) g->pow(g->res + i, g->x + i, n, g->p);
+		else g->kernel(g->res + i, g->x + i, n);
+	}
+}
+
+static void math_run(math_args g){
+	if(parallel_worthwhile(g.n * MATH_WORK_PER_ELEMENT)){
+		linalg_parallel(math_task, &g);
+	} else {
+		math_task(&g, 0, 1);
+	}
+}
+
+void evaluate_batch_function_on_vector(double* v_output,
+		linalg_batch_function function, double* v_input, size_t len,
+		void* ctx){
+	math_run((math_args){.function = function, .ctx = ctx,
+			.res = v_output, .x = v_input, .n = len});
+}
+
+void elementwise_exp(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.exp, .res = res, .x = v, .n = len});
+}
+
+void elementwise_log(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.log, .res = res, .x = v, .n = len});
+}
+
+void elementwise_sqrt(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_kernels.sqrt, .res = res, .x = v, .n = len});
+}
+
+void elementwise_sin(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.sin, .res = res, .x = v, .n = len});
+}
+
+void elementwise_cos(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.cos, .res = res, .x = v, .n = len});
+}
+
+void elementwise_tanh(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.tanh, .res = res, .x = v, .n = len});
+}
+
+void elementwise_sigmoid(double* res, double* v, size_t len){
+	math_run((math_args){.kernel = vec_math.sigmoid, .res = res, .x = v, .n = len});
+}
+
+void elementwise_pow(double* res, double* v, double exponent, size_t len){
+	if(exponent == 0.0){
+		for(size_t i = 0; i < len; i++) res[i] = 1.0;
+	} else if(exponent == 1.0){
+		if(res != v) memcpy(res, v, len * sizeof(double));
+	} else if(exponent == 2.0){
+		vec_kernels.mul(res, v, v, len);
+	} else {
+		// pow(+-1, +-inf) and pow(1, NaN) are 1: left to libm
+		math_run((math_args){.pow = isfinite(exponent) ? vec_math.pow
+				: math_pow_libm, .p = exponent, .res = res, .x = v, .n = len});
+	}
+}
+
+void elementwise_addition(double *res, double *v1, double *v2, size_t len){
+	vec_kernels.add(res, v1, v2, len);
+}
+
+void elementwise_multiplication(double *res, double *v1,
+								double *v2, size_t len){
+	vec_kernels.mul(res, v1, v2, len);
+}
+ 
+/*
+ * Reductions of dot_product, vector_norm, the distances, vector_average
+ * and vector_variance, in the mode of linalg_set_reduction. The terms
+ * (products, squares, deviations) are formed a block of REDUCE_BLOCK at a
+ * time into an L1 buffer and summed there, except in the fast mode,
+ * which uses the fused kernels for unscaled terms. Threads take ranges
+ * aligned to whole blocks and their partial sums are added in thread
+ * order. The reproducible mode sums every block on its own and adds the
+ * block sums in a fixed pairwise order, so neither the split nor the ISA
+ * shows.
+ */
+#define REDUCE_BLOCK 2048
+#define PAIRWISE_LEAF 256
+
+typedef enum {
+	REDUCE_SUM,
+	REDUCE_SQUARES,
+	REDUCE_PRODUCTS,
+	REDUCE_DEVIATIONS,
+	REDUCE_DIFFERENCES  // squared
+} reduce_terms;
+
+typedef struct {
+	reduce_terms terms;
+	const double* a;
+	const double* b;
+	double mean;
+	double scale;        // power of two a and b are scaled by, 0 for none
+	size_t a_stride;     // between elements, 0 or 1 for contiguous
+	size_t b_stride;
+	size_t n;
+	linalg_reduction mode;
+	double* partial;     // sum and correction per thread
+	double* block_sums;  // reproducible mode, threaded
+} reduce_args;
+
+// Pairwise sum of a stream of values: level[k] holds the sum of 2^k
+// values, merged like a binary counter.
+typedef struct {
+	double level[64];
+	size_t count;
+} pairwise_sum;
+
+static void pairwise_add(pairwise_sum* p, double x){
+	size_t k = 0;
+	for(size_t c = p->count; c & 1; c >>= 1) x = p->level[k++] + x;
+	p->level[k] = x;
+	p->count++;
+}
+
+static double pairwise_total(const pairwise_sum* p){
+	double sum = 0.0;
+	for(size_t k = 0, c = p->count; c != 0; k++, c >>= 1){
+		if(c & 1) sum = p->level[k] + sum;
+	}
+	return sum;
+}
+
+// Operands of elements [i, i + n): strided ones gathered into buf (room
+// for two blocks), contiguous ones in place
+static void reduce_gather(const reduce_args* g, size_t i, size_t n,
+		double* buf, const double** a, const double** b){
+	size_t a_step = g->a_stride > 1 ? g->a_stride : 1;
+	size_t b_step = g->b_stride > 1 ? g->b_stride : 1;
+	*a = g->a + i * a_step;
+	*b = g->b != NULL ? g->b + i * b_step : NULL;
+	if(a_step > 1){
+		for(size_t j = 0; j < n; j++) buf[j] = (*a)[j * a_step];
+		*a = buf;
+	}
+	if(g->b == g->a && b_step == a_step){
+		*b = *a;
+	} else if(*b != NULL && b_step > 1){
+		for(size_t j = 0; j < n; j++) buf[REDUCE_BLOCK + j] = (*b)[j * b_step];
+		*b = buf + REDUCE_BLOCK;
+	}
+}
+
+// The n terms of operands a and b as an array, in buf unless they are a
+// itself; a and b may be in buf (from reduce_gather)
+static const double* reduce_load(const reduce_args* g, const double* a,
+		const double* b, size_t n, double* buf){
+	double* b_buf = buf + REDUCE_BLOCK;
+	if(a != buf && (g->scale != 0.0 || g->terms == REDUCE_DEVIATIONS)){
+		memcpy(buf, a, n * sizeof(double));
+		a = buf;
+	}
+
+	switch(g->terms){
+	case REDUCE_SUM:
+		return a;
+	case REDUCE_SQUARES:
+		if(g->scale != 0.0) vec_kernels.scale(buf, g->scale, n);
+		vec_kernels.mul(buf, a, a, n);
+		break;
+	case REDUCE_DIFFERENCES:
+		if(g->scale != 0.0){
+			// Scaled before subtracting, which could overflow
+			if(b != b_buf) memcpy(b_buf, b, n * sizeof(double));
+			vec_kernels.scale(buf, g->scale, n);
+			vec_kernels.scale(b_buf, g->scale, n);
+			b = b_buf;
+		}
+		vec_kernels.sub(buf, a, b, n);
+		vec_kernels.mul(buf, buf, buf, n);
+		break;
+	case REDUCE_PRODUCTS:
+		vec_kernels.mul(buf, a, b, n);
+		break;
+	case REDUCE_DEVIATIONS:
+		vec_kernels.add_scalar(buf, -g->mean, n);
+		vec_kernels.mul(buf, buf, buf, n);
+		break;
+	}
+	return buf;
+}
+
+static double reduce_fast(const reduce_args* g, const double* a,
+		const double* b, size_t n){
+	switch(g->terms){
+	case REDUCE_SUM:
+		return vec_kernels.sum(a, n);
+	case REDUCE_SQUARES:
+		return vec_kernels.sum_of_squares(a, n);
+	case REDUCE_PRODUCTS:
+		return vec_kernels.dot(a, b, n);
+	case REDUCE_DEVIATIONS:
+		return vec_kernels.sum_squared_deviation(a, n, g->mean);
+	case REDUCE_DIFFERENCES:
+		return vec_kernels.squared_distance(a, b, n);
+	}
+	return 0.0;
+}
+
+// Sum of the terms of [begin, end) as out[0] + out[1]
+static void reduce_range(const reduce_args* g, size_t begin, size_t end,
+		double* out){
+	out[1] = 0.0;
+	int fused = g->mode == LINALG_REDUCTION_FAST && g->scale == 0.0;
+	if(fused && g->a_stride <= 1 && g->b_stride <= 1){
+		out[0] = reduce_fast(g, g->a + begin, g->b != NULL ? g->b + begin : NULL,
+				end - begin);
+		return;
+	}
+
+	double buf[2 * REDUCE_BLOCK];
+	pairwise_sum p = {.count = 0};
+	double sum = 0.0, err = 0.0;
+	for(size_t i = begin; i < end; i += REDUCE_BLOCK){
+		size_t n = end - i < REDUCE_BLOCK ? end - i : REDUCE_BLOCK;
+		const double *a, *b;
+		reduce_gather(g, i, n, buf, &a, &b);
+		if(fused){
+			sum += reduce_fast(g, a, b, n);
+			continue;
+		}
+		const double* terms = reduce_load(g, a, b, n, buf);
+		switch(g->mode){
+		case LINALG_REDUCTION_FAST:
+			sum += vec_kernels.sum(terms, n);
+			break;
+		case LINALG_REDUCTION_PAIRWISE:
+			for(size_t j = 0; j < n; j += PAIRWISE_LEAF){
+				size_t m = n - j < PAIRWISE_LEAF ? n - j : PAIRWISE_LEAF;
+				pairwise_add(&p, vec_kernels.sum(terms + j, m));
+			}
+			break;
+		case LINALG_REDUCTION_COMPENSATED: {
+			double block[2];
+			vec_kernels.sum_compensated(terms, n, block);
+			sum = two_sum_add(sum, block[0], &err);
+			err += block[1];
+			break;
+		}
+		case LINALG_REDUCTION_REPRODUCIBLE: {
+			double block = vec_kernels.sum_reproducible(terms, n);
+			if(g->block_sums != NULL) g->block_sums[i / REDUCE_BLOCK] = block;
+			else pairwise_add(&p, block);
+			break;
+		}
+		}
+	}
+	if(g->mode == LINALG_REDUCTION_PAIRWISE
+			|| g->mode == LINALG_REDUCTION_REPRODUCIBLE){
+		sum = pairwise_total(&p);
+	}
+	out[0] = sum;
+	out[1] = err;
+}
+
+// Past an overflow the compensation is NaN (inf - inf) and meaningless
+static double reduce_total(double sum, double err){
+	return isfinite(sum) ? sum + err : sum;
+}
+
+static void reduce_task(void* ctx, size_t t, size_t n_threads){
+	const reduce_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->n, t, n_threads, REDUCE_BLOCK, &begin, &end);
+	reduce_range(g, begin, end, g->partial + 2 * t);
+}
+
+static double reduce(reduce_args g){
+	g.mode = reduction_mode;
+	double out[2];
+	if(!parallel_worthwhile(g.n)){
+		reduce_range(&g, 0, g.n, out);
+		return reduce_total(out[0], out[1]);
+	}
+
+	size_t n_blocks = (g.n + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+	if(g.mode == LINALG_REDUCTION_REPRODUCIBLE){
+		g.block_sums = malloc(n_blocks * sizeof(double));
+		if(g.block_sums == NULL){
+			reduce_range(&g, 0, g.n, out);
+			return reduce_total(out[0], out[1]);
+		}
+	}
+	g.partial = calloc(2 * pool.n_threads, sizeof(double));
+	if(g.partial == NULL){
+		free(g.block_sums);
+		g.block_sums = NULL;
+		reduce_range(&g, 0, g.n, out);
+		return reduce_total(out[0], out[1]);
+	}
+	linalg_parallel(reduce_task, &g);
+
+	double sum = 0.0, err = 0.0;
+	if(g.mode == LINALG_REDUCTION_REPRODUCIBLE){
+		pairwise_sum p = {.count = 0};
+		for(size_t i = 0; i < n_blocks; i++) pairwise_add(&p, g.block_sums[i]);
+		sum = pairwise_total(&p);
+	} else if(g.mode == LINALG_REDUCTION_COMPENSATED){
+		for(size_t t = 0; t < pool.n_threads; t++){
+			sum = two_sum_add(sum, g.partial[2 * t], &err);
+			err += g.partial[2 * t + 1];
+		}
+	} else {
+		for(size_t t = 0; t < pool.n_threads; t++) sum += g.partial[2 * t];
+	}
+	free(g.partial);
+	free(g.block_sums);
+	return reduce_total(sum, err);
+}
+
+// Squares of elements below 2^-511 lose bits; below this sum they may matter
+#define NORM_TINY 0x1p-900
+
+static double reduce_max_abs(const double* a, size_t n, size_t stride){
+	if(stride <= 1){
+		double m[4];
+		vec_kernels.moments(a, n, m);
+		return fmax(-m[2], m[3]);
+	}
+	double max = 0.0;
+	for(size_t i = 0; i < n; i++) max = fmax(max, fabs(a[i * stride]));
+	return max;
+}
+
+// Square root of a SQUARES or DIFFERENCES reduction that, like LAPACK's
+// dnrm2, neither overflows nor underflows: when the plain sum of squares is
+// out of range it is summed again with a and b scaled by a power of two
+// that brings the largest magnitude just below 1.
+static double reduce_norm(reduce_args g){
+	double ssq = reduce(g);
+	if((ssq >= NORM_TINY && isfinite(ssq)) || isnan(ssq) || g.n == 0){
+		return sqrt(ssq);
+	}
+	double max = reduce_max_abs(g.a, g.n, g.a_stride);
+	if(g.b != NULL) max = fmax(max, reduce_max_abs(g.b, g.n, g.b_stride));
+	if(max == 0.0 || isinf(max)) return max;
+	int k = ilogb(max) + 1;
+	if(k < DBL_MIN_EXP) k = DBL_MIN_EXP; // 2^-k must stay finite
+	g.scale = ldexp(1.0, -k);
+	return ldexp(sqrt(reduce(g)), k);
+}
+
+double dot_product(double *v1, double *v2, size_t len){
+	return reduce((reduce_args){.terms = REDUCE_PRODUCTS, .a = v1, .b = v2,
+			.n = len});
+}
+
+double vector_norm(double *v1, size_t len){
+	return reduce_norm((reduce_args){.terms = REDUCE_SQUARES, .a = v1,
+			.n = len});
+}
+
+
+double normalize_vector(double *v1, size_t len){
+	double norm = vector_norm(v1, len);
+	if(norm > 0.0 && isfinite(norm)
+			&& (norm < 0x1p-1000 || norm > 0x1p1000)){
+		// 1/norm would overflow or be subnormal: divide out a power of
+		// two first, exactly unless elements are far below the norm
+		int k = ilogb(norm) < -1000 ? -1000 : ilogb(norm);
+		vec_kernels.scale(v1, ldexp(1.0, -k), len);
+		vec_kernels.scale(v1, 1.0 / ldexp(norm, -k), len);
+	} else {
+		vec_kernels.scale(v1, 1.0 / norm, len);
+	}
+	return norm;
+}
+
+
+void vector_subtraction(double* result, double* v1, double* v2, size_t len){
+	vec_kernels.sub(result, v1, v2, len);
+}
+
+double distance_between_vectors(double *v1, double *v2, size_t len) {
+	return reduce_norm((reduce_args){.terms = REDUCE_DIFFERENCES, .a = v1,
+			.b = v2, .n = len});
+}
+
+double squared_distance_between_vectors(double *v1, double *v2, size_t len){
+	return reduce((reduce_args){.terms = REDUCE_DIFFERENCES, .a = v1,
+			.b = v2, .n = len});
+}
+
+vector_view vector_view_of(double* v, size_t len){
+	return (vector_view){v, len, 1};
+}
+
+double dot_product_view(vector_view v1, vector_view v2){
+	return reduce((reduce_args){.terms = REDUCE_PRODUCTS, .a = v1.data,
+			.b = v2.data, .a_stride = v1.stride, .b_stride = v2.stride,
+			.n = v1.len});
+}
+
+double vector_norm_view(vector_view v){
+	return reduce_norm((reduce_args){.terms = REDUCE_SQUARES, .a = v.data,
+			.a_stride = v.stride, .n = v.len});
+}
+
+void scale_vector_view(vector_view v, double scale_factor){
+	if(v.stride <= 1){
+		vec_kernels.scale(v.data, scale_factor, v.len);
+		return;
+	}
+	for(size_t i = 0; i < v.len; i++) v.data[i * v.stride] *= scale_factor;
+}
+
+void copy_vector_view(vector_view dest, vector_view src){
+	if(dest.stride <= 1 && src.stride <= 1){
+		memmove(dest.data, src.data, src.len * sizeof(double));
+		return;
+	}
+	size_t d = dest.stride > 1 ? dest.stride : 1, s = src.stride > 1 ? src.stride : 1;
+	for(size_t i = 0; i < src.len; i++) dest.data[i * d] = src.data[i * s];
+}
+
+
+double vector_average(double *v1, size_t len){
+	return reduce((reduce_args){.terms = REDUCE_SUM, .a = v1, .n = len}) / len;
+}
+
+double vector_standard_deviation(double *v1, size_t len){
+	return sqrt(vector_variance(v1, len));
+}
+
+
+double vector_variance(double *v1, size_t len){
+	if(reduction_mode == LINALG_REDUCTION_FAST && !parallel_worthwhile(len)){
+		return compute_vector_statistics(v1, len).variance;
+	}
+	// Two passes, both in the selected mode
+	double mean = vector_average(v1, len);
+	return reduce((reduce_args){.terms = REDUCE_DEVIATIONS, .a = v1,
+			.mean = mean, .n = len}) / len;
+}
+
+
+// Elements per block of compute_vector_statistics; a block stays in L1
+// between its two sweeps.
+#define STATISTICS_BLOCK 512
+
+vector_statistics compute_vector_statistics(double* v, size_t len){
+	vector_statistics stats = {NAN, NAN, NAN, NAN, NAN, 0, 0};
+	if(len == 0) return stats;
+
+	// Per block: sum, sum of squares, min and max in one sweep, then the
+	// squared deviation from the block mean while the block is in cache.
+	// Blocks are merged with Chan et al.'s update of mean and M2.
+	double count = 0, mean = 0, m2 = 0, sum_sq = 0;
+	double min = v[0], max = v[0];
+	for(size_t start = 0; start < len; start += STATISTICS_BLOCK){
+		size_t n = len - start < STATISTICS_BLOCK ? len - start : STATISTICS_BLOCK;
+		const double* block = v + start;
+		double moments[4];
+		vec_kernels.moments(block, n, moments);
+		double block_mean = moments[0] / n;
+		double block_m2 = vec_kernels.sum_squared_deviation(block, n, block_mean);
+
+		double total = count + n;
+		double delta = block_mean - mean;
+		mean += delta * n / total;
+		m2 += block_m2 + delta * delta * count * n / total;
+		count = total;
+		sum_sq += moments[1];
+		min = moments[2] < min ? moments[2] : min;
+		max = moments[3] > max ? moments[3] : max;
+	}
+
+	stats.mean = mean;
+	stats.variance = m2 / len;
+	stats.std = sqrt(stats.variance);
+	stats.min = min;
+	stats.max = max;
+	stats.sum_of_squares = sum_sq;
+	stats.norm = sqrt(sum_sq);
+	if(!(sum_sq >= NORM_TINY && isfinite(sum_sq)) && !isnan(sum_sq)){
+		// Overflowed or lost to underflow: redo it scaled
+		stats.norm = reduce_norm((reduce_args){.terms = REDUCE_SQUARES,
+				.a = v, .n = len});
+	}
+	return stats;
+}
+
+
+double vector_max(double* vector, size_t len){
+	double max = vector[0];
+	for(size_t i = 1; i < len; i++){
+		if(vector[i] > max){
+			max = vector[i];
+		}
+	}
+	return max;
+}
+
+// Rounds the row length up to a whole number of cache lines (for rows of at
+// least one cache line) and steps off 4 KiB multiples, so that rows are
+// aligned for SIMD loads and consecutive rows do not alias in the cache.
+static size_t matrix_stride_for(size_t cols, size_t element_size){
+	size_t per_line = LINALG_ALIGNMENT / element_size;
+	if(cols < per_line) return cols;
+	size_t stride = (cols + per_line - 1) / per_line * per_line;
+	if((stride * element_size) % 4096 == 0) stride += per_line;
+	return stride;
+}
+
+// Lays out a rows x cols matrix of element_size elements: sets the row
+// stride and the bytes of the padded data block. Fails (-1) when the block,
+// plus the alignment slack, would not fit a size_t.
+static int matrix_layout(size_t rows, size_t cols, size_t element_size,
+		size_t* stride, size_t* data_bytes){
+	size_t max_elements = (SIZE_MAX - 2 * LINALG_ALIGNMENT) / element_size;
+	if(cols > max_elements) return -1;
+	*stride = matrix_stride_for(cols, element_size);
+	if(*stride != 0 && rows > max_elements / *stride) return -1;
+	*data_bytes = rows * *stride * element_size;
+	return 0;
+}
+
+// Largest row count whose header size fits in a size_t
+#define MATRIX_MAX_ROWS ((SIZE_MAX - sizeof(matrix_t)) / sizeof(double*))
+
+// Callers keep rows <= MATRIX_MAX_ROWS
+static size_t matrix_header_size(size_t rows){
+	return sizeof(matrix_t) + rows * sizeof(double*);
+}
+
+// Allocates the handle together with the row pointer array, so that
+// matrix_of() can recover the handle from the double** view alone.
+static matrix_t* matrix_alloc_header(size_t rows, size_t cols, size_t stride,
+		const linalg_allocator* allocator){
+	if(rows > MATRIX_MAX_ROWS) return NULL;
+	matrix_t* m = allocator_is_system(allocator)
+		? malloc(matrix_header_size(rows))
+		: allocator_alloc(allocator, matrix_header_size(rows));
+	if(m == NULL) return NULL;
+	m->allocator = allocator_is_system(allocator)
+		? (linalg_allocator){NULL, NULL, NULL} : *allocator;
+	m->data   = NULL;
+	m->row    = (double**)(m + 1);
+	m->rows   = rows;
+	m->cols   = cols;
+	m->stride = stride;
+	m->flags  = 0;
+	m->base   = NULL;
+	m->base_size = 0;
+	return m;
+}
+
+static void matrix_set_row_pointers(matrix_t* m){
+	for(size_t i = 0; i < m->rows; i++){
+		m->row[i] = m->data + i * m->stride;
+	}
+}
+
+static void matrix_zero_task(void* ctx, size_t t, size_t n_threads){
+	matrix_t* m = ctx;
+	size_t begin, end;
+	partition_range(m->rows, t, n_threads, 1, &begin, &end);
+	if(end > begin){
+		memset(m->row[begin], 0, (end - begin) * m->stride * sizeof(double));
+	}
+}
+
+static void matrix_free_header(matrix_t* m){
+	linalg_allocator allocator = m->allocator;
+	allocator_free(&allocator, m, matrix_header_size(m->rows));
+}
+
+matrix_t* matrix_alloc_with_allocator(size_t rows, size_t cols,
+		const linalg_allocator* allocator){
+	size_t stride, data_bytes;
+	if(matrix_layout(rows, cols, sizeof(double), &stride, &data_bytes) != 0){
+		return NULL;
+	}
+	matrix_t* m = matrix_alloc_header(rows, cols, stride, allocator);
+	if(m == NULL) return NULL;
+	// System memory: over-allocate one cache line and align by hand.
+	// Serially, calloc keeps large blocks lazily zeroed by the kernel;
+	// with threads, every thread zeroes (first-touches) the rows it will
+	// later work on. Other allocators may hand out dirty memory.
+	int system = allocator_is_system(allocator);
+	size_t bytes = data_bytes + (system ? LINALG_ALIGNMENT : 0);
+	int first_touch = parallel_worthwhile(rows * stride);
+	if(system){
+		m->base = first_touch ? malloc(bytes) : calloc(bytes, 1);
+	} else {
+		m->base = allocator_alloc(allocator, bytes);
+	}
+	if(m->base == NULL){
+		matrix_free_header(m);
+		return NULL;
+	}
+	m->base_size = bytes;
+	uintptr_t addr = ((uintptr_t)m->base + LINALG_ALIGNMENT - 1)
+		& ~(uintptr_t)(LINALG_ALIGNMENT - 1);
+	m->data  = (double*)addr;
+	m->flags = MATRIX_OWNS_DATA;
+	matrix_set_row_pointers(m);
+	if(first_touch){
+		linalg_parallel(matrix_zero_task, m);
+	} else if(!system){
+		memset(m->data, 0, rows * stride * sizeof(double));
+	}
+	return m;
+}
+
+matrix_t* matrix_alloc(size_t rows, size_t cols){
+	return matrix_alloc_with_allocator(rows, cols, NULL);
+}
+
+void matrix_free(matrix_t* m){
+	if(m == NULL) return;
+	if(m->flags & MATRIX_OWNS_DATA){
+		allocator_free(&m->allocator, m->base, m->base_size);
+	}
+	if(m->flags & MATRIX_MAPPED){
+		munmap(m->base, m->base_size);
+	}
+	matrix_free_header(m);
+}
+
+matrix_t* matrix_of(double** mat){
+	return ((matrix_t*)mat) - 1;
+}
+
+double** create_matrix_with_allocator(size_t rows, size_t cols,
+		const linalg_allocator* allocator){
+	matrix_t* m = matrix_alloc_with_allocator(rows, cols, allocator);
+	if(m == NULL) return NULL;
+	return m->row;
+}
+
+double** create_matrix(size_t rows, size_t cols){
+	return create_matrix_with_allocator(rows, cols, NULL);
+}
+
+typedef struct {
+	double** dest;
+	double** src;
+	size_t rows; // of src
+	size_t cols; // of src
+} transpose_args;
+
+// Blocks are transposed through the register-tiled kernel; one block
+// of source and destination fits L1 together.
+#define TRANSPOSE_BLOCK 32
+
+// Rows [begin, end) of dest = columns of src
+static void transpose_rows(const transpose_args* args, size_t begin, size_t end){
+	for(size_t j = begin; j < end; j += TRANSPOSE_BLOCK){
+		size_t n = end - j < TRANSPOSE_BLOCK ? end - j : TRANSPOSE_BLOCK;
+		for(size_t i = 0; i < args->rows; i += TRANSPOSE_BLOCK){
+			size_t m = args->rows - i < TRANSPOSE_BLOCK ? args->rows - i : TRANSPOSE_BLOCK;
+			vec_kernels.transpose(args->dest + j, i,
+					(const double* const*)args->src + i, j, m, n);
+		}
+	}
+}
+
+static void transpose_task(void* ctx, size_t t, size_t n_threads){
+	const transpose_args* args = ctx;
+	size_t begin, end;
+	partition_range(args->cols, t, n_threads, TRANSPOSE_BLOCK, &begin, &end);
+	transpose_rows(args, begin, end);
+}
+
+void transpose_matrix(double** result, double** mat, size_t rows, size_t cols){
+	transpose_args args = {result, mat, rows, cols};
+	if(parallel_worthwhile(rows * cols)){
+		linalg_parallel(transpose_task, &args);
+	} else {
+		transpose_rows(&args, 0, cols);
+	}
+}
+
+double** create_transpose_of_matrix(double** matrix,
+		size_t initial_rows, size_t initial_cols){
+	double** transpose = create_matrix(initial_cols, initial_rows);
+	transpose_matrix(transpose, matrix, initial_rows, initial_cols);
+	return transpose;
+}
+
+typedef struct {
+	double** mat;
+	size_t n;
+} transpose_square_args;
+
+// Swaps block (I, J) with the transpose of block (J, I) through a
+// buffer; diagonal blocks are transposed in the buffer and copied back.
+static void transpose_block_pair(double** mat, size_t n, size_t I, size_t J,
+		double* const* buffer){
+	size_t i0 = I * TRANSPOSE_BLOCK, j0 = J * TRANSPOSE_BLOCK;
+	size_t m = n - i0 < TRANSPOSE_BLOCK ? n - i0 : TRANSPOSE_BLOCK;
+	size_t k = n - j0 < TRANSPOSE_BLOCK ? n - j0 : TRANSPOSE_BLOCK;
+	vec_kernels.transpose(buffer, 0, (const double* const*)mat + i0, j0, m, k);
+	if(I != J){
+		vec_kernels.transpose(mat + i0, j0, (const double* const*)mat + j0, i0, k, m);
+	}
+	for(size_t r = 0; r < k; r++){
+		memcpy(mat[j0 + r] + i0, buffer[r], m * sizeof(double));
+	}
+}
+
+static void transpose_square_task(void* ctx, size_t t, size_t n_threads){
+	const transpose_square_args* args = ctx;
+	_Alignas(LINALG_ALIGNMENT) double buffer[TRANSPOSE_BLOCK * TRANSPOSE_BLOCK];
+	double* buffer_rows[TRANSPOSE_BLOCK];
+	for(size_t r = 0; r < TRANSPOSE_BLOCK; r++){
+		buffer_rows[r] = buffer + r * TRANSPOSE_BLOCK;
+	}
+	// Block pairs I <= J in row order, split evenly between threads
+	size_t n_blocks = (args->n + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+	size_t begin, end;
+	partition_range(n_blocks * (n_blocks + 1) / 2, t, n_threads, 1, &begin, &end);
+	size_t pair = 0;
+	for(size_t I = 0; I < n_blocks && pair < end; I++){
+		if(pair + (n_blocks - I) <= begin){
+			pair += n_blocks - I;
+			continue;
+		}
+		for(size_t J = I; J < n_blocks; J++, pair++){
+			if(pair >= begin && pair < end){
+				transpose_block_pair(args->mat, args->n, I, J, buffer_rows);
+			}
+		}
+	}
+}
+
+void transpose_square_matrix_in_place(double** mat, size_t n){
+	transpose_square_args args = {mat, n};
+	if(parallel_worthwhile(n * n)){
+		linalg_parallel(transpose_square_task, &args);
+	} else {
+		transpose_square_task(&args, 0, 1);
+	}
+}
+
+// In-place transpose of a contiguous rows x cols array by following the
+// permutation cycles: element k = i*cols + j moves to j*rows + i.
+// done has a bit per element.
+static void transpose_cycles(double* a, size_t rows, size_t cols,
+		unsigned char* done){
+	size_t last = rows * cols - 1;
+	for(size_t start = 1; start < last; start++){
+		if(done[start / 8] & (1u << (start % 8))) continue;
+		double carried = a[start];
+		size_t k = start;
+		do {
+			size_t next = (k % cols) * rows + k / cols;
+			double displaced = a[next];
+			a[next] = carried;
+			carried = displaced;
+			done[next / 8] |= 1u << (next % 8);
+			k = next;
+		} while(k != start);
+	}
+}
+
+matrix_t* matrix_transpose_in_place(matrix_t* m){
+	if(!(m->flags & MATRIX_OWNS_DATA)) return NULL;
+	if(m->rows == m->cols){
+		transpose_square_matrix_in_place(m->row, m->rows);
+		return m;
+	}
+	size_t rows = m->rows, cols = m->cols;
+	unsigned char* done = calloc((rows * cols + 7) / 8 + 1, 1);
+	if(done == NULL) return NULL;
+	matrix_t* t;
+	if(allocator_is_system(&m->allocator)){
+		t = realloc(m, matrix_header_size(cols));
+	} else {
+		t = allocator_alloc(&m->allocator, matrix_header_size(cols));
+		if(t != NULL){
+			memcpy(t, m, sizeof(matrix_t));
+			matrix_free_header(m);
+		}
+	}
+	if(t == NULL){
+		free(done);
+		return NULL;
+	}
+	t->row = (double**)(t + 1);
+
+	// Drop the row padding, then permute the packed elements
+	for(size_t i = 1; i < rows && t->stride != cols; i++){
+		memmove(t->data + i * cols, t->data + i * t->stride, cols * sizeof(double));
+	}
+	if(rows > 1 && cols > 1) transpose_cycles(t->data, rows, cols, done);
+	free(done);
+
+	t->rows = cols;
+	t->cols = rows;
+	t->stride = rows;
+	matrix_set_row_pointers(t);
+	return t;
+}
+
+double** create_random_uniform_matrix(size_t rows, size_t cols, 
+		unsigned long int seed){
+	double** matrix = create_matrix(rows, cols);	
+	fill_random_uniform_matrix(matrix, rows, cols, 0.0, 1.0, seed);
+	return matrix;
+}
+
+double** create_random_normal_matrix(size_t rows, size_t cols, double mean,
+		double std, unsigned long int seed){
+	double** matrix = create_matrix(rows, cols);
+	fill_random_normal_matrix(matrix, rows, cols, mean, std, seed);
+	return matrix;
+}
+
+double** create_matrix_with_inserted_column(double** matrix, double* vector, 
+		size_t rows, size_t cols, size_t col_insert_index){
+	double** result = create_matrix(rows, cols+1);
+	// Copy row by row: before insert, inserted element, after insert
+	for(size_t i = 0; i < rows; i++){
+		memcpy(result[i], matrix[i], col_insert_index * sizeof(double));
+		result[i][col_insert_index] = vector[i];
+		memcpy(result[i] + col_insert_index + 1, matrix[i] + col_insert_index,
+			(cols - col_insert_index) * sizeof(double));
+	}
+	return result;
+}
+
+void destroy_matrix(double **matrix, size_t rows){
+	(void)rows; // Rows live in one block owned by the handle
+	if(matrix == NULL) return;
+	matrix_free(matrix_of(matrix));
+}
+
+/*
+ * Views are handles without MATRIX_OWNS_DATA whose row pointers point into
+ * the parent's block, at the parent's stride; matrix_free releases only
+ * the handle. Building one costs O(rows) for the row pointers.
+ */
+matrix_t* matrix_view(const matrix_t* m, size_t row, size_t col, size_t rows,
+		size_t cols){
+	if(row > m->rows || rows > m->rows - row || col > m->cols
+			|| cols > m->cols - col){
+		return NULL;
+	}
+	matrix_t* view = matrix_alloc_header(rows, cols, m->stride, NULL);
+	if(view == NULL) return NULL;
+	view->data = m->data + row * m->stride + col;
+	matrix_set_row_pointers(view);
+	return view;
+}
+
+vector_view matrix_row_view(const matrix_t* m, size_t row){
+	if(row >= m->rows) return (vector_view){m->data, 0, 1};
+	return (vector_view){m->data + row * m->stride, m->cols, 1};
+}
+
+vector_view matrix_column_view(const matrix_t* m, size_t col){
+	if(col >= m->cols) return (vector_view){m->data, 0, m->stride};
+	return (vector_view){m->data + col, m->rows, m->stride};
+}
+
+// Moves the elements to a new block with the given stride, inserting
+// column (unless NULL) at index on the way
+static int matrix_restride(matrix_t* m, size_t stride, const double* column,
+		size_t index){
+	if(m->rows > SIZE_MAX / sizeof(double) / stride) return -1;
+	size_t bytes = m->rows * stride * sizeof(double);
+	double* data = m->rows > 0 ? allocator_alloc(&m->allocator, bytes) : NULL;
+	if(data == NULL && m->rows > 0) return -1;
+	for(size_t i = 0; i < m->rows; i++){
+		double* dest = data + i * stride;
+		if(column == NULL){
+			memcpy(dest, m->row[i], m->cols * sizeof(double));
+			continue;
+		}
+		memcpy(dest, m->row[i], index * sizeof(double));
+		dest[index] = column[i];
+		memcpy(dest + index + 1, m->row[i] + index,
+				(m->cols - index) * sizeof(double));
+	}
+	allocator_free(&m->allocator, m->base, m->base_size);
+	m->base = data;
+	m->base_size = bytes;
+	m->data = data;
+	m->stride = stride;
+	if(column != NULL) m->cols++;
+	matrix_set_row_pointers(m);
+	return 0;
+}
+
+int matrix_reserve_columns(matrix_t* m, size_t capacity){
+	if(!(m->flags & MATRIX_OWNS_DATA)) return -1;
+	if(capacity <= m->stride) return 0;
+	if(capacity > (SIZE_MAX - 2 * LINALG_ALIGNMENT) / sizeof(double)) return -1;
+	return matrix_restride(m, matrix_stride_for(capacity, sizeof(double)),
+			NULL, 0);
+}
+
+int matrix_insert_column(matrix_t* m, const double* column, size_t index){
+	if(!(m->flags & MATRIX_OWNS_DATA) || index > m->cols) return -1;
+	if(m->cols == m->stride){
+		// Out of spare columns: double the capacity, so that appending
+		// costs amortized O(rows)
+		size_t capacity = m->cols < 4 ? 8 : 2 * m->cols;
+		return matrix_restride(m, matrix_stride_for(capacity, sizeof(double)),
+				column, index);
+	}
+	for(size_t i = 0; i < m->rows; i++){
+		double* r = m->row[i];
+		memmove(r + index + 1, r + index, (m->cols - index) * sizeof(double));
+		r[index] = column[i];
+	}
+	m->cols++;
+	return 0;
+}
+
+int matrix_append_column(matrix_t* m, const double* column){
+	return matrix_insert_column(m, column, m->cols);
+}
+
+/* ---------------------------------------------------
+ * Elementwise matrix kernels. All share one row-range
+ * worker so that they are split over the thread pool
+ * the same way.
+ * ------------------------------------------------- */
+
+typedef enum {
+	MATRIX_OP_SCALE,      // res = res * s
+	MATRIX_OP_ADD_SCALAR, // res = res + s
+	MATRIX_OP_ADD,        // res = a + b
+	MATRIX_OP_MULTIPLY,   // res = a * b
+	MATRIX_OP_ADD_SCALED  // res = a + s * b
+} matrix_op;
+
+typedef struct {
+	matrix_op op;
+	double** res;
+	double** a;
+	double** b;
+	double s;
+	size_t rows;
+	size_t cols;
+} matrix_op_args;
+
+static void matrix_op_rows(const matrix_op_args* args, size_t begin, size_t end){
+	const size_t cols = args->cols;
+	const double s = args->s;
+	for(size_t i = begin; i < end; i++){
+		double* res = args->res[i];
+		const double* a = args->a ? args->a[i] : NULL;
+		const double* b = args->b ? args->b[i] : NULL;
+		switch(args->op){
+		case MATRIX_OP_SCALE:
+			for(size_t j = 0; j < cols; j++) res[j] *= s;
+			break;
+		case MATRIX_OP_ADD_SCALAR:
+			for(size_t j = 0; j < cols; j++) res[j] += s;
+			break;
+		case MATRIX_OP_ADD:
+			for(size_t j = 0; j < cols; j++) res[j] = a[j] + b[j];
+			break;
+		case MATRIX_OP_MULTIPLY:
+			for(size_t j = 0; j < cols; j++) res[j] = a[j] * b[j];
+			break;
+		case MATRIX_OP_ADD_SCALED:
+			for(size_t j = 0; j < cols; j++) res[j] = a[j] + s * b[j];
+			break;
+		}
+	}
+}
+
+static void matrix_op_task(void* ctx, size_t t, size_t n_threads){
+	const matrix_op_args* args = ctx;
+	size_t begin, end;
+	partition_range(args->rows, t, n_threads, 1, &begin, &end);
+	matrix_op_rows(args, begin, end);
+}
+
+static void matrix_op_run(matrix_op_args args){
+	if(parallel_worthwhile(args.rows * args.cols)){
+		linalg_parallel(matrix_op_task, &args);
+	} else {
+		matrix_op_rows(&args, 0, args.rows);
+	}
+}
+
+void scale_matrix_by_factor(double** mat, double factor, 
+		size_t rows, size_t cols){
+	matrix_op_run((matrix_op_args){MATRIX_OP_SCALE, mat, NULL, NULL,
+			factor, rows, cols});
+}
+
+void add_scalar_to_matrix(double** mat, double scalar, 
+		size_t rows, size_t cols){
+	matrix_op_run((matrix_op_args){MATRIX_OP_ADD_SCALAR, mat, NULL, NULL,
+			scalar, rows, cols});
+}
+
+void elementwise_matrix_addition(double **result, double **mat1,
+		double **mat2, size_t rows, size_t cols){
+	matrix_op_run((matrix_op_args){MATRIX_OP_ADD, result, mat1, mat2,
+			0, rows, cols});
+}
+
+void elementwise_matrix_multiplication(double **result, double **mat1,
+		double **mat2, size_t rows, size_t cols){
+	matrix_op_run((matrix_op_args){MATRIX_OP_MULTIPLY, result, mat1, mat2,
+			0, rows, cols});
+}
+
+void add_scaled_matrix_to_matrix(double **result, double **mat,
+		double **mat_to_scale, double factor, size_t m, size_t n){
+	matrix_op_run((matrix_op_args){MATRIX_OP_ADD_SCALED, result, mat,
+			mat_to_scale, factor, m, n});
+}
+
+/* ---------------------------------------------------
+ * Lazy elementwise expressions. Nodes are appended to
+ * the context in creation order, which is a valid
+ * evaluation order. Evaluation walks the output in
+ * tiles of one row by EXPR_CHUNK columns; every
+ * intermediate of a tile lives in an L1-sized scratch
+ * slot, so memory is touched once per leaf and once for
+ * the result.
+ * ------------------------------------------------- */
+
+#define EXPR_CHUNK 256
+
+typedef enum {
+	EXPR_MATRIX,
+	EXPR_VECTOR, // one row, broadcast over the rows of a matrix
+	EXPR_SCALAR,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_MUL,
+	EXPR_DIV,
+	EXPR_MIN,
+	EXPR_MAX,
+	EXPR_NEG,
+	EXPR_ABS,
+	EXPR_SQRT,
+	EXPR_APPLY
+} expr_op;
+
+typedef struct {
+	expr_op op;
+	expr_node a, b;
+	double** mat;
+	double* vec;
+	double s;
+	double (*function)(double);
+	size_t rows, cols; // of leaves
+} expr_node_data;
+
+struct linalg_expr {
+	expr_node_data* nodes;
+	size_t n_nodes;
+	size_t capacity;
+};
+
+linalg_expr* expr_create(void){
+	return calloc(1, sizeof(linalg_expr));
+}
+
+void expr_reset(linalg_expr* e){
+	e->n_nodes = 0;
+}
+
+void expr_destroy(linalg_expr* e){
+	if(e == NULL) return;
+	free(e->nodes);
+	free(e);
+}
+
+static expr_node expr_push(linalg_expr* e, expr_node_data node){
+	if(e->n_nodes == e->capacity){
+		size_t capacity = e->capacity ? 2 * e->capacity : 16;
+		expr_node_data* nodes = realloc(e->nodes, capacity * sizeof(expr_node_data));
+		if(nodes == NULL) return -1;
+		e->nodes = nodes;
+		e->capacity = capacity;
+	}
+	e->nodes[e->n_nodes] = node;
+	return (expr_node)e->n_nodes++;
+}
+
+static int expr_valid(const linalg_expr* e, expr_node a){
+	return a >= 0 && (size_t)a < e->n_nodes;
+}
+
+static expr_node expr_unary(linalg_expr* e, expr_op op, expr_node a){
+	if(!expr_valid(e, a)) return -1;
+	return expr_push(e, (expr_node_data){.op = op, .a = a, .b = -1});
+}
+
+static expr_node expr_binary(linalg_expr* e, expr_op op, expr_node a, expr_node b){
+	if(!expr_valid(e, a) || !expr_valid(e, b)) return -1;
+	return expr_push(e, (expr_node_data){.op = op, .a = a, .b = b});
+}
+
+expr_node expr_matrix(linalg_expr* e, double** mat, size_t rows, size_t cols){
+	return expr_push(e, (expr_node_data){.op = EXPR_MATRIX, .a = -1, .b = -1,
+			.mat = mat, .rows = rows, .cols = cols});
+}
+
+expr_node expr_vector(linalg_expr* e, double* v, size_t len){
+	return expr_push(e, (expr_node_data){.op = EXPR_VECTOR, .a = -1, .b = -1,
+			.vec = v, .rows = 1, .cols = len});
+}
+
+expr_node expr_scalar(linalg_expr* e, double s){
+	return expr_push(e, (expr_node_data){.op = EXPR_SCALAR, .a = -1, .b = -1,
+			.s = s});
+}
+
+expr_node expr_add(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_ADD, a, b);
+}
+
+expr_node expr_sub(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_SUB, a, b);
+}
+
+expr_node expr_mul(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_MUL, a, b);
+}
+
+expr_node expr_div(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_DIV, a, b);
+}
+
+expr_node expr_min(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_MIN, a, b);
+}
+
+expr_node expr_max(linalg_expr* e, expr_node a, expr_node b){
+	return expr_binary(e, EXPR_MAX, a, b);
+}
+
+expr_node expr_scale(linalg_expr* e, expr_node a, double factor){
+	return expr_mul(e, expr_scalar(e, factor), a);
+}
+
+expr_node expr_add_scalar(linalg_expr* e, expr_node a, double scalar){
+	return expr_add(e, a, expr_scalar(e, scalar));
+}
+
+expr_node expr_neg(linalg_expr* e, expr_node a){
+	return expr_unary(e, EXPR_NEG, a);
+}
+
+expr_node expr_abs(linalg_expr* e, expr_node a){
+	return expr_unary(e, EXPR_ABS, a);
+}
+
+expr_node expr_sqrt(linalg_expr* e, expr_node a){
+	return expr_unary(e, EXPR_SQRT, a);
+}
+
+expr_node expr_apply(linalg_expr* e, expr_node a, double (*function)(double)){
+	expr_node node = expr_unary(e, EXPR_APPLY, a);
+	if(node >= 0) e->nodes[node].function = function;
+	return node;
+}
+
+// Evaluation plan: the nodes the root depends on, in order, each
+// intermediate assigned a scratch slot.
+typedef struct {
+	const linalg_expr* e;
+	expr_node root;
+	expr_node* program;
+	size_t length;
+	int* slot;      // per node; -1 for matrix/vector leaves and the root
+	size_t n_slots;
+	double** res_rows;
+	double* res_vec;
+	size_t rows, cols;
+	atomic_int failed;
+} expr_plan;
+
+static int expr_is_leaf(expr_op op){
+	return op == EXPR_MATRIX || op == EXPR_VECTOR || op == EXPR_SCALAR;
+}
+
+static void expr_plan_free(expr_plan* plan){
+	free(plan->program);
+	free(plan->slot);
+}
+
+// Fills program and slots; -1 if a leaf does not fit rows x cols.
+static int expr_plan_build(expr_plan* plan, const linalg_expr* e, expr_node root){
+	size_t n = e->n_nodes;
+	char* used = calloc(n, 1);
+	expr_node* last_use = malloc(n * sizeof(expr_node));
+	int* free_slots = malloc(n * sizeof(int));
+	plan->program = malloc(n * sizeof(expr_node));
+	plan->slot = malloc(n * sizeof(int));
+	plan->length = 0;
+	plan->n_slots = 0;
+	int ok = used && last_use && free_slots && plan->program && plan->slot;
+
+	if(ok) used[root] = 1;
+	for(size_t i = n; ok && i-- > 0;){
+		if(!used[i]) continue;
+		const expr_node_data* node = &e->nodes[i];
+		if(node->a >= 0) used[node->a] = 1;
+		if(node->b >= 0) used[node->b] = 1;
+		if(node->op == EXPR_MATRIX){
+			ok = node->rows == plan->rows && node->cols == plan->cols;
+		} else if(node->op == EXPR_VECTOR){
+			ok = node->cols == plan->cols;
+		}
+	}
+
+	size_t n_free = 0;
+	for(size_t i = 0; ok && i < n; i++){
+		if(!used[i]) continue;
+		const expr_node_data* node = &e->nodes[i];
+		plan->program[plan->length++] = (expr_node)i;
+		last_use[i] = (expr_node)i;
+		if(node->a >= 0) last_use[node->a] = (expr_node)i;
+		if(node->b >= 0) last_use[node->b] = (expr_node)i;
+	}
+	for(size_t k = 0; ok && k < plan->length; k++){
+		expr_node i = plan->program[k];
+		const expr_node_data* node = &e->nodes[i];
+		plan->slot[i] = -1;
+		// Operands dying here give their slots back first, so a
+		// result may overwrite its operand (all kernels allow that).
+		expr_node operands[2] = {node->a, node->b};
+		for(int o = 0; o < 2; o++){
+			expr_node x = operands[o];
+			if(x >= 0 && last_use[x] == i && plan->slot[x] >= 0
+					&& e->nodes[x].op != EXPR_SCALAR
+					&& (o == 0 || x != node->a)){
+				free_slots[n_free++] = plan->slot[x];
+			}
+		}
+		if(node->op == EXPR_SCALAR){
+			// Filled once per thread, so never shared
+			plan->slot[i] = (int)plan->n_slots++;
+		} else if(!expr_is_leaf(node->op) && i != root){
+			plan->slot[i] = n_free > 0 ? free_slots[--n_free] : (int)plan->n_slots++;
+		}
+	}
+	free(used);
+	free(last_use);
+	free(free_slots);
+	return ok ? 0 : -1;
+}
+
+// Computes one tile: row i, columns [j0, j0 + n)
+static void expr_eval_tile(const expr_plan* plan, double* scratch,
+		const double** value, size_t i, size_t j0, size_t n){
+	const linalg_expr* e = plan->e;
+	double* res = plan->res_rows ? plan->res_rows[i] + j0 : plan->res_vec + j0;
+	for(size_t k = 0; k < plan->length; k++){
+		expr_node x = plan->program[k];
+		const expr_node_data* node = &e->nodes[x];
+		double* out = x == plan->root ? res : scratch + plan->slot[x] * EXPR_CHUNK;
+		const double* a = node->a >= 0 ? value[node->a] : NULL;
+		const double* b = node->b >= 0 ? value[node->b] : NULL;
+		switch(node->op){
+		case EXPR_MATRIX:
+			value[x] = node->mat[i] + j0;
+			if(x == plan->root) memmove(res, value[x], n * sizeof(double));
+			continue;
+		case EXPR_VECTOR:
+			value[x] = node->vec + j0;
+			if(x == plan->root) memmove(res, value[x], n * sizeof(double));
+			continue;
+		case EXPR_SCALAR:
+			// Slot was filled once per thread
+			value[x] = scratch + plan->slot[x] * EXPR_CHUNK;
+			if(x == plan->root) memcpy(res, value[x], n * sizeof(double));
+			continue;
+		case EXPR_ADD:  vec_kernels.add(out, a, b, n); break;
+		case EXPR_SUB:  vec_kernels.sub(out, a, b, n); break;
+		case EXPR_MUL:  vec_kernels.mul(out, a, b, n); break;
+		case EXPR_DIV:  vec_kernels.div(out, a, b, n); break;
+		case EXPR_MIN:  vec_kernels.min(out, a, b, n); break;
+		case EXPR_MAX:  vec_kernels.max(out, a, b, n); break;
+		case EXPR_SQRT: vec_kernels.sqrt(out, a, n); break;
+		case EXPR_NEG:
+			if(out != a) memmove(out, a, n * sizeof(double));
+			vec_kernels.scale(out, -1.0, n);
+			break;
+		case EXPR_ABS:
+			for(size_t j = 0; j < n; j++) out[j] = fabs(a[j]);
+			break;
+		case EXPR_APPLY:
+			for(size_t j = 0; j < n; j++) out[j] = node->function(a[j]);
+			break;
+		}
+		value[x] = out;
+	}
+}
+
+static void expr_task(void* ctx, size_t t, size_t n_threads){
+	expr_plan* plan = ctx;
+	const linalg_expr* e = plan->e;
+	size_t chunks = (plan->cols + EXPR_CHUNK - 1) / EXPR_CHUNK;
+	size_t begin, end;
+	partition_range(plan->rows * chunks, t, n_threads, 1, &begin, &end);
+	if(begin == end) return;
+
+	double* scratch = aligned_alloc(LINALG_ALIGNMENT,
+			(plan->n_slots + 1) * EXPR_CHUNK * sizeof(double));
+	const double** value = malloc(e->n_nodes * sizeof(double*));
+	if(scratch == NULL || value == NULL){
+		atomic_store(&plan->failed, 1);
+		free(scratch);
+		free(value);
+		return;
+	}
+	for(size_t k = 0; k < plan->length; k++){
+		expr_node x = plan->program[k];
+		if(e->nodes[x].op != EXPR_SCALAR) continue;
+		double* slot = scratch + plan->slot[x] * EXPR_CHUNK;
+		for(size_t j = 0; j < EXPR_CHUNK; j++) slot[j] = e->nodes[x].s;
+	}
+	for(size_t tile = begin; tile < end; tile++){
+		size_t i = tile / chunks, j0 = tile % chunks * EXPR_CHUNK;
+		size_t n = plan->cols - j0 < EXPR_CHUNK ? plan->cols - j0 : EXPR_CHUNK;
+		expr_eval_tile(plan, scratch, value, i, j0, n);
+	}
+	free(scratch);
+	free(value);
+}
+
+static int expr_evaluate(const linalg_expr* e, expr_node root, double** res_rows,
+		double* res_vec, size_t rows, size_t cols){
+	if(!expr_valid(e, root)) return -1;
+	expr_plan plan = {e, root, NULL, 0, NULL, 0, res_rows, res_vec, rows, cols, 0};
+	if(expr_plan_build(&plan, e, root) != 0){
+		expr_plan_free(&plan);
+		return -1;
+	}
+	if(parallel_worthwhile(rows * cols)){
+		linalg_parallel(expr_task, &plan);
+	} else {
+		expr_task(&plan, 0, 1);
+	}
+	expr_plan_free(&plan);
+	return atomic_load(&plan.failed) ? -1 : 0;
+}
+
+int expr_evaluate_matrix(const linalg_expr* e, expr_node root, double** result,
+		size_t rows, size_t cols){
+	return expr_evaluate(e, root, result, NULL, rows, cols);
+}
+
+int expr_evaluate_vector(const linalg_expr* e, expr_node root, double* result,
+		size_t len){
+	return expr_evaluate(e, root, NULL, result, 1, len);
+}
+
+/* ---------------------------------------------------
+ * GEMM engine: C = alpha*op(A)*op(B) + beta*C
+ *
+ * Goto/BLIS structure. B is packed a kc x nc panel at
+ * a time, A an mc x kc block at a time, both into
+ * micro-panels laid out in the order the micro-kernel
+ * reads them. Operands are addressed through row
+ * pointers so that any double** (and any column
+ * offset into one) can be used without copying.
+ * ------------------------------------------------- */
+
+#define GEMM_AT(op, i, j) \
+	((op).trans ? (op).row[(j)][(op).col + (i)] : (op).row[(i)][(op).col + (j)])
+
+// Below this many multiply-adds packing does not pay off
+#define GEMM_SMALL_WORK (48 * 48 * 48)
+
+#define DEFINE_GEMM_KERNEL_GENERIC(name, T) \
+static void name(size_t k, const T* a, const T* b, T* ab){ \
+	T c[4][4] = {{0}}; \
+	for(size_t p = 0; p < k; p++){ \
+		for(int i = 0; i < 4; i++){ \
+			for(int j = 0; j < 4; j++){ \
+				c[i][j] += a[4*p + i] * b[4*p + j]; \
+			} \
+		} \
+	} \
+	memcpy(ab, c, sizeof(c)); \
+}
+
+DEFINE_GEMM_KERNEL_GENERIC(gemm_kernel_generic, double)
+DEFINE_GEMM_KERNEL_GENERIC(gemm_kernel_generic_f32, float)
+
+#ifdef LINALG_X86
+
+// Register tiles of rows x 2 vectors of W elements; row r of the packed
+// A sliver is broadcast against both vectors of the B sliver.
+#define GEMM_ROW(r, BROADCAST, FMADD) \
+	a_r = BROADCAST(a + (r)); \
+	c##r##0 = FMADD(a_r, b0, c##r##0); \
+	c##r##1 = FMADD(a_r, b1, c##r##1);
+
+#define GEMM_STORE(r, STORE, W) \
+	STORE(ab + 2*(W)*(r), c##r##0); \
+	STORE(ab + 2*(W)*(r) + (W), c##r##1);
+
+// 6 rows: 12 accumulators of AVX2's 16 registers
+#define DEFINE_GEMM_KERNEL_6(name, TARGET, T, VEC, W, LOAD, STORE, \
+		BROADCAST, FMADD, ZERO) \
+TARGET static void name(size_t k, const T* a, const T* b, T* ab){ \
+	VEC c00 = ZERO(), c01 = ZERO(), c10 = ZERO(), c11 = ZERO(); \
+	VEC c20 = ZERO(), c21 = ZERO(), c30 = ZERO(), c31 = ZERO(); \
+	VEC c40 = ZERO(), c41 = ZERO(), c50 = ZERO(), c51 = ZERO(); \
+	VEC a_r; \
+	for(size_t p = 0; p < k; p++){ \
+		VEC b0 = LOAD(b); \
+		VEC b1 = LOAD(b + (W)); \
+		GEMM_ROW(0, BROADCAST, FMADD) GEMM_ROW(1, BROADCAST, FMADD) \
+		GEMM_ROW(2, BROADCAST, FMADD) GEMM_ROW(3, BROADCAST, FMADD) \
+		GEMM_ROW(4, BROADCAST, FMADD) GEMM_ROW(5, BROADCAST, FMADD) \
+		a += 6; \
+		b += 2*(W); \
+	} \
+	GEMM_STORE(0, STORE, W) GEMM_STORE(1, STORE, W) GEMM_STORE(2, STORE, W) \
+	GEMM_STORE(3, STORE, W) GEMM_STORE(4, STORE, W) GEMM_STORE(5, STORE, W) \
+}
+
+// 8 rows: 16 accumulators of AVX-512's 32 registers
+#define DEFINE_GEMM_KERNEL_8(name, TARGET, T, VEC, W, LOAD, STORE, \
+		BROADCAST, FMADD, ZERO) \
+TARGET static void name(size_t k, const T* a, const T* b, T* ab){ \
+	VEC c00 = ZERO(), c01 = ZERO(), c10 = ZERO(), c11 = ZERO(); \
+	VEC c20 = ZERO(), c21 = ZERO(), c30 = ZERO(), c31 = ZERO(); \
+	VEC c40 = ZERO(), c41 = ZERO(), c50 = ZERO(), c51 = ZERO(); \
+	VEC c60 = ZERO(), c61 = ZERO(), c70 = ZERO(), c71 = ZERO(); \
+	VEC a_r; \
+	for(size_t p = 0; p < k; p++){ \
+		VEC b0 = LOAD(b); \
+		VEC b1 = LOAD(b + (W)); \
+		GEMM_ROW(0, BROADCAST, FMADD) GEMM_ROW(1, BROADCAST, FMADD) \
+		GEMM_ROW(2, BROADCAST, FMADD) GEMM_ROW(3, BROADCAST, FMADD) \
+		GEMM_ROW(4, BROADCAST, FMADD) GEMM_ROW(5, BROADCAST, FMADD) \
+		GEMM_ROW(6, BROADCAST, FMADD) GEMM_ROW(7, BROADCAST, FMADD) \
+		a += 8; \
+		b += 2*(W); \
+	} \
+	GEMM_STORE(0, STORE, W) GEMM_STORE(1, STORE, W) GEMM_STORE(2, STORE, W) \
+	GEMM_STORE(3, STORE, W) GEMM_STORE(4, STORE, W) GEMM_STORE(5, STORE, W) \
+	GEMM_STORE(6, STORE, W) GEMM_STORE(7, STORE, W) \
+}
+
+#define AVX512_BROADCAST_PD(p) _mm512_set1_pd(*(p))
+#define AVX512_BROADCAST_PS(p) _mm512_set1_ps(*(p))
+
+DEFINE_GEMM_KERNEL_6(gemm_kernel_avx2, LINALG_TARGET_AVX2, double, __m256d, 4,
+		_mm256_load_pd, _mm256_storeu_pd, _mm256_broadcast_sd,
+		_mm256_fmadd_pd, _mm256_setzero_pd)
+DEFINE_GEMM_KERNEL_6(gemm_kernel_avx2_f32, LINALG_TARGET_AVX2, float, __m256, 8,
+		_mm256_load_ps, _mm256_storeu_ps, _mm256_broadcast_ss,
+		_mm256_fmadd_ps, _mm256_setzero_ps)
+DEFINE_GEMM_KERNEL_8(gemm_kernel_avx512, LINALG_TARGET_AVX512, double, __m512d,
+		8, _mm512_load_pd, _mm512_storeu_pd, AVX512_BROADCAST_PD,
+		_mm512_fmadd_pd, _mm512_setzero_pd)
+DEFINE_GEMM_KERNEL_8(gemm_kernel_avx512_f32, LINALG_TARGET_AVX512, float,
+		__m512, 16, _mm512_load_ps, _mm512_storeu_ps, AVX512_BROADCAST_PS,
+		_mm512_fmadd_ps, _mm512_setzero_ps)
+
+#endif // LINALG_X86
+
+/*
+ * The blocked GEMM for element type T; S suffixes every name (empty
+ * for double).
+ */
+#define DEFINE_GEMM(S, T) \
+typedef struct { \
+	T* const* row; \
+	size_t col; /* column offset added to every row */ \
+	int trans; /* operand is used transposed */ \
+} gemm_operand##S; \
+ \
+/* Packs op(A)[i0:i0+mc, p0:p0+kc] into mr-row micro-panels, \
+ * zero-padding the last one. */ \
+static void gemm_pack_a##S(T* dst, gemm_operand##S A, size_t i0, size_t p0, \
+		size_t mc, size_t kc, size_t mr){ \
+	for(size_t ir = 0; ir < mc; ir += mr){ \
+		size_t m_eff = mc - ir < mr ? mc - ir : mr; \
+		if(!A.trans){ \
+			for(size_t r = 0; r < m_eff; r++){ \
+				const T* src = A.row[i0 + ir + r] + A.col + p0; \
+				for(size_t p = 0; p < kc; p++){ \
+					dst[p*mr + r] = src[p]; \
+				} \
+			} \
+			for(size_t r = m_eff; r < mr; r++){ \
+				for(size_t p = 0; p < kc; p++){ \
+					dst[p*mr + r] = 0; \
+				} \
+			} \
+		} else { \
+			for(size_t p = 0; p < kc; p++){ \
+				const T* src = A.row[p0 + p] + A.col + i0 + ir; \
+				size_t r = 0; \
+				for(; r < m_eff; r++) dst[p*mr + r] = src[r]; \
+				for(; r < mr; r++) dst[p*mr + r] = 0; \
+			} \
+		} \
+		dst += mr * kc; \
+	} \
+} \
+ \
+/* Packs op(B)[p0:p0+kc, j0:j0+nc] into nr-column micro-panels, \
+ * zero-padding the last one. */ \
+static void gemm_pack_b##S(T* dst, gemm_operand##S B, size_t p0, size_t j0, \
+		size_t kc, size_t nc, size_t nr){ \
+	for(size_t jr = 0; jr < nc; jr += nr){ \
+		size_t n_eff = nc - jr < nr ? nc - jr : nr; \
+		if(!B.trans){ \
+			for(size_t p = 0; p < kc; p++){ \
+				const T* src = B.row[p0 + p] + B.col + j0 + jr; \
+				size_t c = 0; \
+				for(; c < n_eff; c++) dst[p*nr + c] = src[c]; \
+				for(; c < nr; c++) dst[p*nr + c] = 0; \
+			} \
+		} else { \
+			for(size_t c = 0; c < n_eff; c++){ \
+				const T* src = B.row[j0 + jr + c] + B.col + p0; \
+				for(size_t p = 0; p < kc; p++){ \
+					dst[p*nr + c] = src[p]; \
+				} \
+			} \
+			for(size_t c = n_eff; c < nr; c++){ \
+				for(size_t p = 0; p < kc; p++){ \
+					dst[p*nr + c] = 0; \
+				} \
+			} \
+		} \
+		dst += nr * kc; \
+	} \
+} \
+ \
+/* C[i0:i0+mc, j0:j0+nc] = alpha*Ap*Bp + beta*C using the micro-kernel */ \
+static void gemm_macro_kernel##S(const gemm_config##S* cfg, size_t mc, size_t nc, \
+		size_t kc, T alpha, const T* Ap, const T* Bp, \
+		T beta, gemm_operand##S C, size_t i0, size_t j0){ \
+	const size_t mr = cfg->mr, nr = cfg->nr; \
+	T ab[16 * 16] __attribute__((aligned(LINALG_ALIGNMENT))); \
+	for(size_t jr = 0; jr < nc; jr += nr){ \
+		size_t n_eff = nc - jr < nr ? nc - jr : nr; \
+		for(size_t ir = 0; ir < mc; ir += mr){ \
+			size_t m_eff = mc - ir < mr ? mc - ir : mr; \
+			cfg->kernel(kc, Ap + ir*kc, Bp + jr*kc, ab); \
+			for(size_t r = 0; r < m_eff; r++){ \
+				T* c = C.row[i0 + ir + r] + C.col + j0 + jr; \
+				const T* t = ab + r*nr; \
+				if(beta == 0){ \
+					for(size_t j = 0; j < n_eff; j++) c[j] = alpha * t[j]; \
+				} else if(beta == 1){ \
+					for(size_t j = 0; j < n_eff; j++) c[j] += alpha * t[j]; \
+				} else { \
+					for(size_t j = 0; j < n_eff; j++) c[j] = alpha * t[j] + beta * c[j]; \
+				} \
+			} \
+		} \
+	} \
+} \
+ \
+static void gemm_scale##S(gemm_operand##S C, size_t m, size_t n, T beta){ \
+	for(size_t i = 0; i < m; i++){ \
+		T* c = C.row[i] + C.col; \
+		for(size_t j = 0; j < n; j++){ \
+			c[j] = beta == 0 ? 0 : beta * c[j]; \
+		} \
+	} \
+} \
+ \
+/* Unpacked fallback for products too small to amortize packing */ \
+static void gemm_small##S(size_t m, size_t n, size_t k, T alpha, \
+		gemm_operand##S A, gemm_operand##S B, T beta, gemm_operand##S C){ \
+	gemm_scale##S(C, m, n, beta); \
+	for(size_t i = 0; i < m; i++){ \
+		T* c = C.row[i] + C.col; \
+		for(size_t p = 0; p < k; p++){ \
+			const T a_ip = alpha * GEMM_AT(A, i, p); \
+			if(!B.trans){ \
+				const T* b = B.row[p] + B.col; \
+				for(size_t j = 0; j < n; j++) c[j] += a_ip * b[j]; \
+			} else { \
+				for(size_t j = 0; j < n; j++) c[j] += a_ip * B.row[j][B.col + p]; \
+			} \
+		} \
+	} \
+} \
+ \
+static T* gemm_alloc_panel##S(size_t n){ \
+	return aligned_alloc(LINALG_ALIGNMENT, (n * sizeof(T) \
+			+ LINALG_ALIGNMENT - 1) / LINALG_ALIGNMENT * LINALG_ALIGNMENT); \
+} \
+ \
+typedef struct { \
+	gemm_config##S cfg; \
+	size_t m, n, k; \
+	T alpha, beta; \
+	gemm_operand##S A, B, C; \
+	T* Bp; /* shared packed panel of B */ \
+	size_t mc_max; \
+	spin_barrier barrier; \
+	atomic_int failed; \
+} gemm_args##S; \
+ \
+/* All threads pack each B panel together, then each updates its own \
+ * rows of C (or, for short and wide products, its own columns). */ \
+static void gemm_task##S(void* ctx, size_t t, size_t n_threads){ \
+	gemm_args##S* g = ctx; \
+	const gemm_config##S* cfg = &g->cfg; \
+	T* Ap = gemm_alloc_panel##S(g->mc_max * cfg->kc); \
+	if(Ap == NULL) atomic_store(&g->failed, 1); \
+	spin_barrier_wait(&g->barrier, n_threads); \
+	if(atomic_load(&g->failed)){ \
+		free(Ap); \
+		return; \
+	} \
+	int split_rows = g->m >= 2 * n_threads * cfg->mr; \
+ \
+	for(size_t jc = 0; jc < g->n; jc += cfg->nc){ \
+		size_t nc = g->n - jc < cfg->nc ? g->n - jc : cfg->nc; \
+		for(size_t pc = 0; pc < g->k; pc += cfg->kc){ \
+			size_t kc = g->k - pc < cfg->kc ? g->k - pc : cfg->kc; \
+			T beta_pc = pc == 0 ? g->beta : 1.0; \
+ \
+			size_t begin, end; \
+			partition_range(nc, t, n_threads, cfg->nr, &begin, &end); \
+			if(end > begin){ \
+				gemm_pack_b##S(g->Bp + begin * kc, g->B, pc, jc + begin, kc, \
+						end - begin, cfg->nr); \
+			} \
+			spin_barrier_wait(&g->barrier, n_threads); \
+ \
+			size_t i_begin = 0, i_end = g->m, j_begin = 0, j_end = nc; \
+			if(split_rows){ \
+				partition_range(g->m, t, n_threads, cfg->mr, &i_begin, &i_end); \
+			} else { \
+				partition_range(nc, t, n_threads, cfg->nr, &j_begin, &j_end); \
+			} \
+			for(size_t ic = i_begin; ic < i_end && j_end > j_begin; ic += cfg->mc){ \
+				size_t mc = i_end - ic < cfg->mc ? i_end - ic : cfg->mc; \
+				gemm_pack_a##S(Ap, g->A, ic, pc, mc, kc, cfg->mr); \
+				gemm_macro_kernel##S(cfg, mc, j_end - j_begin, kc, g->alpha, Ap, \
+						g->Bp + j_begin * kc, beta_pc, g->C, ic, jc + j_begin); \
+			} \
+			spin_barrier_wait(&g->barrier, n_threads); \
+		} \
+	} \
+	free(Ap); \
+} \
+ \
+/* C (m x n) = alpha * op(A) (m x k) * op(B) (k x n) + beta * C */ \
+static void gemm##S(size_t m, size_t n, size_t k, T alpha, \
+		gemm_operand##S A, gemm_operand##S B, T beta, gemm_operand##S C){ \
+	if(m == 0 || n == 0) return; \
+	if(k == 0 || alpha == 0){ \
+		gemm_scale##S(C, m, n, beta); \
+		return; \
+	} \
+	if(m * n * k <= GEMM_SMALL_WORK){ \
+		gemm_small##S(m, n, k, alpha, A, B, beta, C); \
+		return; \
+	} \
+ \
+	gemm_args##S g = {.cfg = gemm_cfg##S, .m = m, .n = n, .k = k, .alpha = alpha, \
+		.beta = beta, .A = A, .B = B, .C = C}; \
+	const gemm_config##S* cfg = &g.cfg; \
+	size_t nc_max = n < cfg->nc ? (n + cfg->nr - 1) / cfg->nr * cfg->nr : cfg->nc; \
+	size_t kc_max = k < cfg->kc ? k : cfg->kc; \
+	g.mc_max = m < cfg->mc ? (m + cfg->mr - 1) / cfg->mr * cfg->mr : cfg->mc; \
+	if(kc_max < cfg->kc) g.cfg.kc = kc_max; \
+	g.Bp = gemm_alloc_panel##S(kc_max * nc_max); \
+	if(g.Bp == NULL){ \
+		gemm_small##S(m, n, k, alpha, A, B, beta, C); \
+		return; \
+	} \
+ \
+	if(pool.n_threads > 1 && m * n * k >= 8 * GEMM_SMALL_WORK){ \
+		linalg_parallel(gemm_task##S, &g); \
+	} else { \
+		gemm_task##S(&g, 0, 1); \
+	} \
+	if(atomic_load(&g.failed)){ \
+		/* C is untouched: threads agree on failure before any update */ \
+		gemm_small##S(m, n, k, alpha, A, B, beta, C); \
+	} \
+	free(g.Bp); \
+}
+
+DEFINE_GEMM(, double)
+DEFINE_GEMM(_f32, float)
+
+void general_matrix_multiplication(double **result, double **mat1,
+		double **mat2, size_t m, size_t n, size_t p, double alpha,
+		double beta, int transpose_mat1, int transpose_mat2){
+	gemm_operand A = {mat1, 0, transpose_mat1};
+	gemm_operand B = {mat2, 0, transpose_mat2};
+	gemm_operand C = {result, 0, 0};
+	gemm(m, p, n, alpha, A, B, beta, C);
+}
+
+void matrix_multiplication(double **result, double **mat1, double **mat2,
+		      size_t m, size_t n, size_t p){
+	general_matrix_multiplication(result, mat1, mat2, m, n, p, 1.0, 0.0,
+			LINALG_NO_TRANSPOSE, LINALG_NO_TRANSPOSE);
+}
+
+/* ---------------------------------------------------
+ * Single precision and 16-bit storage. The float
+ * kernels and GEMM are the double ones instantiated
+ * for float; binary16 and bfloat16 vectors are
+ * widened to float as they are loaded and summed in
+ * float.
+ * ------------------------------------------------- */
+
+float* create_vector_f32(size_t len){
+	return calloc(len, sizeof(float));
+}
+
+void destroy_vector_f32(float* vector){
+	free(vector);
+}
+
+// Row pointers and rows in one block; rows are padded like create_matrix's
+float** create_matrix_f32(size_t rows, size_t cols){
+	size_t stride, data_bytes;
+	if(matrix_layout(rows, cols, sizeof(float), &stride, &data_bytes) != 0){
+		return NULL;
+	}
+	// The row pointers go in front of the data, in the same block
+	if(rows > (SIZE_MAX - LINALG_ALIGNMENT - data_bytes) / sizeof(float*)){
+		return NULL;
+	}
+	size_t header = rows * sizeof(float*);
+	float** matrix = calloc(header + data_bytes + LINALG_ALIGNMENT, 1);
+	if(matrix == NULL) return NULL;
+	uintptr_t addr = ((uintptr_t)matrix + header + LINALG_ALIGNMENT - 1)
+		& ~(uintptr_t)(LINALG_ALIGNMENT - 1);
+	for(size_t i = 0; i < rows; i++){
+		matrix[i] = (float*)addr + i * stride;
+	}
+	return matrix;
+}
+
+void destroy_matrix_f32(float** matrix, size_t rows){
+	(void)rows;
+	free(matrix);
+}
+
+void scale_vector_by_factor_f32(float* v, float scale_factor, size_t len){
+	vec_kernels_f32.scale(v, scale_factor, len);
+}
+
+void add_scalar_to_vector_f32(float* v, float scalar, size_t len){
+	vec_kernels_f32.add_scalar(v, scalar, len);
+}
+
+void elementwise_addition_f32(float* res, float* v1, float* v2, size_t len){
+	vec_kernels_f32.add(res, v1, v2, len);
+}
+
+void elementwise_multiplication_f32(float* res, float* v1, float* v2,
+		size_t len){
+	vec_kernels_f32.mul(res, v1, v2, len);
+}
+
+void vector_subtraction_f32(float* result, float* v1, float* v2, size_t len){
+	vec_kernels_f32.sub(result, v1, v2, len);
+}
+
+float dot_product_f32(float* v1, float* v2, size_t len){
+	return vec_kernels_f32.dot(v1, v2, len);
+}
+
+// Squares of floats can neither overflow nor underflow in double
+static float norm_f32_in_double(const float* a, const float* b, size_t n){
+	double sum = 0.0;
+	for(size_t i = 0; i < n; i++){
+		double d = b != NULL ? (double)a[i] - b[i] : a[i];
+		sum += d * d;
+	}
+	return (float)sqrt(sum);
+}
+
+float vector_norm_f32(float* v1, size_t len){
+	float ssq = vec_kernels_f32.sum_of_squares(v1, len);
+	if(ssq >= 0x1p-100f && isfinite(ssq)) return sqrtf(ssq);
+	return isnan(ssq) ? ssq : norm_f32_in_double(v1, NULL, len);
+}
+
+float normalize_vector_f32(float* v1, size_t len){
+	float norm = vector_norm_f32(v1, len);
+	if(norm > 0.0f && isfinite(norm)
+			&& (norm < 0x1p-100f || norm > 0x1p100f)){
+		// As normalize_vector, at float's range
+		int k = ilogbf(norm) < -100 ? -100 : ilogbf(norm);
+		vec_kernels_f32.scale(v1, ldexpf(1.0f, -k), len);
+		vec_kernels_f32.scale(v1, 1.0f / ldexpf(norm, -k), len);
+	} else {
+		vec_kernels_f32.scale(v1, 1.0f / norm, len);
+	}
+	return norm;
+}
+
+float distance_between_vectors_f32(float* v1, float* v2, size_t len){
+	float ssq = vec_kernels_f32.squared_distance(v1, v2, len);
+	if(ssq >= 0x1p-100f && isfinite(ssq)) return sqrtf(ssq);
+	return isnan(ssq) ? ssq : norm_f32_in_double(v1, v2, len);
+}
+
+void general_matrix_multiplication_f32(float** result, float** mat1,
+		float** mat2, size_t m, size_t n, size_t p, float alpha, float beta,
+		int transpose_mat1, int transpose_mat2){
+	gemm_operand_f32 A = {mat1, 0, transpose_mat1};
+	gemm_operand_f32 B = {mat2, 0, transpose_mat2};
+	gemm_operand_f32 C = {result, 0, 0};
+	gemm_f32(m, p, n, alpha, A, B, beta, C);
+}
+
+void matrix_multiplication_f32(float** result, float** mat1, float** mat2,
+		size_t m, size_t n, size_t p){
+	general_matrix_multiplication_f32(result, mat1, mat2, m, n, p, 1.0f, 0.0f,
+			LINALG_NO_TRANSPOSE, LINALG_NO_TRANSPOSE);
+}
+
+void convert_vector_f64_to_f32(float* dst, const double* src, size_t len){
+	for(size_t i = 0; i < len; i++) dst[i] = (float)src[i];
+}
+
+void convert_vector_f32_to_f64(double* dst, const float* src, size_t len){
+	for(size_t i = 0; i < len; i++) dst[i] = src[i];
+}
+
+void convert_vector_f32_to_f16(linalg_f16* dst, const float* src, size_t len){
+	f16_kernels.from_f32(dst, src, len);
+}
+
+void convert_vector_f16_to_f32(float* dst, const linalg_f16* src, size_t len){
+	f16_kernels.to_f32(dst, src, len);
+}
+
+void convert_vector_f32_to_bf16(linalg_bf16* dst, const float* src, size_t len){
+	bf16_kernels.from_f32(dst, src, len);
+}
+
+void convert_vector_bf16_to_f32(float* dst, const linalg_bf16* src, size_t len){
+	bf16_kernels.to_f32(dst, src, len);
+}
+
+float dot_product_f16(const linalg_f16* v1, const linalg_f16* v2, size_t len){
+	return f16_kernels.dot(v1, v2, len);
+}
+
+float vector_norm_f16(const linalg_f16* v1, size_t len){
+	return sqrtf(f16_kernels.sum_of_squares(v1, len));
+}
+
+float distance_between_vectors_f16(const linalg_f16* v1, const linalg_f16* v2,
+		size_t len){
+	return sqrtf(f16_kernels.squared_distance(v1, v2, len));
+}
+
+float dot_product_bf16(const linalg_bf16* v1, const linalg_bf16* v2,
+		size_t len){
+	return bf16_kernels.dot(v1, v2, len);
+}
+
+// bfloat16 has float's exponent range, so its squares can overflow or
+// underflow a float sum as well; redo those sums in double
+static float norm_bf16_in_double(const linalg_bf16* a, const linalg_bf16* b,
+		size_t n){
+	double sum = 0.0;
+	for(size_t i = 0; i < n; i++){
+		double d = bfloat_to_float(a[i]);
+		if(b != NULL) d -= bfloat_to_float(b[i]);
+		sum += d * d;
+	}
+	return (float)sqrt(sum);
+}
+
+float vector_norm_bf16(const linalg_bf16* v1, size_t len){
+	float ssq = bf16_kernels.sum_of_squares(v1, len);
+	if(ssq >= 0x1p-100f && isfinite(ssq)) return sqrtf(ssq);
+	return isnan(ssq) ? ssq : norm_bf16_in_double(v1, NULL, len);
+}
+
+float distance_between_vectors_bf16(const linalg_bf16* v1,
+		const linalg_bf16* v2, size_t len){
+	float ssq = bf16_kernels.squared_distance(v1, v2, len);
+	if(ssq >= 0x1p-100f && isfinite(ssq)) return sqrtf(ssq);
+	return isnan(ssq) ? ssq : norm_bf16_in_double(v1, v2, len);
+}
+
+/* ---------------------------------------------------
+ * Matrix-vector products (BLAS-2). A*x runs four rows
+ * at a time through dot4, sharing the loads of x;
+ * A^T*x and the rank-1 update are axpy's over rows.
+ * Rows (A*x, GER) or columns (A^T*x) are split between
+ * threads on fixed boundaries, so results do not
+ * depend on the thread count.
+ * ------------------------------------------------- */
+
+#define GEMV_ROWS 4
+#define GEMV_COL_BLOCK 2048  // doubles of y kept in L1 by A^T*x
+
+typedef struct {
+	double* y;
+	double** a;
+	const double* x;
+	size_t rows, cols;
+	double alpha, beta;
+} gemv_args;
+
+static void gemv_store(double* y, double value, double beta){
+	*y = beta == 0.0 ? value : value + beta * *y;
+}
+
+static void gemv_task(void* ctx, size_t t, size_t n_threads){
+	const gemv_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->rows, t, n_threads, GEMV_ROWS, &begin, &end);
+	size_t i = begin;
+	for(; i + GEMV_ROWS <= end; i += GEMV_ROWS){
+		double d[GEMV_ROWS];
+		vec_kernels.dot4((const double* const*)g->a + i, g->x, g->cols, d);
+		for(size_t r = 0; r < GEMV_ROWS; r++){
+			gemv_store(g->y + i + r, g->alpha * d[r], g->beta);
+		}
+	}
+	for(; i < end; i++){
+		gemv_store(g->y + i, g->alpha * vec_kernels.dot(g->a[i], g->x, g->cols),
+				g->beta);
+	}
+}
+
+// y[begin, end) = alpha * A^T x + beta * y, over all rows of A
+static void gemv_transposed_task(void* ctx, size_t t, size_t n_threads){
+	const gemv_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->cols, t, n_threads, LINALG_ALIGNMENT / sizeof(double),
+			&begin, &end);
+	for(size_t j = begin; j < end; j += GEMV_COL_BLOCK){
+		size_t n = end - j < GEMV_COL_BLOCK ? end - j : GEMV_COL_BLOCK;
+		double* y = g->y + j;
+		if(g->beta == 0.0){
+			memset(y, 0, n * sizeof(double));
+		} else if(g->beta != 1.0){
+			vec_kernels.scale(y, g->beta, n);
+		}
+		for(size_t i = 0; i < g->rows; i++){
+			vec_kernels.axpy(y, g->alpha * g->x[i], g->a[i] + j, n);
+		}
+	}
+}
+
+// A += alpha * x y^T, g->x is x and g->y is y
+static void rank_one_task(void* ctx, size_t t, size_t n_threads){
+	const gemv_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->rows, t, n_threads, 1, &begin, &end);
+	for(size_t i = begin; i < end; i++){
+		vec_kernels.axpy(g->a[i], g->alpha * g->x[i], g->y, g->cols);
+	}
+}
+
+static void gemv_run(void (*task)(void*, size_t, size_t), gemv_args* g){
+	if(parallel_worthwhile(g->rows * g->cols)){
+		linalg_parallel(task, g);
+	} else {
+		task(g, 0, 1);
+	}
+}
+
+void general_matrix_vector_multiplication(double* res, double** mat,
+		double* vec, size_t rows, size_t cols, double alpha, double beta,
+		int transpose_mat){
+	gemv_args g = {res, mat, vec, rows, cols, alpha, beta};
+	gemv_run(transpose_mat ? gemv_transposed_task : gemv_task, &g);
+}
+
+void matrix_vector_multiplication(double* res, double** mat, double* vec,
+		size_t rows, size_t cols){
+	general_matrix_vector_multiplication(res, mat, vec, rows, cols, 1.0, 0.0,
+			LINALG_NO_TRANSPOSE);
+}
+
+void rank_one_update(double** mat, double* x, double* y, size_t rows,
+		size_t cols, double alpha){
+	gemv_args g = {y, mat, x, rows, cols, alpha, 0.0};
+	gemv_run(rank_one_task, &g);
+}
+
+/* ---------------------------------------------------
+ * Batched small matrices. Many same-shaped matrices in
+ * one array are processed by one call; the batch is
+ * split between threads. Square GEMM and GEMV of the
+ * common sizes use kernels with compile-time bounds,
+ * compiled for every instruction set like the vector
+ * kernels; other shapes use plain loops.
+ * ------------------------------------------------- */
+
+#define BATCH_FIXED_SIZES 5
+static const size_t batch_fixed_size[BATCH_FIXED_SIZES] = {2, 3, 4, 8, 16};
+
+// C = alpha*A*B + beta*C, all N x N
+typedef void (*small_gemm_kernel)(const double* a, size_t lda,
+		const double* b, size_t ldb, double* c, size_t ldc,
+		double alpha, double beta);
+// y = alpha*A*x + beta*y, A N x N
+typedef void (*small_gemv_kernel)(const double* a, size_t lda,
+		const double* x, double* y, double alpha, double beta);
+
+#define DEFINE_SMALL_KERNELS(isa, TARGET, N) \
+TARGET static void small_gemm_##N##_##isa(const double* a, size_t lda, \
+		const double* b, size_t ldb, double* c, size_t ldc, \
+		double alpha, double beta){ \
+	for(size_t i = 0; i < (N); i++){ \
+		double acc[N] = {0}; \
+		_Pragma("GCC unroll 16") \
+		for(size_t p = 0; p < (N); p++){ \
+			double x = a[i*lda + p]; \
+			_Pragma("GCC unroll 16") \
+			for(size_t j = 0; j < (N); j++) acc[j] += x * b[p*ldb + j]; \
+		} \
+		double* ci = c + i*ldc; \
+		if(beta == 0.0){ \
+			for(size_t j = 0; j < (N); j++) ci[j] = alpha * acc[j]; \
+		} else { \
+			for(size_t j = 0; j < (N); j++) ci[j] = alpha * acc[j] + beta * ci[j]; \
+		} \
+	} \
+} \
+TARGET static void small_gemv_##N##_##isa(const double* a, size_t lda, \
+		const double* x, double* y, double alpha, double beta){ \
+	double acc[N]; \
+	for(size_t i = 0; i < (N); i++){ \
+		double sum = 0; \
+		_Pragma("GCC unroll 16") \
+		for(size_t p = 0; p < (N); p++) sum += a[i*lda + p] * x[p]; \
+		acc[i] = alpha * sum; \
+	} \
+	if(beta == 0.0){ \
+		for(size_t i = 0; i < (N); i++) y[i] = acc[i]; \
+	} else { \
+		for(size_t i = 0; i < (N); i++) y[i] = acc[i] + beta * y[i]; \
+	} \
+}
+
+#define DEFINE_SMALL_KERNEL_SET(isa, TARGET) \
+	DEFINE_SMALL_KERNELS(isa, TARGET, 2) \
+	DEFINE_SMALL_KERNELS(isa, TARGET, 3) \
+	DEFINE_SMALL_KERNELS(isa, TARGET, 4) \
+	DEFINE_SMALL_KERNELS(isa, TARGET, 8) \
+	DEFINE_SMALL_KERNELS(isa, TARGET, 16) \
+static const small_gemm_kernel small_gemm_##isa[BATCH_FIXED_SIZES] = { \
+	small_gemm_2_##isa, small_gemm_3_##isa, small_gemm_4_##isa, \
+	small_gemm_8_##isa, small_gemm_16_##isa}; \
+static const small_gemv_kernel small_gemv_##isa[BATCH_FIXED_SIZES] = { \
+	small_gemv_2_##isa, small_gemv_3_##isa, small_gemv_4_##isa, \
+	small_gemv_8_##isa, small_gemv_16_##isa};
+
+DEFINE_SMALL_KERNEL_SET(generic, )
+#ifdef LINALG_X86
+DEFINE_SMALL_KERNEL_SET(avx2, LINALG_TARGET_AVX2)
+DEFINE_SMALL_KERNEL_SET(avx512, LINALG_TARGET_AVX512)
+#endif
+
+// Index of n in batch_fixed_size, or -1
+static int batch_fixed_index(size_t n){
+	for(int k = 0; k < BATCH_FIXED_SIZES; k++){
+		if(batch_fixed_size[k] == n) return k;
+	}
+	return -1;
+}
+
+static small_gemm_kernel small_gemm_for(size_t n){
+	int k = batch_fixed_index(n);
+	if(k < 0) return NULL;
+#ifdef LINALG_X86
+	if(current_isa == LINALG_ISA_AVX512) return small_gemm_avx512[k];
+	if(current_isa == LINALG_ISA_AVX2) return small_gemm_avx2[k];
+#endif
+	return small_gemm_generic[k];
+}
+
+static small_gemv_kernel small_gemv_for(size_t n){
+	int k = batch_fixed_index(n);
+	if(k < 0) return NULL;
+#ifdef LINALG_X86
+	if(current_isa == LINALG_ISA_AVX512) return small_gemv_avx512[k];
+	if(current_isa == LINALG_ISA_AVX2) return small_gemv_avx2[k];
+#endif
+	return small_gemv_generic[k];
+}
+
+matrix_batch matrix_batch_contiguous(double* data, size_t rows, size_t cols){
+	return (matrix_batch){data, rows, cols, cols, rows * cols};
+}
+
+#define BATCH_AT(mb, b, i, j) ((mb).data[(b)*(mb).stride + (i)*(mb).ld + (j)])
+
+typedef enum {
+	BATCH_GEMM,
+	BATCH_GEMV,
+	BATCH_TRANSPOSE,
+	BATCH_ADD_SCALED,  // res = a + s*b
+	BATCH_MULTIPLY,    // res = a .* b
+	BATCH_SCALE        // res = s*a
+} batch_op;
+
+typedef struct {
+	batch_op op;
+	matrix_batch res, a, b;
+	vector_batch y, x;
+	size_t count;
+	size_t k;          // inner dimension of GEMM
+	double alpha, beta;
+	int trans_a, trans_b;
+	small_gemm_kernel gemm_fixed;
+	small_gemv_kernel gemv_fixed;
+} batch_args;
+
+// Copies op(X) (rows x cols of the result) of matrix b into dense buf
+// Operand b as rows x cols, element (i, j) at [i*row_step + j*col_step].
+// Transposed operands are copied to buf when there is one, and read in
+// place, with strided columns, otherwise.
+static const double* batch_operand(const matrix_batch* X, size_t b, int trans,
+		size_t rows, size_t cols, double* buf, size_t* row_step,
+		size_t* col_step){
+	const double* x = X->data + b * X->stride;
+	if(!trans){
+		*row_step = X->ld;
+		*col_step = 1;
+		return x;
+	}
+	if(buf == NULL){
+		*row_step = 1;
+		*col_step = X->ld;
+		return x;
+	}
+	for(size_t i = 0; i < rows; i++){
+		for(size_t j = 0; j < cols; j++) buf[i*cols + j] = x[j*X->ld + i];
+	}
+	*row_step = cols;
+	*col_step = 1;
+	return buf;
+}
+
+static void batch_gemm_one(const batch_args* g, size_t b, double* buf_a,
+		double* buf_b){
+	const size_t m = g->res.rows, n = g->res.cols, k = g->k;
+	size_t lda, a_step, ldb, b_step;
+	const double* a = batch_operand(&g->a, b, g->trans_a, m, k, buf_a,
+			&lda, &a_step);
+	const double* bb = batch_operand(&g->b, b, g->trans_b, k, n, buf_b,
+			&ldb, &b_step);
+	double* c = g->res.data + b * g->res.stride;
+	if(g->gemm_fixed && a_step == 1 && b_step == 1){
+		g->gemm_fixed(a, lda, bb, ldb, c, g->res.ld, g->alpha, g->beta);
+		return;
+	}
+	for(size_t i = 0; i < m; i++){
+		double* ci = c + i * g->res.ld;
+		if(g->beta == 0.0){
+			for(size_t j = 0; j < n; j++) ci[j] = 0;
+		} else if(g->beta != 1.0){
+			for(size_t j = 0; j < n; j++) ci[j] *= g->beta;
+		}
+		for(size_t p = 0; p < k; p++){
+			double x = g->alpha * a[i*lda + p*a_step];
+			const double* bp = bb + p * ldb;
+			if(b_step == 1){
+				for(size_t j = 0; j < n; j++) ci[j] += x * bp[j];
+			} else {
+				for(size_t j = 0; j < n; j++) ci[j] += x * bp[j*b_step];
+			}
+		}
+	}
+}
+
+static void batch_gemv_one(const batch_args* g, size_t b){
+	const double* a = g->a.data + b * g->a.stride;
+	const double* x = g->x.data + b * g->x.stride;
+	double* y = g->y.data + b * g->y.stride;
+	if(g->gemv_fixed){
+		g->gemv_fixed(a, g->a.ld, x, y, g->alpha, g->beta);
+		return;
+	}
+	if(!g->trans_a){
+		for(size_t i = 0; i < g->a.rows; i++){
+			double sum = 0;
+			for(size_t p = 0; p < g->a.cols; p++) sum += a[i*g->a.ld + p] * x[p];
+			y[i] = g->alpha * sum + (g->beta == 0.0 ? 0.0 : g->beta * y[i]);
+		}
+		return;
+	}
+	// y = alpha*A^T*x + beta*y, row by row of A
+	for(size_t j = 0; j < g->a.cols; j++){
+		y[j] = g->beta == 0.0 ? 0.0 : g->beta * y[j];
+	}
+	for(size_t i = 0; i < g->a.rows; i++){
+		double s = g->alpha * x[i];
+		for(size_t j = 0; j < g->a.cols; j++) y[j] += s * a[i*g->a.ld + j];
+	}
+}
+
+static void batch_range(const batch_args* g, size_t begin, size_t end){
+	double buf_a[16 * 16], buf_b[16 * 16];
+	double* heap_a = NULL;
+	double* heap_b = NULL;
+	double* pa = buf_a;
+	double* pb = buf_b;
+	if(g->op == BATCH_GEMM){
+		// Transposed operands are copied; large ones to the heap. If that
+		// fails they are read in place (pa or pb NULL), more slowly.
+		size_t na = g->res.rows * g->k, nb = g->k * g->res.cols;
+		if(g->trans_a && na > 16 * 16) pa = heap_a = malloc(na * sizeof(double));
+		if(g->trans_b && nb > 16 * 16) pb = heap_b = malloc(nb * sizeof(double));
+	}
+	const size_t rows = g->res.rows, cols = g->res.cols;
+	for(size_t b = begin; b < end; b++){
+		switch(g->op){
+		case BATCH_GEMM:
+			batch_gemm_one(g, b, pa, pb);
+			break;
+		case BATCH_GEMV:
+			batch_gemv_one(g, b);
+			break;
+		case BATCH_TRANSPOSE:
+			for(size_t i = 0; i < rows; i++){
+				for(size_t j = 0; j < cols; j++){
+					BATCH_AT(g->res, b, i, j) = BATCH_AT(g->a, b, j, i);
+				}
+			}
+			break;
+		case BATCH_ADD_SCALED:
+			for(size_t i = 0; i < rows; i++){
+				double* r = &BATCH_AT(g->res, b, i, 0);
+				const double* x = &BATCH_AT(g->a, b, i, 0);
+				const double* y = &BATCH_AT(g->b, b, i, 0);
+				for(size_t j = 0; j < cols; j++) r[j] = x[j] + g->alpha * y[j];
+			}
+			break;
+		case BATCH_MULTIPLY:
+			for(size_t i = 0; i < rows; i++){
+				vec_kernels.mul(&BATCH_AT(g->res, b, i, 0),
+						&BATCH_AT(g->a, b, i, 0), &BATCH_AT(g->b, b, i, 0), cols);
+			}
+			break;
+		case BATCH_SCALE:
+			for(size_t i = 0; i < rows; i++){
+				double* r = &BATCH_AT(g->res, b, i, 0);
+				const double* x = &BATCH_AT(g->a, b, i, 0);
+				for(size_t j = 0; j < cols; j++) r[j] = g->alpha * x[j];
+			}
+			break;
+		}
+	}
+	free(heap_a);
+	free(heap_b);
+}
+
+static void batch_task(void* ctx, size_t t, size_t n_threads){
+	const batch_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->count, t, n_threads, 1, &begin, &end);
+	batch_range(g, begin, end);
+}
+
+static void batch_run(batch_args* g, size_t work_per_item){
+	if(parallel_worthwhile(g->count * work_per_item)){
+		linalg_parallel(batch_task, g);
+	} else {
+		batch_range(g, 0, g->count);
+	}
+}
+
+static int batch_valid(const matrix_batch* mb){
+	return mb->data != NULL && mb->ld >= mb->cols;
+}
+
+static int batch_same_shape(const matrix_batch* a, const matrix_batch* b){
+	return a->rows == b->rows && a->cols == b->cols;
+}
+
+int batched_general_matrix_multiplication(matrix_batch res, matrix_batch mat1,
+		matrix_batch mat2, size_t count, double alpha, double beta,
+		int transpose_mat1, int transpose_mat2){
+	size_t m1 = transpose_mat1 ? mat1.cols : mat1.rows;
+	size_t k1 = transpose_mat1 ? mat1.rows : mat1.cols;
+	size_t k2 = transpose_mat2 ? mat2.cols : mat2.rows;
+	size_t n2 = transpose_mat2 ? mat2.rows : mat2.cols;
+	if(!batch_valid(&res) || !batch_valid(&mat1) || !batch_valid(&mat2)
+			|| m1 != res.rows || n2 != res.cols || k1 != k2){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_GEMM, .res = res, .a = mat1, .b = mat2,
+		.count = count, .k = k1, .alpha = alpha, .beta = beta,
+		.trans_a = transpose_mat1, .trans_b = transpose_mat2};
+	if(res.rows == res.cols && res.rows == k1) g.gemm_fixed = small_gemm_for(k1);
+	batch_run(&g, res.rows * res.cols * k1);
+	return 0;
+}
+
+int batched_matrix_vector_multiplication(vector_batch y, matrix_batch mat,
+		vector_batch x, size_t count, double alpha, double beta,
+		int transpose_mat){
+	size_t m = transpose_mat ? mat.cols : mat.rows;
+	size_t n = transpose_mat ? mat.rows : mat.cols;
+	if(!batch_valid(&mat) || y.data == NULL || x.data == NULL
+			|| y.len != m || x.len != n){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_GEMV, .a = mat, .y = y, .x = x,
+		.count = count, .alpha = alpha, .beta = beta, .trans_a = transpose_mat};
+	if(!transpose_mat && mat.rows == mat.cols) g.gemv_fixed = small_gemv_for(m);
+	batch_run(&g, m * n);
+	return 0;
+}
+
+int batched_transpose(matrix_batch res, matrix_batch mat, size_t count){
+	if(!batch_valid(&res) || !batch_valid(&mat)
+			|| res.rows != mat.cols || res.cols != mat.rows){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_TRANSPOSE, .res = res, .a = mat, .count = count};
+	batch_run(&g, res.rows * res.cols);
+	return 0;
+}
+
+int batched_add_scaled(matrix_batch res, matrix_batch mat1, matrix_batch mat2,
+		double factor, size_t count){
+	if(!batch_valid(&res) || !batch_valid(&mat1) || !batch_valid(&mat2)
+			|| !batch_same_shape(&res, &mat1) || !batch_same_shape(&res, &mat2)){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_ADD_SCALED, .res = res, .a = mat1, .b = mat2,
+		.count = count, .alpha = factor};
+	batch_run(&g, res.rows * res.cols);
+	return 0;
+}
+
+int batched_elementwise_multiplication(matrix_batch res, matrix_batch mat1,
+		matrix_batch mat2, size_t count){
+	if(!batch_valid(&res) || !batch_valid(&mat1) || !batch_valid(&mat2)
+			|| !batch_same_shape(&res, &mat1) || !batch_same_shape(&res, &mat2)){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_MULTIPLY, .res = res, .a = mat1, .b = mat2,
+		.count = count};
+	batch_run(&g, res.rows * res.cols);
+	return 0;
+}
+
+int batched_scale(matrix_batch res, matrix_batch mat, double factor,
+		size_t count){
+	if(!batch_valid(&res) || !batch_valid(&mat) || !batch_same_shape(&res, &mat)){
+		return -1;
+	}
+	batch_args g = {.op = BATCH_SCALE, .res = res, .a = mat, .count = count,
+		.alpha = factor};
+	batch_run(&g, res.rows * res.cols);
+	return 0;
+}
+
+/* ---------------------------------------------------
+ * Sparse matrices. CSR stores rows (major) of column
+ * indices (minor), CSC the other way around; minor
+ * indices are sorted and unique within a major. Triplets
+ * are bucketed by major with a counting pass and each
+ * major is then sorted on its own; conversion is one
+ * counting pass, O(nnz + rows + cols).
+ *
+ * Products that gather along a major (CSR A*x, CSC
+ * A^T*x, CSR A*B) split the majors between threads in
+ * ranges of about equal nnz. A*B with CSC splits the
+ * columns of B instead. Every output element is
+ * summed in the same order for any thread count.
+ * ------------------------------------------------- */
+
+static size_t sparse_major(const sparse_matrix* A){
+	return A->format == LINALG_CSR ? A->rows : A->cols;
+}
+
+static size_t sparse_minor(const sparse_matrix* A){
+	return A->format == LINALG_CSR ? A->cols : A->rows;
+}
+
+static sparse_matrix* sparse_alloc(sparse_format format, size_t rows,
+		size_t cols, size_t nnz){
+	sparse_matrix* A = malloc(sizeof(sparse_matrix));
+	if(A == NULL) return NULL;
+	A->format = format;
+	A->rows = rows;
+	A->cols = cols;
+	A->nnz = nnz;
+	size_t major = sparse_major(A);
+	A->ptr = calloc(major + 1, sizeof(size_t));
+	A->index = malloc((nnz ? nnz : 1) * sizeof(size_t));
+	A->values = malloc((nnz ? nnz : 1) * sizeof(double));
+	if(A->ptr == NULL || A->index == NULL || A->values == NULL){
+		destroy_sparse_matrix(A);
+		return NULL;
+	}
+	return A;
+}
+
+void destroy_sparse_matrix(sparse_matrix* A){
+	if(A == NULL) return;
+	free(A->ptr);
+	free(A->index);
+	free(A->values);
+	free(A);
+}
+
+// Exclusive prefix sum of count[0 .. n) into start[0 .. n]
+static void sparse_prefix_sum(const size_t* count, size_t* start, size_t n){
+	size_t sum = 0;
+	for(size_t i = 0; i < n; i++){
+		size_t c = count[i]; // start may alias count
+		start[i] = sum;
+		sum += c;
+	}
+	start[n] = sum;
+}
+
+typedef struct {
+	size_t index;
+	double value;
+} sparse_entry;
+
+static int sparse_entry_compare(const void* a, const void* b){
+	size_t x = ((const sparse_entry*)a)->index, y = ((const sparse_entry*)b)->index;
+	return (x > y) - (x < y);
+}
+
+// Sorts entries begin .. end-1 of A by index; short runs by insertion
+#define SPARSE_INSERTION_SORT 32
+static void sparse_sort_major(sparse_matrix* A, size_t begin, size_t end,
+		sparse_entry* buf){
+	size_t n = end - begin;
+	size_t* index = A->index + begin;
+	double* values = A->values + begin;
+	if(n <= SPARSE_INSERTION_SORT){
+		for(size_t k = 1; k < n; k++){
+			size_t j = k, idx = index[k];
+			double v = values[k];
+			for(; j > 0 && index[j - 1] > idx; j--){
+				index[j] = index[j - 1];
+				values[j] = values[j - 1];
+			}
+			index[j] = idx;
+			values[j] = v;
+		}
+		return;
+	}
+	for(size_t k = 0; k < n; k++) buf[k] = (sparse_entry){index[k], values[k]};
+	qsort(buf, n, sizeof(sparse_entry), sparse_entry_compare);
+	for(size_t k = 0; k < n; k++){
+		index[k] = buf[k].index;
+		values[k] = buf[k].value;
+	}
+}
+
+sparse_matrix* create_sparse_matrix_from_triplets(size_t rows, size_t cols,
+		size_t nnz, const size_t* row_index, const size_t* col_index,
+		const double* values, sparse_format format){
+	for(size_t k = 0; k < nnz; k++){
+		if(row_index[k] >= rows || col_index[k] >= cols) return NULL;
+	}
+	sparse_matrix* A = sparse_alloc(format, rows, cols, nnz);
+	size_t major = format == LINALG_CSR ? rows : cols;
+	const size_t* major_index = format == LINALG_CSR ? row_index : col_index;
+	const size_t* minor_index = format == LINALG_CSR ? col_index : row_index;
+	size_t* next = malloc((major + 1) * sizeof(size_t));
+	if(A == NULL || next == NULL){
+		destroy_sparse_matrix(A);
+		free(next);
+		return NULL;
+	}
+
+	// Bucket by major (sequential for input sorted by row), then sort
+	// each major's minors; both passes stay in cache for typical input
+	for(size_t k = 0; k < nnz; k++) A->ptr[major_index[k]]++;
+	sparse_prefix_sum(A->ptr, A->ptr, major);
+	memcpy(next, A->ptr, major * sizeof(size_t));
+	for(size_t k = 0; k < nnz; k++){
+		size_t pos = next[major_index[k]]++;
+		A->index[pos] = minor_index[k];
+		A->values[pos] = values[k];
+	}
+	size_t longest = 0;
+	for(size_t i = 0; i < major; i++){
+		size_t n = A->ptr[i + 1] - A->ptr[i];
+		longest = n > longest ? n : longest;
+	}
+	sparse_entry* buf = NULL;
+	if(longest > SPARSE_INSERTION_SORT){
+		buf = malloc(longest * sizeof(sparse_entry));
+		if(buf == NULL){
+			destroy_sparse_matrix(A);
+			free(next);
+			return NULL;
+		}
+	}
+	for(size_t i = 0; i < major; i++){
+		sparse_sort_major(A, A->ptr[i], A->ptr[i + 1], buf);
+	}
+	free(buf);
+	free(next);
+
+	// Sum duplicates, compacting in place
+	size_t w = 0;
+	for(size_t i = 0; i < major; i++){
+		size_t begin = A->ptr[i], end = A->ptr[i + 1];
+		A->ptr[i] = w;
+		for(size_t k = begin; k < end; k++){
+			if(w > A->ptr[i] && A->index[w - 1] == A->index[k]){
+				A->values[w - 1] += A->values[k];
+			} else {
+				A->index[w] = A->index[k];
+				A->values[w] = A->values[k];
+				w++;
+			}
+		}
+	}
+	A->ptr[major] = w;
+	A->nnz = w;
+	return A;
+}
+
+sparse_matrix* create_converted_sparse_matrix(const sparse_matrix* A,
+		sparse_format format){
+	sparse_matrix* B = sparse_alloc(format, A->rows, A->cols, A->nnz);
+	if(B == NULL) return NULL;
+	size_t major = sparse_major(A), minor = sparse_minor(A);
+	if(format == A->format){
+		memcpy(B->ptr, A->ptr, (major + 1) * sizeof(size_t));
+		memcpy(B->index, A->index, A->nnz * sizeof(size_t));
+		memcpy(B->values, A->values, A->nnz * sizeof(double));
+		return B;
+	}
+	size_t* next = calloc(minor + 1, sizeof(size_t));
+	if(next == NULL){
+		destroy_sparse_matrix(B);
+		return NULL;
+	}
+	for(size_t k = 0; k < A->nnz; k++) next[A->index[k]]++;
+	sparse_prefix_sum(next, B->ptr, minor);
+	memcpy(next, B->ptr, minor * sizeof(size_t));
+	for(size_t i = 0; i < major; i++){
+		for(size_t k = A->ptr[i]; k < A->ptr[i + 1]; k++){
+			size_t pos = next[A->index[k]]++;
+			B->index[pos] = i;
+			B->values[pos] = A->values[k];
+		}
+	}
+	free(next);
+	return B;
+}
+
+sparse_matrix* create_sparse_matrix_from_dense(double** mat, size_t rows,
+		size_t cols, double tolerance, sparse_format format){
+	size_t nnz = 0;
+	for(size_t i = 0; i < rows; i++){
+		for(size_t j = 0; j < cols; j++) nnz += fabs(mat[i][j]) > tolerance;
+	}
+	sparse_matrix* A = sparse_alloc(LINALG_CSR, rows, cols, nnz);
+	if(A == NULL) return NULL;
+	size_t k = 0;
+	for(size_t i = 0; i < rows; i++){
+		A->ptr[i] = k;
+		for(size_t j = 0; j < cols; j++){
+			if(fabs(mat[i][j]) > tolerance){
+				A->index[k] = j;
+				A->values[k] = mat[i][j];
+				k++;
+			}
+		}
+	}
+	A->ptr[rows] = k;
+	if(format == LINALG_CSR) return A;
+	sparse_matrix* B = create_converted_sparse_matrix(A, format);
+	destroy_sparse_matrix(A);
+	return B;
+}
+
+double** create_dense_matrix_from_sparse(const sparse_matrix* A){
+	double** mat = create_matrix(A->rows, A->cols);
+	if(mat == NULL) return NULL;
+	for(size_t i = 0; i < sparse_major(A); i++){
+		for(size_t k = A->ptr[i]; k < A->ptr[i + 1]; k++){
+			if(A->format == LINALG_CSR) mat[i][A->index[k]] = A->values[k];
+			else mat[A->index[k]][i] = A->values[k];
+		}
+	}
+	return mat;
+}
+
+// Majors [*begin, *end) of part t: ranges with about equal nnz
+static void sparse_partition(const sparse_matrix* A, size_t t,
+		size_t n_parts, size_t* begin, size_t* end){
+	size_t major = sparse_major(A);
+	size_t bound[2];
+	for(int e = 0; e < 2; e++){
+		size_t target = A->nnz * (t + e) / n_parts;
+		// First major whose nonzeros start at or after target
+		size_t lo = 0, hi = major;
+		while(lo < hi){
+			size_t mid = lo + (hi - lo) / 2;
+			if(A->ptr[mid] < target) lo = mid + 1;
+			else hi = mid;
+		}
+		bound[e] = lo;
+	}
+	*begin = bound[0];
+	*end = t + 1 == n_parts ? major : bound[1];
+}
+
+typedef struct {
+	const sparse_matrix* A;
+	double* y;
+	const double* x;
+	double** res;
+	double** mat;
+	size_t p;
+	double alpha, beta;
+} sparse_args;
+
+// y[i] = alpha * sum_k values[k] x[index[k]] + beta * y[i] over majors i
+static void spmv_gather_task(void* ctx, size_t t, size_t n_threads){
+	const sparse_args* g = ctx;
+	const sparse_matrix* A = g->A;
+	size_t begin, end;
+	sparse_partition(A, t, n_threads, &begin, &end);
+	for(size_t i = begin; i < end; i++){
+		double sum = 0;
+		for(size_t k = A->ptr[i]; k < A->ptr[i + 1]; k++){
+			sum += A->values[k] * g->x[A->index[k]];
+		}
+		g->y[i] = g->beta == 0.0 ? g->alpha * sum : g->alpha * sum + g->beta * g->y[i];
+	}
+}
+
+static void scale_or_zero(double* v, double beta, size_t n){
+	if(beta == 0.0) memset(v, 0, n * sizeof(double));
+	else if(beta != 1.0) vec_kernels.scale(v, beta, n);
+}
+
+void sparse_matrix_vector_multiplication(double* res, const sparse_matrix* A,
+		const double* vec, double alpha, double beta, int transpose){
+	sparse_args g = {.A = A, .y = res, .x = vec, .alpha = alpha, .beta = beta};
+	int gather = (A->format == LINALG_CSR) != (transpose == LINALG_TRANSPOSE);
+	if(gather){
+		if(parallel_worthwhile(A->nnz)) linalg_parallel(spmv_gather_task, &g);
+		else spmv_gather_task(&g, 0, 1);
+		return;
+	}
+	// Scatter along the majors; serial
+	scale_or_zero(res, beta, sparse_minor(A));
+	for(size_t i = 0; i < sparse_major(A); i++){
+		double s = alpha * vec[i];
+		for(size_t k = A->ptr[i]; k < A->ptr[i + 1]; k++){
+			res[A->index[k]] += s * A->values[k];
+		}
+	}
+}
+
+// CSR: rows of res split by nnz
+static void spmm_rows_task(void* ctx, size_t t, size_t n_threads){
+	const sparse_args* g = ctx;
+	const sparse_matrix* A = g->A;
+	size_t begin, end;
+	sparse_partition(A, t, n_threads, &begin, &end);
+	for(size_t i = begin; i < end; i++){
+		scale_or_zero(g->res[i], g->beta, g->p);
+		for(size_t k = A->ptr[i]; k < A->ptr[i + 1]; k++){
+			vec_kernels.axpy(g->res[i], g->alpha * A->values[k],
+					g->mat[A->index[k]], g->p);
+		}
+	}
+}
+
+// CSC: columns of res split, every thread scatters all nonzeros
+static void spmm_cols_task(void* ctx, size_t t, size_t n_threads){
+	const sparse_args* g = ctx;
+	const sparse_matrix* A = g->A;
+	size_t begin, end;
+	partition_range(g->p, t, n_threads, LINALG_ALIGNMENT / sizeof(double),
+			&begin, &end);
+	if(end == begin) return;
+	for(size_t i = 0; i < A->rows; i++){
+		scale_or_zero(g->res[i] + begin, g->beta, end - begin);
+	}
+	for(size_t j = 0; j < A->cols; j++){
+		for(size_t k = A->ptr[j]; k < A->ptr[j + 1]; k++){
+			vec_kernels.axpy(g->res[A->index[k]] + begin, g->alpha * A->values[k],
+					g->mat[j] + begin, end - begin);
+		}
+	}
+}
+
+void sparse_dense_matrix_multiplication(double** res, const sparse_matrix* A,
+		double** mat, size_t p, double alpha, double beta){
+	sparse_args g = {.A = A, .res = res, .mat = mat, .p = p,
+		.alpha = alpha, .beta = beta};
+	parallel_task task = A->format == LINALG_CSR ? spmm_rows_task : spmm_cols_task;
+	if(parallel_worthwhile(A->nnz * p)) linalg_parallel(task, &g);
+	else task(&g, 0, 1);
+}
+
+/* ---------------------------------------------------
+ * Factorizations and triangular solves. Cholesky and
+ * the triangular solves are right-looking and blocked
+ * by FACTOR_BLOCK rows/columns; LU is blocked by
+ * LU_BLOCK columns and factors each panel by splitting
+ * its columns recursively. Narrow panels are factored with
+ * BLAS-1/2 kernels and everything else is a level-3
+ * update through gemm on views into the same rows, so
+ * the bulk of the flops run in the packed, threaded
+ * GEMM.
+ * ------------------------------------------------- */
+
+#define FACTOR_BLOCK 64
+#define SYRK_STRIP 256  // column strip of the Cholesky trailing update
+#define LU_BASE 16      // widest LU panel factored without gemm
+#define LU_BLOCK 128   // columns per LU panel
+
+static void swap_rows(double* a, double* b, size_t n){
+	for(size_t j = 0; j < n; j++){
+		double t = a[j];
+		a[j] = b[j];
+		b[j] = t;
+	}
+}
+
+// op(T)(i, j) for a view T; trans reads T transposed
+#define TRI_AT(T, trans, i, j) \
+	((trans) ? (T).row[j][(T).col + (i)] : (T).row[i][(T).col + (j)])
+
+typedef struct {
+	gemm_operand T, B;
+	size_t b0, b1;  // rows of the diagonal block
+	size_t m;       // columns of B
+	int forward, trans, unit;
+} trsm_args;
+
+// Substitution within the diagonal block, on a range of B's columns
+static void trsm_block_task(void* ctx, size_t t, size_t n_threads){
+	const trsm_args* g = ctx;
+	size_t c0, c1;
+	partition_range(g->m, t, n_threads, LINALG_ALIGNMENT / sizeof(double),
+			&c0, &c1);
+	if(c1 == c0) return;
+	for(size_t s = g->b0; s < g->b1; s++){
+		size_t i = g->forward ? s : g->b1 - 1 - (s - g->b0);
+		double* bi = g->B.row[i] + g->B.col + c0;
+		size_t p0 = g->forward ? g->b0 : i + 1;
+		size_t p1 = g->forward ? i : g->b1;
+		for(size_t p = p0; p < p1; p++){
+			double t_ip = TRI_AT(g->T, g->trans, i, p);
+			if(t_ip != 0.0){
+				vec_kernels.axpy(bi, -t_ip, g->B.row[p] + g->B.col + c0, c1 - c0);
+			}
+		}
+		if(!g->unit) vec_kernels.scale(bi, 1.0 / TRI_AT(g->T, g->trans, i, i), c1 - c0);
+	}
+}
+
+// B (n x m) = op(T)^-1 B for triangular T (n x n)
+static void trsm(size_t n, size_t m, gemm_operand T, int lower, int trans,
+		int unit, gemm_operand B){
+	int forward = lower != trans;
+	for(size_t s = 0; s < n; s += FACTOR_BLOCK){
+		size_t bs = n - s < FACTOR_BLOCK ? n - s : FACTOR_BLOCK;
+		size_t b0 = forward ? s : n - s - bs;
+		trsm_args g = {T, B, b0, b0 + bs, m, forward, trans, unit};
+		if(parallel_worthwhile(bs * m)) linalg_parallel(trsm_block_task, &g);
+		else trsm_block_task(&g, 0, 1);
+
+		// Remove the solved rows from the rest: B[r] -= op(T)[r, blk] B[blk]
+		size_t r0 = forward ? b0 + bs : 0;
+		size_t r1 = forward ? n : b0;
+		if(r1 == r0) continue;
+		gemm_operand A = trans
+			? (gemm_operand){T.row + b0, T.col + r0, 1}
+			: (gemm_operand){T.row + r0, T.col + b0, 0};
+		gemm_operand X = {B.row + b0, B.col, 0};
+		gemm_operand C = {B.row + r0, B.col, 0};
+		gemm(r1 - r0, m, bs, -1.0, A, X, 1.0, C);
+	}
+}
+
+void triangular_solve(double** tri, double** b, size_t n, size_t nrhs,
+		int uplo, int transpose, int diagonal){
+	gemm_operand T = {tri, 0, 0};
+	gemm_operand B = {b, 0, 0};
+	trsm(n, nrhs, T, uplo == LINALG_LOWER, transpose == LINALG_TRANSPOSE,
+			diagonal == LINALG_UNIT_DIAGONAL, B);
+}
+
+// Unblocked LU of columns k .. k+nb-1, rows k .. n-1. Rows are swapped
+// whole, which applies the interchanges to L and the trailing matrix too.
+static int lu_panel(double** a, size_t n, size_t k, size_t nb, size_t* pivot){
+	int status = 0;
+	for(size_t j = k; j < k + nb; j++){
+		size_t p = j;
+		double max = fabs(a[j][j]);
+		for(size_t i = j + 1; i < n; i++){
+			if(fabs(a[i][j]) > max){
+				max = fabs(a[i][j]);
+				p = i;
+			}
+		}
+		pivot[j] = p;
+		if(p != j) swap_rows(a[p], a[j], n);
+		if(a[j][j] == 0.0){
+			status = -1;
+			continue;
+		}
+		for(size_t i = j + 1; i < n; i++){
+			double l = a[i][j] /= a[j][j];
+			if(l != 0.0) vec_kernels.axpy(a[i] + j + 1, -l, a[j] + j + 1, k + nb - j - 1);
+		}
+	}
+	return status;
+}
+
+// LU of columns c0 .. c0+w-1 (rows c0 .. n-1): the left half recursively,
+// then the right half is updated with trsm and gemm and recursed on, so
+// all but the narrowest panels run through gemm.
+static int lu_recursive(double** a, size_t n, size_t c0, size_t w,
+		size_t* pivot){
+	if(w <= LU_BASE) return lu_panel(a, n, c0, w, pivot);
+	size_t h = w / 2;
+	int status = lu_recursive(a, n, c0, h, pivot);
+	trsm(h, w - h, (gemm_operand){a + c0, c0, 0}, 1, 0, 1,
+			(gemm_operand){a + c0, c0 + h, 0});
+	gemm(n - c0 - h, w - h, h, -1.0, (gemm_operand){a + c0 + h, c0, 0},
+			(gemm_operand){a + c0, c0 + h, 0}, 1.0,
+			(gemm_operand){a + c0 + h, c0 + h, 0});
+	if(lu_recursive(a, n, c0 + h, w - h, pivot) != 0) status = -1;
+	return status;
+}
+
+int lu_decomposition(double** mat, size_t n, size_t* pivot){
+	int status = 0;
+	for(size_t k = 0; k < n; k += LU_BLOCK){
+		size_t nb = n - k < LU_BLOCK ? n - k : LU_BLOCK;
+		if(lu_recursive(mat, n, k, nb, pivot) != 0) status = -1;
+		size_t rest = n - k - nb;
+		if(rest == 0) continue;
+		// U12 = L11^-1 A12, then A22 -= L21 U12
+		trsm(nb, rest, (gemm_operand){mat + k, k, 0}, 1, 0, 1,
+				(gemm_operand){mat + k, k + nb, 0});
+		gemm(rest, rest, nb, -1.0, (gemm_operand){mat + k + nb, k, 0},
+				(gemm_operand){mat + k, k + nb, 0}, 1.0,
+				(gemm_operand){mat + k + nb, k + nb, 0});
+	}
+	return status;
+}
+
+void lu_solve(double** lu, size_t n, const size_t* pivot, double** b,
+		size_t nrhs){
+	for(size_t i = 0; i < n; i++){
+		if(pivot[i] != i) swap_rows(b[i], b[pivot[i]], nrhs);
+	}
+	gemm_operand T = {lu, 0, 0};
+	gemm_operand B = {b, 0, 0};
+	trsm(n, nrhs, T, 1, 0, 1, B);
+	trsm(n, nrhs, T, 0, 0, 0, B);
+}
+
+typedef struct {
+	double** a;
+	size_t k, nb;      // diagonal block
+	size_t r0, r1;     // rows below it
+} cholesky_args;
+
+// A21 = A21 L11^-T, row by row
+static void cholesky_rows_task(void* ctx, size_t t, size_t n_threads){
+	const cholesky_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->r1 - g->r0, t, n_threads, 1, &begin, &end);
+	for(size_t i = g->r0 + begin; i < g->r0 + end; i++){
+		double* r = g->a[i] + g->k;
+		for(size_t j = 0; j < g->nb; j++){
+			const double* l = g->a[g->k + j] + g->k;
+			r[j] = (r[j] - vec_kernels.dot(r, l, j)) / l[j];
+		}
+	}
+}
+
+int cholesky_decomposition(double** mat, size_t n){
+	for(size_t k = 0; k < n; k += FACTOR_BLOCK){
+		size_t nb = n - k < FACTOR_BLOCK ? n - k : FACTOR_BLOCK;
+		// L11: left-looking within the (already updated) diagonal block
+		for(size_t j = k; j < k + nb; j++){
+			double d = mat[j][j] - vec_kernels.sum_of_squares(mat[j] + k, j - k);
+			if(!(d > 0.0)) return -1;
+			mat[j][j] = sqrt(d);
+			for(size_t i = j + 1; i < k + nb; i++){
+				mat[i][j] = (mat[i][j] - vec_kernels.dot(mat[i] + k, mat[j] + k, j - k))
+					/ mat[j][j];
+			}
+		}
+		size_t r0 = k + nb;
+		if(r0 == n) break;
+		cholesky_args g = {mat, k, nb, r0, n};
+		if(parallel_worthwhile((n - r0) * nb)) linalg_parallel(cholesky_rows_task, &g);
+		else cholesky_rows_task(&g, 0, 1);
+
+		// A22 -= L21 L21^T, lower strips only
+		for(size_t j = r0; j < n; j += SYRK_STRIP){
+			size_t w = n - j < SYRK_STRIP ? n - j : SYRK_STRIP;
+			gemm(n - j, w, nb, -1.0, (gemm_operand){mat + j, k, 0},
+					(gemm_operand){mat + j, k, 1}, 1.0,
+					(gemm_operand){mat + j, j, 0});
+		}
+	}
+	for(size_t i = 0; i < n; i++){
+		memset(mat[i] + i + 1, 0, (n - i - 1) * sizeof(double));
+	}
+	return 0;
+}
+
+void cholesky_solve(double** l, size_t n, double** b, size_t nrhs){
+	gemm_operand T = {l, 0, 0};
+	gemm_operand B = {b, 0, 0};
+	trsm(n, nrhs, T, 1, 0, 0, B);
+	trsm(n, nrhs, T, 1, 1, 0, B);
+}
+
+int solve_linear_system(double* x, double** mat, double* b, size_t n){
+	double** lu = create_matrix(n, n);
+	size_t* pivot = malloc((n ? n : 1) * sizeof(size_t));
+	double** rows = malloc((n ? n : 1) * sizeof(double*));
+	int status = lu == NULL || pivot == NULL || rows == NULL ? -1 : 0;
+	if(status == 0){
+		for(size_t i = 0; i < n; i++){
+			memcpy(lu[i], mat[i], n * sizeof(double));
+			rows[i] = x + i;
+		}
+		memmove(x, b, n * sizeof(double));
+		status = lu_decomposition(lu, n, pivot);
+	}
+	if(status == 0) lu_solve(lu, n, pivot, rows, 1);
+	free(rows);
+	free(pivot);
+	destroy_matrix(lu, n);
+	return status;
+}
+
+/* ---------------------------------------------------
+ * Householder QR in compact WY form. A panel of
+ * QR_BLOCK columns is factored column by column, and
+ * its reflectors H_1 ... H_nb are combined into
+ * I - V T V^T (V unit lower trapezoidal, T upper
+ * triangular) so that applying them to the trailing
+ * columns, or to right-hand sides, is three gemms.
+ * ------------------------------------------------- */
+
+#define QR_BLOCK 32
+
+// Reflector of x (as LAPACK's dlarfg): x[0] becomes beta and x[1..] v
+// (v_0 = 1, not stored), so that (I - tau v v^T) maps x onto beta e_1.
+// Returns tau.
+static double householder_vector(double* x, size_t len){
+	if(len < 2) return 0.0;
+	double alpha = x[0];
+	double sigma = vec_kernels.sum_of_squares(x + 1, len - 1);
+	if(sigma == 0.0) return 0.0;
+	double beta = -copysign(hypot(alpha, sqrt(sigma)), alpha);
+	vec_kernels.scale(x + 1, 1.0 / (alpha - beta), len - 1);
+	x[0] = beta;
+	return (beta - alpha) / beta;
+}
+
+// Unblocked QR of columns k .. k+nb-1, rows k .. m-1, on a transposed
+// copy p (nb x m-k) so that the reflectors run on contiguous columns
+static void qr_panel(double** a, size_t m, size_t k, size_t nb, double* tau,
+		double** p){
+	size_t mk = m - k;
+	for(size_t i = 0; i < mk; i++){
+		for(size_t j = 0; j < nb; j++) p[j][i] = a[k + i][k + j];
+	}
+	for(size_t j = 0; j < nb; j++){
+		double* x = p[j] + j;
+		size_t len = mk - j;
+		tau[k + j] = householder_vector(x, len);
+		if(tau[k + j] == 0.0) continue;
+		for(size_t c = j + 1; c < nb; c++){
+			double* y = p[c] + j;
+			double w = tau[k + j] * (y[0] + vec_kernels.dot(x + 1, y + 1, len - 1));
+			y[0] -= w;
+			vec_kernels.axpy(y + 1, -w, x + 1, len - 1);
+		}
+	}
+	for(size_t i = 0; i < mk; i++){
+		for(size_t j = 0; j < nb; j++) a[k + i][k + j] = p[j][i];
+	}
+}
+
+typedef struct {
+	double** v;      // rows x QR_BLOCK, V with its unit diagonal and zeros
+	double** t;      // QR_BLOCK x QR_BLOCK
+	double** w;      // QR_BLOCK x cols, V^T C
+	double** w2;     // QR_BLOCK x cols, op(T) V^T C
+	size_t rows;
+} qr_work;
+
+static void qr_work_destroy(qr_work* w){
+	destroy_matrix(w->v, w->rows);
+	destroy_matrix(w->t, QR_BLOCK);
+	destroy_matrix(w->w, QR_BLOCK);
+	destroy_matrix(w->w2, QR_BLOCK);
+}
+
+static int qr_work_create(qr_work* w, size_t rows, size_t cols){
+	w->rows = rows;
+	w->v = create_matrix(rows, QR_BLOCK);
+	w->t = create_matrix(QR_BLOCK, QR_BLOCK);
+	w->w = create_matrix(QR_BLOCK, cols);
+	w->w2 = create_matrix(QR_BLOCK, cols);
+	if(w->v && w->t && w->w && w->w2) return 0;
+	qr_work_destroy(w);
+	return -1;
+}
+
+// V and T of the nb reflectors stored at column k (rows k .. m-1). With
+// S = V^T V, column i of T is -tau_i T[0:i, 0:i] S[0:i, i] over tau_i
+// on the diagonal (LAPACK's dlarft).
+static void qr_block_reflector(double** a, size_t m, size_t k, size_t nb,
+		const double* tau, qr_work* w){
+	size_t mk = m - k;
+	for(size_t i = 0; i < mk; i++){
+		double* v = w->v[i];
+		if(i < nb){
+			memcpy(v, a[k + i] + k, i * sizeof(double));
+			v[i] = 1.0;
+			memset(v + i + 1, 0, (nb - i - 1) * sizeof(double));
+		} else {
+			memcpy(v, a[k + i] + k, nb * sizeof(double));
+		}
+	}
+	double** t = w->t;
+	gemm(nb, nb, mk, 1.0, (gemm_operand){w->v, 0, 1},
+			(gemm_operand){w->v, 0, 0}, 0.0, (gemm_operand){t, 0, 0});
+	double s[QR_BLOCK];
+	for(size_t i = 0; i < nb; i++){
+		for(size_t r = 0; r < i; r++) s[r] = t[r][i];
+		for(size_t r = 0; r < i; r++){
+			double acc = 0.0;
+			for(size_t c = r; c < i; c++) acc += t[r][c] * s[c];
+			t[r][i] = -tau[k + i] * acc;
+		}
+		t[i][i] = tau[k + i];
+	}
+	for(size_t i = 1; i < nb; i++) memset(t[i], 0, i * sizeof(double));
+}
+
+// C (m-k x nc) = (I - V op(T) V^T) C, i.e. the panel's Q^T with trans
+static void qr_apply_block(qr_work* w, size_t mk, size_t nb, gemm_operand C,
+		size_t nc, int trans){
+	gemm(nb, nc, mk, 1.0, (gemm_operand){w->v, 0, 1}, C, 0.0,
+			(gemm_operand){w->w, 0, 0});
+	gemm(nb, nc, nb, 1.0, (gemm_operand){w->t, 0, trans},
+			(gemm_operand){w->w, 0, 0}, 0.0, (gemm_operand){w->w2, 0, 0});
+	gemm(mk, nc, nb, -1.0, (gemm_operand){w->v, 0, 0},
+			(gemm_operand){w->w2, 0, 0}, 1.0, C);
+}
+
+int qr_decomposition(double** mat, size_t rows, size_t cols, double* tau){
+	size_t kmax = rows < cols ? rows : cols;
+	if(kmax == 0) return 0;
+	qr_work w;
+	double** p = create_matrix(QR_BLOCK, rows);
+	if(p == NULL || qr_work_create(&w, rows, cols) != 0){
+		destroy_matrix(p, QR_BLOCK);
+		return -1;
+	}
+	for(size_t k = 0; k < kmax; k += QR_BLOCK){
+		size_t nb = kmax - k < QR_BLOCK ? kmax - k : QR_BLOCK;
+		qr_panel(mat, rows, k, nb, tau, p);
+		if(k + nb == cols) continue;
+		qr_block_reflector(mat, rows, k, nb, tau, &w);
+		qr_apply_block(&w, rows - k, nb, (gemm_operand){mat + k, k + nb, 0},
+				cols - k - nb, 1);
+	}
+	qr_work_destroy(&w);
+	destroy_matrix(p, QR_BLOCK);
+	return 0;
+}
+
+int qr_multiply_q(double** qr, size_t rows, size_t cols, const double* tau,
+		double** b, size_t nrhs, int transpose){
+	size_t kmax = rows < cols ? rows : cols;
+	if(kmax == 0 || nrhs == 0) return 0;
+	qr_work w;
+	if(qr_work_create(&w, rows, nrhs) != 0) return -1;
+	// Q = Q_1 Q_2 ... Q_p over panels: Q^T applies them forward
+	int trans = transpose == LINALG_TRANSPOSE;
+	size_t panels = (kmax + QR_BLOCK - 1) / QR_BLOCK;
+	for(size_t s = 0; s < panels; s++){
+		size_t k = (trans ? s : panels - 1 - s) * QR_BLOCK;
+		size_t nb = kmax - k < QR_BLOCK ? kmax - k : QR_BLOCK;
+		qr_block_reflector(qr, rows, k, nb, tau, &w);
+		qr_apply_block(&w, rows - k, nb, (gemm_operand){b + k, 0, 0}, nrhs, trans);
+	}
+	qr_work_destroy(&w);
+	return 0;
+}
+
+int qr_solve(double** qr, size_t rows, size_t cols, const double* tau,
+		double** b, size_t nrhs){
+	if(rows < cols) return -1;
+	for(size_t i = 0; i < cols; i++){
+		if(qr[i][i] == 0.0) return -1;
+	}
+	if(qr_multiply_q(qr, rows, cols, tau, b, nrhs, LINALG_TRANSPOSE) != 0) return -1;
+	trsm(cols, nrhs, (gemm_operand){qr, 0, 0}, 0, 0, 0, (gemm_operand){b, 0, 0});
+	return 0;
+}
+
+int least_squares(double* x, double** mat, double* y, size_t rows, size_t cols,
+		int intercept){
+	if(rows < cols + (intercept != 0)) return -1;
+	double** a = create_matrix(rows, cols);
+	double** b = create_matrix(rows, 1);
+	double* tau = create_vector(cols + 1);
+	double* mean = create_vector(cols + 1);
+	int status = a && b && tau && mean ? 0 : -1;
+	double y_mean = 0.0;
+	if(status == 0){
+		for(size_t i = 0; i < rows; i++){
+			memcpy(a[i], mat[i], cols * sizeof(double));
+			b[i][0] = y[i];
+		}
+		if(intercept){
+			// Centering the columns and y takes the bias column out of
+			// the fit; the bias is then mean(y) - mean(mat) . x
+			for(size_t i = 0; i < rows; i++){
+				vec_kernels.axpy(mean, 1.0, a[i], cols);
+				y_mean += y[i];
+			}
+			vec_kernels.scale(mean, 1.0 / rows, cols);
+			y_mean /= rows;
+			for(size_t i = 0; i < rows; i++){
+				vec_kernels.axpy(a[i], -1.0, mean, cols);
+				b[i][0] -= y_mean;
+			}
+		}
+		status = qr_decomposition(a, rows, cols, tau);
+	}
+	if(status == 0) status = qr_solve(a, rows, cols, tau, b, 1);
+	if(status == 0){
+		double* w = x + (intercept != 0);
+		double bias = y_mean;
+		for(size_t j = 0; j < cols; j++){
+			w[j] = b[j][0];
+			bias -= mean[j] * w[j];
+		}
+		if(intercept) x[0] = bias;
+	}
+	destroy_vector(mean);
+	destroy_vector(tau);
+	destroy_matrix(b, rows);
+	destroy_matrix(a, rows);
+	return status;
+}
+
+/* ---------------------------------------------------
+ * Symmetric eigensolver: Householder reduction to
+ * tridiagonal form, then Cuppen's divide and conquer.
+ * Each merge deflates, solves the secular equation of
+ * the rank-one tear and takes the eigenvectors from Gu
+ * and Eisenstat's recomputed z, so they stay
+ * orthogonal to working precision; they are applied
+ * to the halves with one gemm. Blocks up to DC_BASE
+ * are solved by implicit QL, and the reduction is
+ * undone through the QR code's compact WY blocks.
+ * ------------------------------------------------- */
+
+#define DC_BASE 32
+#define QL_ITERATIONS_PER_VALUE 30
+#define SECULAR_MAX_ITERATIONS 200
+
+#define TRIDIAG_BLOCK 32
+
+typedef struct {
+	double** a;
+	size_t i, m;      // the trailing block is rows/cols i+1 .. i+m
+	const double* v;
+	double* p;
+	double tau;
+} tridiag_args;
+
+// p = tau A22 v on a range of the trailing block's rows
+static void tridiag_task(void* ctx, size_t t, size_t n_threads){
+	const tridiag_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->m, t, n_threads, 1, &begin, &end);
+	size_t c = g->i + 1;
+	for(size_t r = begin; r < end; r++){
+		g->p[r] = g->tau * vec_kernels.dot(g->a[c + r] + c, g->v, g->m);
+	}
+}
+
+// A = Q T Q^T for symmetric a with both triangles stored: d and e get
+// T's diagonal and subdiagonal, and reflector i is left below the
+// subdiagonal of column i, so rows 1.. of a hold Q in the layout of
+// qr_decomposition. Blocked as LAPACK's dsytrd/dlatrd: within a panel
+// of TRIDIAG_BLOCK columns the trailing matrix is not touched, each
+// column being brought up to date from V and W, and the panel's
+// A -= V W^T + W V^T is applied by gemm. Returns -1 if memory runs out.
+static int tridiagonalize(double** a, size_t n, double* d, double* e,
+		double* tau){
+	double** vm = create_matrix(n, TRIDIAG_BLOCK);
+	double** wm = create_matrix(n, TRIDIAG_BLOCK);
+	double* x = create_vector(2 * TRIDIAG_BLOCK + 2 * n + 1);
+	if(!(vm && wm && x)){
+		destroy_vector(x);
+		destroy_matrix(wm, n);
+		destroy_matrix(vm, n);
+		return -1;
+	}
+	double* x2 = x + TRIDIAG_BLOCK;
+	double* col = x2 + TRIDIAG_BLOCK;
+	double* v = col + 1;
+	double* p = col + n + 1;
+	for(size_t k = 0; k + 1 < n; k += TRIDIAG_BLOCK){
+		size_t nb = n - 1 - k < TRIDIAG_BLOCK ? n - 1 - k : TRIDIAG_BLOCK;
+		for(size_t r = k; r < n; r++){
+			memset(vm[r], 0, nb * sizeof(double));
+			memset(wm[r], 0, nb * sizeof(double));
+		}
+		for(size_t j = 0; j < nb; j++){
+			size_t i = k + j, m = n - i - 1;
+			// Column i (row i, by symmetry) with the panel applied so far
+			for(size_t r = i; r < n; r++){
+				col[r - i] = a[i][r] - vec_kernels.dot(vm[r], wm[i], j)
+					- vec_kernels.dot(wm[r], vm[i], j);
+			}
+			tau[i] = householder_vector(v, m);
+			d[i] = col[0];
+			e[i] = v[0];
+			v[0] = 1.0;
+			for(size_t r = 0; r < m; r++){
+				a[i + 1 + r][i] = v[r];
+				vm[i + 1 + r][j] = v[r];
+			}
+			if(tau[i] == 0.0) continue;
+
+			// w = tau (A22 - V W^T - W V^T) v - tau/2 (w . v) v
+			tridiag_args g = {a, i, m, v, p, tau[i]};
+			if(parallel_worthwhile(m * m)) linalg_parallel(tridiag_task, &g);
+			else tridiag_task(&g, 0, 1);
+			memset(x, 0, j * sizeof(double));
+			memset(x2, 0, j * sizeof(double));
+			for(size_t r = 0; r < m; r++){
+				vec_kernels.axpy(x, v[r], wm[i + 1 + r], j);
+				vec_kernels.axpy(x2, v[r], vm[i + 1 + r], j);
+			}
+			for(size_t r = 0; r < m; r++){
+				p[r] -= tau[i] * (vec_kernels.dot(vm[i + 1 + r], x, j)
+						+ vec_kernels.dot(wm[i + 1 + r], x2, j));
+			}
+			vec_kernels.axpy(p, -0.5 * tau[i] * vec_kernels.dot(p, v, m), v, m);
+			for(size_t r = 0; r < m; r++) wm[i + 1 + r][j] = p[r];
+		}
+		size_t c = k + nb, rest = n - c;
+		gemm(rest, rest, nb, -1.0, (gemm_operand){vm + c, 0, 0},
+				(gemm_operand){wm + c, 0, 1}, 1.0, (gemm_operand){a + c, c, 0});
+		gemm(rest, rest, nb, -1.0, (gemm_operand){wm + c, 0, 0},
+				(gemm_operand){vm + c, 0, 1}, 1.0, (gemm_operand){a + c, c, 0});
+	}
+	d[n - 1] = a[n - 1][n - 1];
+	e[n - 1] = 0.0;
+	destroy_vector(x);
+	destroy_matrix(wm, n);
+	destroy_matrix(vm, n);
+	return 0;
+}
+
+// Implicit QL on the tridiagonal (d, e), e[i] coupling i and i+1; the
+// rotations are accumulated into columns c0 .. c0+n-1 of rows z[0..n-1]
+// unless z is NULL. e is destroyed. Off-diagonals below eps |T| are
+// negligible: the reduction has perturbed the eigenvalues by as much,
+// and a purely relative test can stall on blocks of rounding noise
+// (the null space of a low-rank matrix).
+static int tridiagonal_ql(double* d, double* e, size_t n, double** z, size_t c0){
+	if(n == 0) return 0;
+	e[n - 1] = 0.0;
+	double norm = 0.0;
+	for(size_t i = 0; i < n; i++) norm = fmax(norm, fabs(d[i]) + fabs(e[i]));
+	size_t budget = QL_ITERATIONS_PER_VALUE * n;
+	for(size_t l = 0; l < n; l++){
+		for(;;){
+			size_t m = l;
+			for(; m + 1 < n; m++){
+				if(fabs(e[m]) <= DBL_EPSILON * norm) break;
+			}
+			if(m == l) break;
+			if(budget-- == 0) return -1;
+			double g = (d[l + 1] - d[l]) / (2.0 * e[l]);
+			double r = hypot(g, 1.0);
+			g = d[m] - d[l] + e[l] / (g + copysign(r, g));
+			double s = 1.0, c = 1.0, p = 0.0;
+			int underflow = 0;
+			for(size_t i = m; i-- > l;){
+				double f = s * e[i], b = c * e[i];
+				e[i + 1] = r = hypot(f, g);
+				if(r == 0.0){
+					d[i + 1] -= p;
+					e[m] = 0.0;
+					underflow = 1;
+					break;
+				}
+				s = f / r;
+				c = g / r;
+				g = d[i + 1] - p;
+				r = (d[i] - g) * s + 2.0 * c * b;
+				d[i + 1] = g + (p = s * r);
+				g = c * r - b;
+				for(size_t k = 0; z != NULL && k < n; k++){
+					double* zk = z[k] + c0;
+					f = zk[i + 1];
+					zk[i + 1] = s * zk[i] + c * f;
+					zk[i] = c * zk[i] - s * f;
+				}
+			}
+			if(underflow) continue;
+			d[l] -= p;
+			e[l] = g;
+			e[m] = 0.0;
+		}
+	}
+	return 0;
+}
+
+// Root i of 1 + rho sum_j z_j^2 / (d_j - x) = 0 for ascending d and
+// rho > 0. The root is found as origin + tau from the nearer pole, and
+// delta gets d_j - x as (d_j - origin) - tau so that the differences
+// stay accurate (as in LAPACK's dlaed4). Safeguarded iteration on a
+// model with the two neighbouring poles, falling back to bisection.
+static double secular_root(const double* d, const double* z, size_t K,
+		size_t i, double rho, double* delta){
+	int last = i + 1 == K;
+	double origin = d[i], lo = 0.0, hi;
+	if(last){
+		double zz = 0.0;
+		for(size_t j = 0; j < K; j++) zz += z[j] * z[j];
+		hi = rho * zz;
+	} else {
+		double mid = 0.5 * (d[i + 1] - d[i]);
+		double f = 1.0;
+		for(size_t j = 0; j < K; j++) f += rho * z[j] * z[j] / ((d[j] - d[i]) - mid);
+		if(f > 0.0){
+			hi = mid;
+		} else {
+			origin = d[i + 1];
+			lo = -mid;
+			hi = 0.0;
+		}
+	}
+	for(size_t j = 0; j < K; j++) delta[j] = d[j] - origin;
+	double a = delta[i], b = last ? 0.0 : delta[i + 1];
+	double x = 0.5 * (lo + hi);
+	for(int iter = 0; iter < SECULAR_MAX_ITERATIONS; iter++){
+		double psi = 0.0, dpsi = 0.0, phi = 0.0, dphi = 0.0;
+		for(size_t j = 0; j <= i; j++){
+			double t = z[j] / (delta[j] - x);
+			psi += z[j] * t;
+			dpsi += t * t;
+		}
+		for(size_t j = i + 1; j < K; j++){
+			double t = z[j] / (delta[j] - x);
+			phi += z[j] * t;
+			dphi += t * t;
+		}
+		double f = 1.0 + rho * (psi + phi);
+		if(fabs(f) <= K * DBL_EPSILON * (1.0 + rho * (fabs(psi) + fabs(phi)))) break;
+		if(f < 0.0) lo = x;
+		else hi = x;
+
+		// Solve c + q / (a - y) + s / (b - y) = 0, the model matching
+		// each half's value and slope at x
+		double q = rho * dpsi * (a - x) * (a - x);
+		double s = last ? 0.0 : rho * dphi * (b - x) * (b - x);
+		double c = 1.0 + rho * (psi - dpsi * (a - x))
+			+ (last ? 0.0 : rho * (phi - dphi * (b - x)));
+		double y = 0.5 * (lo + hi);
+		if(last){
+			if(c != 0.0) y = a + q / c;
+		} else if(c == 0.0){
+			y = (q * b + s * a) / (q + s);
+		} else {
+			double B = -(c * (a + b) + q + s), C = c * a * b + q * b + s * a;
+			double disc = B * B - 4.0 * c * C;
+			double w = -0.5 * (B + copysign(sqrt(disc > 0.0 ? disc : 0.0), B));
+			double y1 = w / c, y2 = w != 0.0 ? C / w : y1;
+			y = y1 > lo && y1 < hi ? y1 : y2;
+		}
+		if(!(y > lo && y < hi)) y = 0.5 * (lo + hi);
+		if(y == x) break;
+		x = y;
+	}
+	for(size_t j = 0; j < K; j++) delta[j] -= x;
+	return origin + x;
+}
+
+typedef struct {
+	double** qk;   // n x n: the non-deflated columns of Q
+	double** u;    // n x n: delta, then U^T of the merge
+	double** r;    // n x n: Q U
+	double* z;     // n each
+	double* ds;
+	double* zs;
+	double* dv;
+	double* row;
+	size_t* perm;  // n each
+	size_t* nd;
+	size_t* df;
+	size_t* src;
+	size_t n;
+} dc_work;
+
+static void dc_work_destroy(dc_work* w){
+	destroy_matrix(w->qk, w->n);
+	destroy_matrix(w->u, w->n);
+	destroy_matrix(w->r, w->n);
+	free(w->z);
+	free(w->perm);
+}
+
+static int dc_work_create(dc_work* w, size_t n){
+	w->n = n;
+	w->qk = create_matrix(n, n);
+	w->u = create_matrix(n, n);
+	w->r = create_matrix(n, n);
+	w->z = malloc(5 * n * sizeof(double));
+	w->perm = malloc(4 * n * sizeof(size_t));
+	if(!(w->qk && w->u && w->r && w->z && w->perm)){
+		dc_work_destroy(w);
+		return -1;
+	}
+	w->ds = w->z + n;
+	w->zs = w->ds + n;
+	w->dv = w->zs + n;
+	w->row = w->dv + n;
+	w->nd = w->perm + n;
+	w->df = w->nd + n;
+	w->src = w->df + n;
+	return 0;
+}
+
+// Sorts the n eigenpairs (d, columns c0.. of q) ascending
+static void sort_eigenpairs(double* d, size_t n, double** q, size_t c0){
+	for(size_t i = 0; i < n; i++){
+		size_t k = i;
+		for(size_t j = i + 1; j < n; j++) if(d[j] < d[k]) k = j;
+		if(k == i) continue;
+		double t = d[i];
+		d[i] = d[k];
+		d[k] = t;
+		for(size_t r = 0; r < n; r++){
+			t = q[r][c0 + i];
+			q[r][c0 + i] = q[r][c0 + k];
+			q[r][c0 + k] = t;
+		}
+	}
+}
+
+// Merges the eigensystems of the halves [0, m) and [m, n), which are in
+// d and the diagonal blocks of q (columns c0..), into that of
+// diag(T1, T2) + beta v v^T with v = e_{m-1} + sign(beta) e_m.
+static void dc_merge(double* d, size_t n, size_t m, double beta, double** q,
+		size_t c0, dc_work* w){
+	double sign = beta < 0.0 ? -1.0 : 1.0;
+	double rho = fabs(beta);
+	double* z = w->z;
+	for(size_t j = 0; j < n; j++) z[j] = q[m - 1][c0 + j] + sign * q[m][c0 + j];
+	double zz = sqrt(vec_kernels.sum_of_squares(z, n));
+	vec_kernels.scale(z, 1.0 / zz, n);
+	rho *= zz * zz;
+
+	// Order of d: merge of the two ascending halves
+	size_t* perm = w->perm;
+	for(size_t t = 0, i = 0, j = m; t < n; t++){
+		perm[t] = j == n || (i < m && d[i] <= d[j]) ? i++ : j++;
+	}
+	double dmax = fmax(fabs(d[perm[0]]), fabs(d[perm[n - 1]]));
+	double tol = 8.0 * DBL_EPSILON * fmax(dmax, rho);
+
+	// Deflation: negligible z components, and close pairs of d whose
+	// z can be rotated into one of them
+	size_t K = 0, ndf = 0, prev = SIZE_MAX;
+	for(size_t t = 0; t < n; t++){
+		size_t j = perm[t];
+		if(rho * fabs(z[j]) <= tol){
+			w->df[ndf++] = j;
+			continue;
+		}
+		if(prev != SIZE_MAX){
+			double r = hypot(z[prev], z[j]);
+			double c = z[j] / r, s = -z[prev] / r;
+			if(fabs((d[j] - d[prev]) * c * s) <= tol){
+				z[j] = r;
+				z[prev] = 0.0;
+				for(size_t i = 0; i < n; i++){
+					double* qi = q[i] + c0;
+					double x = qi[prev], y = qi[j];
+					qi[prev] = c * x + s * y;
+					qi[j] = c * y - s * x;
+				}
+				double dp = d[prev] * c * c + d[j] * s * s;
+				d[j] = d[prev] * s * s + d[j] * c * c;
+				d[prev] = dp;
+				w->df[ndf++] = prev;
+				prev = j;
+				continue;
+			}
+			w->nd[K++] = prev;
+		}
+		prev = j;
+	}
+	if(prev != SIZE_MAX) w->nd[K++] = prev;
+
+	// Roots of the secular equation; z is then recomputed from them
+	// (Gu and Eisenstat) so that the eigenvectors z_j / (d_j - lambda)
+	// are orthogonal even for roots close to a pole.
+	double** u = w->u;
+	for(size_t i = 0; i < K; i++){
+		w->ds[i] = d[w->nd[i]];
+		w->zs[i] = z[w->nd[i]];
+	}
+	for(size_t i = 0; i < K; i++){
+		w->dv[i] = secular_root(w->ds, w->zs, K, i, rho, u[i]);
+	}
+	for(size_t j = 0; j < K; j++){
+		double p = -u[j][j] / rho;
+		for(size_t i = 0; i < K; i++){
+			if(i != j) p *= -u[i][j] / (w->ds[i] - w->ds[j]);
+		}
+		z[j] = copysign(sqrt(fabs(p)), w->zs[j]);
+	}
+	for(size_t i = 0; i < K; i++){
+		for(size_t j = 0; j < K; j++) u[i][j] = z[j] / u[i][j];
+		vec_kernels.scale(u[i], 1.0 / sqrt(vec_kernels.sum_of_squares(u[i], K)), K);
+	}
+	for(size_t r = 0; r < n; r++){
+		for(size_t i = 0; i < K; i++) w->qk[r][i] = q[r][c0 + w->nd[i]];
+	}
+	gemm(n, K, K, 1.0, (gemm_operand){w->qk, 0, 0}, (gemm_operand){u, 0, 1},
+			0.0, (gemm_operand){w->r, 0, 0});
+
+	// Ascending output: the roots (already sorted) merged with the
+	// deflated values; src < K is a column of r, else of q
+	for(size_t t = 1; t < ndf; t++){
+		size_t j = w->df[t], s = t;
+		for(; s > 0 && d[w->df[s - 1]] > d[j]; s--) w->df[s] = w->df[s - 1];
+		w->df[s] = j;
+	}
+	for(size_t t = 0; t < ndf; t++) w->ds[t] = d[w->df[t]];
+	for(size_t t = 0, i = 0, j = 0; t < n; t++){
+		if(j == ndf || (i < K && w->dv[i] <= w->ds[j])){
+			w->src[t] = i;
+			d[t] = w->dv[i++];
+		} else {
+			w->src[t] = K + w->df[j];
+			d[t] = w->ds[j++];
+		}
+	}
+	for(size_t r = 0; r < n; r++){
+		double* qr = q[r] + c0;
+		for(size_t t = 0; t < n; t++){
+			size_t s = w->src[t];
+			w->row[t] = s < K ? w->r[r][s] : qr[s - K];
+		}
+		memcpy(qr, w->row, n * sizeof(double));
+	}
+}
+
+// Eigensystem of the tridiagonal (d, e) into d (ascending) and the
+// diagonal block of q at rows q[0..n-1], columns c0.., which is zero
+static int tridiagonal_dc(double* d, double* e, size_t n, double** q,
+		size_t c0, dc_work* w){
+	if(n <= DC_BASE){
+		for(size_t i = 0; i < n; i++) q[i][c0 + i] = 1.0;
+		if(tridiagonal_ql(d, e, n, q, c0) != 0) return -1;
+		sort_eigenpairs(d, n, q, c0);
+		return 0;
+	}
+	size_t m = n / 2;
+	double beta = e[m - 1];
+	d[m - 1] -= fabs(beta);
+	d[m] -= fabs(beta);
+	if(tridiagonal_dc(d, e, m, q, c0, w) != 0) return -1;
+	if(tridiagonal_dc(d + m, e + m, n - m, q + m, c0 + m, w) != 0) return -1;
+	dc_merge(d, n, m, beta, q, c0, w);
+	return 0;
+}
+
+static int compare_double_ascending(const void* a, const void* b){
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+int symmetric_eigen_decomposition(double* eigenvalues, double** eigenvectors,
+		double** mat, size_t n){
+	if(n == 0) return 0;
+	double** a = create_matrix(n, n);
+	double* e = create_vector(2 * n);
+	int status = a && e ? 0 : -1;
+	double* tau = e + n;
+	if(status == 0){
+		for(size_t i = 0; i < n; i++){
+			for(size_t j = 0; j <= i; j++) a[i][j] = a[j][i] = mat[i][j];
+		}
+		status = tridiagonalize(a, n, eigenvalues, e, tau);
+	}
+	if(status == 0){
+		if(eigenvectors == NULL){
+			status = tridiagonal_ql(eigenvalues, e, n, NULL, 0);
+			if(status == 0){
+				qsort(eigenvalues, n, sizeof(double), compare_double_ascending);
+			}
+		} else {
+			dc_work w;
+			status = dc_work_create(&w, n);
+			if(status == 0){
+				for(size_t i = 0; i < n; i++) memset(eigenvectors[i], 0, n * sizeof(double));
+				status = tridiagonal_dc(eigenvalues, e, n, eigenvectors, 0, &w);
+				dc_work_destroy(&w);
+			}
+			if(status == 0 && n > 1){
+				status = qr_multiply_q(a + 1, n - 1, n - 1, tau, eigenvectors + 1, n,
+						LINALG_NO_TRANSPOSE);
+			}
+		}
+	}
+	destroy_vector(e);
+	destroy_matrix(a, n);
+	return status;
+}
+
+/* ---------------------------------------------------
+ * Randomized truncated SVD (Halko, Martinsson and
+ * Tropp). The range of A is sampled with a Gaussian
+ * test matrix, sharpened by power iterations and
+ * decomposed through its small projection. A is only
+ * used in products with thin matrices: dense input
+ * runs on the threaded GEMM, sparse input on
+ * sparse_dense_matrix_multiplication.
+ * ------------------------------------------------- */
+
+#define SVD_OVERSAMPLING 10
+#define JACOBI_MAX_SWEEPS 60
+#define CHOLESKY_QR_MIN_RCOND 1e-6  // smallest diag(R) ratio for CholeskyQR
+
+typedef struct {
+	size_t rows, cols;
+	double** mat;           // dense, or
+	const sparse_matrix* A; // sparse with
+	sparse_matrix At;       // its transpose, on A's arrays
+} svd_operator;
+
+// y = A x (x is cols x l), or y = A^T x (x is rows x l) with trans
+static void svd_apply(const svd_operator* op, double** y, double** x, size_t l,
+		int trans){
+	if(op->mat == NULL){
+		sparse_dense_matrix_multiplication(y, trans ? &op->At : op->A, x, l, 1.0, 0.0);
+		return;
+	}
+	gemm(trans ? op->cols : op->rows, l, trans ? op->rows : op->cols, 1.0,
+			(gemm_operand){op->mat, 0, trans}, (gemm_operand){x, 0, 0}, 0.0,
+			(gemm_operand){y, 0, 0});
+}
+
+typedef struct {
+	double** scratch;   // max(rows, cols) x l
+	double** gram;      // l x l each
+	double** inv;
+	double** r1;
+	double** r2;
+	double* tau;        // l
+	size_t rows, l;
+} svd_work;
+
+static void svd_work_destroy(svd_work* w){
+	destroy_matrix(w->scratch, w->rows);
+	destroy_matrix(w->gram, w->l);
+	destroy_matrix(w->inv, w->l);
+	destroy_matrix(w->r1, w->l);
+	destroy_matrix(w->r2, w->l);
+	destroy_vector(w->tau);
+}
+
+static int svd_work_create(svd_work* w, size_t rows, size_t l){
+	w->rows = rows;
+	w->l = l;
+	w->scratch = create_matrix(rows, l);
+	w->gram = create_matrix(l, l);
+	w->inv = create_matrix(l, l);
+	w->r1 = create_matrix(l, l);
+	w->r2 = create_matrix(l, l);
+	w->tau = create_vector(l);
+	if(w->scratch && w->gram && w->inv && w->r1 && w->r2 && w->tau) return 0;
+	svd_work_destroy(w);
+	return -1;
+}
+
+// One CholeskyQR step, x = y R^-1 with R^T R = y^T y and R in r. Fails,
+// leaving x untouched, when y is too ill-conditioned for the step to
+// be accurate.
+static int cholesky_qr_step(double** x, double** y, size_t m, size_t l,
+		double** r, svd_work* w){
+	double** g = w->gram;
+	gemm(l, l, m, 1.0, (gemm_operand){y, 0, 1}, (gemm_operand){y, 0, 0}, 0.0,
+			(gemm_operand){g, 0, 0});
+	if(cholesky_decomposition(g, l) != 0) return -1;
+	double lo = g[0][0], hi = g[0][0];
+	for(size_t i = 1; i < l; i++){
+		lo = fmin(lo, g[i][i]);
+		hi = fmax(hi, g[i][i]);
+	}
+	if(!(lo > CHOLESKY_QR_MIN_RCOND * hi)) return -1;
+	for(size_t i = 0; i < l; i++){
+		memset(w->inv[i], 0, l * sizeof(double));
+		w->inv[i][i] = 1.0;
+		for(size_t j = 0; j < l; j++) r[i][j] = g[j][i];
+	}
+	triangular_solve(g, w->inv, l, l, LINALG_LOWER, LINALG_NO_TRANSPOSE,
+			LINALG_NON_UNIT_DIAGONAL);
+	gemm(m, l, l, 1.0, (gemm_operand){y, 0, 0}, (gemm_operand){w->inv, 0, 1},
+			0.0, (gemm_operand){x, 0, 0});
+	return 0;
+}
+
+// y (m x l, m >= l) = an orthonormal basis of its columns, y = Q R with
+// R in r unless r is NULL. CholeskyQR2 keeps this on the threaded GEMM
+// in a few passes over y; Householder QR takes over when y is
+// ill-conditioned or rank deficient.
+static int orthonormalize(double** y, size_t m, size_t l, double** r,
+		svd_work* w){
+	double** q = w->scratch;
+	if(cholesky_qr_step(q, y, m, l, w->r1, w) == 0
+			&& cholesky_qr_step(y, q, m, l, w->r2, w) == 0){
+		if(r != NULL){
+			gemm(l, l, l, 1.0, (gemm_operand){w->r2, 0, 0},
+					(gemm_operand){w->r1, 0, 0}, 0.0, (gemm_operand){r, 0, 0});
+		}
+		return 0;
+	}
+	if(qr_decomposition(y, m, l, w->tau) != 0) return -1;
+	for(size_t i = 0; i < m; i++){
+		if(r != NULL && i < l){
+			memset(r[i], 0, i * sizeof(double));
+			memcpy(r[i] + i, y[i] + i, (l - i) * sizeof(double));
+		}
+		memset(q[i], 0, l * sizeof(double));
+		if(i < l) q[i][i] = 1.0;
+	}
+	if(qr_multiply_q(y, m, l, w->tau, q, l, LINALG_NO_TRANSPOSE) != 0) return -1;
+	for(size_t i = 0; i < m; i++) memcpy(y[i], q[i], l * sizeof(double));
+	return 0;
+}
+
+// One-sided Jacobi on the rows of h (l x l): rotates pairs of rows until
+// all are orthogonal, applying the same rotations to the rows of g.
+static void jacobi_rows(double** h, double** g, size_t l){
+	for(int sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++){
+		int rotated = 0;
+		for(size_t i = 0; i + 1 < l; i++){
+			for(size_t j = i + 1; j < l; j++){
+				double alpha = vec_kernels.sum_of_squares(h[i], l);
+				double beta = vec_kernels.sum_of_squares(h[j], l);
+				double gamma = vec_kernels.dot(h[i], h[j], l);
+				if(fabs(gamma) <= DBL_EPSILON * sqrt(alpha * beta)) continue;
+				double zeta = (beta - alpha) / (2.0 * gamma);
+				double t = copysign(1.0, zeta) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+				double c = 1.0 / sqrt(1.0 + t * t), s = c * t;
+				for(size_t k = 0; k < l; k++){
+					double x = h[i][k], y = h[j][k];
+					h[i][k] = c * x - s * y;
+					h[j][k] = s * x + c * y;
+					x = g[i][k];
+					y = g[j][k];
+					g[i][k] = c * x - s * y;
+					g[j][k] = s * x + c * y;
+				}
+				rotated = 1;
+			}
+		}
+		if(!rotated) break;
+	}
+}
+
+static int randomized_svd(double* s, double** u, double** v,
+		const svd_operator* op, size_t k, size_t power_iterations,
+		unsigned long int seed){
+	size_t rows = op->rows, cols = op->cols;
+	size_t rank = rows < cols ? rows : cols;
+	if(k > rank) return -1;
+	if(k == 0) return 0;
+	size_t l = k + SVD_OVERSAMPLING < rank ? k + SVD_OVERSAMPLING : rank;
+	svd_work w;
+	if(svd_work_create(&w, rows > cols ? rows : cols, l) != 0) return -1;
+	double** y = create_matrix(rows, l);
+	double** z = create_matrix(cols, l);
+	double** h = create_matrix(l, l);
+	double** g = create_matrix(l, l);
+	double* sv = create_vector(l);
+	size_t* order = malloc(l * sizeof(size_t));
+	double** picked = malloc(2 * k * sizeof(double*));
+	int status = y && z && h && g && sv && order && picked ? 0 : -1;
+
+	// Q = y: orthonormal basis of (A A^T)^p A Omega, re-orthonormalized
+	// after every product
+	if(status == 0){
+		fill_random_normal_matrix(z, cols, l, 0.0, 1.0, seed);
+		svd_apply(op, y, z, l, 0);
+		status = orthonormalize(y, rows, l, NULL, &w);
+	}
+	for(size_t it = 0; status == 0 && it < power_iterations; it++){
+		svd_apply(op, z, y, l, 1);
+		status = orthonormalize(z, cols, l, NULL, &w);
+		if(status != 0) break;
+		svd_apply(op, y, z, l, 0);
+		status = orthonormalize(y, rows, l, NULL, &w);
+	}
+
+	// A^T Q = Qb R with Qb = z, so A ~ Q R^T Qb^T. Jacobi on the rows
+	// of R gives J R = S W^T, hence A ~ (Q W) S (Qb J^T)^T.
+	if(status == 0){
+		svd_apply(op, z, y, l, 1);
+		status = orthonormalize(z, cols, l, h, &w);
+	}
+	if(status == 0){
+		for(size_t i = 0; i < l; i++) g[i][i] = 1.0;
+		jacobi_rows(h, g, l);
+		for(size_t i = 0; i < l; i++){
+			sv[i] = sqrt(vec_kernels.sum_of_squares(h[i], l));
+			if(sv[i] > 0.0) vec_kernels.scale(h[i], 1.0 / sv[i], l);
+			size_t t = i;
+			for(; t > 0 && sv[order[t - 1]] < sv[i]; t--) order[t] = order[t - 1];
+			order[t] = i;
+		}
+		for(size_t j = 0; j < k; j++){
+			s[j] = sv[order[j]];
+			picked[j] = h[order[j]];
+			picked[k + j] = g[order[j]];
+		}
+		if(u != NULL){
+			gemm(rows, k, l, 1.0, (gemm_operand){y, 0, 0},
+					(gemm_operand){picked, 0, 1}, 0.0, (gemm_operand){u, 0, 0});
+		}
+		if(v != NULL){
+			gemm(cols, k, l, 1.0, (gemm_operand){z, 0, 0},
+					(gemm_operand){picked + k, 0, 1}, 0.0, (gemm_operand){v, 0, 0});
+		}
+	}
+	free(picked);
+	free(order);
+	destroy_vector(sv);
+	destroy_matrix(g, l);
+	destroy_matrix(h, l);
+	destroy_matrix(z, cols);
+	destroy_matrix(y, rows);
+	svd_work_destroy(&w);
+	return status;
+}
+
+int truncated_svd(double* s, double** u, double** v, double** mat,
+		size_t rows, size_t cols, size_t k, size_t power_iterations,
+		unsigned long int seed){
+	svd_operator op = {.rows = rows, .cols = cols, .mat = mat};
+	return randomized_svd(s, u, v, &op, k, power_iterations, seed);
+}
+
+int sparse_truncated_svd(double* s, double** u, double** v,
+		const sparse_matrix* A, size_t k, size_t power_iterations,
+		unsigned long int seed){
+	// A's arrays in one format are those of A^T in the other
+	svd_operator op = {.rows = A->rows, .cols = A->cols, .A = A, .At = *A};
+	op.At.format = A->format == LINALG_CSR ? LINALG_CSC : LINALG_CSR;
+	op.At.rows = A->cols;
+	op.At.cols = A->rows;
+	return randomized_svd(s, u, v, &op, k, power_iterations, seed);
+}
+
+/* ---------------------------------------------------
+ * Pairwise distances and k nearest neighbours. Dot
+ * products come from the GEMM and distances from the
+ * expansion |q - r|^2 = |q|^2 + |r|^2 - 2 q.r. For the
+ * nearest neighbours KNN_QUERY_BLOCK queries are
+ * compared with KNN_REFERENCE_BLOCK references at a
+ * time, and every tile is folded into a bounded
+ * max-heap per query, so the full distance matrix is
+ * never stored. Large searches are split over query
+ * blocks, or over references (heaps merged at the
+ * end) when there are few queries. The distances of
+ * the k winners are recomputed directly, free of the
+ * cancellation in the expansion.
+ * ------------------------------------------------- */
+
+#define KNN_QUERY_BLOCK 64
+#define KNN_REFERENCE_BLOCK 512
+
+// Per vector: squared norm (Euclidean metrics) or inverse norm (cosine)
+static void distance_norms(double* out, double** v, size_t n, size_t dim,
+		linalg_distance metric){
+	for(size_t i = 0; i < n; i++){
+		double ssq = vec_kernels.sum_of_squares(v[i], dim);
+		if(metric == LINALG_DISTANCE_COSINE){
+			out[i] = ssq > 0.0 ? 1.0 / sqrt(ssq) : 0.0;
+		} else {
+			out[i] = ssq;
+		}
+	}
+}
+
+/*
+ * Search keys, smaller being nearer: the squared distance for both
+ * Euclidean metrics, 1 - cos and -q.r. A tile of dot products scaled by
+ * distance_alpha is turned into keys in place.
+ */
+static double distance_alpha(linalg_distance metric){
+	switch(metric){
+	case LINALG_DISTANCE_COSINE:
+		return 1.0;
+	case LINALG_DISTANCE_DOT:
+		return -1.0;
+	default:
+		return -2.0;
+	}
+}
+
+static void distance_keys(double* c, size_t m, double q_norm,
+		const double* r_norms, linalg_distance metric){
+	switch(metric){
+	case LINALG_DISTANCE_EUCLIDEAN:
+	case LINALG_DISTANCE_SQUARED_EUCLIDEAN:
+		for(size_t j = 0; j < m; j++){
+			double d = q_norm + r_norms[j] + c[j];
+			c[j] = d < 0.0 ? 0.0 : d; // cancellation, keeps NaN
+		}
+		break;
+	case LINALG_DISTANCE_COSINE:
+		for(size_t j = 0; j < m; j++) c[j] = 1.0 - c[j] * q_norm * r_norms[j];
+		break;
+	case LINALG_DISTANCE_DOT:
+		break;
+	}
+}
+
+static double distance_key_exact(const double* q, const double* r, size_t dim,
+		double q_norm, double r_norm, linalg_distance metric){
+	switch(metric){
+	case LINALG_DISTANCE_COSINE:
+		return 1.0 - vec_kernels.dot(q, r, dim) * q_norm * r_norm;
+	case LINALG_DISTANCE_DOT:
+		return -vec_kernels.dot(q, r, dim);
+	default:
+		return vec_kernels.squared_distance(q, r, dim);
+	}
+}
+
+static double distance_from_key(double key, linalg_distance metric){
+	switch(metric){
+	case LINALG_DISTANCE_EUCLIDEAN:
+		return sqrt(key);
+	case LINALG_DISTANCE_DOT:
+		return -key;
+	default:
+		return key;
+	}
+}
+
+typedef struct {
+	double** result;
+	const double* q_norms;
+	const double* r_norms;
+	size_t n_queries, n_references;
+	linalg_distance metric;
+} distance_args;
+
+static void distance_task(void* ctx, size_t t, size_t n_threads){
+	const distance_args* g = ctx;
+	size_t begin, end;
+	partition_range(g->n_queries, t, n_threads, 1, &begin, &end);
+	for(size_t i = begin; i < end; i++){
+		double* row = g->result[i];
+		distance_keys(row, g->n_references, g->q_norms[i], g->r_norms, g->metric);
+		if(g->metric == LINALG_DISTANCE_EUCLIDEAN){
+			vec_kernels.sqrt(row, row, g->n_references);
+		}
+	}
+}
+
+int pairwise_distances(double** result, double** queries, size_t n_queries,
+		double** references, size_t n_references, size_t dim,
+		linalg_distance metric){
+	if(n_queries == 0 || n_references == 0) return 0;
+	// The dot products are the result already
+	double alpha = metric == LINALG_DISTANCE_DOT ? 1.0 : distance_alpha(metric);
+	gemm(n_queries, n_references, dim, alpha, (gemm_operand){queries, 0, 0},
+			(gemm_operand){references, 0, 1}, 0.0, (gemm_operand){result, 0, 0});
+	if(metric == LINALG_DISTANCE_DOT) return 0;
+
+	double* q_norms = malloc(n_queries * sizeof(double));
+	double* r_norms = malloc(n_references * sizeof(double));
+	if(q_norms == NULL || r_norms == NULL){
+		free(q_norms);
+		free(r_norms);
+		return -1;
+	}
+	distance_norms(q_norms, queries, n_queries, dim, metric);
+	distance_norms(r_norms, references, n_references, dim, metric);
+	distance_args g = {result, q_norms, r_norms, n_queries, n_references, metric};
+	if(parallel_worthwhile(n_queries * n_references)){
+		linalg_parallel(distance_task, &g);
+	} else {
+		distance_task(&g, 0, 1);
+	}
+	free(q_norms);
+	free(r_norms);
+	return 0;
+}
+
+typedef struct {
+	double key;
+	size_t index;
+} knn_entry;
+
+// Ties go to the lower index, so the result does not depend on the split
+static int knn_worse(knn_entry a, knn_entry b){
+	return a.key > b.key || (a.key == b.key && a.index > b.index);
+}
+
+// Keeps the k best entries in a max-heap; heap[0] is the worst of them
+static void knn_push(knn_entry* heap, size_t* count, size_t k, knn_entry e){
+	size_t i;
+	if(*count < k){
+		for(i = (*count)++; i > 0 && knn_worse(e, heap[(i - 1) / 2]); i = (i - 1) / 2){
+			heap[i] = heap[(i - 1) / 2];
+		}
+		heap[i] = e;
+		return;
+	}
+	if(!knn_worse(heap[0], e)) return;
+	for(i = 0; 2 * i + 1 < k;){
+		size_t child = 2 * i + 1;
+		if(child + 1 < k && knn_worse(heap[child + 1], heap[child])) child++;
+		if(!knn_worse(heap[child], e)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+typedef struct {
+	size_t* indices;
+	double* distances;
+	double** queries;
+	double** references;
+	size_t n_queries, n_references, dim, k;
+	linalg_distance metric;
+	const double* q_norms;
+	const double* r_norms;
+	// Per thread: a tile, its row pointers, and a heap and its size per query
+	double* tiles;
+	double** tile_rows;
+	knn_entry* heaps;
+	size_t* counts;
+	int split_queries;
+	size_t q0;  // query block, when the references are split
+} knn_args;
+
+// Candidates among references [r_begin, r_end) for queries [q0, q0 + mq),
+// into thread t's heaps
+static void knn_search(const knn_args* g, size_t t, size_t q0, size_t mq,
+		size_t r_begin, size_t r_end){
+	double** tile = g->tile_rows + t * KNN_QUERY_BLOCK;
+	knn_entry* heaps = g->heaps + t * KNN_QUERY_BLOCK * g->k;
+	size_t* counts = g->counts + t * KNN_QUERY_BLOCK;
+	double alpha = distance_alpha(g->metric);
+	for(size_t r0 = r_begin; r0 < r_end; r0 += KNN_REFERENCE_BLOCK){
+		size_t mr = r_end - r0 < KNN_REFERENCE_BLOCK ? r_end - r0 : KNN_REFERENCE_BLOCK;
+		gemm(mq, mr, g->dim, alpha, (gemm_operand){g->queries + q0, 0, 0},
+				(gemm_operand){g->references + r0, 0, 1}, 0.0,
+				(gemm_operand){tile, 0, 0});
+		for(size_t i = 0; i < mq; i++){
+			double* keys = tile[i];
+			knn_entry* heap = heaps + i * g->k;
+			distance_keys(keys, mr, g->q_norms[q0 + i], g->r_norms + r0, g->metric);
+			for(size_t j = 0; j < mr; j++){
+				knn_entry e = {isnan(keys[j]) ? INFINITY : keys[j], r0 + j};
+				if(counts[i] < g->k || knn_worse(heap[0], e)){
+					knn_push(heap, &counts[i], g->k, e);
+				}
+			}
+		}
+	}
+}
+
+// Merges the heaps of threads [t, t + n_heaps) for queries [q0, q0 + mq)
+// and writes their neighbours, nearest first
+static void knn_finish(const knn_args* g, size_t t, size_t n_heaps, size_t q0,
+		size_t mq){
+	const size_t k = g->k;
+	for(size_t i = 0; i < mq; i++){
+		knn_entry* heap = g->heaps + (t * KNN_QUERY_BLOCK + i) * k;
+		size_t* count = g->counts + t * KNN_QUERY_BLOCK + i;
+		for(size_t h = 1; h < n_heaps; h++){
+			const knn_entry* other = g->heaps + ((t + h) * KNN_QUERY_BLOCK + i) * k;
+			size_t n_other = g->counts[(t + h) * KNN_QUERY_BLOCK + i];
+			for(size_t j = 0; j < n_other; j++) knn_push(heap, count, k, other[j]);
+		}
+
+		const size_t q = q0 + i;
+		for(size_t j = 0; j < *count; j++){
+			size_t r = heap[j].index;
+			double key = distance_key_exact(g->queries[q], g->references[r],
+					g->dim, g->q_norms[q], g->r_norms[r], g->metric);
+			heap[j].key = isnan(key) ? INFINITY : key;
+		}
+		for(size_t j = 1; j < *count; j++){
+			knn_entry e = heap[j];
+			size_t l = j;
+			for(; l > 0 && knn_worse(heap[l - 1], e); l--) heap[l] = heap[l - 1];
+			heap[l] = e;
+		}
+
+		for(size_t j = 0; j < k; j++){
+			knn_entry e = j < *count ? heap[j] : (knn_entry){INFINITY, SIZE_MAX};
+			if(g->indices != NULL) g->indices[q * k + j] = e.index;
+			if(g->distances != NULL){
+				g->distances[q * k + j] = distance_from_key(e.key, g->metric);
+			}
+		}
+	}
+}
+
+static void knn_task(void* ctx, size_t t, size_t n_threads){
+	const knn_args* g = ctx;
+	size_t begin, end;
+	if(!g->split_queries){
+		size_t mq = g->n_queries - g->q0 < KNN_QUERY_BLOCK
+			? g->n_queries - g->q0 : KNN_QUERY_BLOCK;
+		partition_range(g->n_references, t, n_threads, KNN_REFERENCE_BLOCK,
+				&begin, &end);
+		knn_search(g, t, g->q0, mq, begin, end);
+		return;
+	}
+	partition_range(g->n_queries, t, n_threads, KNN_QUERY_BLOCK, &begin, &end);
+	for(size_t q0 = begin; q0 < end; q0 += KNN_QUERY_BLOCK){
+		size_t mq = end - q0 < KNN_QUERY_BLOCK ? end - q0 : KNN_QUERY_BLOCK;
+		memset(g->counts + t * KNN_QUERY_BLOCK, 0, KNN_QUERY_BLOCK * sizeof(size_t));
+		knn_search(g, t, q0, mq, 0, g->n_references);
+		knn_finish(g, t, 1, q0, mq);
+	}
+}
+
+int k_nearest_neighbours(size_t* indices, double* distances, double** queries,
+		size_t n_queries, double** references, size_t n_references, size_t dim,
+		size_t k, linalg_distance metric){
+	if(k == 0 || n_queries == 0) return 0;
+	const size_t n_threads = pool.n_threads;
+	knn_args g = {.indices = indices, .distances = distances,
+		.queries = queries, .references = references, .n_queries = n_queries,
+		.n_references = n_references, .dim = dim, .k = k, .metric = metric};
+	double* q_norms = malloc(n_queries * sizeof(double));
+	double* r_norms = malloc(n_references * sizeof(double));
+	g.tiles = malloc(n_threads * KNN_QUERY_BLOCK * KNN_REFERENCE_BLOCK
+			* sizeof(double));
+	g.tile_rows = malloc(n_threads * KNN_QUERY_BLOCK * sizeof(double*));
+	g.heaps = malloc(n_threads * KNN_QUERY_BLOCK * k * sizeof(knn_entry));
+	g.counts = calloc(n_threads * KNN_QUERY_BLOCK, sizeof(size_t));
+	int status = -1;
+	if(q_norms == NULL || (r_norms == NULL && n_references > 0)
+			|| g.tiles == NULL || g.tile_rows == NULL || g.heaps == NULL
+			|| g.counts == NULL){
+		goto done;
+	}
+	for(size_t i = 0; i < n_threads * KNN_QUERY_BLOCK; i++){
+		g.tile_rows[i] = g.tiles + i * KNN_REFERENCE_BLOCK;
+	}
+	distance_norms(q_norms, queries, n_queries, dim, metric);
+	distance_norms(r_norms, references, n_references, dim, metric);
+	g.q_norms = q_norms;
+	g.r_norms = r_norms;
+
+	// Few queries: all threads search each query block, over their own
+	// references
+	int threaded = parallel_worthwhile(n_queries * n_references);
+	g.split_queries = !threaded || n_queries >= n_threads * KNN_QUERY_BLOCK;
+	if(g.split_queries){
+		if(threaded) linalg_parallel(knn_task, &g);
+		else knn_task(&g, 0, 1);
+	} else {
+		for(g.q0 = 0; g.q0 < n_queries; g.q0 += KNN_QUERY_BLOCK){
+			size_t mq = n_queries - g.q0 < KNN_QUERY_BLOCK
+				? n_queries - g.q0 : KNN_QUERY_BLOCK;
+			memset(g.counts, 0, n_threads * KNN_QUERY_BLOCK * sizeof(size_t));
+			linalg_parallel(knn_task, &g);
+			knn_finish(&g, 0, n_threads, g.q0, mq);
+		}
+	}
+	status = 0;
+done:
+	free(q_norms);
+	free(r_norms);
+	free(g.tiles);
+	free(g.tile_rows);
+	free(g.heaps);
+	free(g.counts);
+	return status;
+}
+
+void print_vector(double* a, size_t len){
+	printf("[");
+	for(size_t ix = 0; ix < len; ix++){
+		if(ix != len - 1){
+        		printf("%f, ", a[ix]);
+		} else {
+        		printf("%f", a[ix]);
+		}
+	}
+	printf("]\n");
+}
+
+
+void print_matrix(double** a, size_t rows, size_t cols){
+	printf("[\n");
+	for(int row_i = 0; row_i < rows; row_i++){
+		print_vector(a[row_i], cols);
+	}
+	printf("]\n");
+}
+
+/* ---------------------------------------------------
+ * CSV writer. Rows are formatted into large buffers
+ * (in parallel over row blocks when threads are on)
+ * and written with one fwrite per buffer.
+ * ------------------------------------------------- */
+
+#define CSV_WRITE_BATCH_BYTES (8 << 20)
+
+// 10^k for k in [-POW10_RANGE, POW10_RANGE], extended precision
+#define POW10_RANGE 350
+static long double pow10_table[2 * POW10_RANGE + 1];
+static pthread_once_t pow10_once = PTHREAD_ONCE_INIT;
+
+static void pow10_table_init(void){
+	for(int k = -POW10_RANGE; k <= POW10_RANGE; k++){
+		pow10_table[k + POW10_RANGE] = powl(10.0L, k);
+	}
+}
+
+static const uint64_t pow10_u64[] = {
+	UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+	UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+	UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+	UINT64_C(10000000000), UINT64_C(100000000000),
+	UINT64_C(1000000000000), UINT64_C(10000000000000),
+	UINT64_C(100000000000000), UINT64_C(1000000000000000),
+	UINT64_C(10000000000000000), UINT64_C(100000000000000000)
+};
+
+// Rounds |x| (finite, non-zero) to precision+1 significant digits:
+// |x| ~ digits * 10^(exp10 - precision). Returns 0 when the result could
+// be off by one in the last digit (near a tie), so the caller must use
+// the exact (printf) path.
+static int decimal_digits(double x, int precision, uint64_t* digits, int* exp10){
+	if(LDBL_MANT_DIG < 64 || precision > 15) return 0;
+	// Binary exponent from the bits; 78913 / 2^18 ~ log10(2)
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int e2 = (int)((bits >> 52) & 0x7ff) - 1023;
+	if(e2 == -1023) e2 = ilogb(x); // subnormal
+	int e = (e2 * 78913) >> 18;
+	long double y = (long double)x * pow10_table[precision - e + POW10_RANGE];
+	if(y < pow10_u64[precision]){
+		e--;
+		y = (long double)x * pow10_table[precision - e + POW10_RANGE];
+	} else if(y >= pow10_u64[precision + 1]){
+		e++;
+		y = (long double)x * pow10_table[precision - e + POW10_RANGE];
+	}
+	uint64_t r = (uint64_t)y;
+	long double frac = y - r;
+	if(fabsl(frac - 0.5L) < y * 0x1p-56L) return 0;
+	uint64_t d = r + (frac > 0.5L);
+	if(d == pow10_u64[precision + 1]){
+		d = pow10_u64[precision];
+		e++;
+	}
+	*digits = d;
+	*exp10 = e;
+	return 1;
+}
+
+// Writes digits (n_digits of them) as d.ddde+XX
+static size_t write_exponential(char* out, int negative, uint64_t digits,
+		int n_digits, int exp10){
+	char* p = out;
+	if(negative) *p++ = '-';
+	char buffer[20] = {0};
+	for(int i = n_digits - 1; i >= 0; i--){
+		buffer[i] = '0' + digits % 10;
+		digits /= 10;
+	}
+	*p++ = buffer[0];
+	if(n_digits > 1){
+		*p++ = '.';
+		memcpy(p, buffer + 1, n_digits - 1);
+		p += n_digits - 1;
+	}
+	*p++ = 'e';
+	*p++ = exp10 < 0 ? '-' : '+';
+	int a = exp10 < 0 ? -exp10 : exp10;
+	if(a >= 100) *p++ = '0' + a / 100;
+	*p++ = '0' + a / 10 % 10;
+	*p++ = '0' + a % 10;
+	return p - out;
+}
+
+// Room format_double needs, including the terminating NUL of snprintf
+#define FORMAT_DOUBLE_SIZE(precision) ((precision) < 0 ? 32 : (size_t)(precision) + 10)
+
+static const char* parse_double(const char* p, const char* end, double* value);
+
+// Writes x like printf("%.*e", precision, x); for negative precision the
+// shortest such string that reads back as x (trailing zeros dropped).
+// out must have room for FORMAT_DOUBLE_SIZE(precision) chars. Returns
+// number of chars written.
+static size_t format_double(char* out, double x, int precision){
+	if(!isfinite(x) || x == 0){
+		return snprintf(out, FORMAT_DOUBLE_SIZE(precision), "%.*e",
+				precision < 0 ? 0 : precision, x);
+	}
+	int negative = signbit(x) != 0;
+	double ax = fabs(x);
+	uint64_t digits;
+	int exp10;
+	if(precision >= 0){
+		if(decimal_digits(ax, precision, &digits, &exp10)){
+			return write_exponential(out, negative, digits, precision + 1, exp10);
+		}
+		return snprintf(out, FORMAT_DOUBLE_SIZE(precision), "%.*e", precision, x);
+	}
+
+	// Shortest round trip: 15 significant digits, then 16, then 17.
+	// Subnormals have fewer significant bits, so start from one digit.
+	for(int p = ax < DBL_MIN ? 0 : 14; p <= 16; p++){
+		char buffer[32];
+		size_t n;
+		if(p < 16 && decimal_digits(ax, p, &digits, &exp10)){
+			n = write_exponential(buffer, 0, digits, p + 1, exp10);
+		} else {
+			n = snprintf(buffer, sizeof(buffer), "%.*e", p, ax);
+		}
+		double back;
+		if(p < 16 && (parse_double(buffer, buffer + n, &back) == NULL || back != ax)){
+			continue;
+		}
+		// Drop trailing zeros of the mantissa
+		char* e = memchr(buffer, 'e', n);
+		char* last = e - 1;
+		while(*last == '0') last--;
+		if(*last == '.') last--;
+		size_t mantissa_len = last + 1 - buffer;
+		char* q = out;
+		if(negative) *q++ = '-';
+		memcpy(q, buffer, mantissa_len);
+		q += mantissa_len;
+		memcpy(q, e, buffer + n - e);
+		q += buffer + n - e;
+		return q - out;
+	}
+	return snprintf(out, 32, "%.17e", x);
+}
+
+static const csv_write_options csv_write_defaults = {8, 0};
+
+typedef struct {
+	double** rows;      // element (i, j) is rows[i][j] ...
+	const double* flat; // ... or flat[i] when rows is NULL (cols == 1)
+	size_t n_rows;
+	size_t cols;
+	int precision;
+	size_t row0, row1;   // rows of the current batch
+	size_t n_slices;     // the batch is split into this many slices
+	char** buffers;      // one per slice
+	size_t* lengths;
+} csv_format_args;
+
+// Upper bound of a formatted element plus separator
+static size_t csv_bytes_per_element(int precision){
+	return FORMAT_DOUBLE_SIZE(precision) + 2;
+}
+
+static size_t csv_format_rows(const csv_format_args* args, char* out,
+		size_t begin, size_t end){
+	char* p = out;
+	for(size_t i = begin; i < end; i++){
+		for(size_t j = 0; j < args->cols; j++){
+			double x = args->rows ? args->rows[i][j] : args->flat[i];
+			p += format_double(p, x, args->precision);
+			if(j + 1 < args->cols){
+				*p++ = ',';
+				*p++ = ' ';
+			}
+		}
+		*p++ = '\n';
+	}
+	return p - out;
+}
+
+// Slices are planned for the pool size, but linalg_parallel may run
+// fewer threads (down to the caller alone), so each takes every
+// n_threads-th slice
+static void csv_format_task(void* ctx, size_t t, size_t n_threads){
+	csv_format_args* args = ctx;
+	for(size_t s = t; s < args->n_slices; s += n_threads){
+		size_t begin, end;
+		partition_range(args->row1 - args->row0, s, args->n_slices, 1,
+				&begin, &end);
+		args->lengths[s] = csv_format_rows(args, args->buffers[s],
+				args->row0 + begin, args->row0 + end);
+	}
+}
+
+static int csv_write_rows(FILE* file, csv_format_args* args){
+	pthread_once(&pow10_once, pow10_table_init);
+	size_t row_bytes = args->cols * csv_bytes_per_element(args->precision) + 1;
+	size_t n_threads = parallel_worthwhile(args->n_rows * args->cols)
+		? pool.n_threads : 1;
+	size_t batch_rows = n_threads * CSV_WRITE_BATCH_BYTES / row_bytes;
+	if(batch_rows < n_threads) batch_rows = n_threads;
+	size_t rows_per_thread = (batch_rows + n_threads - 1) / n_threads;
+
+	char* buffers[n_threads];
+	size_t lengths[n_threads];
+	int status = 0;
+	for(size_t t = 0; t < n_threads; t++){
+		buffers[t] = malloc(rows_per_thread * row_bytes);
+		if(buffers[t] == NULL) status = -1;
+	}
+	args->n_slices = n_threads;
+	args->buffers = buffers;
+	args->lengths = lengths;
+	for(size_t row0 = 0; status == 0 && row0 < args->n_rows; row0 += batch_rows){
+		args->row0 = row0;
+		args->row1 = args->n_rows - row0 < batch_rows ? args->n_rows : row0 + batch_rows;
+		memset(lengths, 0, sizeof(lengths));
+		if(n_threads > 1){
+			linalg_parallel(csv_format_task, args);
+		} else {
+			csv_format_task(args, 0, 1);
+		}
+		for(size_t t = 0; t < n_threads; t++){
+			if(fwrite(buffers[t], 1, lengths[t], file) != lengths[t]) status = -1;
+		}
+	}
+	for(size_t t = 0; t < n_threads; t++){
+		free(buffers[t]);
+	}
+	return status;
+}
+
+static FILE* csv_open(const char* filepath, const char* header){
+	FILE* file = fopen(filepath, "w");
+	if(file != NULL && header != NULL){
+		fprintf(file, "%s\n", header);
+	}
+	return file;
+}
+
+static int csv_close(FILE* file, int status){
+	if(fclose(file) != 0) status = -1;
+	return status;
+}
+
+int write_matrix_to_csv(const char* filepath, const char* header,
+		double** matrix, size_t rows, size_t cols,
+		const csv_write_options* options){
+	if(options == NULL) options = &csv_write_defaults;
+	FILE* file = csv_open(filepath, header);
+	if(file == NULL) return -1;
+	csv_format_args args = {matrix, NULL, rows, cols, options->precision};
+	int status = csv_close(file, csv_write_rows(file, &args));
+	if(status == 0 && options->print_banner){
+		printf("\nSucessfully printed matrix to file: %s\n", filepath);
+	}
+	return status;
+}
+
+int write_vector_to_csv(const char* filepath, const char* header,
+		double* vector, size_t size, const csv_write_options* options){
+	if(options == NULL) options = &csv_write_defaults;
+	FILE* file = csv_open(filepath, header);
+	if(file == NULL) return -1;
+	csv_format_args args = {NULL, vector, size, 1, options->precision};
+	int status = csv_close(file, csv_write_rows(file, &args));
+	if(status == 0 && options->print_banner){
+		printf("\nSucessfully printed vector to file: %s\n", filepath);
+	}
+	return status;
+}
+
+void print_matrix_to_file(char* filepath, char* header, double** matrix,
+					  	  size_t rows, size_t cols){
+	csv_write_options options = {8, 1};
+	write_matrix_to_csv(filepath, header, matrix, rows, cols, &options);
+}
+
+
+void print_vector_to_file(char* filepath, char* header, double* vector,
+		size_t size){
+	csv_write_options options = {8, 1};
+	write_vector_to_csv(filepath, header, vector, size, &options);
+}
+
+// Helper for print_vectors_as_columns_to_file
+int get_max_value_of_int_vector(int* vector, int len){
+	int max = vector[0];
+	for(int i = 1; i < len; i++){
+		if(vector[i] > max){
+			max = vector[i];
+		}
+	}
+	return max;
+}
+
+int write_vectors_as_columns_to_csv(const char* filepath, const char* header,
+		double** vector_of_vectors, int n_vectors, int* len_vectors,
+		const csv_write_options* options){
+	if(options == NULL) options = &csv_write_defaults;
+	pthread_once(&pow10_once, pow10_table_init);
+	FILE* file = csv_open(filepath, header);
+	if(file == NULL) return -1;
+
+	int  n_cols   = n_vectors;
+	int* len_cols = len_vectors;
+	int max_rows = get_max_value_of_int_vector(len_cols, n_cols);
+	size_t row_bytes = n_cols * csv_bytes_per_element(options->precision) + 1;
+	size_t capacity = CSV_WRITE_BATCH_BYTES > row_bytes ? CSV_WRITE_BATCH_BYTES : row_bytes;
+	char* buffer = malloc(capacity);
+	if(buffer == NULL) return csv_close(file, -1);
+
+	int status = 0;
+	size_t length = 0;
+	for(int row_i = 0; row_i < max_rows; row_i++){ //rows
+		if(capacity - length < row_bytes){
+			if(fwrite(buffer, 1, length, file) != length) status = -1;
+			length = 0;
+		}
+		char* p = buffer + length;
+		for(int col_i = 0; col_i < n_cols; col_i++){  //cols
+			if(row_i < len_cols[col_i]){ //within vector_i's length; print
+				p += format_double(p, vector_of_vectors[col_i][row_i],
+						options->precision);
+			}
+			if(col_i != n_cols - 1){
+				*p++ = ',';
+				*p++ = ' ';
+			} else { // = last column, break line
+				*p++ = '\n';
+			}
+		}
+		length = p - buffer;
+	}
+	if(fwrite(buffer, 1, length, file) != length) status = -1;
+	free(buffer);
+
+	status = csv_close(file, status);
+	if(status == 0 && options->print_banner){
+		printf("\nSucessfully printed vector of vectors to file: %s\n", filepath);
+	}
+	return status;
+}
+
+void print_vectors_as_columns_to_file(char* filepath, char* header,
+		double** vector_of_vectors, int n_vectors, int* len_vectors){
+	csv_write_options options = {8, 1};
+	write_vectors_as_columns_to_csv(filepath, header, vector_of_vectors,
+			n_vectors, len_vectors, &options);
+}
+
+void read_csv_to_matrix(
+	double** matrix, char* filepath, size_t rows, size_t cols
+) {
+    char *row_buffer = NULL;
+    size_t buffer_size = 0;
+
+    FILE *file = fopen(filepath, "r");
+
+    // Skip comments (rows starting with #) and one extra row
+    // which is assumed to be header
+    while (getline(&row_buffer, &buffer_size, file) != -1) {
+        if (strncmp(row_buffer, "#", sizeof(char)) != 0) break;
+    }
+
+    // Read all rows (getline grows the buffer, so long rows are kept whole)
+    size_t i_row = 0;
+    while (i_row < rows && getline(&row_buffer, &buffer_size, file) != -1) {
 
         // Read all "," separated columns in row
-        int i_col = 0;
+        size_t i_col = 0;
         char *value_string = strtok(row_buffer, ",");
         while(value_string != NULL && i_col < cols) {
             matrix[i_row][i_col] = atof(value_string);
@@ -424,9 +6826,612 @@ void read_csv_to_matrix(
             i_col++;
         }
 
-        fgets(row_buffer, max_row_length, file);
         i_row++;
     }
 
+    free(row_buffer);
     fclose(file);
 }
+
+/* ---------------------------------------------------
+ * Parallel CSV reader. The file is mapped (or read in
+ * one go if it cannot be mapped), cut into one chunk
+ * per thread at line boundaries, and every chunk is
+ * first counted and then parsed in parallel.
+ * ------------------------------------------------- */
+
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a number in [p, end). Mantissas that fit in 53 bits with a
+// power of ten up to 1e22 are exact in double, so m * 10^e (or m / 10^-e)
+// is correctly rounded; anything else goes through strtod. Returns the
+// position after the number, or NULL if there is none.
+static const char* parse_double(const char* p, const char* end, double* value){
+	const char* start = p;
+	int negative = 0;
+	if(p < end && (*p == '-' || *p == '+')){
+		negative = *p == '-';
+		p++;
+	}
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0; // significant digits kept in mantissa
+	size_t digits_seen = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; p++, digits_seen++){
+		if(digits < 19){
+			mantissa = mantissa * 10 + (*p - '0');
+			if(mantissa != 0) digits++;
+		} else {
+			exponent++;
+		}
+	}
+	if(p < end && *p == '.'){
+		for(p++; p < end && *p >= '0' && *p <= '9'; p++, digits_seen++){
+			if(digits < 19){
+				mantissa = mantissa * 10 + (*p - '0');
+				if(mantissa != 0) digits++;
+				exponent--;
+			}
+		}
+	}
+	int has_digits = digits_seen > 0;
+	if(has_digits && p < end && (*p == 'e' || *p == 'E')){
+		const char* q = p + 1;
+		int exp_negative = 0, exp_value = 0;
+		if(q < end && (*q == '-' || *q == '+')){
+			exp_negative = *q == '-';
+			q++;
+		}
+		if(q < end && *q >= '0' && *q <= '9'){
+			for(; q < end && *q >= '0' && *q <= '9'; q++){
+				if(exp_value < 100000) exp_value = exp_value * 10 + (*q - '0');
+			}
+			exponent += exp_negative ? -exp_value : exp_value;
+			p = q;
+		}
+	}
+	if(has_digits && digits < 19 && mantissa <= (UINT64_C(1) << 53)
+			&& exponent >= -22 && exponent <= 22){
+		double x = (double)mantissa;
+		x = exponent < 0 ? x / exact_powers_of_ten[-exponent]
+			: x * exact_powers_of_ten[exponent];
+		*value = negative ? -x : x;
+		return p;
+	}
+
+	// Slow path: long mantissas, large exponents, inf and nan
+	char buffer[128];
+	size_t n = 0;
+	for(const char* q = start; q < end && n < sizeof(buffer) - 1
+			&& *q != ',' && *q != '\n' && *q != '\r'; q++){
+		buffer[n++] = *q;
+	}
+	buffer[n] = '\0';
+	char* stop;
+	*value = strtod(buffer, &stop);
+	if(stop == buffer) return NULL;
+	return start + (stop - buffer);
+}
+
+static int csv_is_blank(char c){
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// End of the line starting at p (position of '\n' or end)
+static const char* csv_line_end(const char* p, const char* end){
+	const char* nl = memchr(p, '\n', end - p);
+	return nl != NULL ? nl : end;
+}
+
+static int csv_line_is_empty(const char* p, const char* line_end){
+	for(; p < line_end; p++){
+		if(!csv_is_blank(*p)) return 0;
+	}
+	return 1;
+}
+
+typedef struct {
+	const char* begin;
+	const char* end;
+	size_t first_line; // file line number of begin
+	size_t lines;      // all lines in chunk
+	size_t rows;       // non-empty lines in chunk
+	size_t first_row;  // matrix row of first non-empty line
+	csv_error error;
+} csv_chunk;
+
+typedef struct {
+	csv_chunk* chunks;
+	size_t n_chunks;
+	double** matrix;
+	size_t cols;
+} csv_parse_args;
+
+static void csv_count_task(void* ctx, size_t t, size_t n_threads){
+	csv_parse_args* args = ctx;
+	for(size_t c = t; c < args->n_chunks; c += n_threads){
+		csv_chunk* chunk = &args->chunks[c];
+		for(const char* p = chunk->begin; p < chunk->end; ){
+			const char* line_end = csv_line_end(p, chunk->end);
+			chunk->lines++;
+			if(!csv_line_is_empty(p, line_end)) chunk->rows++;
+			p = line_end + 1;
+		}
+	}
+}
+
+static void csv_set_error(csv_error* error, size_t line, size_t column,
+		const char* message){
+	error->line = line;
+	error->column = column;
+	snprintf(error->message, sizeof(error->message), "%s", message);
+}
+
+static void csv_parse_task(void* ctx, size_t t, size_t n_threads){
+	csv_parse_args* args = ctx;
+	for(size_t c = t; c < args->n_chunks; c += n_threads){
+		csv_chunk* chunk = &args->chunks[c];
+		size_t line = chunk->first_line, row = chunk->first_row;
+		for(const char* p = chunk->begin; p < chunk->end; line++){
+			const char* line_end = csv_line_end(p, chunk->end);
+			if(csv_line_is_empty(p, line_end)){
+				p = line_end + 1;
+				continue;
+			}
+			double* out = args->matrix[row++];
+			size_t col = 0;
+			for(;;){
+				while(p < line_end && csv_is_blank(*p)) p++;
+				const char* q = col < args->cols
+					? parse_double(p, line_end, &out[col]) : p;
+				if(col >= args->cols){
+					csv_set_error(&chunk->error, line, col + 1,
+							"more fields than in first row");
+					return;
+				}
+				if(q == NULL){
+					csv_set_error(&chunk->error, line, col + 1, "not a number");
+					return;
+				}
+				p = q;
+				while(p < line_end && csv_is_blank(*p)) p++;
+				col++;
+				if(p == line_end) break;
+				if(*p != ','){
+					csv_set_error(&chunk->error, line, col,
+							"unexpected character after number");
+					return;
+				}
+				p++;
+			}
+			if(col != args->cols){
+				csv_set_error(&chunk->error, line, col,
+						"fewer fields than in first row");
+				return;
+			}
+			p = line_end + 1;
+		}
+	}
+}
+
+double** read_csv_to_new_matrix(const char* filepath, size_t* rows,
+		size_t* cols, csv_error* error){
+	csv_error local_error;
+	if(error == NULL) error = &local_error;
+	memset(error, 0, sizeof(*error));
+	*rows = 0;
+	*cols = 0;
+
+	int fd = open(filepath, O_RDONLY);
+	if(fd < 0){
+		csv_set_error(error, 0, 0, "cannot open file");
+		return NULL;
+	}
+	struct stat st;
+	char* text = NULL;
+	size_t size = 0;
+	int mapped = 0;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		size = st.st_size;
+		text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(text == MAP_FAILED){
+			text = NULL;
+		} else {
+			mapped = 1;
+			madvise(text, size, MADV_SEQUENTIAL);
+		}
+	}
+	if(text == NULL){
+		// Not mappable (pipe, special file): read it whole in large chunks
+		size_t capacity = 1 << 20;
+		size = 0;
+		text = malloc(capacity);
+		ssize_t got;
+		while(text != NULL && (got = read(fd, text + size, capacity - size)) > 0){
+			size += got;
+			if(size == capacity){
+				char* grown = realloc(text, capacity *= 2);
+				if(grown == NULL) free(text);
+				text = grown;
+			}
+		}
+	}
+	close(fd);
+	if(text == NULL){
+		csv_set_error(error, 0, 0, "cannot read file");
+		return NULL;
+	}
+	const char* end = text + size;
+
+	// Skip comments (lines starting with #) and one header line
+	const char* p = text;
+	size_t line = 1;
+	while(p < end && *p == '#'){
+		p = csv_line_end(p, end) + 1;
+		line++;
+	}
+	if(p < end){
+		p = csv_line_end(p, end) + 1;
+		line++;
+	}
+	if(p > end) p = end;
+
+	// Shape: columns from the first data line
+	double** matrix = NULL;
+	const char* first = p;
+	while(first < end && csv_line_is_empty(first, csv_line_end(first, end))){
+		first = csv_line_end(first, end) + 1;
+	}
+	if(first >= end){
+		csv_set_error(error, line, 0, "no data rows");
+		goto done;
+	}
+	size_t n_cols = 1;
+	for(const char* q = first; q < csv_line_end(first, end); q++){
+		if(*q == ',') n_cols++;
+	}
+
+	// One chunk per thread, boundaries moved to the next line start
+	size_t n_chunks = pool.n_threads;
+	if(n_chunks > 1 && (size_t)(end - p) < n_chunks * (1 << 20)){
+		n_chunks = (end - p) / (1 << 20) + 1;
+	}
+	csv_chunk* chunks = calloc(n_chunks, sizeof(csv_chunk));
+	if(chunks == NULL){
+		csv_set_error(error, 0, 0, "out of memory");
+		goto done;
+	}
+	const char* chunk_begin = p;
+	for(size_t c = 0; c < n_chunks; c++){
+		const char* chunk_end = c + 1 == n_chunks ? end
+			: p + (end - p) * (c + 1) / n_chunks;
+		if(chunk_end < chunk_begin) chunk_end = chunk_begin;
+		if(chunk_end < end) chunk_end = csv_line_end(chunk_end, end) + 1;
+		if(chunk_end > end) chunk_end = end;
+		chunks[c].begin = chunk_begin;
+		chunks[c].end = chunk_end;
+		chunk_begin = chunk_end;
+	}
+
+	csv_parse_args args = {chunks, n_chunks, NULL, n_cols};
+	linalg_parallel(csv_count_task, &args);
+	size_t n_rows = 0;
+	for(size_t c = 0; c < n_chunks; c++){
+		chunks[c].first_line = line;
+		chunks[c].first_row = n_rows;
+		line += chunks[c].lines;
+		n_rows += chunks[c].rows;
+	}
+
+	matrix = create_matrix(n_rows, n_cols);
+	if(matrix == NULL){
+		csv_set_error(error, 0, 0, "out of memory");
+	} else {
+		args.matrix = matrix;
+		linalg_parallel(csv_parse_task, &args);
+		for(size_t c = 0; c < n_chunks; c++){
+			if(chunks[c].error.line != 0){
+				*error = chunks[c].error;
+				destroy_matrix(matrix, n_rows);
+				matrix = NULL;
+				break;
+			}
+		}
+	}
+	if(matrix != NULL){
+		*rows = n_rows;
+		*cols = n_cols;
+	}
+	free(chunks);
+
+done:
+	if(mapped){
+		munmap(text, size);
+	} else {
+		free(text);
+	}
+	return matrix;
+}
+
+
+/* ---------------------------------------------------
+ * Binary matrix files, see linalg.h for the layout.
+ * ------------------------------------------------- */
+
+#define MATRIX_FILE_MAGIC "LINALGMX"
+#define MATRIX_FILE_BYTE_ORDER 0x01020304u
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_DTYPE_DOUBLE 1
+#define MATRIX_FILE_HEADER_SIZE 64
+
+typedef struct {
+	char     magic[8];
+	uint32_t byte_order;
+	uint16_t version;
+	uint16_t dtype;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t data_offset;
+	uint32_t alignment;
+	uint8_t  padding[MATRIX_FILE_HEADER_SIZE - 44];
+} matrix_file_header;
+
+_Static_assert(sizeof(matrix_file_header) == MATRIX_FILE_HEADER_SIZE,
+		"matrix file header must be 64 bytes");
+
+static uint16_t swap16(uint16_t x){ return (uint16_t)(x << 8 | x >> 8); }
+static uint32_t swap32(uint32_t x){ return __builtin_bswap32(x); }
+static uint64_t swap64(uint64_t x){ return __builtin_bswap64(x); }
+
+// Checks the header, converting it to host byte order. Sets *swapped if
+// the file was written with the other byte order. Returns 0 if valid.
+static int matrix_file_check_header(matrix_file_header* h, size_t file_size,
+		int* swapped){
+	if(memcmp(h->magic, MATRIX_FILE_MAGIC, sizeof(h->magic)) != 0) return -1;
+	*swapped = h->byte_order == swap32(MATRIX_FILE_BYTE_ORDER);
+	if(!*swapped && h->byte_order != MATRIX_FILE_BYTE_ORDER) return -1;
+	if(*swapped){
+		h->version = swap16(h->version);
+		h->dtype = swap16(h->dtype);
+		h->rows = swap64(h->rows);
+		h->cols = swap64(h->cols);
+		h->data_offset = swap64(h->data_offset);
+		h->alignment = swap32(h->alignment);
+	}
+	if(h->version != MATRIX_FILE_VERSION || h->dtype != MATRIX_FILE_DTYPE_DOUBLE){
+		return -1;
+	}
+	// Whatever cols is, the row pointers alone must fit in memory
+	if(h->rows > MATRIX_MAX_ROWS || h->cols > SIZE_MAX / sizeof(double)) return -1;
+	if(h->cols != 0 && h->rows > SIZE_MAX / sizeof(double) / h->cols) return -1;
+	if(h->data_offset < sizeof(*h) || h->data_offset % sizeof(double) != 0
+			|| h->data_offset > file_size
+			|| (file_size - h->data_offset) / sizeof(double) < h->rows * h->cols){
+		return -1;
+	}
+	return 0;
+}
+
+int save_matrix_to_binary_file(const char* filepath, double** matrix,
+		size_t rows, size_t cols){
+	FILE* file = fopen(filepath, "wb");
+	if(file == NULL) return -1;
+	matrix_file_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MATRIX_FILE_MAGIC, sizeof(h.magic));
+	h.byte_order = MATRIX_FILE_BYTE_ORDER;
+	h.version = MATRIX_FILE_VERSION;
+	h.dtype = MATRIX_FILE_DTYPE_DOUBLE;
+	h.rows = rows;
+	h.cols = cols;
+	h.data_offset = MATRIX_FILE_HEADER_SIZE;
+	h.alignment = LINALG_ALIGNMENT;
+
+	int status = fwrite(&h, sizeof(h), 1, file) == 1 ? 0 : -1;
+	for(size_t i = 0; status == 0 && i < rows; i++){
+		if(fwrite(matrix[i], sizeof(double), cols, file) != cols) status = -1;
+	}
+	if(fclose(file) != 0) status = -1;
+	return status;
+}
+
+double** load_matrix_from_binary_file(const char* filepath, size_t* rows,
+		size_t* cols){
+	FILE* file = fopen(filepath, "rb");
+	if(file == NULL) return NULL;
+	struct stat st;
+	matrix_file_header h;
+	int swapped;
+	if(fstat(fileno(file), &st) != 0 || fread(&h, sizeof(h), 1, file) != 1
+			|| matrix_file_check_header(&h, st.st_size, &swapped) != 0
+			|| fseek(file, h.data_offset, SEEK_SET) != 0){
+		fclose(file);
+		return NULL;
+	}
+
+	double** matrix = create_matrix(h.rows, h.cols);
+	for(size_t i = 0; matrix != NULL && i < h.rows; i++){
+		if(fread(matrix[i], sizeof(double), h.cols, file) != h.cols){
+			destroy_matrix(matrix, h.rows);
+			matrix = NULL;
+			break;
+		}
+		if(swapped){
+			uint64_t* bits = (uint64_t*)matrix[i];
+			for(size_t j = 0; j < h.cols; j++) bits[j] = swap64(bits[j]);
+		}
+	}
+	fclose(file);
+	if(matrix != NULL){
+		*rows = h.rows;
+		*cols = h.cols;
+	}
+	return matrix;
+}
+
+matrix_t* matrix_map_file(const char* filepath){
+	int fd = open(filepath, O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(matrix_file_header)){
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) return NULL;
+
+	matrix_file_header h;
+	memcpy(&h, base, sizeof(h));
+	int swapped;
+	if(matrix_file_check_header(&h, size, &swapped) != 0 || swapped){
+		munmap(base, size);
+		return NULL;
+	}
+	matrix_t* m = matrix_alloc_header(h.rows, h.cols, h.cols, NULL);
+	if(m == NULL){
+		munmap(base, size);
+		return NULL;
+	}
+	m->data = (double*)((char*)base + h.data_offset);
+	m->base = base;
+	m->base_size = size;
+	m->flags = MATRIX_MAPPED;
+	matrix_set_row_pointers(m);
+	return m;
+}
+
+/* ---------------------------------------------------
+ * Binary sparse matrix files, see linalg.h for the
+ * layout. Shares byte order handling with the dense
+ * format; the arrays are validated on load.
+ * ------------------------------------------------- */
+
+#define SPARSE_FILE_MAGIC "LINALGSP"
+
+typedef struct {
+	char     magic[8];
+	uint32_t byte_order;
+	uint16_t version;
+	uint16_t dtype;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t nnz;
+	uint16_t format;
+	uint16_t reserved;
+	uint8_t  padding[MATRIX_FILE_HEADER_SIZE - 44];
+} sparse_file_header;
+
+_Static_assert(sizeof(sparse_file_header) == MATRIX_FILE_HEADER_SIZE,
+		"sparse file header must be 64 bytes");
+
+int save_sparse_matrix_to_binary_file(const char* filepath,
+		const sparse_matrix* A){
+	FILE* file = fopen(filepath, "wb");
+	if(file == NULL) return -1;
+	sparse_file_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SPARSE_FILE_MAGIC, sizeof(h.magic));
+	h.byte_order = MATRIX_FILE_BYTE_ORDER;
+	h.version = MATRIX_FILE_VERSION;
+	h.dtype = MATRIX_FILE_DTYPE_DOUBLE;
+	h.format = A->format;
+	h.rows = A->rows;
+	h.cols = A->cols;
+	h.nnz = A->nnz;
+
+	size_t major = sparse_major(A);
+	int status = fwrite(&h, sizeof(h), 1, file) == 1 ? 0 : -1;
+	// Indices as uint64_t whatever the width of size_t
+	for(size_t i = 0; status == 0 && i <= major; i++){
+		uint64_t x = A->ptr[i];
+		if(fwrite(&x, sizeof(x), 1, file) != 1) status = -1;
+	}
+	for(size_t k = 0; status == 0 && k < A->nnz; k++){
+		uint64_t x = A->index[k];
+		if(fwrite(&x, sizeof(x), 1, file) != 1) status = -1;
+	}
+	if(status == 0 && fwrite(A->values, sizeof(double), A->nnz, file) != A->nnz){
+		status = -1;
+	}
+	if(fclose(file) != 0) status = -1;
+	return status;
+}
+
+// Reads n uint64_t into size_t dst
+static int sparse_read_indices(FILE* file, size_t* dst, size_t n, int swapped){
+	uint64_t buf[512];
+	for(size_t done = 0; done < n;){
+		size_t chunk = n - done < 512 ? n - done : 512;
+		if(fread(buf, sizeof(uint64_t), chunk, file) != chunk) return -1;
+		for(size_t k = 0; k < chunk; k++){
+			uint64_t x = swapped ? swap64(buf[k]) : buf[k];
+			if(x > SIZE_MAX) return -1;
+			dst[done + k] = x;
+		}
+		done += chunk;
+	}
+	return 0;
+}
+
+sparse_matrix* load_sparse_matrix_from_binary_file(const char* filepath){
+	FILE* file = fopen(filepath, "rb");
+	if(file == NULL) return NULL;
+	struct stat st;
+	sparse_file_header h;
+	if(fstat(fileno(file), &st) != 0 || fread(&h, sizeof(h), 1, file) != 1
+			|| memcmp(h.magic, SPARSE_FILE_MAGIC, sizeof(h.magic)) != 0){
+		fclose(file);
+		return NULL;
+	}
+	int swapped = h.byte_order == swap32(MATRIX_FILE_BYTE_ORDER);
+	if(swapped){
+		h.version = swap16(h.version);
+		h.dtype = swap16(h.dtype);
+		h.format = swap16(h.format);
+		h.rows = swap64(h.rows);
+		h.cols = swap64(h.cols);
+		h.nnz = swap64(h.nnz);
+	}
+	size_t major = h.format == LINALG_CSR ? h.rows : h.cols;
+	size_t minor = h.format == LINALG_CSR ? h.cols : h.rows;
+	// The arrays must fit the file before anything is allocated
+	size_t size = st.st_size - sizeof(h);
+	if((!swapped && h.byte_order != MATRIX_FILE_BYTE_ORDER)
+			|| h.version != MATRIX_FILE_VERSION
+			|| h.dtype != MATRIX_FILE_DTYPE_DOUBLE
+			|| (h.format != LINALG_CSR && h.format != LINALG_CSC)
+			|| h.nnz > size / 16
+			|| major >= size / 8 - 2 * h.nnz){
+		fclose(file);
+		return NULL;
+	}
+	sparse_matrix* A = sparse_alloc(h.format, h.rows, h.cols, h.nnz);
+	int status = A == NULL ? -1 : 0;
+	if(status == 0){
+		status = sparse_read_indices(file, A->ptr, major + 1, swapped) == 0
+			&& sparse_read_indices(file, A->index, h.nnz, swapped) == 0
+			&& fread(A->values, sizeof(double), h.nnz, file) == h.nnz ? 0 : -1;
+	}
+	fclose(file);
+	if(status == 0 && swapped){
+		uint64_t* bits = (uint64_t*)A->values;
+		for(size_t k = 0; k < h.nnz; k++) bits[k] = swap64(bits[k]);
+	}
+	// Structure: ptr non-decreasing from 0 to nnz, minors in range
+	if(status == 0 && (A->ptr[0] != 0 || A->ptr[major] != h.nnz)) status = -1;
+	for(size_t i = 0; status == 0 && i < major; i++){
+		if(A->ptr[i] > A->ptr[i + 1]) status = -1;
+	}
+	for(size_t k = 0; status == 0 && k < h.nnz; k++){
+		if(A->index[k] >= minor) status = -1;
+	}
+	if(status != 0){
+		destroy_sparse_matrix(A);
+		return NULL;
+	}
+	return A;
+}
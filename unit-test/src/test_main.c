@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "test_main.h"
 #include "linalg.h"
@@ -134,6 +135,938 @@ START_TEST(test_matrix_multiplication)
     destroy_matrix(matrix_B, ARRAY_SIZE_M); matrix_B = NULL;
 }
 
+START_TEST(test_general_matrix_multiplication)
+{
+    // Large enough to go through the packed, blocked path
+    const size_t m = 67, n = 131, p = 45;
+    double **At = create_matrix(n, m);
+    double **B = create_matrix(n, p);
+    double **C = create_matrix(m, p);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < m; j++) At[i][j] = sin(i + 2.0*j);
+	for(size_t j = 0; j < p; j++) B[i][j] = cos(3.0*i - j);
+    }
+    for(size_t i = 0; i < m; i++){
+	for(size_t j = 0; j < p; j++) C[i][j] = 1.0;
+    }
+    general_matrix_multiplication(C, At, B, m, n, p, 2.0, 0.5,
+				  LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+    for(size_t i = 0; i < m; i++){
+	for(size_t j = 0; j < p; j++){
+	    double expected = 0.5;
+	    for(size_t k = 0; k < n; k++) expected += 2.0 * At[k][i] * B[k][j];
+	    ck_assert_double_eq_tol(C[i][j], expected, 1e-9);
+	}
+    }
+    destroy_matrix(At, n); At = NULL;
+    destroy_matrix(B, n); B = NULL;
+    destroy_matrix(C, m); C = NULL;
+}
+
+START_TEST(test_matrix_vector_products)
+{
+    const size_t m = 301, n = 517;
+    double **A = create_matrix(m, n);
+    double *x = create_vector(n), *xt = create_vector(m);
+    double *y = create_vector(m), *yt = create_vector(n);
+    for(size_t i = 0; i < m; i++){
+	for(size_t j = 0; j < n; j++) A[i][j] = sin(i + 0.5*j);
+	xt[i] = cos(2.0*i);
+	y[i] = 1.0;
+    }
+    for(size_t j = 0; j < n; j++){
+	x[j] = cos(0.3*j);
+	yt[j] = 1.0;
+    }
+    general_matrix_vector_multiplication(y, A, x, m, n, 2.0, 0.5,
+					 LINALG_NO_TRANSPOSE);
+    general_matrix_vector_multiplication(yt, A, xt, m, n, -1.0, 3.0,
+					 LINALG_TRANSPOSE);
+    for(size_t i = 0; i < m; i++){
+	double expected = 0.5;
+	for(size_t j = 0; j < n; j++) expected += 2.0 * A[i][j] * x[j];
+	ck_assert_double_eq_tol(y[i], expected, 1e-9);
+    }
+    for(size_t j = 0; j < n; j++){
+	double expected = 3.0;
+	for(size_t i = 0; i < m; i++) expected -= A[i][j] * xt[i];
+	ck_assert_double_eq_tol(yt[j], expected, 1e-9);
+    }
+
+    // Same bits for any thread count
+    double *serial = create_vector(n);
+    linalg_set_num_threads(1);
+    matrix_vector_multiplication(serial, A, x, m, n);
+    linalg_set_num_threads(3);
+    matrix_vector_multiplication(y, A, x, m, n);
+    ck_assert_mem_eq(y, serial, m * sizeof(double));
+    general_matrix_vector_multiplication(yt, A, xt, m, n, 1.0, 0.0,
+					 LINALG_TRANSPOSE);
+    linalg_set_num_threads(1);
+    general_matrix_vector_multiplication(serial, A, xt, m, n, 1.0, 0.0,
+					 LINALG_TRANSPOSE);
+    ck_assert_mem_eq(yt, serial, n * sizeof(double));
+    linalg_set_num_threads(0);
+
+    rank_one_update(A, xt, x, m, n, -2.0);
+    for(size_t i = 0; i < m; i += 7){
+	for(size_t j = 0; j < n; j++){
+	    ck_assert_double_eq_tol(A[i][j], sin(i + 0.5*j) - 2.0 * xt[i] * x[j],
+				    1e-12);
+	}
+    }
+    destroy_vector(serial); serial = NULL;
+    destroy_vector(yt); yt = NULL;
+    destroy_vector(y); y = NULL;
+    destroy_vector(xt); xt = NULL;
+    destroy_vector(x); x = NULL;
+    destroy_matrix(A, m); A = NULL;
+}
+
+START_TEST(test_linear_solve)
+{
+    // Larger than one block so the blocked updates run
+    const size_t n = 150, nrhs = 3;
+    double **A = create_matrix(n, n);
+    double **S = create_matrix(n, n);
+    double **F = create_matrix(n, n);
+    double **X = create_matrix(n, nrhs);
+    double **B = create_matrix(n, nrhs);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < n; j++) A[i][j] = sin(1.0 + i*j + 0.5*i);
+	for(size_t j = 0; j < nrhs; j++) X[i][j] = cos(i - 3.0*j);
+    }
+    // S = A A^T + n I is symmetric positive definite
+    general_matrix_multiplication(S, A, A, n, n, n, 1.0, 0.0,
+				  LINALG_NO_TRANSPOSE, LINALG_TRANSPOSE);
+    for(size_t i = 0; i < n; i++) S[i][i] += n;
+
+    // LU: A X = B
+    matrix_multiplication(B, A, X, n, n, nrhs);
+    size_t *pivot = malloc(n * sizeof(size_t));
+    for(size_t i = 0; i < n; i++) memcpy(F[i], A[i], n * sizeof(double));
+    ck_assert_int_eq(lu_decomposition(F, n, pivot), 0);
+    lu_solve(F, n, pivot, B, nrhs);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < nrhs; j++) ck_assert_double_eq_tol(B[i][j], X[i][j], 1e-8);
+    }
+
+    // Cholesky: S X = B, and L L^T == S
+    matrix_multiplication(B, S, X, n, n, nrhs);
+    for(size_t i = 0; i < n; i++) memcpy(F[i], S[i], n * sizeof(double));
+    ck_assert_int_eq(cholesky_decomposition(F, n), 0);
+    ck_assert_double_eq(F[3][7], 0.0);
+    cholesky_solve(F, n, B, nrhs);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < nrhs; j++) ck_assert_double_eq_tol(B[i][j], X[i][j], 1e-10);
+    }
+    double **LLt = create_matrix(n, n);
+    general_matrix_multiplication(LLt, F, F, n, n, n, 1.0, 0.0,
+				  LINALG_NO_TRANSPOSE, LINALG_TRANSPOSE);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < n; j++) ck_assert_double_eq_tol(LLt[i][j], S[i][j], 1e-9);
+    }
+
+    // Transposed triangular solve: L^T X = B
+    general_matrix_multiplication(B, F, X, n, n, nrhs, 1.0, 0.0,
+				  LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+    triangular_solve(F, B, n, nrhs, LINALG_LOWER, LINALG_TRANSPOSE,
+		     LINALG_NON_UNIT_DIAGONAL);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < nrhs; j++) ck_assert_double_eq_tol(B[i][j], X[i][j], 1e-10);
+    }
+
+    // Vector solve in place, singular and indefinite matrices
+    double *v = create_vector(n);
+    for(size_t i = 0; i < n; i++) v[i] = X[i][0];
+    double *b = create_vector(n);
+    matrix_vector_multiplication(b, A, v, n, n);
+    ck_assert_int_eq(solve_linear_system(b, A, b, n), 0);
+    for(size_t i = 0; i < n; i++) ck_assert_double_eq_tol(b[i], v[i], 1e-8);
+    for(size_t i = 0; i < n; i++) A[i][5] = 0.0;
+    ck_assert_int_eq(solve_linear_system(b, A, b, n), -1);
+    S[n - 1][n - 1] = -1.0;
+    ck_assert_int_eq(cholesky_decomposition(S, n), -1);
+
+    destroy_vector(b); b = NULL;
+    destroy_vector(v); v = NULL;
+    free(pivot); pivot = NULL;
+    destroy_matrix(LLt, n); LLt = NULL;
+    destroy_matrix(B, n); B = NULL;
+    destroy_matrix(X, n); X = NULL;
+    destroy_matrix(F, n); F = NULL;
+    destroy_matrix(S, n); S = NULL;
+    destroy_matrix(A, n); A = NULL;
+}
+
+START_TEST(test_least_squares)
+{
+    // More columns than one panel, so the blocked updates run
+    const size_t rows = 200, cols = 70;
+    double **A = create_matrix(rows, cols);
+    double **F = create_matrix(rows, cols);
+    double **B = create_matrix(rows, cols);
+    double *tau = create_vector(cols);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) A[i][j] = sin(1.0 + i*j + 0.5*i);
+	memcpy(F[i], A[i], cols * sizeof(double));
+    }
+
+    // Q R == A, with R taken from the upper triangle
+    ck_assert_int_eq(qr_decomposition(F, rows, cols, tau), 0);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) B[i][j] = j >= i ? F[i][j] : 0.0;
+    }
+    ck_assert_int_eq(qr_multiply_q(F, rows, cols, tau, B, cols,
+				   LINALG_NO_TRANSPOSE), 0);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) ck_assert_double_eq_tol(B[i][j], A[i][j], 1e-10);
+    }
+
+    // Exact fit with an implicit bias, then a noisy one against the
+    // explicitly widened matrix
+    double *w = create_vector(cols + 1);
+    double *y = create_vector(rows);
+    for(size_t i = 0; i < rows; i++){
+	y[i] = 2.5;
+	for(size_t j = 0; j < cols; j++) y[i] += A[i][j] * cos(1.0 * j);
+    }
+    ck_assert_int_eq(least_squares(w, A, y, rows, cols, 1), 0);
+    ck_assert_double_eq_tol(w[0], 2.5, 1e-10);
+    for(size_t j = 0; j < cols; j++) ck_assert_double_eq_tol(w[j + 1], cos(1.0 * j), 1e-10);
+
+    double *ones = create_vector(rows);
+    for(size_t i = 0; i < rows; i++){
+	ones[i] = 1.0;
+	y[i] += 0.1 * sin(7.0 * i);
+    }
+    double **W = create_matrix_with_inserted_column(A, ones, rows, cols, 0);
+    double *v = create_vector(cols + 1);
+    ck_assert_int_eq(least_squares(v, W, y, rows, cols + 1, 0), 0);
+    ck_assert_int_eq(least_squares(w, A, y, rows, cols, 1), 0);
+    for(size_t j = 0; j <= cols; j++) ck_assert_double_eq_tol(w[j], v[j], 1e-9);
+
+    // Rank deficient: a constant column duplicates the bias; and too
+    // few rows
+    for(size_t i = 0; i < rows; i++) A[i][4] = 3.0;
+    ck_assert_int_eq(least_squares(w, A, y, rows, cols, 1), -1);
+    ck_assert_int_eq(least_squares(w, A, y, cols, cols, 1), -1);
+
+    destroy_vector(v); v = NULL;
+    destroy_matrix(W, rows); W = NULL;
+    destroy_vector(ones); ones = NULL;
+    destroy_vector(y); y = NULL;
+    destroy_vector(w); w = NULL;
+    destroy_vector(tau); tau = NULL;
+    destroy_matrix(B, rows); B = NULL;
+    destroy_matrix(F, rows); F = NULL;
+    destroy_matrix(A, rows); A = NULL;
+}
+
+START_TEST(test_eigen_and_svd)
+{
+    // Larger than one divide-and-conquer block so merges run
+    const size_t n = 120;
+    double **S = create_matrix(n, n);
+    double **V = create_matrix(n, n);
+    double **P = create_matrix(n, n);
+    double *lambda = create_vector(n);
+    double *mu = create_vector(n);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j <= i; j++) S[i][j] = S[j][i] = sin(1.0 + i*j + 0.5*i);
+    }
+    // S V == V diag(lambda), V^T V == I, and the values alone agree;
+    // then I + x x^T, whose eigenvalue 1 repeats n - 1 times
+    for(int pass = 0; pass < 2; pass++){
+	ck_assert_int_eq(symmetric_eigen_decomposition(lambda, V, S, n), 0);
+	ck_assert_int_eq(symmetric_eigen_decomposition(mu, NULL, S, n), 0);
+	matrix_multiplication(P, S, V, n, n, n);
+	for(size_t i = 0; i < n; i++){
+	    if(i > 0) ck_assert(lambda[i - 1] <= lambda[i]);
+	    ck_assert_double_eq_tol(mu[i], lambda[i], 1e-10);
+	    for(size_t j = 0; j < n; j++) {
+		ck_assert_double_eq_tol(P[i][j], lambda[j] * V[i][j], 1e-10);
+	    }
+	}
+	general_matrix_multiplication(P, V, V, n, n, n, 1.0, 0.0,
+				      LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+	for(size_t i = 0; i < n; i++){
+	    for(size_t j = 0; j < n; j++) ck_assert_double_eq_tol(P[i][j], i == j, 1e-12);
+	}
+	for(size_t i = 0; i < n; i++){
+	    for(size_t j = 0; j < n; j++) S[i][j] = (i == j) + cos(1.0*i) * cos(1.0*j);
+	}
+    }
+    ck_assert_double_eq_tol(lambda[n - 2], 1.0, 1e-12);
+
+    // Rank 6 matrix: the top 4 singular triplets are exact, and the
+    // sparse path sees the same matrix. A small diagonal then makes
+    // the samples full rank, which takes the CholeskyQR path.
+    const size_t rows = 300, cols = 200, rank = 6, k = 4;
+    double **U0 = create_random_normal_matrix(rows, rank, 0.0, 1.0, 3);
+    double **W0 = create_random_normal_matrix(rank, cols, 0.0, 1.0, 4);
+    double **A = create_matrix(rows, cols);
+    matrix_multiplication(A, U0, W0, rows, rank, cols);
+    double **G = create_matrix(cols, cols);
+    double *g = create_vector(cols);
+    double s[4], t[4];
+    double **U = create_matrix(rows, k);
+    double **Vk = create_matrix(cols, k);
+    for(int pass = 0; pass < 2; pass++){
+	general_matrix_multiplication(G, A, A, cols, rows, cols, 1.0, 0.0,
+				      LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+	ck_assert_int_eq(symmetric_eigen_decomposition(g, NULL, G, cols), 0);
+	ck_assert_int_eq(truncated_svd(s, U, Vk, A, rows, cols, k, 1, 42), 0);
+	for(size_t j = 0; j < k; j++){
+	    ck_assert_double_eq_tol(s[j], sqrt(g[cols - 1 - j]), 1e-9 * s[0]);
+	    // A v_j == s_j u_j
+	    for(size_t i = 0; i < rows; i++){
+		double av = 0.0;
+		for(size_t c = 0; c < cols; c++) av += A[i][c] * Vk[c][j];
+		ck_assert_double_eq_tol(av, s[j] * U[i][j], 1e-9 * s[0]);
+	    }
+	}
+	sparse_matrix *SA = create_sparse_matrix_from_dense(A, rows, cols, 0.0,
+							      LINALG_CSR);
+	ck_assert_int_eq(sparse_truncated_svd(t, NULL, NULL, SA, k, 1, 42), 0);
+	for(size_t j = 0; j < k; j++) ck_assert_double_eq_tol(t[j], s[j], 1e-9 * s[0]);
+	destroy_sparse_matrix(SA); SA = NULL;
+	for(size_t i = 0; i < cols; i++) A[i][i] += 1e-3;
+    }
+    ck_assert_int_eq(truncated_svd(s, U, Vk, A, rows, cols, cols + 1, 1, 42), -1);
+
+    destroy_matrix(Vk, cols); Vk = NULL;
+    destroy_matrix(U, rows); U = NULL;
+    destroy_vector(g); g = NULL;
+    destroy_matrix(G, cols); G = NULL;
+    destroy_matrix(A, rows); A = NULL;
+    destroy_matrix(W0, rank); W0 = NULL;
+    destroy_matrix(U0, rows); U0 = NULL;
+    destroy_vector(mu); mu = NULL;
+    destroy_vector(lambda); lambda = NULL;
+    destroy_matrix(P, n); P = NULL;
+    destroy_matrix(V, n); V = NULL;
+    destroy_matrix(S, n); S = NULL;
+}
+
+START_TEST(test_threaded_matrix_kernels)
+{
+    // Large enough for the kernels to split work over the pool
+    const size_t n = 300;
+    double **a = create_matrix(n, n);
+    double **b = create_matrix(n, n);
+    double **serial = create_matrix(n, n);
+    double **threaded = create_matrix(n, n);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < n; j++){
+	    a[i][j] = sin(i + 0.5*j);
+	    b[i][j] = cos(0.25*i - j);
+	}
+    }
+    add_scaled_matrix_to_matrix(serial, a, b, 0.3, n, n);
+    linalg_set_num_threads(3);
+    ck_assert_uint_eq(linalg_get_num_threads(), 3);
+    add_scaled_matrix_to_matrix(threaded, a, b, 0.3, n, n);
+    for(size_t i = 0; i < n; i++){
+	ck_assert_mem_eq(serial[i], threaded[i], n * sizeof(double));
+    }
+
+    matrix_multiplication(threaded, a, b, n, n, n);
+    linalg_set_num_threads(1);
+    matrix_multiplication(serial, a, b, n, n, n);
+    for(size_t i = 0; i < n; i++){
+	for(size_t j = 0; j < n; j++){
+	    ck_assert_double_eq_tol(threaded[i][j], serial[i][j], 1e-9);
+	}
+    }
+    destroy_matrix(a, n); a = NULL;
+    destroy_matrix(b, n); b = NULL;
+    destroy_matrix(serial, n); serial = NULL;
+    destroy_matrix(threaded, n); threaded = NULL;
+}
+
+START_TEST(test_create_matrix_contiguous)
+{
+    double **mat = create_matrix(ARRAY_SIZE_M, 100);
+    matrix_t *m = matrix_of(mat);
+    ck_assert_ptr_eq(m->row, mat);
+    ck_assert_uint_eq(m->rows, ARRAY_SIZE_M);
+    ck_assert_uint_eq(m->cols, 100);
+    ck_assert(m->stride >= m->cols);
+    ck_assert_uint_eq((size_t)m->data % LINALG_ALIGNMENT, 0);
+    for(size_t i = 0; i < ARRAY_SIZE_M; i++){
+	ck_assert_ptr_eq(mat[i], m->data + i * m->stride);
+	ck_assert_uint_eq((size_t)mat[i] % LINALG_ALIGNMENT, 0);
+	for(size_t j = 0; j < 100; j++){
+	    ck_assert_double_eq(mat[i][j], 0);
+	}
+    }
+    destroy_matrix(mat, ARRAY_SIZE_M); mat = NULL;
+}
+
+START_TEST(test_matrix_views)
+{
+    matrix_t *m = matrix_alloc(5, 7);
+    for(size_t i = 0; i < 5; i++)
+	for(size_t j = 0; j < 7; j++) m->row[i][j] = 10.0*i + j;
+
+    // Window (1, 2) of 3 x 4, and a view of the view; writes reach m
+    matrix_t *v = matrix_view(m, 1, 2, 3, 4);
+    ck_assert_double_eq(v->row[0][0], 12);
+    ck_assert_double_eq(v->row[2][3], 35);
+    matrix_t *w = matrix_view(v, 1, 1, 2, 2);
+    w->row[1][1] = -1;
+    ck_assert_double_eq(m->row[3][4], -1);
+    ck_assert_ptr_null(matrix_view(m, 3, 0, 3, 7));
+    ck_assert_ptr_null(matrix_view(m, 0, 5, 5, 3));
+
+    // Matrix kernels take the view's rows
+    double **t = create_matrix(4, 3);
+    transpose_matrix(t, v->row, 3, 4);
+    ck_assert_double_eq(t[3][0], 15);
+    ck_assert_double_eq(t[2][2], -1);
+    double **p = create_matrix(3, 3);
+    matrix_multiplication(p, v->row, t, 3, 4, 3);
+    ck_assert_double_eq(p[0][1], 12*22 + 13*23 + 14*24 + 15*25);
+
+    // Strided columns
+    vector_view c = matrix_column_view(m, 1), r = matrix_row_view(m, 2);
+    ck_assert_double_eq(dot_product_view(c, c), 1 + 121 + 441 + 961 + 1681);
+    ck_assert_double_eq(vector_norm_view(c), sqrt(1 + 121 + 441 + 961 + 1681));
+    ck_assert_double_eq(dot_product_view(matrix_column_view(m, 0), r), 0*20 + 10*21
+	    + 20*22 + 30*23 + 40*24);
+    double col[5];
+    copy_vector_view(vector_view_of(col, 5), c);
+    ck_assert_double_eq(col[4], 41);
+    // Out of range: empty views
+    ck_assert_uint_eq(matrix_row_view(m, m->rows).len, 0);
+    ck_assert_uint_eq(matrix_column_view(m, m->cols).len, 0);
+    ck_assert_double_eq(vector_norm_view(matrix_column_view(m, SIZE_MAX)), 0);
+    scale_vector_view(c, 2);
+    ck_assert_double_eq(m->row[3][1], 62);
+    ck_assert_double_eq(m->row[3][0], 30);
+    matrix_free(w);
+    matrix_free(v);
+    destroy_matrix(t, 4); t = NULL;
+    destroy_matrix(p, 3); p = NULL;
+
+    // Gathered column sums equal the contiguous ones, also threaded
+    const size_t rows = 100003;
+    matrix_t *tall = matrix_alloc(rows, 3);
+    double *copy = create_vector(rows);
+    for(size_t i = 0; i < rows; i++) tall->row[i][2] = copy[i] = sin(0.37*i) * (i % 7);
+    linalg_set_reduction(LINALG_REDUCTION_REPRODUCIBLE);
+    for(size_t threads = 1; threads <= 3; threads += 2){
+	linalg_set_num_threads(threads);
+	ck_assert_double_eq(vector_norm_view(matrix_column_view(tall, 2)),
+			    vector_norm(copy, rows));
+	ck_assert_double_eq(dot_product_view(matrix_column_view(tall, 2),
+			    vector_view_of(copy, rows)), dot_product(copy, copy, rows));
+    }
+    linalg_set_num_threads(1);
+    linalg_set_reduction(LINALG_REDUCTION_FAST);
+    matrix_free(tall);
+    destroy_vector(copy); copy = NULL;
+
+    // Builder: appends grow the room geometrically, inserts shift in place
+    matrix_t *b = matrix_alloc(4, 1);
+    double column[4];
+    for(size_t k = 0; k < 40; k++){
+	for(size_t i = 0; i < 4; i++) column[i] = 100.0*k + i;
+	ck_assert_int_eq(matrix_append_column(b, column), 0);
+	ck_assert(b->stride >= b->cols);
+    }
+    for(size_t i = 0; i < 4; i++) column[i] = -1.0 - i;
+    ck_assert_int_eq(matrix_insert_column(b, column, 0), 0);
+    ck_assert_int_eq(matrix_insert_column(b, column, 20), 0);
+    ck_assert_int_eq(matrix_insert_column(b, column, 50), -1);
+    ck_assert_uint_eq(b->cols, 43);
+    for(size_t i = 0; i < 4; i++){
+	ck_assert_ptr_eq(b->row[i], b->data + i * b->stride);
+	ck_assert_double_eq(b->row[i][0], -1.0 - i);
+	ck_assert_double_eq(b->row[i][1], 0);
+	ck_assert_double_eq(b->row[i][2], i);
+	ck_assert_double_eq(b->row[i][20], -1.0 - i);
+	ck_assert_double_eq(b->row[i][21], 1800.0 + i);
+	ck_assert_double_eq(b->row[i][42], 3900.0 + i);
+    }
+    ck_assert_int_eq(matrix_reserve_columns(b, 200), 0);
+    ck_assert_int_eq(matrix_reserve_columns(b, SIZE_MAX), -1);
+    ck_assert_int_eq(matrix_reserve_columns(b, SIZE_MAX / 16), -1);
+    ck_assert(b->stride >= 200);
+    ck_assert_double_eq(b->row[3][42], 3903);
+    matrix_t *bv = matrix_view(b, 0, 0, 2, 2);
+    ck_assert_int_eq(matrix_append_column(bv, column), -1);
+    matrix_free(bv);
+    matrix_free(b);
+    matrix_free(m);
+}
+
+START_TEST(test_allocators)
+{
+    // Arena: temporaries after a mark go away with one reset
+    linalg_arena *arena = linalg_arena_create(4096);
+    ck_assert_ptr_nonnull(arena);
+    linalg_allocator a = linalg_arena_allocator(arena);
+    double *kept = create_vector_with_allocator(10, &a);
+    linalg_arena_marker mark = linalg_arena_mark(arena);
+    double **first = NULL;
+    for(int round = 0; round < 3; round++){
+	double **mat = create_matrix_with_allocator(ARRAY_SIZE_M, 70, &a);
+	ck_assert_ptr_nonnull(mat);
+	if(round == 0) first = mat;
+	ck_assert_ptr_eq(mat, first); // same memory every round
+	ck_assert_uint_eq((size_t)mat[1] % LINALG_ALIGNMENT, 0);
+	for(size_t i = 0; i < ARRAY_SIZE_M; i++){
+	    for(size_t j = 0; j < 70; j++) ck_assert_double_eq(mat[i][j], 0.0);
+	    mat[i][i % 70] = 1.0;
+	}
+	double *v = create_vector_malloc_with_allocator(5000, &a); // new chunk
+	ck_assert_ptr_nonnull(v);
+	v[4999] = 1.0;
+	linalg_arena_reset(arena, &mark);
+    }
+    for(size_t i = 0; i < 10; i++) ck_assert_double_eq(kept[i], 0.0);
+
+    // Freeing the latest allocation gives it back
+    double *x = create_vector_with_allocator(8, &a);
+    destroy_vector_with_allocator(x, 8, &a);
+    ck_assert_ptr_eq(create_vector_with_allocator(8, &a), x);
+    linalg_arena_reset(arena, NULL);
+    ck_assert_ptr_eq(create_vector_with_allocator(10, &a), kept);
+    linalg_arena_destroy(arena); arena = NULL;
+
+    // Pool: freed blocks are reused, matrices free into their pool
+    linalg_pool *pool = linalg_pool_create();
+    linalg_allocator p = linalg_pool_allocator(pool);
+    matrix_t *m = matrix_alloc_with_allocator(13, 17, &p);
+    double *data = m->data;
+    ck_assert_uint_eq((size_t)data % LINALG_ALIGNMENT, 0);
+    m->row[12][16] = 2.0;
+    m = matrix_transpose_in_place(m);
+    ck_assert_double_eq(m->row[16][12], 2.0);
+    matrix_free(m); m = NULL;
+    m = matrix_alloc_with_allocator(13, 17, &p);
+    ck_assert_ptr_eq(m->data, data);
+    ck_assert_double_eq(m->row[12][16], 0.0);
+    double **big = create_matrix_with_allocator(600, 600, &p);
+    big[599][599] = 1.0;
+    destroy_matrix(big, 600);
+    ck_assert_ptr_eq(create_matrix_with_allocator(600, 600, &p), big);
+    big = NULL;
+    matrix_free(m); m = NULL;
+    linalg_pool_destroy(pool); pool = NULL;
+}
+
+START_TEST(test_transpose)
+{
+    // Sizes off the 8x8 tiles and 32x32 blocks
+    const size_t rows = 75, cols = 43;
+    double **mat = create_matrix(rows, cols);
+    double **t = create_matrix(cols, rows);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) mat[i][j] = 1000.0*i + j;
+    }
+    transpose_matrix(t, mat, rows, cols);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) ck_assert_double_eq(t[j][i], mat[i][j]);
+    }
+
+    double **sq = create_matrix(rows, rows);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < rows; j++) sq[i][j] = 1000.0*i + j;
+    }
+    transpose_square_matrix_in_place(sq, rows);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < rows; j++) ck_assert_double_eq(sq[i][j], 1000.0*j + i);
+    }
+
+    matrix_t *m = matrix_transpose_in_place(matrix_of(mat));
+    ck_assert_ptr_nonnull(m);
+    ck_assert_uint_eq(m->rows, cols);
+    ck_assert_uint_eq(m->cols, rows);
+    for(size_t i = 0; i < cols; i++){
+	ck_assert_mem_eq(m->row[i], t[i], rows * sizeof(double));
+    }
+    matrix_free(m); m = NULL;
+    destroy_matrix(sq, rows); sq = NULL;
+    destroy_matrix(t, cols); t = NULL;
+}
+
+START_TEST(test_fused_expression)
+{
+    const size_t rows = ARRAY_SIZE_M, cols = 300;
+    double **a = create_random_uniform_matrix(rows, cols, 1);
+    double **b = create_random_uniform_matrix(rows, cols, 2);
+    double **c = create_random_uniform_matrix(rows, cols, 3);
+    double **expected = create_matrix(rows, cols);
+    double **res = create_matrix(rows, cols);
+    double *v = create_random_uniform_vector(cols, 4);
+
+    // Same rounding as the chain of separate calls
+    elementwise_matrix_multiplication(res, a, b, rows, cols);
+    add_scaled_matrix_to_matrix(expected, res, c, 0.5, rows, cols);
+    scale_matrix_by_factor(expected, 2.0, rows, cols);
+    add_scalar_to_matrix(expected, 1.0, rows, cols);
+
+    linalg_expr *e = expr_create();
+    expr_node x = expr_add(e, expr_mul(e, expr_matrix(e, a, rows, cols),
+				       expr_matrix(e, b, rows, cols)),
+			   expr_scale(e, expr_matrix(e, c, rows, cols), 0.5));
+    x = expr_add_scalar(e, expr_scale(e, x, 2.0), 1.0);
+    ck_assert_int_eq(expr_evaluate_matrix(e, x, res, rows, cols), 0);
+    for(size_t i = 0; i < rows; i++){
+	ck_assert_mem_eq(res[i], expected[i], cols * sizeof(double));
+    }
+
+    // Broadcast vector, result overwriting a leaf
+    expr_reset(e);
+    expr_node m = expr_matrix(e, a, rows, cols);
+    x = expr_sqrt(e, expr_abs(e, expr_sub(e, m, expr_vector(e, v, cols))));
+    ck_assert_int_eq(expr_evaluate_matrix(e, x, b, rows, cols), 0);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++){
+	    ck_assert_double_eq(b[i][j], sqrt(fabs(a[i][j] - v[j])));
+	}
+    }
+
+    // Vector result; leaf of the wrong shape
+    x = expr_div(e, expr_max(e, expr_vector(e, v, cols), expr_scalar(e, 0.5)),
+		 expr_scalar(e, 4.0));
+    ck_assert_int_eq(expr_evaluate_vector(e, x, res[0], cols), 0);
+    for(size_t j = 0; j < cols; j++){
+	ck_assert_double_eq(res[0][j], (v[j] > 0.5 ? v[j] : 0.5) / 4.0);
+    }
+    ck_assert_int_eq(expr_evaluate_matrix(e, m, res, rows, cols - 1), -1);
+    ck_assert_int_eq(expr_evaluate_vector(e, expr_add(e, m, -1), res[0], cols), -1);
+
+    expr_destroy(e); e = NULL;
+    destroy_vector(v); v = NULL;
+    destroy_matrix(res, rows); res = NULL;
+    destroy_matrix(expected, rows); expected = NULL;
+    destroy_matrix(c, rows); c = NULL;
+    destroy_matrix(b, rows); b = NULL;
+    destroy_matrix(a, rows); a = NULL;
+}
+
+START_TEST(test_batched_small_matrices)
+{
+    const size_t count = 1000, sizes[] = {3, 4, 5, 8, 16};
+    linalg_isa isa = linalg_get_isa();
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+	const size_t n = sizes[s], e = n * n;
+	double *a = create_random_uniform_vector(count * e, 1);
+	double *b = create_random_uniform_vector(count * e, 2);
+	double *c = create_random_uniform_vector(count * e, 3);
+	double *res = create_vector(count * e);
+	double *y = create_vector(count * n);
+	matrix_batch A = matrix_batch_contiguous(a, n, n);
+	matrix_batch B = matrix_batch_contiguous(b, n, n);
+	matrix_batch R = matrix_batch_contiguous(res, n, n);
+	vector_batch X = {c, n, e}; // first row of each c matrix
+	vector_batch Y = {y, n, n};
+
+	// res = 2*A^T*B + 0.5*c, fixed-size kernels of every ISA
+	for(int i = LINALG_ISA_GENERIC; i <= (int)isa; i++){
+	    linalg_set_isa(i);
+	    copy_vector(res, c, count * e);
+	    ck_assert_int_eq(batched_general_matrix_multiplication(R, A, B,
+		count, 2.0, 0.5, LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE), 0);
+	    for(size_t k = 0; k < count; k += 97){
+		for(size_t r = 0; r < n; r++){
+		    for(size_t q = 0; q < n; q++){
+			double sum = 0;
+			for(size_t p = 0; p < n; p++){
+			    sum += a[k*e + p*n + r] * b[k*e + p*n + q];
+			}
+			ck_assert_double_eq_tol(res[k*e + r*n + q],
+						2.0 * sum + 0.5 * c[k*e + r*n + q], 1e-12);
+		    }
+		}
+	    }
+
+	    ck_assert_int_eq(batched_matrix_vector_multiplication(Y, A, X,
+		count, 1.0, 0.0, LINALG_NO_TRANSPOSE), 0);
+	    for(size_t k = 0; k < count; k += 97){
+		for(size_t r = 0; r < n; r++){
+		    ck_assert_double_eq_tol(y[k*n + r],
+			dot_product(a + k*e + r*n, c + k*e, n), 1e-12);
+		}
+	    }
+	}
+	linalg_set_isa(isa);
+
+	// Elementwise ops and transpose, B shared by every item
+	matrix_batch B0 = B;
+	B0.stride = 0;
+	ck_assert_int_eq(batched_add_scaled(R, A, B0, -1.0, count), 0);
+	ck_assert_double_eq(res[5*e + 1], a[5*e + 1] - b[1]);
+	ck_assert_int_eq(batched_elementwise_multiplication(R, R, A, count), 0);
+	ck_assert_double_eq(res[5*e + 1], (a[5*e + 1] - b[1]) * a[5*e + 1]);
+	ck_assert_int_eq(batched_scale(R, A, 3.0, count), 0);
+	ck_assert_double_eq(res[count*e - 1], 3.0 * a[count*e - 1]);
+	ck_assert_int_eq(batched_transpose(R, A, count), 0);
+	ck_assert_double_eq(res[7*e + 1], a[7*e + n]);
+
+	// Shape mismatch
+	matrix_batch wide = matrix_batch_contiguous(b, n, n + 1);
+	ck_assert_int_eq(batched_general_matrix_multiplication(R, A, wide,
+	    count, 1.0, 0.0, LINALG_NO_TRANSPOSE, LINALG_NO_TRANSPOSE), -1);
+	ck_assert_int_eq(batched_add_scaled(R, A, wide, 1.0, count), -1);
+
+	destroy_vector(y); y = NULL;
+	destroy_vector(res); res = NULL;
+	destroy_vector(c); c = NULL;
+	destroy_vector(b); b = NULL;
+	destroy_vector(a); a = NULL;
+    }
+
+    // Operands past 16 x 16 are transposed through the heap (or read in
+    // place when that allocation fails)
+    const size_t n = 24, e = n * n, few = 5;
+    double *a = create_random_uniform_vector(few * e, 4);
+    double *b = create_random_uniform_vector(few * e, 5);
+    double *res = create_vector(few * e);
+    ck_assert_int_eq(batched_general_matrix_multiplication(
+	matrix_batch_contiguous(res, n, n), matrix_batch_contiguous(a, n, n),
+	matrix_batch_contiguous(b, n, n), few, 1.0, 0.0,
+	LINALG_TRANSPOSE, LINALG_TRANSPOSE), 0);
+    for(size_t k = 0; k < few; k++){
+	for(size_t r = 0; r < n; r++){
+	    for(size_t q = 0; q < n; q++){
+		double sum = 0;
+		for(size_t p = 0; p < n; p++) sum += a[k*e + p*n + r] * b[k*e + q*n + p];
+		ck_assert_double_eq_tol(res[k*e + r*n + q], sum, 1e-12);
+	    }
+	}
+    }
+    destroy_vector(res); res = NULL;
+    destroy_vector(b); b = NULL;
+    destroy_vector(a); a = NULL;
+}
+
+START_TEST(test_vector_kernels_every_isa)
+{
+    // _i is the instruction set; skip those the CPU lacks
+    const size_t len = 37; // not a multiple of any vector width
+    double v1[37], v2[37], res[37];
+    for(size_t i = 0; i < len; i++){
+	v1[i] = 0.1*i;
+	v2[i] = 1.0 - 0.01*i;
+    }
+    linalg_isa host = linalg_get_isa();
+    if(linalg_set_isa((linalg_isa)_i) == 0){
+	ck_assert_double_eq_tol(dot_product(v1, v2, len), 50.394, 1e-9);
+	ck_assert_double_eq_tol(vector_norm(v1, len), 12.7302788657594, 1e-9);
+	vector_subtraction(res, v1, v2, len);
+	for(size_t i = 0; i < len; i++){
+	    ck_assert_double_eq_tol(res[i], 0.11*i - 1.0, 1e-12);
+	}
+	scale_vector_by_factor(res, 2.0, len);
+	add_scalar_to_vector(res, 2.0, len);
+	for(size_t i = 0; i < len; i++){
+	    ck_assert_double_eq_tol(res[i], 0.22*i, 1e-12);
+	}
+    }
+    linalg_set_isa(host);
+}
+
+START_TEST(test_single_and_half_precision)
+{
+    // _i is the instruction set; skip those the CPU lacks
+    const size_t len = 37; // not a multiple of any vector width
+    float v1[37], v2[37], res[37];
+    for(size_t i = 0; i < len; i++){
+	v1[i] = 0.1f*i;
+	v2[i] = 1.0f - 0.01f*i;
+    }
+    linalg_isa host = linalg_get_isa();
+    if(linalg_set_isa((linalg_isa)_i) != 0) return;
+
+    ck_assert_float_eq_tol(dot_product_f32(v1, v2, len), 50.394f, 1e-4f);
+    ck_assert_float_eq_tol(vector_norm_f32(v1, len), 12.7302788f, 1e-5f);
+    ck_assert_float_eq_tol(distance_between_vectors_f32(v1, v2, len),
+			   9.3044395f, 1e-5f);
+    vector_subtraction_f32(res, v1, v2, len);
+    scale_vector_by_factor_f32(res, 2.0f, len);
+    add_scalar_to_vector_f32(res, 2.0f, len);
+    for(size_t i = 0; i < len; i++) ck_assert_float_eq_tol(res[i], 0.22f*i, 1e-5f);
+
+    // Float GEMM (large enough for the packed path) against double
+    const size_t m = 70, n = 90, p = 50;
+    float **a = create_matrix_f32(n, m), **b = create_matrix_f32(n, p);
+    float **c = create_matrix_f32(m, p);
+    double **ad = create_matrix(n, m), **bd = create_matrix(n, p);
+    double **cd = create_matrix(m, p);
+    for(size_t k = 0; k < n; k++){
+	for(size_t i = 0; i < m; i++) ad[k][i] = a[k][i] = sinf(0.3f*k + i);
+	for(size_t j = 0; j < p; j++) bd[k][j] = b[k][j] = cosf(k - 0.7f*j);
+    }
+    for(size_t i = 0; i < m; i++) ck_assert_uint_eq((uintptr_t)c[i] % 64, 0);
+    general_matrix_multiplication_f32(c, a, b, m, n, p, 2.0f, 0.0f,
+				      LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+    general_matrix_multiplication(cd, ad, bd, m, n, p, 2.0, 0.0,
+				  LINALG_TRANSPOSE, LINALG_NO_TRANSPOSE);
+    for(size_t i = 0; i < m; i++){
+	for(size_t j = 0; j < p; j++) ck_assert_float_eq_tol(c[i][j], cd[i][j], 1e-4f);
+    }
+    // Sizes whose block would not fit a size_t are refused, not wrapped
+    ck_assert_ptr_null(create_matrix_f32(((size_t)1 << 61) + 1, 4));
+    ck_assert_ptr_null(create_matrix_f32(SIZE_MAX / sizeof(float*), 0));
+    ck_assert_ptr_null(create_matrix_f32(2, SIZE_MAX / 2));
+
+    // Round to nearest even at both ends of the binary16 range; NaN
+    // stays NaN
+    const float f[9] = {1.0f, -2.5f, 65504.0f, 65520.0f, 0x1p-24f, 0x1p-25f,
+			0x3p-25f, 1.0f/3.0f, NAN};
+    const linalg_f16 h[9] = {0x3C00, 0xC100, 0x7BFF, 0x7C00, 0x0001, 0x0000,
+			     0x0002, 0x3555, 0x7E00};
+    const float g[9] = {1.0f, 1.00390625f, 1.01171875f, -3.0f, INFINITY,
+			0.1f, -1e-40f, 3e38f, NAN};
+    const linalg_bf16 bh[9] = {0x3F80, 0x3F80, 0x3F82, 0xC040, 0x7F80,
+			       0x3DCD, 0x8001, 0x7F62, 0x7FC0};
+    float src[37], back[37];
+    linalg_f16 half[37];
+    linalg_bf16 bhalf[37];
+    for(size_t i = 0; i < len; i++) src[i] = f[i % 9];
+    convert_vector_f32_to_f16(half, src, len);
+    convert_vector_f16_to_f32(back, half, len);
+    for(size_t i = 0; i < len; i++) ck_assert_uint_eq(half[i], h[i % 9]);
+    ck_assert_float_eq(back[4], 0x1p-24f);
+    ck_assert_float_eq(back[7], 0.333251953125f);
+    ck_assert_float_infinite(back[3]);
+    ck_assert_float_nan(back[8]);
+    for(size_t i = 0; i < len; i++) src[i] = g[i % 9];
+    convert_vector_f32_to_bf16(bhalf, src, len);
+    convert_vector_bf16_to_f32(back, bhalf, len);
+    for(size_t i = 0; i < len; i++) ck_assert_uint_eq(bhalf[i], bh[i % 9]);
+    ck_assert_float_eq(back[5], 0.10009765625f);
+
+    // Reductions over 16-bit storage agree with float on the same values
+    linalg_f16 h1[37], h2[37];
+    linalg_bf16 b1[37], b2[37];
+    float r1[37], r2[37];
+    convert_vector_f32_to_f16(h1, v1, len);
+    convert_vector_f32_to_f16(h2, v2, len);
+    convert_vector_f16_to_f32(r1, h1, len);
+    convert_vector_f16_to_f32(r2, h2, len);
+    ck_assert_float_eq_tol(dot_product_f16(h1, h2, len), dot_product_f32(r1, r2, len), 1e-4f);
+    ck_assert_float_eq_tol(vector_norm_f16(h1, len), vector_norm_f32(r1, len), 1e-5f);
+    ck_assert_float_eq_tol(distance_between_vectors_f16(h1, h2, len),
+			   distance_between_vectors_f32(r1, r2, len), 1e-5f);
+    convert_vector_f32_to_bf16(b1, v1, len);
+    convert_vector_f32_to_bf16(b2, v2, len);
+    convert_vector_bf16_to_f32(r1, b1, len);
+    convert_vector_bf16_to_f32(r2, b2, len);
+    ck_assert_float_eq_tol(dot_product_bf16(b1, b2, len), dot_product_f32(r1, r2, len), 1e-4f);
+    ck_assert_float_eq_tol(vector_norm_bf16(b1, len), vector_norm_f32(r1, len), 1e-5f);
+    ck_assert_float_eq_tol(distance_between_vectors_bf16(b1, b2, len),
+			   distance_between_vectors_f32(r1, r2, len), 1e-5f);
+
+    destroy_matrix(cd, m); cd = NULL;
+    destroy_matrix(bd, n); bd = NULL;
+    destroy_matrix(ad, n); ad = NULL;
+    destroy_matrix_f32(c, m); c = NULL;
+    destroy_matrix_f32(b, n); b = NULL;
+    destroy_matrix_f32(a, n); a = NULL;
+    linalg_set_isa(host);
+}
+
+// Within ulps units in the last place of want; special values exactly
+static void assert_ulps(double got, double want, double ulps)
+{
+    if(isnan(want)){
+	ck_assert(isnan(got));
+    } else if(isinf(want) || want == 0.0){
+	ck_assert(got == want);
+    } else {
+	ck_assert_double_le(fabs(got - want), ulps * 2.220446049250313e-16 * fabs(want));
+    }
+}
+
+static void batch_square_plus(double* out, const double* in, size_t len, void* ctx)
+{
+    const double* offset = ctx;
+    for(size_t i = 0; i < len; i++) out[i] = in[i] * in[i] + *offset;
+}
+
+START_TEST(test_elementwise_math)
+{
+    // _i is the instruction set; skip those the CPU lacks
+    const size_t len = 1003; // not a multiple of any vector width
+    linalg_isa host = linalg_get_isa();
+    if(linalg_set_isa((linalg_isa)_i) != 0) return;
+    double *x = create_vector(len), *y = create_vector(len);
+
+    // Against the C library: each has at most 1 (tanh and sigmoid 3) ULP
+    // error, libm about half an ULP
+    for(size_t i = 0; i < len; i++) x[i] = -700.0 + 1400.0 * (i + 0.5) / len;
+    elementwise_exp(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], exp(x[i]), 2.0);
+    for(size_t i = 0; i < len; i++) x[i] = ldexp(1.0 + (double)i / len, (int)i - 520);
+    elementwise_log(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], log(x[i]), 2.0);
+    for(size_t i = 0; i < len; i++) x[i] = -50.0 + 100.0 * (i + 0.5) / len;
+    x[17] = 3e7; // beyond the vector range reduction
+    elementwise_sin(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], sin(x[i]), 2.0);
+    elementwise_cos(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], cos(x[i]), 2.0);
+    for(size_t i = 0; i < len; i++) x[i] = -20.0 + 40.0 * (i + 0.5) / len;
+    elementwise_tanh(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], tanh(x[i]), 4.0);
+    elementwise_sigmoid(y, x, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], 1.0 / (1.0 + exp(-x[i])), 4.0);
+    for(size_t i = 0; i < len; i++) x[i] = 0.01 + 0.37 * i;
+    elementwise_pow(y, x, -1.75, len);
+    for(size_t i = 0; i < len; i++) assert_ulps(y[i], pow(x[i], -1.75), 2.0);
+    // Large |p|: an error in log x is multiplied by |p log x| (up to 575)
+    const double big_p[4] = {200.5, -200.5, 250.3, -250.3};
+    for(size_t i = 0; i < len; i++) x[i] = exp(log(0.1) + log(100.0) * (i + 0.5) / len);
+    for(size_t k = 0; k < 4; k++){
+	elementwise_pow(y, x, big_p[k], len);
+	for(size_t i = 0; i < len; i++) assert_ulps(y[i], pow(x[i], big_p[k]), 2.0);
+    }
+    for(size_t i = 0; i < len; i++) x[i] = 0.01 + 0.37 * i;
+    elementwise_sqrt(x, x, len); // in place
+    for(size_t i = 0; i < len; i++) ck_assert_double_eq(x[i], sqrt(0.01 + 0.37 * i));
+
+    // Special values as in the C library
+    const double s[11] = {NAN, INFINITY, -INFINITY, 0.0, -0.0, -1.0, -8.0,
+			  1e-310, 710.0, -746.0, 2.5};
+    double (*const f[5])(double) = {exp, log, sin, tanh, sqrt};
+    void (*const g[5])(double*, double*, size_t) = {elementwise_exp,
+	elementwise_log, elementwise_sin, elementwise_tanh, elementwise_sqrt};
+    for(size_t k = 0; k < 5; k++){
+	g[k](y, (double*)s, 11);
+	for(size_t i = 0; i < 11; i++) assert_ulps(y[i], f[k](s[i]), 2.0);
+    }
+    const double p[5] = {3.0, -1.0, 0.5, 1.0 / 3.0, -2.0};
+    for(size_t k = 0; k < 5; k++){
+	elementwise_pow(y, (double*)s, p[k], 11);
+	for(size_t i = 0; i < 11; i++) assert_ulps(y[i], pow(s[i], p[k]), 2.0);
+    }
+    destroy_vector(y); y = NULL;
+    destroy_vector(x); x = NULL;
+
+    // Threaded runs give the same bits; batch callbacks see every element
+    const size_t big = 200003;
+    double *u = create_random_normal_vector(big, 0.0, 3.0, 11);
+    double *ref = create_vector(big), *out = create_vector(big);
+    double offset = 0.5;
+    elementwise_tanh(ref, u, big);
+    linalg_set_num_threads(3);
+    elementwise_tanh(out, u, big);
+    ck_assert_mem_eq(out, ref, big * sizeof(double));
+    evaluate_batch_function_on_vector(out, batch_square_plus, u, big, &offset);
+    linalg_set_num_threads(0);
+    for(size_t i = 0; i < big; i++) ck_assert_double_eq(out[i], u[i] * u[i] + 0.5);
+    destroy_vector(out); out = NULL;
+    destroy_vector(ref); ref = NULL;
+    destroy_vector(u); u = NULL;
+    linalg_set_isa(host);
+}
+
 START_TEST(test_vector_length)
 {
     // assert re and correct answer is within 0.001f //
@@ -175,6 +1108,90 @@ START_TEST(test_average_and_std)
     free(v); v = NULL;
 }
 
+START_TEST(test_vector_statistics)
+{
+    // Spans several blocks; large offset checks the update is stable
+    const size_t len = 1234;
+    double *v = malloc(sizeof(double) * len);
+    double sum = 0;
+    for(size_t i = 0; i < len; i++){
+	v[i] = 1e9 + sin(0.1*i);
+	sum += sin(0.1*i);
+    }
+    double mean = 1e9 + sum / len, m2 = 0, sum_sq = 0;
+    for(size_t i = 0; i < len; i++){
+	m2 += (v[i] - mean) * (v[i] - mean);
+	sum_sq += v[i] * v[i];
+    }
+    vector_statistics stats = compute_vector_statistics(v, len);
+    ck_assert_double_eq_tol(stats.mean, mean, 1e-6);
+    ck_assert_double_eq_tol(stats.variance, m2 / len, 1e-9);
+    ck_assert_double_eq_tol(stats.std, sqrt(m2 / len), 1e-9);
+    ck_assert_double_eq_tol(stats.min, 1e9 - 1, 1e-3);
+    ck_assert_double_eq_tol(stats.max, 1e9 + 1, 1e-3);
+    ck_assert_double_eq_tol(stats.sum_of_squares / sum_sq, 1, 1e-12);
+    ck_assert_double_eq_tol(stats.norm / sqrt(sum_sq), 1, 1e-12);
+    ck_assert_double_eq_tol(vector_variance(v, len), m2 / len, 1e-9);
+    free(v); v = NULL;
+
+    // The norm is scaled where the plain sum of squares is out of range
+    double huge[2] = {3e200, 4e200}, tiny[2] = {3e-200, 4e-200};
+    ck_assert_double_eq_tol(compute_vector_statistics(huge, 2).norm / 5e200, 1, 1e-15);
+    ck_assert_double_eq_tol(compute_vector_statistics(tiny, 2).norm / 5e-200, 1, 1e-15);
+}
+
+START_TEST(test_reduction_modes)
+{
+    // Big terms that cancel exactly around ones: the sum is m
+    const size_t m = 66667, len = 3 * m;
+    double *v = create_vector(len), *ones = create_vector(len);
+    for(size_t k = 0; k < m; k++){
+	v[3*k] = ldexp(1.0 + (k % 97) / 97.0, 20 + k % 40);
+	v[3*k + 1] = 1.0;
+	v[len - 1 - 3*k] = -ldexp(1.0 + (k % 97) / 97.0, 20 + k % 40);
+    }
+    for(size_t i = 0; i < len; i++) ones[i] = 1.0;
+    ck_assert_int_eq(linalg_get_reduction(), LINALG_REDUCTION_FAST);
+    linalg_set_reduction(LINALG_REDUCTION_COMPENSATED);
+    ck_assert_int_eq(linalg_get_reduction(), LINALG_REDUCTION_COMPENSATED);
+    for(size_t threads = 1; threads <= 3; threads += 2){
+	linalg_set_num_threads(threads);
+	ck_assert_double_eq_tol(vector_average(v, len) * len, m, 1e-6 * m);
+	ck_assert_double_eq_tol(dot_product(v, ones, len), m, 1e-6 * m);
+    }
+    linalg_set_num_threads(1);
+
+    // Pairwise: error grows with log(len), not len
+    for(size_t i = 0; i < len; i++) v[i] = 0.1 + 1e-3 * sin(0.1*i);
+    long double sum = 0;
+    for(size_t i = 0; i < len; i++) sum += v[i];
+    linalg_set_reduction(LINALG_REDUCTION_PAIRWISE);
+    ck_assert_double_le(fabs(vector_average(v, len) * len - (double)sum),
+	    32 * 0x1p-53 * (double)sum);
+
+    // Reproducible: same bits on every instruction set and thread count
+    for(size_t i = 0; i < len; i++) v[i] = sin(1.3*i) * exp(i % 29 - 14.0);
+    linalg_isa host = linalg_get_isa();
+    linalg_set_reduction(LINALG_REDUCTION_REPRODUCIBLE);
+    linalg_set_isa(LINALG_ISA_GENERIC);
+    double ref[4] = {dot_product(v, ones, len), vector_norm(v, len),
+	vector_average(v, len), vector_variance(v, len)};
+    for(int isa = LINALG_ISA_GENERIC; isa <= LINALG_ISA_AVX512; isa++){
+	if(linalg_set_isa((linalg_isa)isa) != 0) continue;
+	for(size_t threads = 1; threads <= 4; threads++){
+	    linalg_set_num_threads(threads);
+	    double res[4] = {dot_product(v, ones, len), vector_norm(v, len),
+		vector_average(v, len), vector_variance(v, len)};
+	    ck_assert_mem_eq(res, ref, sizeof(ref));
+	}
+    }
+    linalg_set_num_threads(1);
+    linalg_set_isa(host);
+    linalg_set_reduction(LINALG_REDUCTION_FAST);
+    destroy_vector(v); v = NULL;
+    destroy_vector(ones); ones = NULL;
+}
+
 START_TEST(test_distance_between_vectors)
 {
     double *v1 = malloc(sizeof(double) * SIZE);
@@ -189,6 +1206,422 @@ START_TEST(test_distance_between_vectors)
     free(v2); v2 = NULL;
 }
 
+START_TEST(test_norm_extremes)
+{
+    // Plain sums of squares overflow, underflow or go subnormal here
+    double huge[2] = {3e200, 4e200}, tiny[2] = {3e-200, 4e-200};
+    double sub[2] = {3 * 0x1p-1070, 4 * 0x1p-1070}, mixed[3] = {1e300, 1e-300, 0};
+    double *big = create_vector(1000);
+    for(size_t i = 0; i < 1000; i++) big[i] = 1e300;
+    for(int mode = LINALG_REDUCTION_FAST; mode <= LINALG_REDUCTION_REPRODUCIBLE; mode++){
+	linalg_set_reduction((linalg_reduction)mode);
+	ck_assert_double_eq_tol(vector_norm(huge, 2) / 5e200, 1, 1e-15);
+	ck_assert_double_eq_tol(vector_norm(tiny, 2) / 5e-200, 1, 1e-15);
+	ck_assert_double_eq(vector_norm(sub, 2), 5 * 0x1p-1070);
+	ck_assert_double_eq(vector_norm(mixed, 3), 1e300);
+	ck_assert_double_eq_tol(vector_norm(big, 1000) / (sqrt(1000) * 1e300), 1, 1e-14);
+    }
+    linalg_set_reduction(LINALG_REDUCTION_FAST);
+    double nan_v[2] = {1, NAN}, inf_v[2] = {1, -INFINITY}, zero[2] = {0, 0};
+    ck_assert(isnan(vector_norm(nan_v, 2)));
+    ck_assert(isinf(vector_norm(inf_v, 2)));
+    ck_assert_double_eq(vector_norm(zero, 2), 0);
+
+    double a[3] = {1e308, 1, 2}, b[3] = {-5e307, 1, 2};
+    ck_assert_double_eq_tol(distance_between_vectors(a, b, 3) / 1.5e308, 1, 1e-15);
+    double c[3] = {1, 2, 3}, d[3] = {4, 6, 3};
+    ck_assert_double_eq(squared_distance_between_vectors(c, d, 3), 25);
+    ck_assert_double_eq(distance_between_vectors(c, d, 3), 5);
+
+    // The norm returned; 1/norm itself would overflow or be subnormal
+    double small[2] = {3e-310, 4e-310}, large[2] = {3e307, 4e307};
+    ck_assert_double_eq_tol(normalize_vector(small, 2) / 5e-310, 1, 1e-9);
+    ck_assert_double_eq_tol(small[0], 0.6, 1e-9);
+    ck_assert_double_eq_tol(small[1], 0.8, 1e-9);
+    ck_assert_double_eq_tol(normalize_vector(large, 2) / 5e307, 1, 1e-15);
+    ck_assert_double_eq_tol(large[0], 0.6, 1e-15);
+    ck_assert_double_eq_tol(large[1], 0.8, 1e-15);
+
+    float huge_f[2] = {3e20f, 4e20f}, tiny_f[2] = {3e-30f, 4e-30f};
+    ck_assert_float_eq_tol(vector_norm_f32(huge_f, 2) / 5e20f, 1, 1e-6f);
+    ck_assert_float_eq_tol(vector_norm_f32(tiny_f, 2) / 5e-30f, 1, 1e-6f);
+    ck_assert_float_eq_tol(distance_between_vectors_f32(huge_f, tiny_f, 2) / 5e20f,
+			   1, 1e-6f);
+    // bfloat16 shares float's range: the same fallback
+    float huge_b[2] = {3 * 0x1p66f, 4 * 0x1p66f}, tiny_b[2] = {3 * 0x1p-66f, 4 * 0x1p-66f};
+    linalg_bf16 huge_h[2], tiny_h[2];
+    convert_vector_f32_to_bf16(huge_h, huge_b, 2);
+    convert_vector_f32_to_bf16(tiny_h, tiny_b, 2);
+    ck_assert_float_eq(vector_norm_bf16(huge_h, 2), 5 * 0x1p66f);
+    ck_assert_float_eq(vector_norm_bf16(tiny_h, 2), 5 * 0x1p-66f);
+    ck_assert_float_eq(distance_between_vectors_bf16(huge_h, tiny_h, 2), 5 * 0x1p66f);
+    const linalg_bf16 zero_h[2] = {0, 0};
+    ck_assert_float_eq(distance_between_vectors_bf16(tiny_h, zero_h, 2), 5 * 0x1p-66f);
+    // Subnormal norm, whose reciprocal overflows float, and one whose
+    // reciprocal is subnormal
+    float small_f[2] = {3 * 0x1p-140f, 4 * 0x1p-140f};
+    float large_f[2] = {3 * 0x1p124f, 4 * 0x1p124f};
+    ck_assert_float_eq(normalize_vector_f32(small_f, 2), 5 * 0x1p-140f);
+    ck_assert_float_eq_tol(small_f[0], 0.6f, 1e-6f);
+    ck_assert_float_eq_tol(small_f[1], 0.8f, 1e-6f);
+    ck_assert_float_eq(normalize_vector_f32(large_f, 2), 5 * 0x1p124f);
+    ck_assert_float_eq_tol(large_f[0], 0.6f, 1e-6f);
+    ck_assert_float_eq_tol(large_f[1], 0.8f, 1e-6f);
+    destroy_vector(big); big = NULL;
+}
+
+START_TEST(test_nearest_neighbours)
+{
+    // Several query and reference blocks, partial last ones
+    const size_t nq = 130, nr = 1100, dim = 13, k = 5;
+    double **q = create_random_uniform_matrix(nq, dim, 11);
+    double **r = create_random_uniform_matrix(nr, dim, 12);
+    double **d = create_matrix(nq, nr);
+    double *key = create_vector(nr);
+    size_t *idx = malloc(nq * k * sizeof(size_t)), *ref_idx = malloc(k * sizeof(size_t));
+    size_t *idx3 = malloc(nq * k * sizeof(size_t));
+    double *dist = create_vector(nq * k), *dist3 = create_vector(nq * k);
+    for(int metric = LINALG_DISTANCE_EUCLIDEAN; metric <= LINALG_DISTANCE_DOT; metric++){
+	ck_assert_int_eq(pairwise_distances(d, q, nq, r, nr, dim, metric), 0);
+	linalg_set_num_threads(1);
+	ck_assert_int_eq(k_nearest_neighbours(idx, dist, q, nq, r, nr, dim, k, metric), 0);
+	for(size_t i = 0; i < nq; i++){
+	    for(size_t j = 0; j < nr; j++){
+		double dot = dot_product(q[i], r[j], dim);
+		double e[4] = {distance_between_vectors(q[i], r[j], dim),
+		    squared_distance_between_vectors(q[i], r[j], dim),
+		    1 - dot / (vector_norm(q[i], dim) * vector_norm(r[j], dim)), dot};
+		ck_assert_double_eq_tol(d[i][j], e[metric], 1e-12);
+		key[j] = metric == LINALG_DISTANCE_DOT ? -dot : e[metric];
+	    }
+	    // Brute force selection, ties to the lower index
+	    for(size_t m = 0; m < k; m++){
+		size_t best = SIZE_MAX;
+		for(size_t j = 0; j < nr; j++){
+		    int taken = 0;
+		    for(size_t l = 0; l < m; l++) taken |= ref_idx[l] == j;
+		    if(!taken && (best == SIZE_MAX || key[j] < key[best])) best = j;
+		}
+		ref_idx[m] = best;
+		ck_assert_uint_eq(idx[i*k + m], best);
+		ck_assert_double_eq_tol(dist[i*k + m], metric == LINALG_DISTANCE_DOT
+			? -key[best] : key[best], 1e-14);
+	    }
+	}
+	// Split over query blocks (2 threads) or references (3)
+	for(size_t threads = 2; threads <= 3; threads++){
+	    linalg_set_num_threads(threads);
+	    k_nearest_neighbours(idx3, dist3, q, nq, r, nr, dim, k, metric);
+	    ck_assert_mem_eq(idx3, idx, nq * k * sizeof(size_t));
+	    ck_assert_mem_eq(dist3, dist, nq * k * sizeof(double));
+	}
+	linalg_set_num_threads(1);
+    }
+
+    // Fewer references than k
+    k_nearest_neighbours(idx, dist, q, 2, r, 3, dim, k, LINALG_DISTANCE_EUCLIDEAN);
+    ck_assert_uint_eq(idx[3], SIZE_MAX);
+    ck_assert(isinf(dist[4]));
+    ck_assert(idx[2] < 3);
+    destroy_matrix(q, nq); q = NULL;
+    destroy_matrix(r, nr); r = NULL;
+    destroy_matrix(d, nq); d = NULL;
+    destroy_vector(key); key = NULL;
+    destroy_vector(dist); dist = NULL;
+    destroy_vector(dist3); dist3 = NULL;
+    free(idx); free(idx3); free(ref_idx);
+}
+
+START_TEST(test_read_csv_to_new_matrix)
+{
+    const char *path = "test_read_csv.csv";
+    FILE *file = fopen(path, "w");
+    fprintf(file, "# comment\nx, y\n1.5, -2e3\n\n0.125,  7\r\n-0, 1e-5");
+    fclose(file);
+    size_t rows, cols;
+    csv_error error;
+    double **mat = read_csv_to_new_matrix(path, &rows, &cols, &error);
+    ck_assert_ptr_nonnull(mat);
+    ck_assert_uint_eq(rows, 3);
+    ck_assert_uint_eq(cols, 2);
+    ck_assert_double_eq(mat[0][0], 1.5);
+    ck_assert_double_eq(mat[0][1], -2e3);
+    ck_assert_double_eq(mat[1][0], 0.125);
+    ck_assert_double_eq(mat[1][1], 7);
+    ck_assert_double_eq(mat[2][1], 1e-5);
+    destroy_matrix(mat, rows); mat = NULL;
+
+    file = fopen(path, "w");
+    fprintf(file, "x, y\n1, 2\n3, four\n");
+    fclose(file);
+    mat = read_csv_to_new_matrix(path, &rows, &cols, &error);
+    ck_assert_ptr_null(mat);
+    ck_assert_uint_eq(error.line, 3);
+    ck_assert_uint_eq(error.column, 2);
+    remove(path);
+}
+
+typedef struct {
+    const double *first; // input of the chunk that writes
+    double **mat;
+    size_t rows, cols;
+    int status;
+} nested_csv_write;
+
+static void batch_write_csv(double* out, const double* in, size_t len, void* ctx)
+{
+    nested_csv_write *w = ctx;
+    for(size_t i = 0; i < len; i++) out[i] = in[i];
+    if(in == w->first){
+	w->status = write_matrix_to_csv("test_write_csv_nested.csv", NULL, w->mat,
+					w->rows, w->cols, NULL);
+    }
+}
+
+START_TEST(test_write_matrix_to_csv)
+{
+    const char *path = "test_write_csv.csv";
+    double **mat = create_matrix(2, 3);
+    double values[6] = {0.1, -2.5e-300, 123456789.0, 0, 1.0/3.0, -7.25e10};
+    for(size_t i = 0; i < 6; i++) mat[i / 3][i % 3] = values[i];
+
+    // Same bytes as fprintf with %.8e
+    ck_assert_int_eq(write_matrix_to_csv(path, "a, b, c", mat, 2, 3, NULL), 0);
+    char expected[256], line[256];
+    FILE *file = fopen(path, "r");
+    ck_assert_str_eq(fgets(line, sizeof(line), file), "a, b, c\n");
+    for(size_t i = 0; i < 2; i++){
+	snprintf(expected, sizeof(expected), "%.8e, %.8e, %.8e\n",
+		 values[3*i], values[3*i + 1], values[3*i + 2]);
+	ck_assert_str_eq(fgets(line, sizeof(line), file), expected);
+    }
+    fclose(file);
+
+    // Shortest round trip
+    csv_write_options shortest = {-1, 0};
+    ck_assert_int_eq(write_matrix_to_csv(path, NULL, mat, 2, 3, &shortest), 0);
+    size_t rows, cols;
+    file = fopen(path, "r");
+    ck_assert_str_eq(fgets(line, sizeof(line), file), "1e-01, -2.5e-300, 1.23456789e+08\n");
+    fclose(file);
+    double **back = read_csv_to_new_matrix(path, &rows, &cols, NULL);
+    ck_assert_uint_eq(rows, 1); // first line is taken as header
+    for(size_t j = 0; j < 3; j++) ck_assert_double_eq(back[0][j], values[3 + j]);
+    destroy_matrix(back, rows); back = NULL;
+    destroy_matrix(mat, 2); mat = NULL;
+
+    // From inside a parallel region the writer runs on one thread, with
+    // the batches it planned for the whole pool
+    const size_t big_rows = 1000, big_cols = 1000, len = 1 << 17;
+    linalg_set_num_threads(3);
+    double **big = create_random_uniform_matrix(big_rows, big_cols, 21);
+    ck_assert_int_eq(write_matrix_to_csv(path, NULL, big, big_rows, big_cols, NULL), 0);
+    double *v = create_vector(len), *out = create_vector(len);
+    nested_csv_write w = {v, big, big_rows, big_cols, -1};
+    evaluate_batch_function_on_vector(out, batch_write_csv, v, len, &w);
+    linalg_set_num_threads(0);
+    ck_assert_int_eq(w.status, 0);
+    FILE *a = fopen(path, "rb"), *b = fopen("test_write_csv_nested.csv", "rb");
+    int ca, cb;
+    do {
+	ca = fgetc(a);
+	cb = fgetc(b);
+	ck_assert_int_eq(ca, cb);
+    } while(ca != EOF);
+    fclose(a);
+    fclose(b);
+    destroy_vector(out); out = NULL;
+    destroy_vector(v); v = NULL;
+    destroy_matrix(big, big_rows); big = NULL;
+    remove("test_write_csv_nested.csv");
+    remove(path);
+}
+
+START_TEST(test_binary_matrix_file)
+{
+    const char *path = "test_matrix.bin";
+    const size_t rows = ARRAY_SIZE_M, cols = 70;
+    double **mat = create_matrix(rows, cols);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < cols; j++) mat[i][j] = 1.0 / (1 + i + 3*j);
+    }
+    ck_assert_int_eq(save_matrix_to_binary_file(path, mat, rows, cols), 0);
+
+    size_t loaded_rows, loaded_cols;
+    double **loaded = load_matrix_from_binary_file(path, &loaded_rows, &loaded_cols);
+    ck_assert_ptr_nonnull(loaded);
+    ck_assert_uint_eq(loaded_rows, rows);
+    ck_assert_uint_eq(loaded_cols, cols);
+
+    matrix_t *mapped = matrix_map_file(path);
+    ck_assert_ptr_nonnull(mapped);
+    ck_assert_uint_eq(mapped->rows, rows);
+    ck_assert_uint_eq(mapped->cols, cols);
+    ck_assert_uint_eq((size_t)mapped->data % LINALG_ALIGNMENT, 0);
+    for(size_t i = 0; i < rows; i++){
+	ck_assert_mem_eq(loaded[i], mat[i], cols * sizeof(double));
+	ck_assert_mem_eq(mapped->row[i], mat[i], cols * sizeof(double));
+    }
+    matrix_free(mapped); mapped = NULL;
+    destroy_matrix(loaded, rows); loaded = NULL;
+    destroy_matrix(mat, rows); mat = NULL;
+
+    // Not a matrix file
+    FILE *file = fopen(path, "w");
+    fprintf(file, "x, y\n1, 2\n");
+    fclose(file);
+    ck_assert_ptr_null(matrix_map_file(path));
+    ck_assert_ptr_null(load_matrix_from_binary_file(path, &loaded_rows, &loaded_cols));
+
+    // Empty columns do not exempt the rows from the size checks: the
+    // row pointers of 2^61 rows overflow the header size
+    ck_assert_int_eq(save_matrix_to_binary_file(path, NULL, 0, 0), 0);
+    uint64_t huge_rows = (uint64_t)1 << 61;
+    file = fopen(path, "r+b");
+    fseek(file, 16, SEEK_SET); // magic, byte order, version, dtype
+    fwrite(&huge_rows, sizeof(huge_rows), 1, file);
+    fclose(file);
+    ck_assert_ptr_null(matrix_map_file(path));
+    ck_assert_ptr_null(load_matrix_from_binary_file(path, &loaded_rows, &loaded_cols));
+    ck_assert_ptr_null(matrix_alloc(SIZE_MAX / sizeof(double*), 0));
+    ck_assert_ptr_null(matrix_alloc(SIZE_MAX / 64, 16));
+    remove(path);
+}
+
+START_TEST(test_sparse_matrix)
+{
+    // Banded 400 x 300 matrix with a duplicate entry
+    const size_t rows = 400, cols = 300, p = 37;
+    size_t nnz = 0, ri[2000], ci[2000];
+    double vals[2000];
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = i % cols; j < cols && j < i % cols + 3; j++){
+	    ri[nnz] = rows - 1 - i; // unsorted input
+	    ci[nnz] = j;
+	    vals[nnz++] = 1.0 + i + 0.5*j;
+	}
+    }
+    ri[nnz] = ri[0]; ci[nnz] = ci[0]; vals[nnz++] = 2.0;
+    double **dense = create_matrix(rows, cols);
+    for(size_t k = 0; k < nnz; k++) dense[ri[k]][ci[k]] += vals[k];
+
+    sparse_matrix *csr = create_sparse_matrix_from_triplets(rows, cols, nnz,
+	ri, ci, vals, LINALG_CSR);
+    sparse_matrix *csc = create_sparse_matrix_from_dense(dense, rows, cols, 0.0,
+	LINALG_CSC);
+    ck_assert_uint_eq(csr->nnz, nnz - 1);
+    ck_assert_uint_eq(csc->nnz, nnz - 1);
+    double **back = create_dense_matrix_from_sparse(csc);
+    for(size_t i = 0; i < rows; i++){
+	ck_assert_mem_eq(back[i], dense[i], cols * sizeof(double));
+    }
+    destroy_matrix(back, rows); back = NULL;
+    ri[0] = rows;
+    ck_assert_ptr_null(create_sparse_matrix_from_triplets(rows, cols, nnz,
+	ri, ci, vals, LINALG_CSR));
+
+    // SpMV in all four variants against the dense GEMV
+    double *x = create_vector(rows), *y = create_vector(rows);
+    double *expected = create_vector(rows);
+    for(size_t i = 0; i < rows; i++) x[i] = cos(0.1*i);
+    for(int t = LINALG_NO_TRANSPOSE; t <= LINALG_TRANSPOSE; t++){
+	size_t len = t ? cols : rows;
+	for(size_t i = 0; i < len; i++) expected[i] = y[i] = 1.0;
+	general_matrix_vector_multiplication(expected, dense, x, rows, cols,
+					     2.0, -1.0, t);
+	sparse_matrix_vector_multiplication(y, csr, x, 2.0, -1.0, t);
+	for(size_t i = 0; i < len; i++) ck_assert_double_eq_tol(y[i], expected[i], 1e-9);
+	sparse_matrix_vector_multiplication(y, csc, x, 2.0, 0.0, t);
+	for(size_t i = 0; i < len; i++){
+	    ck_assert_double_eq_tol(y[i], expected[i] + 1.0, 1e-9);
+	}
+    }
+
+    // SpMM against the dense GEMM, both formats
+    double **B = create_matrix(cols, p);
+    double **C = create_matrix(rows, p);
+    double **D = create_matrix(rows, p);
+    for(size_t i = 0; i < cols; i++){
+	for(size_t j = 0; j < p; j++) B[i][j] = sin(i - 2.0*j);
+    }
+    matrix_multiplication(D, dense, B, rows, cols, p);
+    sparse_dense_matrix_multiplication(C, csr, B, p, 1.0, 0.0);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < p; j++) ck_assert_double_eq_tol(C[i][j], D[i][j], 1e-9);
+    }
+    sparse_dense_matrix_multiplication(C, csc, B, p, 1.0, -1.0);
+    for(size_t i = 0; i < rows; i++){
+	for(size_t j = 0; j < p; j++) ck_assert_double_eq_tol(C[i][j], 0.0, 1e-9);
+    }
+
+    // Binary file round trip
+    const char *path = "test_sparse.bin";
+    ck_assert_int_eq(save_sparse_matrix_to_binary_file(path, csc), 0);
+    sparse_matrix *loaded = load_sparse_matrix_from_binary_file(path);
+    ck_assert_ptr_nonnull(loaded);
+    ck_assert_int_eq(loaded->format, LINALG_CSC);
+    ck_assert_uint_eq(loaded->nnz, csc->nnz);
+    ck_assert_mem_eq(loaded->ptr, csc->ptr, (cols + 1) * sizeof(size_t));
+    ck_assert_mem_eq(loaded->index, csc->index, csc->nnz * sizeof(size_t));
+    ck_assert_mem_eq(loaded->values, csc->values, csc->nnz * sizeof(double));
+    destroy_sparse_matrix(loaded); loaded = NULL;
+    save_matrix_to_binary_file(path, dense, rows, cols);
+    ck_assert_ptr_null(load_sparse_matrix_from_binary_file(path));
+    remove(path);
+
+    destroy_matrix(D, rows); D = NULL;
+    destroy_matrix(C, rows); C = NULL;
+    destroy_matrix(B, cols); B = NULL;
+    destroy_vector(expected); expected = NULL;
+    destroy_vector(y); y = NULL;
+    destroy_vector(x); x = NULL;
+    destroy_sparse_matrix(csc); csc = NULL;
+    destroy_sparse_matrix(csr); csr = NULL;
+    destroy_matrix(dense, rows); dense = NULL;
+}
+
+START_TEST(test_random_generation)
+{
+    // Same stream for every thread count and instruction set
+    const size_t len = 200003;
+    double *ref = create_random_normal_vector(len, 1.0, 2.0, 42);
+    double *v = create_vector(len);
+    linalg_isa isa = linalg_get_isa();
+    for(size_t threads = 1; threads <= 4; threads++){
+	linalg_set_num_threads(threads);
+	for(int i = LINALG_ISA_GENERIC; i <= (int)isa; i++){
+	    linalg_set_isa(i);
+	    fill_random_normal_vector(v, len, 1.0, 2.0, 42);
+	    ck_assert_mem_eq(v, ref, len * sizeof(double));
+	}
+    }
+    linalg_set_isa(isa);
+    linalg_set_num_threads(0);
+
+    vector_statistics stats = compute_vector_statistics(ref, len);
+    ck_assert_double_eq_tol(stats.mean, 1.0, 0.02);
+    ck_assert_double_eq_tol(stats.std, 2.0, 0.02);
+
+    fill_random_exponential_vector(v, len, 4.0, 7);
+    stats = compute_vector_statistics(v, len);
+    ck_assert_double_eq_tol(stats.mean, 0.25, 0.005);
+    ck_assert_double_ge(stats.min, 0.0);
+
+    // Matrix element (i, j) is element i*cols + j of the stream
+    const size_t rows = 37, cols = 101;
+    double **mat = create_random_uniform_matrix(rows, cols, 5);
+    fill_random_uniform_vector(v, rows * cols, 0.0, 1.0, 5);
+    for(size_t i = 0; i < rows; i++){
+	ck_assert_mem_eq(mat[i], v + i * cols, cols * sizeof(double));
+	for(size_t j = 0; j < cols; j++){
+	    ck_assert(mat[i][j] >= 0.0 && mat[i][j] < 1.0);
+	}
+    }
+    destroy_matrix(mat, rows); mat = NULL;
+    destroy_vector(v); v = NULL;
+    destroy_vector(ref); ref = NULL;
+}
+
 
 int
 main()
@@ -200,10 +1633,37 @@ main()
     add_test(test_elementwise_multiplication);
     add_test(test_dot_product);
     add_test(test_matrix_multiplication);
+    add_test(test_general_matrix_multiplication);
+    add_test(test_matrix_vector_products);
+    add_test(test_linear_solve);
+    add_test(test_least_squares);
+    add_test(test_eigen_and_svd);
+    add_test(test_threaded_matrix_kernels);
+    add_test(test_create_matrix_contiguous);
+    add_test(test_matrix_views);
+    add_test(test_allocators);
+    add_test(test_transpose);
+    add_test(test_fused_expression);
+    add_test(test_batched_small_matrices);
+    add_loop_test(test_vector_kernels_every_isa,
+		  LINALG_ISA_GENERIC, LINALG_ISA_AVX512 + 1);
+    add_loop_test(test_single_and_half_precision,
+		  LINALG_ISA_GENERIC, LINALG_ISA_AVX512 + 1);
+    add_loop_test(test_elementwise_math,
+		  LINALG_ISA_GENERIC, LINALG_ISA_AVX512 + 1);
     add_test(test_vector_length);
     add_test(test_vector_normed);
     add_test(test_average_and_std);
+    add_test(test_vector_statistics);
+    add_test(test_reduction_modes);
     add_test(test_distance_between_vectors);
+    add_test(test_norm_extremes);
+    add_test(test_nearest_neighbours);
+    add_test(test_read_csv_to_new_matrix);
+    add_test(test_write_matrix_to_csv);
+    add_test(test_binary_matrix_file);
+    add_test(test_sparse_matrix);
+    add_test(test_random_generation);
     
     test_teardown();
     return 0;
@@ -10,8 +10,8 @@ CFLAGS += \
 
 LIB += \
      -lcheck \
-	 -lgsl \
-	 -lgslcblas
+	 -lm \
+	 -lpthread
 
 OBJ += \
 	obj/linalg.o